@@ -197,6 +197,18 @@ public class BpfCoordinatorShimImpl
         return false;
     }
 
+    @Override
+    public boolean updateRaFrame(int ifIndex, @NonNull byte[] frame) {
+        /* no op */
+        return false;
+    }
+
+    @Override
+    public boolean removeRaFrame(int ifIndex) {
+        /* no op */
+        return false;
+    }
+
     @Override
     public String toString() {
         return "Netd used";
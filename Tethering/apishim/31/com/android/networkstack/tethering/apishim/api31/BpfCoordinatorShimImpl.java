@@ -44,6 +44,8 @@ import com.android.networkstack.tethering.TetherDevValue;
 import com.android.networkstack.tethering.TetherDownstream6Key;
 import com.android.networkstack.tethering.TetherLimitKey;
 import com.android.networkstack.tethering.TetherLimitValue;
+import com.android.networkstack.tethering.TetherRaKey;
+import com.android.networkstack.tethering.TetherRaValue;
 import com.android.networkstack.tethering.TetherUpstream6Key;
 
 import java.io.FileDescriptor;
@@ -92,6 +94,11 @@ public class BpfCoordinatorShimImpl
     @Nullable
     private final BpfMap<TetherDevKey, TetherDevValue> mBpfDevMap;
 
+    // BPF map of router advertisements answering router solicitations, by downstream. Not
+    // required by #isInitialized, the RA daemon answers router solicitations without it.
+    @Nullable
+    private final BpfMap<TetherRaKey, TetherRaValue> mBpfRaMap;
+
     // Tracking IPv4 rule count while any rule is using the given upstream interfaces. Used for
     // reducing the BPF map iteration query. The count is increased or decreased when the rule is
     // added or removed successfully on mBpfDownstream4Map. Counting the rules on downstream4 map
@@ -116,6 +123,7 @@ public class BpfCoordinatorShimImpl
         mBpfStatsMap = deps.getBpfStatsMap();
         mBpfLimitMap = deps.getBpfLimitMap();
         mBpfDevMap = deps.getBpfDevMap();
+        mBpfRaMap = deps.getBpfRaMap();
 
         // Clear the stubs of the maps for handling the system service crash if any.
         // Doesn't throw the exception and clear the stubs as many as possible.
@@ -154,6 +162,11 @@ public class BpfCoordinatorShimImpl
         } catch (ErrnoException e) {
             mLog.e("Could not clear mBpfDevMap: " + e);
         }
+        try {
+            if (mBpfRaMap != null) mBpfRaMap.clear();
+        } catch (ErrnoException e) {
+            mLog.e("Could not clear mBpfRaMap: " + e);
+        }
     }
 
     @Override
@@ -482,6 +495,32 @@ public class BpfCoordinatorShimImpl
         return true;
     }
 
+    @Override
+    public boolean updateRaFrame(int ifIndex, @NonNull byte[] frame) {
+        if (!isInitialized() || mBpfRaMap == null) return false;
+
+        try {
+            mBpfRaMap.updateEntry(new TetherRaKey(ifIndex), TetherRaValue.fromFrame(frame));
+        } catch (ErrnoException | IllegalArgumentException e) {
+            mLog.e("Could not update RA frame of interface " + ifIndex + ": " + e);
+            return false;
+        }
+        return true;
+    }
+
+    @Override
+    public boolean removeRaFrame(int ifIndex) {
+        if (!isInitialized() || mBpfRaMap == null) return false;
+
+        try {
+            mBpfRaMap.deleteEntry(new TetherRaKey(ifIndex));
+        } catch (ErrnoException e) {
+            mLog.e("Could not delete RA frame of interface " + ifIndex + ": " + e);
+            return false;
+        }
+        return true;
+    }
+
     private String mapStatus(BpfMap m, String name) {
         return name + "{" + (m != null ? "OK" : "ERROR") + "}";
     }
@@ -495,7 +534,8 @@ public class BpfCoordinatorShimImpl
                 mapStatus(mBpfUpstream4Map, "mBpfUpstream4Map"),
                 mapStatus(mBpfStatsMap, "mBpfStatsMap"),
                 mapStatus(mBpfLimitMap, "mBpfLimitMap"),
-                mapStatus(mBpfDevMap, "mBpfDevMap")
+                mapStatus(mBpfDevMap, "mBpfDevMap"),
+                mapStatus(mBpfRaMap, "mBpfRaMap")
         });
     }
 
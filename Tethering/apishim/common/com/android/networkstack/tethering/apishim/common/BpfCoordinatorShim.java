@@ -192,5 +192,15 @@ public abstract class BpfCoordinatorShim {
      * Remove interface index mapping.
      */
     public abstract boolean removeDevMap(int ifIndex);
+
+    /**
+     * Set the router advertisement frame answering the router solicitations of a downstream.
+     */
+    public abstract boolean updateRaFrame(int ifIndex, @NonNull byte[] frame);
+
+    /**
+     * Remove the router advertisement frame of a downstream.
+     */
+    public abstract boolean removeRaFrame(int ifIndex);
 }
 
@@ -18,13 +18,16 @@
 #include <error.h>
 #include <jni.h>
 #include <linux/filter.h>
+#include <linux/if_packet.h>
 #include <nativehelper/JNIHelp.h>
+#include <nativehelper/ScopedPrimitiveArray.h>
 #include <nativehelper/ScopedUtfChars.h>
 #include <netjniutils/netjniutils.h>
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <stdio.h>
 
@@ -33,6 +36,25 @@ namespace android {
 static const uint32_t kIPv6NextHeaderOffset = offsetof(ip6_hdr, ip6_nxt);
 static const uint32_t kIPv6PayloadStart = sizeof(ip6_hdr);
 static const uint32_t kICMPv6TypeOffset = kIPv6PayloadStart + offsetof(icmp6_hdr, icmp6_type);
+static const uint32_t kIPv6HopLimitOffset = offsetof(ip6_hdr, ip6_hlim);
+
+// Geometry of the TPACKET_V3 ring of the shared ND socket. Must match TetheringUtils.java. The
+// kernel retires a block to userspace when it is full or after kNdRingBlockTimeoutMs, so ND packets
+// of all downstreams are delivered in batches.
+static const uint32_t kNdRingBlockSize = 1 << 16;
+static const uint32_t kNdRingBlockCount = 8;
+static const uint32_t kNdRingFrameSize = 1 << 11;
+static const uint32_t kNdRingBlockTimeoutMs = 10;
+
+// Each packet read from the ring is prefixed by the index of the interface it was received on
+// and its length, both in network byte order.
+static const size_t kNdRecordHeaderLen = sizeof(uint32_t) + sizeof(uint16_t);
+
+struct NdRing {
+    uint8_t* map;
+    size_t len;
+    uint32_t nextBlock;
+};
 
 static void throwSocketException(JNIEnv *env, const char* msg, int error) {
     jniThrowExceptionFmt(env, "java/net/SocketException", "%s: %s", msg, strerror(error));
@@ -81,12 +103,12 @@ static void com_android_networkstack_tethering_util_setupRaSocket(JNIEnv *env, j
 
     int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
 
-    // Set an ICMPv6 filter that only passes Router Solicitations.
-    struct icmp6_filter rs_only;
-    ICMP6_FILTER_SETBLOCKALL(&rs_only);
-    ICMP6_FILTER_SETPASS(ND_ROUTER_SOLICIT, &rs_only);
-    socklen_t len = sizeof(rs_only);
-    if (setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &rs_only, len) != 0) {
+    // Set an ICMPv6 filter that blocks everything. The socket only sends Router Advertisements;
+    // Router Solicitations are read from the shared ND packet socket.
+    struct icmp6_filter block_all;
+    ICMP6_FILTER_SETBLOCKALL(&block_all);
+    socklen_t len = sizeof(block_all);
+    if (setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &block_all, len) != 0) {
         throwSocketException(env, "setsockopt(ICMP6_FILTER)", errno);
         return;
     }
@@ -158,6 +180,139 @@ static void com_android_networkstack_tethering_util_setupRaSocket(JNIEnv *env, j
     }
 }
 
+// Passes the NS, NA and RS packets, which must all have a hop limit of 255.
+static void com_android_networkstack_tethering_util_setupNdFilter(JNIEnv *env, jobject clazz,
+        jobject javaFd) {
+    sock_filter filter_code[] = {
+        // Check header is ICMPv6.
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kIPv6NextHeaderOffset),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    IPPROTO_ICMPV6, 0, 6),
+
+        // Check the packet was not routed.
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kIPv6HopLimitOffset),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    255, 0, 4),
+
+        // Check ICMPv6 type.
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kICMPv6TypeOffset),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    ND_ROUTER_SOLICIT, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    ND_NEIGHBOR_SOLICIT, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    ND_NEIGHBOR_ADVERT, 1, 0),
+
+        // Reject or accept.
+        BPF_STMT(BPF_RET | BPF_K,              0),
+        BPF_STMT(BPF_RET | BPF_K,              0xffff)
+    };
+
+    const sock_fprog filter = {
+        sizeof(filter_code) / sizeof(filter_code[0]),
+        filter_code,
+    };
+
+    int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0) {
+        throwSocketException(env, "setsockopt(SO_ATTACH_FILTER)", errno);
+    }
+}
+
+static jlong com_android_networkstack_tethering_util_createNdRing(JNIEnv *env, jobject clazz,
+        jobject javaFd) {
+    int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        throwSocketException(env, "setsockopt(PACKET_VERSION)", errno);
+        return 0;
+    }
+
+    struct tpacket_req3 req = {
+        .tp_block_size = kNdRingBlockSize,
+        .tp_block_nr = kNdRingBlockCount,
+        .tp_frame_size = kNdRingFrameSize,
+        .tp_frame_nr = kNdRingBlockSize / kNdRingFrameSize * kNdRingBlockCount,
+        .tp_retire_blk_tov = kNdRingBlockTimeoutMs,
+    };
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        throwSocketException(env, "setsockopt(PACKET_RX_RING)", errno);
+        return 0;
+    }
+
+    const size_t len = (size_t)kNdRingBlockSize * kNdRingBlockCount;
+    void* map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        throwSocketException(env, "mmap", errno);
+        return 0;
+    }
+
+    NdRing* ring = new NdRing{static_cast<uint8_t*>(map), len, 0};
+    return reinterpret_cast<jlong>(ring);
+}
+
+static void com_android_networkstack_tethering_util_destroyNdRing(JNIEnv *env, jobject clazz,
+        jlong jring) {
+    NdRing* ring = reinterpret_cast<NdRing*>(jring);
+    if (ring == nullptr) return;
+    munmap(ring->map, ring->len);
+    delete ring;
+}
+
+// Copies the packets of one retired block to out, and hands the block back to the kernel.
+static size_t readNdBlock(const uint8_t* block, uint8_t* out) {
+    auto* desc = reinterpret_cast<const tpacket_block_desc*>(block);
+    const uint8_t* end = block + kNdRingBlockSize;
+    const uint8_t* p = block + desc->hdr.bh1.offset_to_first_pkt;
+    size_t used = 0;
+    for (uint32_t i = 0; i < desc->hdr.bh1.num_pkts && p + sizeof(tpacket3_hdr) <= end; i++) {
+        auto* hdr = reinterpret_cast<const tpacket3_hdr*>(p);
+        auto* sll = reinterpret_cast<const sockaddr_ll*>(p + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+        // For SOCK_DGRAM sockets the mac header offset points at the network header.
+        if (p + hdr->tp_mac + hdr->tp_snaplen > end) break;
+
+        // A socket bound to all interfaces also sees the packets sent by this device.
+        if (sll->sll_pkttype != PACKET_OUTGOING) {
+            const uint32_t ifindex = htonl(sll->sll_ifindex);
+            const uint16_t len = htons(hdr->tp_snaplen);
+            memcpy(out + used, &ifindex, sizeof(ifindex));
+            memcpy(out + used + sizeof(ifindex), &len, sizeof(len));
+            memcpy(out + used + kNdRecordHeaderLen, p + hdr->tp_mac, hdr->tp_snaplen);
+            used += kNdRecordHeaderLen + hdr->tp_snaplen;
+        }
+
+        if (hdr->tp_next_offset == 0) break;
+        p += hdr->tp_next_offset;
+    }
+    return used;
+}
+
+// Reads all the blocks the kernel retired so far, as long as they fit in buf. A block always fits
+// in kNdRingBlockSize bytes once copied, since every packet takes more room in the ring than its
+// record header does.
+static jint com_android_networkstack_tethering_util_readNdRing(JNIEnv *env, jobject clazz,
+        jlong jring, jbyteArray buf) {
+    NdRing* ring = reinterpret_cast<NdRing*>(jring);
+    ScopedByteArrayRW out(env, buf);
+    if (ring == nullptr || out.get() == nullptr) {
+        jniThrowErrnoException(env, "readNdRing", EINVAL);
+        return 0;
+    }
+
+    size_t used = 0;
+    while (out.size() - used >= kNdRingBlockSize) {
+        uint8_t* block = ring->map + (size_t)ring->nextBlock * kNdRingBlockSize;
+        auto* desc = reinterpret_cast<tpacket_block_desc*>(block);
+        if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+
+        used += readNdBlock(block, reinterpret_cast<uint8_t*>(out.get()) + used);
+        __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ring->nextBlock = (ring->nextBlock + 1) % kNdRingBlockCount;
+    }
+
+    // Like read() on a non-blocking socket, so that the reader goes back to waiting.
+    if (used == 0) jniThrowErrnoException(env, "readNdRing", EAGAIN);
+    return used;
+}
+
 /*
  * JNI registration.
  */
@@ -169,6 +324,14 @@ static const JNINativeMethod gMethods[] = {
         (void*) com_android_networkstack_tethering_util_setupNsSocket },
     { "setupRaSocket", "(Ljava/io/FileDescriptor;I)V",
         (void*) com_android_networkstack_tethering_util_setupRaSocket },
+    { "setupNdFilter", "(Ljava/io/FileDescriptor;)V",
+        (void*) com_android_networkstack_tethering_util_setupNdFilter },
+    { "createNdRing", "(Ljava/io/FileDescriptor;)J",
+        (void*) com_android_networkstack_tethering_util_createNdRing },
+    { "readNdRing", "(J[B)I",
+        (void*) com_android_networkstack_tethering_util_readNdRing },
+    { "destroyNdRing", "(J)V",
+        (void*) com_android_networkstack_tethering_util_destroyNdRing },
 };
 
 int register_com_android_networkstack_tethering_util_TetheringUtils(JNIEnv* env) {
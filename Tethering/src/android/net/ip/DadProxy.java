@@ -17,6 +17,7 @@
 package android.net.ip;
 
 import android.os.Handler;
+import android.util.Log;
 
 import androidx.annotation.VisibleForTesting;
 
@@ -25,6 +26,10 @@ import com.android.net.module.util.InterfaceParams;
 /**
  * Basic Duplicate address detection proxy.
  *
+ * Forwards NA packets from the upstream iface to the tethered iface, and NS packets from the
+ * tethered iface to the upstream iface. NS packets are read from the {@link NdPacketReader} shared
+ * by all tethered ifaces.
+ *
  * @hide
  */
 public class DadProxy {
@@ -32,24 +37,47 @@ public class DadProxy {
 
     @VisibleForTesting
     public static NeighborPacketForwarder naForwarder;
-    public static NeighborPacketForwarder nsForwarder;
+    private final NdPacketReader mNdReader;
+    private final int mTetheredIfIndex;
+    private final NdPacketReader.Listener mNsListener = this::onTetheredNdPacket;
+    private InterfaceParams mUpstreamIface;
 
-    public DadProxy(Handler h, InterfaceParams tetheredIface) {
+    public DadProxy(Handler h, InterfaceParams tetheredIface, NdPacketReader ndReader) {
         naForwarder = new NeighborPacketForwarder(h, tetheredIface,
                                         NeighborPacketForwarder.ICMPV6_NEIGHBOR_ADVERTISEMENT);
-        nsForwarder = new NeighborPacketForwarder(h, tetheredIface,
-                                        NeighborPacketForwarder.ICMPV6_NEIGHBOR_SOLICITATION);
+        mNdReader = ndReader;
+        mTetheredIfIndex = tetheredIface.index;
     }
 
     /** Stop NS/NA Forwarders. */
     public void stop() {
         naForwarder.stop();
-        nsForwarder.stop();
+        mNdReader.removeListener(mTetheredIfIndex, mNsListener);
+        mUpstreamIface = null;
     }
 
     /** Set upstream iface on both forwarders. */
     public void setUpstreamIface(InterfaceParams upstreamIface) {
         naForwarder.setUpstreamIface(upstreamIface);
-        nsForwarder.setUpstreamIface(upstreamIface);
+
+        final InterfaceParams oldUpstreamIface = mUpstreamIface;
+        mUpstreamIface = upstreamIface;
+        if (oldUpstreamIface == null && upstreamIface != null) {
+            if (!mNdReader.addListener(mTetheredIfIndex, mNsListener)) {
+                Log.e(TAG, "Failed to listen to the ND packets of ifindex " + mTetheredIfIndex);
+            }
+        } else if (oldUpstreamIface != null && upstreamIface == null) {
+            mNdReader.removeListener(mTetheredIfIndex, mNsListener);
+        }
+    }
+
+    private void onTetheredNdPacket(byte[] buf, int offset, int length) {
+        if (mUpstreamIface == null) return;
+        if (length <= NeighborPacketForwarder.ICMPV6_TYPE_OFFSET) return;
+        if (buf[offset + NeighborPacketForwarder.ICMPV6_TYPE_OFFSET]
+                != (byte) NeighborPacketForwarder.ICMPV6_NEIGHBOR_SOLICITATION) {
+            return;
+        }
+        NeighborPacketForwarder.forwardPacket(TAG, mUpstreamIface, buf, offset, length);
     }
 }
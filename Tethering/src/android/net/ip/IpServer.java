@@ -166,8 +166,9 @@ public class IpServer extends StateMachine {
          * To support multiple tethered interfaces concurrently DAD Proxy
          * needs to be supported per IpServer instead of per upstream.
          */
-        public DadProxy getDadProxy(Handler handler, InterfaceParams ifParams) {
-            return new DadProxy(handler, ifParams);
+        public DadProxy getDadProxy(Handler handler, InterfaceParams ifParams,
+                NdPacketReader ndReader) {
+            return new DadProxy(handler, ifParams, ndReader);
         }
 
         /** Create an IpNeighborMonitor to be used by this IpServer */
@@ -177,8 +178,9 @@ public class IpServer extends StateMachine {
         }
 
         /** Create a RouterAdvertisementDaemon instance to be used by IpServer.*/
-        public RouterAdvertisementDaemon getRouterAdvertisementDaemon(InterfaceParams ifParams) {
-            return new RouterAdvertisementDaemon(ifParams);
+        public RouterAdvertisementDaemon getRouterAdvertisementDaemon(InterfaceParams ifParams,
+                NdPacketReader ndReader) {
+            return new RouterAdvertisementDaemon(ifParams, ndReader);
         }
 
         /** Get |ifName|'s interface information.*/
@@ -235,6 +237,9 @@ public class IpServer extends StateMachine {
     private final Callback mCallback;
     private final InterfaceController mInterfaceCtrl;
     private final PrivateAddressCoordinator mPrivateAddressCoordinator;
+    // Shared by all IpServers, reads the router and neighbor solicitations of the downstream.
+    @NonNull
+    private final NdPacketReader mNdReader;
 
     private final String mIfaceName;
     private final int mInterfaceType;
@@ -288,7 +293,7 @@ public class IpServer extends StateMachine {
             String ifaceName, Looper looper, int interfaceType, SharedLog log,
             INetd netd, @NonNull BpfCoordinator coordinator, Callback callback,
             TetheringConfiguration config, PrivateAddressCoordinator addressCoordinator,
-            Dependencies deps) {
+            @NonNull NdPacketReader ndReader, Dependencies deps) {
         super(ifaceName, looper);
         mLog = log.forSubComponent(ifaceName);
         mNetd = netd;
@@ -302,6 +307,7 @@ public class IpServer extends StateMachine {
         mUsingBpfOffload = config.isBpfOffloadEnabled();
         mP2pLeasesSubnetPrefixLength = config.getP2pLeasesSubnetPrefixLength();
         mPrivateAddressCoordinator = addressCoordinator;
+        mNdReader = ndReader;
         mDeps = deps;
         resetLinkProperties();
         mLastError = TetheringManager.TETHER_ERROR_NO_ERROR;
@@ -677,7 +683,15 @@ public class IpServer extends StateMachine {
             return false;
         }
 
-        mRaDaemon = mDeps.getRouterAdvertisementDaemon(mInterfaceParams);
+        mRaDaemon = mDeps.getRouterAdvertisementDaemon(mInterfaceParams, mNdReader);
+        // Let the BPF program answer router solicitations with the current RA.
+        final RouterAdvertisementDaemon raDaemon = mRaDaemon;
+        final int ifIndex = mInterfaceParams.index;
+        mRaDaemon.setRaFrameListener(frame -> getHandler().post(() -> {
+            // Ignore the frames posted before IPv6 was stopped.
+            if (mRaDaemon != raDaemon) return;
+            mBpfCoordinator.updateRaFrame(ifIndex, frame);
+        }));
         if (!mRaDaemon.start()) {
             stopIPv6();
             return false;
@@ -685,13 +699,14 @@ public class IpServer extends StateMachine {
 
         if (SdkLevel.isAtLeastS()) {
             // DAD Proxy starts forwarding packets after IPv6 upstream is present.
-            mDadProxy = mDeps.getDadProxy(getHandler(), mInterfaceParams);
+            mDadProxy = mDeps.getDadProxy(getHandler(), mInterfaceParams, mNdReader);
         }
 
         return true;
     }
 
     private void stopIPv6() {
+        if (mInterfaceParams != null) mBpfCoordinator.updateRaFrame(mInterfaceParams.index, null);
         mInterfaceParams = null;
         setRaParams(null);
 
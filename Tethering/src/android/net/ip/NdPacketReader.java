@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package android.net.ip;
+
+import static android.system.OsConstants.AF_PACKET;
+import static android.system.OsConstants.ETH_P_IPV6;
+import static android.system.OsConstants.SOCK_DGRAM;
+import static android.system.OsConstants.SOCK_NONBLOCK;
+
+import android.net.util.SocketUtils;
+import android.os.Handler;
+import android.system.ErrnoException;
+import android.system.Os;
+import android.util.Log;
+import android.util.SparseArray;
+
+import androidx.annotation.NonNull;
+
+import com.android.net.module.util.PacketReader;
+import com.android.networkstack.tethering.util.TetheringUtils;
+
+import java.io.FileDescriptor;
+import java.io.IOException;
+import java.net.SocketAddress;
+import java.net.SocketException;
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+
+/**
+ * Receives the neighbor solicitations, neighbor advertisements and router solicitations of all
+ * interfaces on a single packet socket, and dispatches them to the listeners of the interface they
+ * arrived on.
+ *
+ * Tethering owns a single instance, shared by the IpServers of all downstreams. Packets are read in
+ * batches from a TPACKET_V3 ring, so one socket and one wakeup on the handler thread serve every
+ * downstream and ND message type, instead of one socket and one reader thread each. The socket is
+ * only open while there are listeners. Packets sent by this device are skipped.
+ *
+ * All methods must be called on the handler thread.
+ *
+ * @hide
+ */
+public class NdPacketReader extends PacketReader {
+    private static final String TAG = NdPacketReader.class.getSimpleName();
+
+    // Header of each packet read from the ring: interface index and packet length.
+    private static final int RECORD_HEADER_LEN = 4 + 2;
+    private static final int RECV_BUF_SIZE = 4 * TetheringUtils.ND_RING_BLOCK_SIZE;
+
+    /** Receives the ND packets of an interface. */
+    public interface Listener {
+        /**
+         * Called with an IPv6 packet, starting at its IPv6 header. The buffer is reused once
+         * this returns.
+         */
+        void onNdPacket(@NonNull byte[] buf, int offset, int length);
+    }
+
+    private final SparseArray<ArrayList<Listener>> mListeners = new SparseArray<>();
+    private int mListenerCount;
+    private long mRing;
+
+    public NdPacketReader(@NonNull Handler h) {
+        super(h, RECV_BUF_SIZE);
+    }
+
+    /**
+     * Starts passing the ND packets received on an interface to the given listener. The socket
+     * is opened along with the first listener. Returns false if it could not be opened.
+     */
+    public boolean addListener(int ifIndex, @NonNull Listener listener) {
+        ArrayList<Listener> listeners = mListeners.get(ifIndex);
+        if (listeners == null) {
+            listeners = new ArrayList<>();
+            mListeners.put(ifIndex, listeners);
+        }
+        if (listeners.contains(listener)) return true;
+        listeners.add(listener);
+        mListenerCount++;
+
+        if (mListenerCount == 1 && !start()) {
+            Log.e(TAG, "Failed to start, dropping ND packets of ifindex " + ifIndex);
+            removeListener(ifIndex, listener);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Stops passing the ND packets of an interface to a listener. The socket is closed along with
+     * the last listener.
+     */
+    public void removeListener(int ifIndex, @NonNull Listener listener) {
+        final ArrayList<Listener> listeners = mListeners.get(ifIndex);
+        if (listeners == null || !listeners.remove(listener)) return;
+        if (listeners.isEmpty()) mListeners.remove(ifIndex);
+
+        mListenerCount--;
+        if (mListenerCount == 0) stop();
+    }
+
+    @Override
+    protected FileDescriptor createFd() {
+        FileDescriptor fd = null;
+        try {
+            fd = Os.socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            // Set up the filter and the ring before binding, so that no packet is queued before.
+            TetheringUtils.setupNdFilter(fd);
+            mRing = TetheringUtils.createNdRing(fd);
+
+            // Interface index 0 binds to all interfaces.
+            final SocketAddress bindAddress = SocketUtils.makePacketSocketAddress(ETH_P_IPV6, 0);
+            Os.bind(fd, bindAddress);
+        } catch (ErrnoException | SocketException e) {
+            Log.wtf(TAG, "Failed to create socket", e);
+            closeSocketQuietly(fd);
+            releaseRing();
+            return null;
+        }
+        return fd;
+    }
+
+    @Override
+    protected int readPacket(@NonNull FileDescriptor fd, @NonNull byte[] packetBuffer)
+            throws Exception {
+        return TetheringUtils.readNdRing(mRing, packetBuffer);
+    }
+
+    @Override
+    protected void handlePacket(@NonNull byte[] recvbuf, int length) {
+        final ByteBuffer buf = ByteBuffer.wrap(recvbuf, 0, length);
+        while (buf.remaining() >= RECORD_HEADER_LEN) {
+            final int ifIndex = buf.getInt();
+            final int packetLen = buf.getShort() & 0xffff;
+            if (packetLen > buf.remaining()) {
+                Log.wtf(TAG, "Truncated packet of ifindex " + ifIndex);
+                return;
+            }
+
+            final ArrayList<Listener> listeners = mListeners.get(ifIndex);
+            if (listeners != null) {
+                for (Listener listener : listeners) {
+                    listener.onNdPacket(recvbuf, buf.position(), packetLen);
+                }
+            }
+            buf.position(buf.position() + packetLen);
+        }
+    }
+
+    @Override
+    protected void onStop() {
+        releaseRing();
+    }
+
+    private void releaseRing() {
+        if (mRing == 0) return;
+        TetheringUtils.destroyNdRing(mRing);
+        mRing = 0;
+    }
+
+    private static void closeSocketQuietly(FileDescriptor fd) {
+        try {
+            SocketUtils.closeSocket(fd);
+        } catch (IOException ignored) {
+        }
+    }
+}
@@ -61,6 +61,7 @@ public class NeighborPacketForwarder extends PacketReader {
     private static final int IPV6_DST_ADDR_OFFSET = 24;
     private static final int IPV6_HEADER_LEN = 40;
     private static final int ETH_HEADER_LEN = 14;
+    static final int ICMPV6_TYPE_OFFSET = IPV6_HEADER_LEN;
 
     private InterfaceParams mListenIfaceParams, mSendIfaceParams;
 
@@ -106,7 +107,7 @@ public class NeighborPacketForwarder extends PacketReader {
 
     // TODO: move NetworkStackUtils.closeSocketQuietly to
     // frameworks/libs/net/common/device/com/android/net/module/util/[someclass].
-    private void closeSocketQuietly(FileDescriptor fd) {
+    private static void closeSocketQuietly(FileDescriptor fd) {
         try {
             SocketUtils.closeSocket(fd);
         } catch (IOException ignored) {
@@ -139,11 +140,12 @@ public class NeighborPacketForwarder extends PacketReader {
         return mFd;
     }
 
-    private Inet6Address getIpv6DestinationAddress(byte[] recvbuf) {
+    private static Inet6Address getIpv6DestinationAddress(byte[] recvbuf, int offset) {
         Inet6Address dstAddr;
         try {
             dstAddr = (Inet6Address) Inet6Address.getByAddress(Arrays.copyOfRange(recvbuf,
-                    IPV6_DST_ADDR_OFFSET, IPV6_DST_ADDR_OFFSET + IPV6_ADDR_LEN));
+                    offset + IPV6_DST_ADDR_OFFSET,
+                    offset + IPV6_DST_ADDR_OFFSET + IPV6_ADDR_LEN));
         } catch (UnknownHostException | ClassCastException impossible) {
             throw new AssertionError("16-byte array not valid IPv6 address?");
         }
@@ -155,12 +157,20 @@ public class NeighborPacketForwarder extends PacketReader {
         if (mSendIfaceParams == null) {
             return;
         }
+        forwardPacket(mTag, mSendIfaceParams, recvbuf, 0, length);
+    }
 
+    /**
+     * Sends the IPv6 packet at the given offset of recvbuf on sendIfaceParams, if it is
+     * multicast.
+     */
+    static void forwardPacket(String tag, InterfaceParams sendIfaceParams, byte[] recvbuf,
+            int offset, int length) {
         // The BPF filter should already have checked the length of the packet, but...
         if (length < IPV6_HEADER_LEN) {
             return;
         }
-        Inet6Address destv6 = getIpv6DestinationAddress(recvbuf);
+        Inet6Address destv6 = getIpv6DestinationAddress(recvbuf, offset);
         if (!destv6.isMulticastAddress()) {
             return;
         }
@@ -169,11 +179,11 @@ public class NeighborPacketForwarder extends PacketReader {
         FileDescriptor fd = null;
         try {
             fd = Os.socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_RAW);
-            SocketUtils.bindSocketToInterface(fd, mSendIfaceParams.name);
+            SocketUtils.bindSocketToInterface(fd, sendIfaceParams.name);
 
-            int ret = Os.sendto(fd, recvbuf, 0, length, 0, dest);
+            int ret = Os.sendto(fd, recvbuf, offset, length, 0, dest);
         } catch (ErrnoException | SocketException e) {
-            Log.e(mTag, "handlePacket error: " + e);
+            Log.e(tag, "handlePacket error: " + e);
         } finally {
             closeSocketQuietly(fd);
         }
@@ -23,11 +23,18 @@ import static android.system.OsConstants.SOCK_RAW;
 import static android.system.OsConstants.SOL_SOCKET;
 import static android.system.OsConstants.SO_SNDTIMEO;
 
+import static com.android.net.module.util.IpUtils.icmpv6Checksum;
+import static com.android.net.module.util.NetworkStackConstants.ETHER_ADDR_LEN;
+import static com.android.net.module.util.NetworkStackConstants.ETHER_HEADER_LEN;
+import static com.android.net.module.util.NetworkStackConstants.ETHER_TYPE_IPV6;
 import static com.android.net.module.util.NetworkStackConstants.ICMPV6_ND_OPTION_SLLA;
 import static com.android.net.module.util.NetworkStackConstants.ICMPV6_RA_HEADER_LEN;
 import static com.android.net.module.util.NetworkStackConstants.ICMPV6_ROUTER_ADVERTISEMENT;
 import static com.android.net.module.util.NetworkStackConstants.ICMPV6_ROUTER_SOLICITATION;
+import static com.android.net.module.util.NetworkStackConstants.IPV6_ADDR_LEN;
+import static com.android.net.module.util.NetworkStackConstants.IPV6_HEADER_LEN;
 import static com.android.net.module.util.NetworkStackConstants.IPV6_MIN_MTU;
+import static com.android.net.module.util.NetworkStackConstants.IPV6_SRC_ADDR_OFFSET;
 import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_AUTONOMOUS;
 import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_ON_LINK;
 import static com.android.net.module.util.NetworkStackConstants.TAG_SYSTEM_NEIGHBOR;
@@ -43,6 +50,8 @@ import android.system.Os;
 import android.system.StructTimeval;
 import android.util.Log;
 
+import androidx.annotation.Nullable;
+
 import com.android.internal.annotations.GuardedBy;
 import com.android.net.module.util.InterfaceParams;
 import com.android.net.module.util.structs.Icmpv6Header;
@@ -58,10 +67,14 @@ import java.io.IOException;
 import java.net.Inet6Address;
 import java.net.InetAddress;
 import java.net.InetSocketAddress;
+import java.net.NetworkInterface;
 import java.net.SocketException;
+import java.net.UnknownHostException;
 import java.nio.BufferOverflowException;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
+import java.util.Arrays;
+import java.util.Collections;
 import java.util.HashMap;
 import java.util.HashSet;
 import java.util.Iterator;
@@ -103,8 +116,13 @@ public class RouterAdvertisementDaemon {
 
     private static final int DAY_IN_SECONDS = 86_400;
 
+    // From RFC4861
+    private static final int ND_HOP_LIMIT = 255;
+
     private final InterfaceParams mInterface;
     private final InetSocketAddress mAllNodes;
+    private final NdPacketReader mNdReader;
+    private final NdPacketReader.Listener mRsListener = this::onNdPacket;
 
     // This lock is to protect the RA from being updated while being
     // transmitted on another thread  (multicast or unicast).
@@ -119,10 +137,19 @@ public class RouterAdvertisementDaemon {
     private final DeprecatedInfoTracker mDeprecatedInfoTracker;
     @GuardedBy("mLock")
     private RaParams mRaParams;
+    @GuardedBy("mLock")
+    private byte[] mLastRaFrame;
+
+    private volatile RaFrameListener mRaFrameListener;
+    // The source addresses of the RA frame. The link-local address is looked up outside of mLock,
+    // when the daemon starts and after each multicast RA.
+    @Nullable
+    private final byte[] mSrcMac;
+    @Nullable
+    private volatile Inet6Address mLinkLocalAddress;
 
     private volatile FileDescriptor mSocket;
     private volatile MulticastTransmitter mMulticastTransmitter;
-    private volatile UnicastResponder mUnicastResponder;
 
     /** Encapsulate the RA parameters for RouterAdvertisementDaemon.*/
     public static class RaParams {
@@ -183,6 +210,15 @@ public class RouterAdvertisementDaemon {
         }
     }
 
+    /** Receives the RA frame built by {@link #getRaFrame} whenever it changes. */
+    public interface RaFrameListener {
+        /**
+         * Called with the new frame, or null if solicitations cannot be answered with a frame.
+         * Called on an arbitrary thread, with the lock of the daemon held.
+         */
+        void onRaFrameChanged(@Nullable byte[] frame);
+    }
+
     private static class DeprecatedInfoTracker {
         private final HashMap<IpPrefix, Integer> mPrefixes = new HashMap<>();
         private final HashMap<Inet6Address, Integer> mDnses = new HashMap<>();
@@ -247,9 +283,11 @@ public class RouterAdvertisementDaemon {
         }
     }
 
-    public RouterAdvertisementDaemon(InterfaceParams ifParams) {
+    public RouterAdvertisementDaemon(InterfaceParams ifParams, NdPacketReader ndReader) {
         mInterface = ifParams;
         mAllNodes = new InetSocketAddress(getAllNodesForScopeId(mInterface.index), 0);
+        mNdReader = ndReader;
+        mSrcMac = (ifParams.macAddr != null) ? ifParams.macAddr.toByteArray() : null;
         mDeprecatedInfoTracker = new DeprecatedInfoTracker();
     }
 
@@ -274,29 +312,107 @@ public class RouterAdvertisementDaemon {
         maybeNotifyMulticastTransmitter();
     }
 
-    /** Start router advertisement daemon. */
+    /** Set the listener of the RA frame, before the daemon is started. */
+    public void setRaFrameListener(@Nullable RaFrameListener listener) {
+        mRaFrameListener = listener;
+    }
+
+    /**
+     * Start router advertisement daemon. Must be called on the handler thread of the ND reader,
+     * which router solicitations are read from.
+     */
     public boolean start() {
         if (!createSocket()) {
             return false;
         }
 
+        updateLinkLocalAddress();
         mMulticastTransmitter = new MulticastTransmitter();
         mMulticastTransmitter.start();
 
-        mUnicastResponder = new UnicastResponder();
-        mUnicastResponder.start();
+        if (!mNdReader.addListener(mInterface.index, mRsListener)) {
+            Log.e(TAG, "Failed to listen to router solicitations, only sending multicast RAs");
+        }
 
         return true;
     }
 
-    /** Stop router advertisement daemon. */
+    /** Stop router advertisement daemon. Must be called on the handler thread of the ND reader. */
     public void stop() {
+        mNdReader.removeListener(mInterface.index, mRsListener);
         closeSocket();
         // Wake up mMulticastTransmitter thread to interrupt a potential 1 day sleep before
         // the thread's termination.
         maybeNotifyMulticastTransmitter();
         mMulticastTransmitter = null;
-        mUnicastResponder = null;
+    }
+
+    /**
+     * Returns the current RA as an ethernet frame, for the BPF program that answers router
+     * solicitations in the kernel. Returns null if there is nothing to announce, if the interface
+     * has no MAC address, or if it had no link-local address to send it from when last checked.
+     * The listener set with {@link #setRaFrameListener} is told about every change of the frame.
+     *
+     * The destination MAC and IPv6 addresses are zero, and so is the destination address the
+     * ICMPv6 checksum is computed with. The BPF program fills them in for each solicitor.
+     */
+    @Nullable
+    public byte[] getRaFrame() {
+        final Inet6Address src = mLinkLocalAddress;
+        if (mSrcMac == null || src == null) return null;
+
+        final ByteBuffer frame;
+        synchronized (mLock) {
+            if (mRaLength < ICMPV6_RA_HEADER_LEN) return null;
+            frame = ByteBuffer.allocate(ETHER_HEADER_LEN + IPV6_HEADER_LEN + mRaLength);
+            frame.put(new byte[ETHER_ADDR_LEN]);
+            frame.put(mSrcMac);
+            frame.putShort(asShort(ETHER_TYPE_IPV6));
+            frame.putInt(0x60000000);  // Version 6, no traffic class nor flow label
+            frame.putShort(asShort(mRaLength));
+            frame.put(asByte(IPPROTO_ICMPV6));
+            frame.put(asByte(ND_HOP_LIMIT));
+            frame.put(src.getAddress());
+            frame.put(new byte[IPV6_ADDR_LEN]);
+            // The checksum of mRA is zero, the kernel computes it when sending.
+            frame.put(mRA, 0, mRaLength);
+        }
+
+        final int icmpv6Offset = ETHER_HEADER_LEN + IPV6_HEADER_LEN;
+        final short checksum = icmpv6Checksum(frame, ETHER_HEADER_LEN, icmpv6Offset,
+                frame.capacity() - icmpv6Offset);
+        frame.putShort(icmpv6Offset + 2, checksum);
+        return frame.array();
+    }
+
+    // Must not be called with mLock held: this enumerates the addresses of all interfaces.
+    private void updateLinkLocalAddress() {
+        try {
+            final NetworkInterface iface = NetworkInterface.getByIndex(mInterface.index);
+            if (iface == null) return;
+            for (InetAddress addr : Collections.list(iface.getInetAddresses())) {
+                if (addr instanceof Inet6Address && addr.isLinkLocalAddress()) {
+                    mLinkLocalAddress = (Inet6Address) addr;
+                    return;
+                }
+            }
+            mLinkLocalAddress = null;
+        } catch (SocketException e) {
+            Log.e(TAG, "Failed to get link-local address: " + e);
+        }
+    }
+
+    // Called whenever the RA changes, and whenever an RA is sent so that a link-local address
+    // added after the last change is picked up.
+    @GuardedBy("mLock")
+    private void maybeUpdateRaFrameLocked() {
+        final RaFrameListener listener = mRaFrameListener;
+        if (listener == null) return;
+
+        final byte[] frame = getRaFrame();
+        if (Arrays.equals(frame, mLastRaFrame)) return;
+        mLastRaFrame = frame;
+        listener.onRaFrameChanged(frame);
     }
 
     @GuardedBy("mLock")
@@ -360,6 +476,8 @@ public class RouterAdvertisementDaemon {
         if (!shouldSendRA) {
             mRaLength = 0;
         }
+
+        maybeUpdateRaFrameLocked();
     }
 
     private void maybeNotifyMulticastTransmitter() {
@@ -568,34 +686,24 @@ public class RouterAdvertisementDaemon {
         }
     }
 
-    private final class UnicastResponder extends Thread {
-        private final InetSocketAddress mSolicitor = new InetSocketAddress(0);
-        // The recycled buffer for receiving Router Solicitations from clients.
-        // If the RS is larger than IPV6_MIN_MTU the packets are truncated.
-        // This is fine since currently only byte 0 is examined anyway.
-        private final byte[] mSolicitation = new byte[IPV6_MIN_MTU];
-
-        @Override
-        public void run() {
-            while (isSocketValid()) {
-                try {
-                    // Blocking receive.
-                    final int rval = Os.recvfrom(
-                            mSocket, mSolicitation, 0, mSolicitation.length, 0, mSolicitor);
-                    // Do the least possible amount of validation.
-                    if (rval < 1 || mSolicitation[0] != asByte(ICMPV6_ROUTER_SOLICITATION)) {
-                        continue;
-                    }
-                } catch (ErrnoException | SocketException e) {
-                    if (isSocketValid()) {
-                        Log.e(TAG, "recvfrom error: " + e);
-                    }
-                    continue;
-                }
+    // Answers the router solicitations read by the ND reader, on its handler thread. The RA is
+    // unicast to the solicitor if it has a link-local source address, and multicast otherwise.
+    private void onNdPacket(byte[] buf, int offset, int length) {
+        if (length <= NeighborPacketForwarder.ICMPV6_TYPE_OFFSET) return;
+        if (buf[offset + NeighborPacketForwarder.ICMPV6_TYPE_OFFSET]
+                != asByte(ICMPV6_ROUTER_SOLICITATION)) {
+            return;
+        }
 
-                maybeSendRA(mSolicitor);
-            }
+        final byte[] src = Arrays.copyOfRange(buf, offset + IPV6_SRC_ADDR_OFFSET,
+                offset + IPV6_SRC_ADDR_OFFSET + IPV6_ADDR_LEN);
+        final Inet6Address solicitor;
+        try {
+            solicitor = Inet6Address.getByAddress(null /* host */, src, mInterface.index);
+        } catch (UnknownHostException impossible) {
+            throw new AssertionError("16-byte array not valid IPv6 address?");
         }
+        maybeSendRA(new InetSocketAddress(solicitor, 0));
     }
 
     // TODO: Consider moving this to run on a provided Looper as a Handler,
@@ -614,11 +722,14 @@ public class RouterAdvertisementDaemon {
                 }
 
                 maybeSendRA(mAllNodes);
+                updateLinkLocalAddress();
                 synchronized (mLock) {
                     if (mDeprecatedInfoTracker.decrementCounters()) {
                         // At least one deprecated PIO has been removed;
                         // reassemble the RA.
                         assembleRaLocked();
+                    } else {
+                        maybeUpdateRaFrameLocked();
                     }
                 }
             }
@@ -122,6 +122,7 @@ public class BpfCoordinator {
     private static final String TETHER_LIMIT_MAP_PATH = makeMapPath("limit");
     private static final String TETHER_ERROR_MAP_PATH = makeMapPath("error");
     private static final String TETHER_DEV_MAP_PATH = makeMapPath("dev");
+    private static final String TETHER_RA_MAP_PATH = makeMapPath("ra");
     private static final String DUMPSYS_RAWMAP_ARG_STATS = "--stats";
     private static final String DUMPSYS_RAWMAP_ARG_UPSTREAM4 = "--upstream4";
 
@@ -405,6 +406,18 @@ public class BpfCoordinator {
                 return null;
             }
         }
+
+        /** Get router advertisement BPF map. */
+        @Nullable public BpfMap<TetherRaKey, TetherRaValue> getBpfRaMap() {
+            if (!isAtLeastS()) return null;
+            try {
+                return new BpfMap<>(TETHER_RA_MAP_PATH,
+                    BpfMap.BPF_F_RDWR, TetherRaKey.class, TetherRaValue.class);
+            } catch (ErrnoException e) {
+                Log.e(TAG, "Cannot create ra map: " + e);
+                return null;
+            }
+        }
     }
 
     @VisibleForTesting
@@ -898,6 +911,24 @@ public class BpfCoordinator {
         }
     }
 
+    /**
+     * Set the router advertisement that the BPF program answers the router solicitations of the
+     * given downstream with, or remove it if null. Without one, router solicitations are answered
+     * by the RA daemon.
+     *
+     * Note that the router solicitations are only seen by the BPF program while it is attached,
+     * see #maybeAttachProgram.
+     */
+    public void updateRaFrame(int downstreamIfindex, @Nullable final byte[] frame) {
+        if (!isUsingBpf()) return;
+
+        if (frame == null) {
+            mBpfCoordinatorShim.removeRaFrame(downstreamIfindex);
+        } else if (!mBpfCoordinatorShim.updateRaFrame(downstreamIfindex, frame)) {
+            mLog.e("Failed to update RA frame of " + getIfName(downstreamIfindex));
+        }
+    }
+
     /**
      * Attach BPF program
      *
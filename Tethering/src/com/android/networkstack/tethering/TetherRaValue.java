@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import androidx.annotation.NonNull;
+
+import com.android.net.module.util.Struct;
+import com.android.net.module.util.Struct.Field;
+import com.android.net.module.util.Struct.Type;
+
+import java.util.Arrays;
+
+/**
+ * The value of BpfMap which is used for router advertisement templates: a complete ethernet frame
+ * whose destination addresses are filled in by the BPF program answering router solicitations.
+ */
+public class TetherRaValue extends Struct {
+    // Sync from bpf_tethering.h: ethernet and ipv6 headers, plus an IPV6_MIN_MTU sized RA.
+    public static final int FRAME_MAX_LEN = 14 + 40 + 1280;
+
+    // The rate limit state of the BPF program, reset whenever the frame is written.
+    @Field(order = 0, type = Type.U32)
+    public final long rsWindow;  // window of the rsAnswered count
+
+    @Field(order = 1, type = Type.U32)
+    public final long rsAnswered;  // solicitations answered by the BPF program in rsWindow
+
+    @Field(order = 2, type = Type.U16)
+    public final int len;  // length of the frame in bytes
+
+    @Field(order = 3, type = Type.ByteArray, arraysize = FRAME_MAX_LEN)
+    public final byte[] frame;
+
+    public TetherRaValue(final long rsWindow, final long rsAnswered, final int len,
+            @NonNull final byte[] frame) {
+        this.rsWindow = rsWindow;
+        this.rsAnswered = rsAnswered;
+        this.len = len;
+        this.frame = frame;
+    }
+
+    /** Creates a value holding the given frame, which must not exceed FRAME_MAX_LEN bytes. */
+    public static TetherRaValue fromFrame(@NonNull final byte[] frame) {
+        if (frame.length > FRAME_MAX_LEN) {
+            throw new IllegalArgumentException("RA frame too long: " + frame.length);
+        }
+        return new TetherRaValue(0 /* rsWindow */, 0 /* rsAnswered */, frame.length,
+                Arrays.copyOf(frame, FRAME_MAX_LEN));
+    }
+}
@@ -22,6 +22,7 @@ import android.bluetooth.BluetoothPan;
 import android.content.Context;
 import android.net.INetd;
 import android.net.ip.IpServer;
+import android.net.ip.NdPacketReader;
 import android.net.util.SharedLog;
 import android.os.Handler;
 import android.os.IBinder;
@@ -155,6 +156,14 @@ public abstract class TetheringDependencies {
         return new PrivateAddressCoordinator(ctx, cfg);
     }
 
+    /**
+     * Get the NdPacketReader shared by the IpServers of all downstreams.
+     */
+    @NonNull
+    public NdPacketReader getNdPacketReader(@NonNull Handler h) {
+        return new NdPacketReader(h);
+    }
+
     /**
      * Get BluetoothPanShim object to enable/disable bluetooth tethering.
      *
@@ -17,6 +17,7 @@ package com.android.networkstack.tethering.util;
 
 import android.net.TetherStatsParcel;
 import android.net.TetheringRequestParcel;
+import android.system.ErrnoException;
 import android.util.Log;
 
 import androidx.annotation.NonNull;
@@ -144,13 +145,47 @@ public class TetheringUtils {
     }
 
     /**
-     * Configures a socket for receiving ICMPv6 router solicitations and sending advertisements.
+     * Configures a socket for sending ICMPv6 router advertisements. The socket receives no
+     * packets: router solicitations are read by {@link android.net.ip.NdPacketReader}.
      * @param fd the socket's {@link FileDescriptor}.
      * @param ifIndex the interface index.
      */
     public static native void setupRaSocket(FileDescriptor fd, int ifIndex)
             throws SocketException;
 
+    /**
+     * Size of the blocks of the ring set up by {@link #createNdRing}. Buffers passed to
+     * {@link #readNdRing} must hold at least one block.
+     */
+    public static final int ND_RING_BLOCK_SIZE = 1 << 16;
+
+    /**
+     * Configures a packet socket to only receive ICMPv6 neighbor solicitations, neighbor
+     * advertisements and router solicitations, with a hop limit of 255.
+     * @param fd the socket's {@link FileDescriptor}.
+     */
+    public static native void setupNdFilter(FileDescriptor fd) throws SocketException;
+
+    /**
+     * Sets up a TPACKET_V3 receive ring on a packet socket and maps it. Must be called before
+     * the socket is bound, and the ring released with {@link #destroyNdRing}.
+     * @param fd the socket's {@link FileDescriptor}.
+     * @return an opaque handle to the ring.
+     */
+    public static native long createNdRing(FileDescriptor fd) throws SocketException;
+
+    /**
+     * Reads the blocks of packets the kernel retired to the ring. Each packet is prefixed by the
+     * 32-bit index of the interface it was received on and its 16-bit length, in network byte
+     * order.
+     * @return the number of bytes written to buf.
+     * @throws ErrnoException with EAGAIN if no block is ready.
+     */
+    public static native int readNdRing(long ring, byte[] buf) throws ErrnoException;
+
+    /** Unmaps a ring set up by {@link #createNdRing}. */
+    public static native void destroyNdRing(long ring);
+
     /**
      * Read s as an unsigned 16-bit integer.
      */
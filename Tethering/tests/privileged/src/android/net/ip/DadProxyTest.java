@@ -207,7 +207,7 @@ public class DadProxyTest {
     }
 
     private DadProxy setupProxy() throws Exception {
-        DadProxy proxy = new DadProxy(mHandler, mTetheredParams);
+        DadProxy proxy = new DadProxy(mHandler, mTetheredParams, new NdPacketReader(mHandler));
         mHandler.post(() -> proxy.setUpstreamIface(mUpstreamParams));
 
         // Upstream iface is added to local network to simplify test case.
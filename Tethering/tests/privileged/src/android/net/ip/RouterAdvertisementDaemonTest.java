@@ -18,6 +18,7 @@ package android.net.ip;
 
 import static android.net.RouteInfo.RTN_UNICAST;
 
+import static com.android.net.module.util.IpUtils.icmpv6Checksum;
 import static com.android.net.module.util.NetworkStackConstants.ETHER_HEADER_LEN;
 import static com.android.net.module.util.NetworkStackConstants.ETHER_TYPE_IPV6;
 import static com.android.net.module.util.NetworkStackConstants.ICMPV6_ND_OPTION_MTU;
@@ -32,8 +33,11 @@ import static com.android.net.module.util.NetworkStackConstants.IPV6_HEADER_LEN;
 import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_AUTONOMOUS;
 import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_ON_LINK;
 
+import static org.junit.Assert.assertArrayEquals;
 import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
 import static org.junit.Assert.assertNotNull;
+import static org.junit.Assert.assertNull;
 import static org.junit.Assert.assertTrue;
 import static org.junit.Assert.fail;
 
@@ -79,8 +83,12 @@ import org.mockito.MockitoAnnotations;
 import java.net.Inet6Address;
 import java.net.InetAddress;
 import java.nio.ByteBuffer;
+import java.util.Arrays;
 import java.util.HashSet;
 import java.util.List;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
 
 @RunWith(AndroidJUnit4.class)
 @SmallTest
@@ -122,7 +130,7 @@ public final class RouterAdvertisementDaemonTest {
         // Looper must be prepared here since AndroidJUnitRunner runs tests on separate threads.
         if (Looper.myLooper() == null) Looper.prepare();
 
-        mRaDaemon = new RouterAdvertisementDaemon(mTetheredParams);
+        mRaDaemon = new RouterAdvertisementDaemon(mTetheredParams, new NdPacketReader(mHandler));
         sNetd.networkAddInterface(INetd.LOCAL_NET_ID, mTetheredParams.name);
     }
 
@@ -148,6 +156,13 @@ public final class RouterAdvertisementDaemonTest {
         mHandler.post(mTetheredPacketReader::start);
     }
 
+    // Router solicitations are read from the ND reader, which must be used on its handler thread.
+    private boolean startRaDaemon() throws Exception {
+        final CompletableFuture<Boolean> started = new CompletableFuture<>();
+        mHandler.post(() -> started.complete(mRaDaemon.start()));
+        return started.get(PACKET_TIMEOUT_MS, TimeUnit.MILLISECONDS);
+    }
+
     private class TestRaPacket {
         final RaParams mNewParams, mOldParams;
 
@@ -306,7 +321,7 @@ public final class RouterAdvertisementDaemonTest {
 
     @Test
     public void testUnSolicitRouterAdvertisement() throws Exception {
-        assertTrue(mRaDaemon.start());
+        assertTrue(startRaDaemon());
         final RaParams params1 = createRaParams("2001:1122:3344::5566");
         mRaDaemon.buildNewRa(null, params1);
         assertMulticastRaPacket(new TestRaPacket(null, params1));
@@ -324,7 +339,7 @@ public final class RouterAdvertisementDaemonTest {
         // initiate the address resolution first before responding the unicast RA.
         sNetd.setProcSysNet(INetd.IPV6, INetd.CONF, mTetheredParams.name, "forwarding", "1");
 
-        assertTrue(mRaDaemon.start());
+        assertTrue(startRaDaemon());
         final RaParams params1 = createRaParams("2001:1122:3344::5566");
         mRaDaemon.buildNewRa(null, params1);
         assertMulticastRaPacket(new TestRaPacket(null, params1));
@@ -341,4 +356,67 @@ public final class RouterAdvertisementDaemonTest {
         mTetheredPacketReader.sendResponse(rs);
         assertUnicastRaPacket(new TestRaPacket(null, params1));
     }
+
+    @Test
+    public void testRaFrame() throws Exception {
+        final LinkedBlockingQueue<byte[]> frames = new LinkedBlockingQueue<>();
+        mRaDaemon.setRaFrameListener(frame -> frames.add(frame == null ? new byte[0] : frame));
+        assertTrue(startRaDaemon());
+        // Nothing to announce yet.
+        assertNull(mRaDaemon.getRaFrame());
+
+        final RaParams params = createRaParams("2001:1122:3344::5566");
+        mRaDaemon.buildNewRa(null, params);
+        // Once an RA was sent, the link-local address of the interface is looked up again, and
+        // the frame is sent from it.
+        assertMulticastRaPacket(new TestRaPacket(null, params));
+        final byte[] frame = pollRaFrame(frames);
+
+        // The checksum is computed with the zero destination address of the frame.
+        final ByteBuffer buf = ByteBuffer.wrap(frame);
+        final int icmpv6Offset = ETHER_HEADER_LEN + IPV6_HEADER_LEN;
+        final short checksum = buf.getShort(icmpv6Offset + 2);
+        buf.putShort(icmpv6Offset + 2, (short) 0);
+        assertEquals(checksum, icmpv6Checksum(buf, ETHER_HEADER_LEN, icmpv6Offset,
+                frame.length - icmpv6Offset));
+
+        // Addressed to all nodes, the frame is the RA the daemon sends.
+        buf.position(0);
+        buf.put(MacAddress.fromString("33:33:00:00:00:01").toByteArray());
+        buf.position(ETHER_HEADER_LEN + IPV6_HEADER_LEN - IPV6_ADDR_LEN);
+        buf.put(IPV6_ADDR_ALL_NODES_MULTICAST.getAddress());
+        assertTrue(new TestRaPacket(null, params).isPacketMatched(frame, true /* multicast */));
+    }
+
+    // Returns the next non-null frame passed to the listener.
+    private byte[] pollRaFrame(LinkedBlockingQueue<byte[]> frames) throws Exception {
+        byte[] frame;
+        while ((frame = frames.poll(PACKET_TIMEOUT_MS, TimeUnit.MILLISECONDS)) != null) {
+            if (frame.length > 0) return frame;
+        }
+        fail("No RA frame received");
+        return null;
+    }
+
+    @Test
+    public void testRaFrameListener() throws Exception {
+        // Null frames are recorded as empty arrays.
+        final LinkedBlockingQueue<byte[]> frames = new LinkedBlockingQueue<>();
+        mRaDaemon.setRaFrameListener(frame -> frames.add(frame == null ? new byte[0] : frame));
+        assertTrue(startRaDaemon());
+
+        final RaParams params = createRaParams("2001:1122:3344::5566");
+        mRaDaemon.buildNewRa(null, params);
+        assertMulticastRaPacket(new TestRaPacket(null, params));
+        // The frame is pushed as soon as the interface has a link-local address, even if that is
+        // only after the RA was built.
+        final byte[] frame = pollRaFrame(frames);
+        assertArrayEquals(mRaDaemon.getRaFrame(), frame);
+
+        // Deprecating the prefix changes the frame as well.
+        mRaDaemon.buildNewRa(params, null);
+        final byte[] deprecatedFrame = pollRaFrame(frames);
+        assertFalse(Arrays.equals(frame, deprecatedFrame));
+        assertArrayEquals(mRaDaemon.getRaFrame(), deprecatedFrame);
+    }
 }
@@ -85,6 +85,7 @@ import android.net.dhcp.IDhcpServer;
 import android.net.dhcp.IDhcpServerCallbacks;
 import android.net.ip.IpNeighborMonitor.NeighborEvent;
 import android.net.ip.IpNeighborMonitor.NeighborEventConsumer;
+import android.net.ip.RouterAdvertisementDaemon.RaFrameListener;
 import android.net.ip.RouterAdvertisementDaemon.RaParams;
 import android.net.util.SharedLog;
 import android.os.Build;
@@ -111,6 +112,8 @@ import com.android.networkstack.tethering.PrivateAddressCoordinator;
 import com.android.networkstack.tethering.Tether6Value;
 import com.android.networkstack.tethering.TetherDevKey;
 import com.android.networkstack.tethering.TetherDevValue;
+import com.android.networkstack.tethering.TetherRaKey;
+import com.android.networkstack.tethering.TetherRaValue;
 import com.android.networkstack.tethering.TetherDownstream6Key;
 import com.android.networkstack.tethering.TetherLimitKey;
 import com.android.networkstack.tethering.TetherLimitValue;
@@ -180,6 +183,7 @@ public class IpServerTest {
     @Mock private IDhcpServer mDhcpServer;
     @Mock private DadProxy mDadProxy;
     @Mock private RouterAdvertisementDaemon mRaDaemon;
+    @Mock private NdPacketReader mNdPacketReader;
     @Mock private IpNeighborMonitor mIpNeighborMonitor;
     @Mock private IpServer.Dependencies mDependencies;
     @Mock private PrivateAddressCoordinator mAddressCoordinator;
@@ -193,6 +197,7 @@ public class IpServerTest {
     @Mock private BpfMap<TetherStatsKey, TetherStatsValue> mBpfStatsMap;
     @Mock private BpfMap<TetherLimitKey, TetherLimitValue> mBpfLimitMap;
     @Mock private BpfMap<TetherDevKey, TetherDevValue> mBpfDevMap;
+    @Mock private BpfMap<TetherRaKey, TetherRaValue> mBpfRaMap;
 
     @Captor private ArgumentCaptor<DhcpServingParamsParcel> mDhcpParamsCaptor;
 
@@ -211,8 +216,9 @@ public class IpServerTest {
 
     private void initStateMachine(int interfaceType, boolean usingLegacyDhcp,
             boolean usingBpfOffload) throws Exception {
-        when(mDependencies.getDadProxy(any(), any())).thenReturn(mDadProxy);
-        when(mDependencies.getRouterAdvertisementDaemon(any())).thenReturn(mRaDaemon);
+        when(mDependencies.getDadProxy(any(), any(), eq(mNdPacketReader))).thenReturn(mDadProxy);
+        when(mDependencies.getRouterAdvertisementDaemon(any(), eq(mNdPacketReader)))
+                .thenReturn(mRaDaemon);
         when(mDependencies.getInterfaceParams(IFACE_NAME)).thenReturn(TEST_IFACE_PARAMS);
         when(mDependencies.getInterfaceParams(UPSTREAM_IFACE)).thenReturn(UPSTREAM_IFACE_PARAMS);
         when(mDependencies.getInterfaceParams(UPSTREAM_IFACE2)).thenReturn(UPSTREAM_IFACE_PARAMS2);
@@ -235,7 +241,7 @@ public class IpServerTest {
         when(mTetherConfig.getP2pLeasesSubnetPrefixLength()).thenReturn(P2P_SUBNET_PREFIX_LENGTH);
         mIpServer = new IpServer(
                 IFACE_NAME, mLooper.getLooper(), interfaceType, mSharedLog, mNetd, mBpfCoordinator,
-                mCallback, mTetherConfig, mAddressCoordinator, mDependencies);
+                mCallback, mTetherConfig, mAddressCoordinator, mNdPacketReader, mDependencies);
         mIpServer.start();
         mNeighborEventConsumer = neighborCaptor.getValue();
 
@@ -355,6 +361,11 @@ public class IpServerTest {
                     public BpfMap<TetherDevKey, TetherDevValue> getBpfDevMap() {
                         return mBpfDevMap;
                     }
+
+                    @Nullable
+                    public BpfMap<TetherRaKey, TetherRaValue> getBpfRaMap() {
+                        return mBpfRaMap;
+                    }
                 };
         mBpfCoordinator = spy(new BpfCoordinator(mBpfDeps));
 
@@ -367,7 +378,7 @@ public class IpServerTest {
                 .thenReturn(mIpNeighborMonitor);
         mIpServer = new IpServer(IFACE_NAME, mLooper.getLooper(), TETHERING_BLUETOOTH, mSharedLog,
                 mNetd, mBpfCoordinator, mCallback, mTetherConfig, mAddressCoordinator,
-                mDependencies);
+                mNdPacketReader, mDependencies);
         mIpServer.start();
         mLooper.dispatchAll();
         verify(mCallback).updateInterfaceState(
@@ -1277,6 +1288,33 @@ public class IpServerTest {
         reset(mRaDaemon);
     }
 
+    @Test
+    public void testRaFrameUpdates() throws Exception {
+        final ArgumentCaptor<RaFrameListener> listenerCaptor =
+                ArgumentCaptor.forClass(RaFrameListener.class);
+        initTetheredStateMachine(TETHERING_WIFI, UPSTREAM_IFACE);
+        verify(mRaDaemon).setRaFrameListener(listenerCaptor.capture());
+        final RaFrameListener listener = listenerCaptor.getValue();
+
+        // Frames are pushed from the IpServer handler, whatever thread the daemon calls from.
+        final byte[] frame = new byte[] {1, 2, 3, 4};
+        listener.onRaFrameChanged(frame);
+        verify(mBpfCoordinator, never()).updateRaFrame(TEST_IFACE_PARAMS.index, frame);
+        mLooper.dispatchAll();
+        verify(mBpfCoordinator).updateRaFrame(TEST_IFACE_PARAMS.index, frame);
+
+        listener.onRaFrameChanged(null);
+        mLooper.dispatchAll();
+        verify(mBpfCoordinator).updateRaFrame(TEST_IFACE_PARAMS.index, null);
+
+        // Frames posted after IPv6 was stopped are ignored.
+        dispatchCommand(IpServer.CMD_TETHER_UNREQUESTED);
+        verify(mBpfCoordinator, times(2)).updateRaFrame(TEST_IFACE_PARAMS.index, null);
+        listener.onRaFrameChanged(frame);
+        mLooper.dispatchAll();
+        verify(mBpfCoordinator).updateRaFrame(TEST_IFACE_PARAMS.index, frame);
+    }
+
     @Test
     public void testStopObsoleteDhcpServer() throws Exception {
         final ArgumentCaptor<DhcpServerCallbacks> cbCaptor =
@@ -1476,7 +1514,7 @@ public class IpServerTest {
             inOrder.verify(mDadProxy).stop();
         }
         else {
-            verify(mDependencies, never()).getDadProxy(any(), any());
+            verify(mDependencies, never()).getDadProxy(any(), any(), any());
         }
     }
     @Test @IgnoreAfter(Build.VERSION_CODES.R)
@@ -361,6 +361,7 @@ public class BpfCoordinatorTest {
     @Mock private BpfMap<TetherDownstream6Key, Tether6Value> mBpfDownstream6Map;
     @Mock private BpfMap<TetherUpstream6Key, Tether6Value> mBpfUpstream6Map;
     @Mock private BpfMap<TetherDevKey, TetherDevValue> mBpfDevMap;
+    @Mock private BpfMap<TetherRaKey, TetherRaValue> mBpfRaMap;
 
     // Late init since methods must be called by the thread that created this object.
     private TestableNetworkStatsProviderCbBinder mTetherStatsProviderCb;
@@ -453,6 +454,11 @@ public class BpfCoordinatorTest {
                     public BpfMap<TetherDevKey, TetherDevValue> getBpfDevMap() {
                         return mBpfDevMap;
                     }
+
+                    @Nullable
+                    public BpfMap<TetherRaKey, TetherRaValue> getBpfRaMap() {
+                        return mBpfRaMap;
+                    }
             });
 
     @Before public void setUp() {
@@ -1611,6 +1617,25 @@ public class BpfCoordinatorTest {
         verify(mBpfDevMap, never()).updateEntry(any(), any());
     }
 
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testUpdateRaFrame() throws Exception {
+        final BpfCoordinator coordinator = makeBpfCoordinator();
+        final byte[] frame = new byte[] {1, 2, 3, 4};
+
+        coordinator.updateRaFrame(DOWNSTREAM_IFINDEX, frame);
+        verify(mBpfRaMap).updateEntry(eq(new TetherRaKey(DOWNSTREAM_IFINDEX)),
+                eq(TetherRaValue.fromFrame(frame)));
+
+        coordinator.updateRaFrame(DOWNSTREAM_IFINDEX, null);
+        verify(mBpfRaMap).deleteEntry(eq(new TetherRaKey(DOWNSTREAM_IFINDEX)));
+
+        // Frames that do not fit in the map are left to the RA daemon.
+        clearInvocations(mBpfRaMap);
+        coordinator.updateRaFrame(DOWNSTREAM_IFINDEX, new byte[TetherRaValue.FRAME_MAX_LEN + 1]);
+        verify(mBpfRaMap, never()).updateEntry(any(), any());
+    }
+
     @Test
     @IgnoreUpTo(Build.VERSION_CODES.R)
     public void testAddDevMapRule4() throws Exception {
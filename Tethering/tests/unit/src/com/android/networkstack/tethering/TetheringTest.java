@@ -153,6 +153,7 @@ import android.net.dhcp.IDhcpServer;
 import android.net.ip.DadProxy;
 import android.net.ip.IpNeighborMonitor;
 import android.net.ip.IpServer;
+import android.net.ip.NdPacketReader;
 import android.net.ip.RouterAdvertisementDaemon;
 import android.net.util.NetworkConstants;
 import android.net.util.SharedLog;
@@ -262,6 +263,7 @@ public class TetheringTest {
     @Mock private IPv6TetheringCoordinator mIPv6TetheringCoordinator;
     @Mock private DadProxy mDadProxy;
     @Mock private RouterAdvertisementDaemon mRouterAdvertisementDaemon;
+    @Mock private NdPacketReader mNdPacketReader;
     @Mock private IpNeighborMonitor mIpNeighborMonitor;
     @Mock private IDhcpServer mDhcpServer;
     @Mock private INetd mNetd;
@@ -359,13 +361,16 @@ public class TetheringTest {
     public class MockIpServerDependencies extends IpServer.Dependencies {
         @Override
         public DadProxy getDadProxy(
-                Handler handler, InterfaceParams ifParams) {
+                Handler handler, InterfaceParams ifParams, NdPacketReader ndReader) {
+            // All downstreams share the reader owned by Tethering.
+            assertEquals(mNdPacketReader, ndReader);
             return mDadProxy;
         }
 
         @Override
         public RouterAdvertisementDaemon getRouterAdvertisementDaemon(
-                InterfaceParams ifParams) {
+                InterfaceParams ifParams, NdPacketReader ndReader) {
+            assertEquals(mNdPacketReader, ndReader);
             return mRouterAdvertisementDaemon;
         }
 
@@ -497,6 +502,11 @@ public class TetheringTest {
             return false;
         }
 
+        @Override
+        public NdPacketReader getNdPacketReader(Handler h) {
+            return mNdPacketReader;
+        }
+
         @Override
         public PrivateAddressCoordinator getPrivateAddressCoordinator(Context ctx,
                 TetheringConfiguration cfg) {
@@ -189,4 +189,37 @@ public class TetheringUtilsTest {
         icmpv6 = Struct.parse(Icmpv6Header.class, received);
         assertEquals(NetworkStackConstants.ICMPV6_NEIGHBOR_SOLICITATION, icmpv6.type);
     }
+
+    @Test
+    public void testNdSocketFilter() throws Exception {
+        MacAddress mac1 = MacAddress.fromString("11:22:33:44:55:66");
+        MacAddress mac2 = MacAddress.fromString("aa:bb:cc:dd:ee:ff");
+        Inet6Address ll1 = (Inet6Address) InetAddress.getByName("fe80::1");
+        Inet6Address ll2 = (Inet6Address) InetAddress.getByName("fe80::abcd");
+        Inet6Address allRouters = NetworkStackConstants.IPV6_ADDR_ALL_ROUTERS_MULTICAST;
+
+        // ND packets that went through a router are not valid.
+        final ByteBuffer routedNs = Ipv6Utils.buildNsPacket(mac1, mac2, ll1, ll2, ll1);
+        final int hopLimitOffset = Struct.getSize(EthernetHeader.class) + 7;
+        routedNs.put(hopLimitOffset, (byte) 64);
+
+        final int[] types = {
+                NetworkStackConstants.ICMPV6_NEIGHBOR_ADVERTISEMENT,
+                NetworkStackConstants.ICMPV6_NEIGHBOR_SOLICITATION,
+                NetworkStackConstants.ICMPV6_ROUTER_SOLICITATION,
+        };
+        final ByteBuffer[] packets = {
+                Ipv6Utils.buildNaPacket(mac1, mac2, ll1, ll2, 0, ll1),
+                Ipv6Utils.buildNsPacket(mac1, mac2, ll1, ll2, ll1),
+                Ipv6Utils.buildRsPacket(mac1, mac2, ll1, allRouters),
+        };
+        for (int i = 0; i < packets.length; i++) {
+            final ByteBuffer received = checkIcmpSocketFilter(packets[i] /* passed */,
+                    routedNs /* dropped */, TetheringUtils::setupNdFilter);
+
+            Struct.parse(Ipv6Header.class, received);  // Skip IPv6 header.
+            final Icmpv6Header icmpv6 = Struct.parse(Icmpv6Header.class, received);
+            assertEquals(types[i], icmpv6.type);
+        }
+    }
 }
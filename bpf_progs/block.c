@@ -23,38 +23,67 @@
 #define BPFLOADER_MIN_VER BPFLOADER_T_BETA3_VERSION
 
 #include "bpf_helpers.h"
+#include "block.h"
 
 #define ALLOW 1
 #define DISALLOW 0
 
-DEFINE_BPF_MAP_GRW(blocked_ports_map, ARRAY, int, uint64_t,
-        1024 /* 64K ports -> 1024 u64s */, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(blocked_ports_map, ARRAY, int, uint64_t, BLOCKED_PORTS_MAP_SIZE, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(blocked_bind_stats_map, LRU_PERCPU_HASH, BlockedBindKey, uint64_t,
+                   BLOCKED_BIND_STATS_ENTRIES, AID_SYSTEM)
+
+static inline __always_inline bool is_blocked(BlockedPortsBitmap bitmap, int port) {
+    int key = bitmap * BLOCKED_PORTS_WORDS + (port >> 6);
+    int shift = port & 63;
+
+    uint64_t *val = bpf_blocked_ports_map_lookup_elem(&key);
+    // Lookup should never fail in reality, but if it does return here to keep the
+    // BPF verifier happy.
+    if (!val) return false;
+
+    return (*val >> shift) & 1;
+}
+
+static inline __always_inline int deny(struct bpf_sock_addr *ctx, int port) {
+    BlockedBindKey key = {
+        // bind() runs in process context, so the current uid is the one of the socket owner.
+        .uid = bpf_get_current_uid_gid(),
+        .port = port,
+        .protocol = ctx->protocol,
+    };
+
+    uint64_t *count = bpf_blocked_bind_stats_map_lookup_elem(&key);
+    if (count) {
+        // Per cpu map, so no need for atomics.
+        (*count)++;
+    } else {
+        uint64_t one = 1;
+        bpf_blocked_bind_stats_map_update_elem(&key, &one, BPF_NOEXIST);
+    }
+    return DISALLOW;
+}
 
 static inline __always_inline int block_port(struct bpf_sock_addr *ctx) {
     if (!ctx->user_port) return ALLOW;
 
+    // user_port is in network byte order.
+    const int port = ntohs(ctx->user_port);
+
     switch (ctx->protocol) {
         case IPPROTO_TCP:
         case IPPROTO_MPTCP:
+            return is_blocked(BLOCKED_PORTS_TCP, port) ? deny(ctx, port) : ALLOW;
         case IPPROTO_UDP:
         case IPPROTO_UDPLITE:
+            return is_blocked(BLOCKED_PORTS_UDP, port) ? deny(ctx, port) : ALLOW;
         case IPPROTO_DCCP:
         case IPPROTO_SCTP:
-            break;
+            // Neither stream nor datagram only, so blocked by either bitmap.
+            if (is_blocked(BLOCKED_PORTS_TCP, port)) return deny(ctx, port);
+            return is_blocked(BLOCKED_PORTS_UDP, port) ? deny(ctx, port) : ALLOW;
         default:
             return ALLOW; // unknown protocols are allowed
     }
-
-    int key = ctx->user_port >> 6;
-    int shift = ctx->user_port & 63;
-
-    uint64_t *val = bpf_blocked_ports_map_lookup_elem(&key);
-    // Lookup should never fail in reality, but if it does return here to keep the
-    // BPF verifier happy.
-    if (!val) return ALLOW;
-
-    if ((*val >> shift) & 1) return DISALLOW;
-    return ALLOW;
 }
 
 DEFINE_BPF_PROG_KVER("bind4/block_port", AID_ROOT, AID_SYSTEM,
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// blocked_ports_map holds one bitmap of 64K ports per protocol, back to back. Port p of a bitmap
+// is bit (p & 63) of word (p >> 6).
+#define BLOCKED_PORTS_WORDS 1024  // 64K ports -> 1024 u64s
+
+typedef enum {
+    BLOCKED_PORTS_TCP = 0,  // TCP and MPTCP
+    BLOCKED_PORTS_UDP = 1,  // UDP and UDP-Lite
+    BLOCKED_PORTS_BITMAPS = 2,
+} BlockedPortsBitmap;
+
+#define BLOCKED_PORTS_MAP_SIZE (BLOCKED_PORTS_BITMAPS * BLOCKED_PORTS_WORDS)
+
+#define STRUCT_SIZE(name, size) _Static_assert(sizeof(name) == (size), "Incorrect struct size.")
+
+// Key of blocked_bind_stats_map, which counts the binds denied per cpu. The least recently
+// denied pairs are evicted once the map is full.
+#define BLOCKED_BIND_STATS_ENTRIES 1024
+
+typedef struct {
+    uint32_t uid;
+    uint16_t port;  // Host byte order
+    uint8_t protocol;
+    uint8_t pad;
+} BlockedBindKey;
+STRUCT_SIZE(BlockedBindKey, 4 + 2 + 1 + 1);  // 8
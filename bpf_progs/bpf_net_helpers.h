@@ -51,6 +51,8 @@ static int (*bpf_redirect_map)(const struct bpf_map_def* map, __u32 key,
 
 static int (*bpf_skb_change_head)(struct __sk_buff* skb, __u32 head_room,
                                   __u64 flags) = (void*)BPF_FUNC_skb_change_head;
+static int (*bpf_skb_change_tail)(struct __sk_buff* skb, __u32 len,
+                                  __u64 flags) = (void*)BPF_FUNC_skb_change_tail;
 static int (*bpf_skb_adjust_room)(struct __sk_buff* skb, __s32 len_diff, __u32 mode,
                                   __u64 flags) = (void*)BPF_FUNC_skb_adjust_room;
 
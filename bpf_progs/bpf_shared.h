@@ -219,7 +219,62 @@ typedef struct {
     struct in6_addr pfx96;   // The destination /96 nat64 prefix, bottom 32 bits must be 0
     bool oifIsEthernet;      // Whether the output interface requires ethernet header
     uint8_t pad[3];
+    struct ethhdr macHeader;  // includes dst/src mac and ethertype (zeroed iff rawip egress
+                              // or if the next hop neighbour has not been resolved yet)
+    uint16_t pmtu;            // The path MTU towards the nat64 prefix, 0 if unknown
 } ClatEgress4Value;
-STRUCT_SIZE(ClatEgress4Value, 4 + 2 * 16 + 1 + 3);  // 40
+STRUCT_SIZE(ClatEgress4Value, 4 + 2 * 16 + 1 + 3 + 14 + 2);  // 56
+
+// Reasons for the clat programs to punt a packet to clatd (or to drop it).
+#define BPF_CLAT_ERRORS           \
+    ERR(INVALID_IP_VERSION)       \
+    ERR(INVALID_IP_HEADER)        \
+    ERR(CHECKSUM)                 \
+    ERR(HAS_IP_OPTIONS)           \
+    ERR(IS_IP_FRAG)               \
+    ERR(NO_OIF)                   \
+    ERR(ETHER_OIF_UNSUPPORTED)    \
+    ERR(NEIGHBOUR_UNRESOLVED)     \
+    ERR(UNSUPPORTED_PROTOCOL)     \
+    ERR(SHORT_L4_HEADER)          \
+    ERR(UDP_CSUM_ZERO)            \
+    ERR(FRAGMENTED_UDP_CSUM_ZERO) \
+    ERR(ICMP_FRAGMENT)            \
+    ERR(ICMP_UNTRANSLATED)        \
+    ERR(ICMP_INVALID_INNER)       \
+    ERR(CHANGE_PROTO_FAILED)      \
+    ERR(ADJUST_ROOM_FAILED)       \
+    ERR(CHANGE_HEAD_FAILED)       \
+    ERR(PMTU_EXCEEDED)            \
+    ERR(_MAX)
+
+#define ERR(x) BPF_CLAT_ERR_ ##x,
+enum {
+    BPF_CLAT_ERRORS
+};
+#undef ERR
+
+#define ERR(x) #x,
+static const char *bpf_clat_errors[] = {
+    BPF_CLAT_ERRORS
+};
+#undef ERR
+
+typedef uint32_t ClatStatsKey;  // The v4-* interface index
+
+// Per cpu translation counters of a clat v4-* interface.  The byte counts are those of the IPv4
+// packets as seen on the v4-* interface, while the overhead counts the additional bytes of the
+// IPv6 packets on the upstream interface (ie. the 20 bytes of header growth, plus 8 bytes for a
+// fragment header), so the upstream usage can be derived without guessing.
+typedef struct {
+    uint64_t rxPackets;
+    uint64_t rxBytes;
+    uint64_t rxOverheadBytes;
+    uint64_t txPackets;
+    uint64_t txBytes;
+    uint64_t txOverheadBytes;
+    uint64_t punts[BPF_CLAT_ERR__MAX];  // Indexed by BPF_CLAT_ERR_*, includes drops
+} ClatStatsValue;
+STRUCT_SIZE(ClatStatsValue, (6 + BPF_CLAT_ERR__MAX) * 8);
 
 #undef STRUCT_SIZE
@@ -161,4 +161,28 @@ typedef struct {
 } Tether4Value;
 STRUCT_SIZE(Tether4Value, 4 + 14 + 2 + 16 + 16 + 2 + 2 + 8);  // 64
 
+typedef uint32_t TetherRaKey;  // downstream ifindex
+
+// A router advertisement ready to be sent on a downstream, from its ethernet header onwards,
+// used to answer router solicitations without waking up the RA daemon.
+//
+// The destination MAC and IPv6 addresses are zero, and the ICMPv6 checksum is computed with
+// the destination address of the pseudo header zeroed as well. The sender writes the
+// destination addresses and adds the destination IPv6 address to the checksum.
+#define TETHER_RA_FRAME_MAX_LEN (14 + 40 + 1280)  // ethernet + ipv6 headers + IPV6_MIN_MTU
+
+// At most TETHER_RA_MAX_ANSWERS solicitations are answered per downstream and per window of
+// 2^TETHER_RA_WINDOW_SHIFT ns (about a second), so that a flood of solicitations does not turn
+// into a flood of RAs sent by the kernel. The rest are left to the RA daemon.
+#define TETHER_RA_WINDOW_SHIFT 30
+#define TETHER_RA_MAX_ANSWERS 16
+
+typedef struct {
+    uint32_t rsWindow;    // Kernel updates: bpf_ktime_get_ns() >> TETHER_RA_WINDOW_SHIFT
+    uint32_t rsAnswered;  // Kernel updates: solicitations answered during rsWindow
+    uint16_t len;         // Length of frame in bytes
+    uint8_t frame[TETHER_RA_FRAME_MAX_LEN];
+} TetherRaValue;
+STRUCT_SIZE(TetherRaValue, 4 + 4 + 2 + TETHER_RA_FRAME_MAX_LEN);  // 1344
+
 #undef STRUCT_SIZE
@@ -15,6 +15,8 @@
  */
 
 #include <linux/bpf.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 #include <linux/in.h>
@@ -39,11 +41,252 @@
 #include "clat_mark.h"
 
 // From kernel:include/net/ip.h
-#define IP_DF 0x4000  // Flag: "Don't Fragment"
+#define IP_CE 0x8000      // Flag: "Congestion"
+#define IP_DF 0x4000      // Flag: "Don't Fragment"
+#define IP_MF 0x2000      // Flag: "More Fragments"
+#define IP_OFFSET 0x1FFF  // "Fragment Offset" part
+
+// From kernel:include/net/ipv6.h
+#define IP6_MF 0x0001
+struct frag_hdr {
+    __u8 nexthdr;
+    __u8 reserved;
+    __be16 frag_off;
+    __be32 identification;
+};
+
+// IPv4 header including the maximum 40 bytes of options
+#define MAX_IPV4_HEADER_SIZE 60
+
+// Zero checksum UDP datagrams up to this size get their checksum calculated in ebpf,
+// comfortably above the default mtu of the v4-* interface.
+#define UDP_CSUM_MAX_LEN 2048
+#define UDP_CSUM_CHUNK_SIZE 128
+
+// ----- Checksum helpers -----
+
+// One's complement add the 'len' (even) bytes at 'p' to the (unfolded) sum.
+static inline __always_inline __wsum csum_add_words(__wsum sum, const void* p, const int len) {
+    for (int i = 0; i < len / sizeof(__u16); ++i) {
+        sum += ((const __u16*)p)[i];
+    }
+    return sum;
+}
+
+// One's complement subtract the 'len' (even) bytes at 'p' from the (unfolded) sum.
+// Note the cast: '~' promotes a u16 to int, and the resulting high bits would lose carries.
+static inline __always_inline __wsum csum_sub_words(__wsum sum, const void* p, const int len) {
+    for (int i = 0; i < len / sizeof(__u16); ++i) {
+        sum += (__u16)~((const __u16*)p)[i];
+    }
+    return sum;
+}
+
+// Fold an unfolded sum into its 16-bit one's complement, ie. the value of a checksum field.
+static inline __always_inline __u16 csum_fold_sum(__wsum sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);  // collapse u32 into range 0 .. 0x1FFFE
+    sum = (sum & 0xFFFF) + (sum >> 16);  // collapse any potential carry into u16
+    return (__u16)~sum;
+}
+
+// Add the one's complement sum of the 'len' bytes at offset 'off' in the packet to the
+// (unfolded) sum, zero padding an odd length.  Returns a negative error if the bytes could not
+// be read, or if 'len' is more than UDP_CSUM_MAX_LEN.
+static inline __always_inline __s64 csum_skb_bytes(struct __sk_buff* skb, const __u32 off,
+                                                   const __u32 len, __wsum sum) {
+    __u8 buf[UDP_CSUM_CHUNK_SIZE];
+
+    if (len > UDP_CSUM_MAX_LEN) return -1;
+
+#pragma unroll
+    for (__u32 i = 0; i < UDP_CSUM_MAX_LEN / UDP_CSUM_CHUNK_SIZE; ++i) {
+        const __u32 pos = i * UDP_CSUM_CHUNK_SIZE;
+        if (pos >= len) break;
+        __u32 n = UDP_CSUM_CHUNK_SIZE;
+        if (len - pos < UDP_CSUM_CHUNK_SIZE) {
+            // The final partial chunk: zero the tail, since the whole buffer is summed below.
+            __builtin_memset(buf, 0, sizeof(buf));
+            // Written this way so the verifier can tell n is in range 1 .. UDP_CSUM_CHUNK_SIZE.
+            n = ((len - pos - 1) & (UDP_CSUM_CHUNK_SIZE - 1)) + 1;
+        }
+        if (bpf_skb_load_bytes(skb, off + pos, buf, n)) return -1;
+        const __s64 ret = bpf_csum_diff(NULL, 0, (__be32*)buf, sizeof(buf), sum);
+        if (ret < 0) return ret;
+        sum = ret;
+    }
+    return sum;
+}
+
+// ----- ICMP translation (RFC 7915) -----
+
+// Translates the type, code and rest-of-header fields of an ICMPv6 message into an ICMP header
+// (with a zero checksum).  Returns 1 for an error message (which embeds the offending packet),
+// 0 for an echo message and -1 if the message is not translated in ebpf (ie. left to clatd).
+static inline __always_inline int icmp6_to_icmp4(const struct icmp6hdr* icmp6,
+                                                 struct icmphdr* icmp4) {
+    // The identifier and sequence number of echo messages are carried over as is.
+    icmp4->un.gateway = icmp6->icmp6_dataun.un_data32[0];
+    icmp4->checksum = 0;
+
+    switch (icmp6->icmp6_type) {
+        case ICMPV6_ECHO_REQUEST:
+            icmp4->type = ICMP_ECHO;
+            icmp4->code = 0;
+            return 0;
+
+        case ICMPV6_ECHO_REPLY:
+            icmp4->type = ICMP_ECHOREPLY;
+            icmp4->code = 0;
+            return 0;
+
+        case ICMPV6_DEST_UNREACH:
+            icmp4->type = ICMP_DEST_UNREACH;
+            icmp4->un.gateway = 0;
+            switch (icmp6->icmp6_code) {
+                case ICMPV6_NOROUTE:
+                case ICMPV6_NOT_NEIGHBOUR:  // beyond scope of source address
+                case ICMPV6_ADDR_UNREACH:
+                    icmp4->code = ICMP_HOST_UNREACH;
+                    return 1;
+                case ICMPV6_ADM_PROHIBITED:
+                    icmp4->code = ICMP_HOST_ANO;
+                    return 1;
+                case ICMPV6_PORT_UNREACH:
+                    icmp4->code = ICMP_PORT_UNREACH;
+                    return 1;
+                default:
+                    return -1;
+            }
+
+        case ICMPV6_PKT_TOOBIG: {
+            icmp4->type = ICMP_DEST_UNREACH;
+            icmp4->code = ICMP_FRAG_NEEDED;
+            icmp4->un.gateway = 0;
+            // The IPv4 path mtu is 20 bytes smaller, and needs to fit in 16 bits.
+            __u32 mtu = ntohl(icmp6->icmp6_mtu);
+            if (mtu < IPV6_MIN_MTU) return -1;
+            mtu -= sizeof(struct ipv6hdr) - sizeof(struct iphdr);
+            if (mtu > 0xFFFF) mtu = 0xFFFF;
+            icmp4->un.frag.mtu = htons(mtu);
+            return 1;
+        }
+
+        case ICMPV6_TIME_EXCEED:
+            // The hop limit and fragment reassembly codes are the same in both protocols.
+            if (icmp6->icmp6_code > ICMPV6_EXC_FRAGTIME) return -1;
+            icmp4->type = ICMP_TIME_EXCEEDED;
+            icmp4->code = icmp6->icmp6_code;
+            icmp4->un.gateway = 0;
+            return 1;
+
+        default:  // parameter problems need their pointer remapped, leave them to clatd
+            return -1;
+    }
+}
+
+// The reverse of icmp6_to_icmp4(): translates an ICMP header into an ICMPv6 header (with a zero
+// checksum), returning 1 for an error message, 0 for an echo message and -1 if not translated.
+static inline __always_inline int icmp4_to_icmp6(const struct icmphdr* icmp4,
+                                                 struct icmp6hdr* icmp6) {
+    // The identifier and sequence number of echo messages are carried over as is.
+    icmp6->icmp6_dataun.un_data32[0] = icmp4->un.gateway;
+    icmp6->icmp6_cksum = 0;
+
+    switch (icmp4->type) {
+        case ICMP_ECHO:
+            icmp6->icmp6_type = ICMPV6_ECHO_REQUEST;
+            icmp6->icmp6_code = 0;
+            return 0;
+
+        case ICMP_ECHOREPLY:
+            icmp6->icmp6_type = ICMPV6_ECHO_REPLY;
+            icmp6->icmp6_code = 0;
+            return 0;
+
+        case ICMP_DEST_UNREACH:
+            icmp6->icmp6_type = ICMPV6_DEST_UNREACH;
+            icmp6->icmp6_dataun.un_data32[0] = 0;
+            switch (icmp4->code) {
+                case ICMP_NET_UNREACH:
+                case ICMP_HOST_UNREACH:
+                case ICMP_SR_FAILED:
+                case ICMP_NET_UNKNOWN:
+                case ICMP_HOST_UNKNOWN:
+                case ICMP_HOST_ISOLATED:
+                case ICMP_NET_UNR_TOS:
+                case ICMP_HOST_UNR_TOS:
+                    icmp6->icmp6_code = ICMPV6_NOROUTE;
+                    return 1;
+                case ICMP_NET_ANO:
+                case ICMP_HOST_ANO:
+                case ICMP_PKT_FILTERED:
+                case ICMP_PREC_CUTOFF:
+                    icmp6->icmp6_code = ICMPV6_ADM_PROHIBITED;
+                    return 1;
+                case ICMP_PORT_UNREACH:
+                    icmp6->icmp6_code = ICMPV6_PORT_UNREACH;
+                    return 1;
+                case ICMP_PROT_UNREACH:
+                    // Translated to a parameter problem pointing at the next header field.
+                    icmp6->icmp6_type = ICMPV6_PARAMPROB;
+                    icmp6->icmp6_code = ICMPV6_UNK_NEXTHDR;
+                    icmp6->icmp6_pointer = htonl(offsetof(struct ipv6hdr, nexthdr));
+                    return 1;
+                case ICMP_FRAG_NEEDED: {
+                    // Pre RFC 1191 routers do not report an mtu, leave estimating it to clatd.
+                    const __u16 mtu = ntohs(icmp4->un.frag.mtu);
+                    if (!mtu) return -1;
+                    // The IPv6 path mtu is 20 bytes larger.
+                    icmp6->icmp6_type = ICMPV6_PKT_TOOBIG;
+                    icmp6->icmp6_code = 0;
+                    icmp6->icmp6_mtu = htonl(mtu + sizeof(struct ipv6hdr) - sizeof(struct iphdr));
+                    return 1;
+                }
+                default:
+                    return -1;
+            }
+
+        case ICMP_TIME_EXCEEDED:
+            // The ttl and fragment reassembly codes are the same in both protocols.
+            if (icmp4->code > ICMP_EXC_FRAGTIME) return -1;
+            icmp6->icmp6_type = ICMPV6_TIME_EXCEED;
+            icmp6->icmp6_code = icmp4->code;
+            icmp6->icmp6_dataun.un_data32[0] = 0;
+            return 1;
+
+        default:  // parameter problems need their pointer remapped, leave them to clatd
+            return -1;
+    }
+}
+
+// ----- Clat Stats -----
+
+// Translation counters, indexed by v4-* interface.  The entries are created and deleted by
+// ClatCoordinator together with the translation rules.
+DEFINE_BPF_MAP_GRW(clat_stats_map, PERCPU_HASH, ClatStatsKey, ClatStatsValue, 16, AID_SYSTEM)
+
+// Expects the 'ClatStatsValue* stats' of the interface to be in scope.  There is no need for
+// atomic increments, since the map is per cpu.
+#define COUNT_AND_RETURN(counter, ret) do {               \
+    if (stats) ++stats->punts[BPF_CLAT_ERR_ ## counter];  \
+    return ret;                                           \
+} while(0)
+
+#define TC_DROP(counter) COUNT_AND_RETURN(counter, TC_ACT_SHOT)
+#define TC_PUNT(counter) COUNT_AND_RETURN(counter, TC_ACT_PIPE)
+
+// Mark ingress non-offloaded clat packet for dropping in ip6tables bw_raw_PREROUTING.
+// Non-offloaded clat packet is going to be handled by clat daemon and ip6tables. The
+// duplicate one in ip6tables is not necessary.
+#define TC_PUNT_TO_CLATD(counter) do {  \
+    skb->mark = CLAT_MARK;              \
+    TC_PUNT(counter);                   \
+} while(0)
 
 DEFINE_BPF_MAP_GRW(clat_ingress6_map, HASH, ClatIngress6Key, ClatIngress6Value, 16, AID_SYSTEM)
 
-static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet) {
+static inline __always_inline int nat64(struct __sk_buff* skb, const bool is_ethernet,
+                                        const bool adjust_room_supported) {
     // Require ethernet dst mac address to be our unicast address.
     if (is_ethernet && (skb->pkt_type != PACKET_HOST)) return TC_ACT_PIPE;
 
@@ -55,12 +298,18 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
     // Not clear if this is actually necessary considering we use DPA (Direct Packet Access),
     // but we need to make sure we can read the IPv6 header reliably so that we can set
     // skb->mark = 0xDeadC1a7 for packets we fail to offload.
-    try_make_writable(skb, l2_header_size + sizeof(struct ipv6hdr));
+    // ICMPv6 errors additionally need the ICMPv6 header and the embedded IPv6 header.
+    try_make_writable(skb, l2_header_size + sizeof(struct ipv6hdr) +
+                                   (adjust_room_supported ? sizeof(struct icmp6hdr) +
+                                                                    sizeof(struct ipv6hdr)
+                                                          : 0));
 
     void* data = (void*)(long)skb->data;
     const void* data_end = (void*)(long)skb->data_end;
     const struct ethhdr* const eth = is_ethernet ? data : NULL;  // used iff is_ethernet
     const struct ipv6hdr* const ip6 = is_ethernet ? (void*)(eth + 1) : data;
+    const struct icmp6hdr* const icmp6 = (void*)(ip6 + 1);       // used iff ICMPv6
+    const struct ipv6hdr* const inner6 = (void*)(icmp6 + 1);     // used iff ICMPv6 error
 
     // Must have (ethernet and) ipv6 header
     if (data + l2_header_size + sizeof(*ip6) > data_end) return TC_ACT_PIPE;
@@ -87,8 +336,33 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
 
     ClatIngress6Value* v = bpf_clat_ingress6_map_lookup_elem(&k);
 
+    // ICMPv6 errors from IPv6 routers between us and the NAT64 (for example 'packet too big')
+    // are not sourced from the NAT64 prefix.  Find the translation through the NAT64 prefix the
+    // embedded packet was sent to instead, and source the ICMP error from the RFC 7600 IPv4
+    // dummy address (192.0.0.8, INADDR_DUMMY).
+    bool dummy_src = false;
+    if (adjust_room_supported && !v && ip6->nexthdr == IPPROTO_ICMPV6) {
+        if ((void*)(inner6 + 1) > data_end) return TC_ACT_PIPE;
+        if (icmp6->icmp6_type & ICMPV6_INFOMSG_MASK) return TC_ACT_PIPE;
+
+        k.pfx96.in6_u.u6_addr32[0] = inner6->daddr.in6_u.u6_addr32[0];
+        k.pfx96.in6_u.u6_addr32[1] = inner6->daddr.in6_u.u6_addr32[1];
+        k.pfx96.in6_u.u6_addr32[2] = inner6->daddr.in6_u.u6_addr32[2];
+        v = bpf_clat_ingress6_map_lookup_elem(&k);
+        dummy_src = true;
+    }
+
     if (!v) return TC_ACT_PIPE;
 
+    // Everything from here on is clat traffic, accounted to the v4-* interface.
+    const ClatStatsKey stats_key = v->oif;
+    ClatStatsValue* const stats = bpf_clat_stats_map_lookup_elem(&stats_key);
+
+    struct icmphdr icmp4;  // used iff is_icmp
+    struct iphdr inner4;   // used iff is_icmp_error
+    bool is_icmp = false;
+    bool is_icmp_error = false;
+
     switch (ip6->nexthdr) {
         case IPPROTO_TCP:  // For TCP & UDP the checksum neutrality of the chosen IPv6
         case IPPROTO_UDP:  // address means there is no need to update their checksums.
@@ -96,14 +370,60 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
         case IPPROTO_ESP:  // since there is never a checksum to update.
             break;
 
+        case IPPROTO_ICMPV6: {
+            if (!adjust_room_supported) TC_PUNT_TO_CLATD(UNSUPPORTED_PROTOCOL);
+            if ((void*)(icmp6 + 1) > data_end) TC_PUNT_TO_CLATD(SHORT_L4_HEADER);
+
+            const int ret = icmp6_to_icmp4(icmp6, &icmp4);
+            if (ret < 0) TC_PUNT_TO_CLATD(ICMP_UNTRANSLATED);
+            is_icmp = true;
+            is_icmp_error = ret;
+            if (!is_icmp_error) break;
+
+            // The embedded packet is one we translated on egress, from our IPv6 address towards
+            // the NAT64 prefix.  Its TCP/UDP checksum is (again) neutral to the translation.
+            if ((void*)(inner6 + 1) > data_end) TC_PUNT_TO_CLATD(ICMP_INVALID_INNER);
+            if (inner6->version != 6) TC_PUNT_TO_CLATD(ICMP_INVALID_INNER);
+            if (inner6->nexthdr != IPPROTO_TCP && inner6->nexthdr != IPPROTO_UDP) {
+                TC_PUNT_TO_CLATD(ICMP_INVALID_INNER);
+            }
+            if (inner6->saddr.in6_u.u6_addr32[0] != ip6->daddr.in6_u.u6_addr32[0] ||
+                inner6->saddr.in6_u.u6_addr32[1] != ip6->daddr.in6_u.u6_addr32[1] ||
+                inner6->saddr.in6_u.u6_addr32[2] != ip6->daddr.in6_u.u6_addr32[2] ||
+                inner6->saddr.in6_u.u6_addr32[3] != ip6->daddr.in6_u.u6_addr32[3] ||
+                inner6->daddr.in6_u.u6_addr32[0] != k.pfx96.in6_u.u6_addr32[0] ||
+                inner6->daddr.in6_u.u6_addr32[1] != k.pfx96.in6_u.u6_addr32[1] ||
+                inner6->daddr.in6_u.u6_addr32[2] != k.pfx96.in6_u.u6_addr32[2]) {
+                TC_PUNT_TO_CLATD(ICMP_INVALID_INNER);
+            }
+            if (ntohs(inner6->payload_len) > 0xFFFF - sizeof(struct iphdr)) {
+                TC_PUNT_TO_CLATD(ICMP_INVALID_INNER);
+            }
+
+            inner4 = (struct iphdr){
+                    .version = 4,
+                    .ihl = sizeof(struct iphdr) / sizeof(__u32),
+                    .tos = (inner6->priority << 4) + (inner6->flow_lbl[0] >> 4),
+                    .tot_len = htons(ntohs(inner6->payload_len) + sizeof(struct iphdr)),
+                    .id = 0,
+                    .frag_off = htons(IP_DF),
+                    .ttl = inner6->hop_limit,
+                    .protocol = inner6->nexthdr,
+                    .check = 0,
+                    .saddr = v->local4.s_addr,
+                    .daddr = inner6->daddr.in6_u.u6_addr32[3],
+            };
+            inner4.check = csum_fold_sum(csum_add_words(0, &inner4, sizeof(inner4)));
+            break;
+        }
+
         default:  // do not know how to handle anything else
-            // Mark ingress non-offloaded clat packet for dropping in ip6tables bw_raw_PREROUTING.
-            // Non-offloaded clat packet is going to be handled by clat daemon and ip6tables. The
-            // duplicate one in ip6tables is not necessary.
-            skb->mark = CLAT_MARK;
-            return TC_ACT_PIPE;
+            TC_PUNT_TO_CLATD(UNSUPPORTED_PROTOCOL);
     }
 
+    // The embedded IPv4 header of a translated ICMP error is 20 bytes shorter than the IPv6 one.
+    const int inner_shrink = is_icmp_error ? sizeof(struct ipv6hdr) - sizeof(struct iphdr) : 0;
+
     struct ethhdr eth2;  // used iff is_ethernet
     if (is_ethernet) {
         eth2 = *eth;                     // Copy over the ethernet header (src/dst mac)
@@ -114,44 +434,63 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
             .version = 4,                                                      // u4
             .ihl = sizeof(struct iphdr) / sizeof(__u32),                       // u4
             .tos = (ip6->priority << 4) + (ip6->flow_lbl[0] >> 4),             // u8
-            .tot_len = htons(ntohs(ip6->payload_len) + sizeof(struct iphdr)),  // u16
+            .tot_len = htons(ntohs(ip6->payload_len) + sizeof(struct iphdr) -  // u16
+                             inner_shrink),
             .id = 0,                                                           // u16
             .frag_off = htons(IP_DF),                                          // u16
             .ttl = ip6->hop_limit,                                             // u8
-            .protocol = ip6->nexthdr,                                          // u8
+            .protocol = is_icmp ? IPPROTO_ICMP : ip6->nexthdr,                 // u8
             .check = 0,                                                        // u16
-            .saddr = ip6->saddr.in6_u.u6_addr32[3],                            // u32
+            .saddr = dummy_src ? htonl(INADDR_DUMMY)                           // u32
+                               : ip6->saddr.in6_u.u6_addr32[3],
             .daddr = v->local4.s_addr,                                         // u32
     };
 
     // Calculate the IPv4 one's complement checksum of the IPv4 header.
-    __wsum sum4 = 0;
-    for (int i = 0; i < sizeof(ip) / sizeof(__u16); ++i) {
-        sum4 += ((__u16*)&ip)[i];
-    }
-    // Note that sum4 is guaranteed to be non-zero by virtue of ip.version == 4
-    sum4 = (sum4 & 0xFFFF) + (sum4 >> 16);  // collapse u32 into range 1 .. 0x1FFFE
-    sum4 = (sum4 & 0xFFFF) + (sum4 >> 16);  // collapse any potential carry into u16
-    ip.check = (__u16)~sum4;                // sum4 cannot be zero, so this is never 0xFFFF
+    // Note that the sum is guaranteed to be non-zero by virtue of ip.version == 4,
+    // so the checksum is never 0xFFFF.
+    ip.check = csum_fold_sum(csum_add_words(0, &ip, sizeof(ip)));
 
     // Calculate the *negative* IPv6 16-bit one's complement checksum of the IPv6 header.
-    __wsum sum6 = 0;
-    // We'll end up with a non-zero sum due to ip6->version == 6 (which has '0' bits)
-    for (int i = 0; i < sizeof(*ip6) / sizeof(__u16); ++i) {
-        sum6 += ~((__u16*)ip6)[i];  // note the bitwise negation
+    __wsum sum6 = csum_sub_words(0, ip6, sizeof(*ip6));
+
+    if (is_icmp) {
+        // Unlike the ICMPv6 checksum, the ICMP checksum does not cover a pseudo header.
+        // Given a valid ICMPv6 checksum, the sum of the ICMPv6 message is the negative sum
+        // of the pseudo header, from which we replace the (ICMPv6 and embedded IPv6) headers.
+        // (an invalid ICMPv6 checksum thus results in an equally invalid ICMP checksum)
+        const __be16 pseudo6[] = {ip6->payload_len, htons(IPPROTO_ICMPV6)};
+        __wsum sum = csum_sub_words(0, &ip6->saddr, 2 * sizeof(struct in6_addr));
+        sum = csum_sub_words(sum, pseudo6, sizeof(pseudo6));
+        sum = csum_sub_words(sum, icmp6, sizeof(*icmp6));
+        sum = csum_add_words(sum, &icmp4, sizeof(icmp4));
+        if (is_icmp_error) {
+            sum = csum_sub_words(sum, inner6, sizeof(*inner6));
+            sum = csum_add_words(sum, &inner4, sizeof(inner4));
+        }
+        icmp4.checksum = csum_fold_sum(sum);
+
+        // And the replaced headers need to be reflected in skb->csum (see below).
+        // The embedded IPv4 header's sum is zero, just like the outer IPv4 header's.
+        sum6 = csum_sub_words(sum6, icmp6, sizeof(*icmp6));
+        sum6 = csum_add_words(sum6, &icmp4, sizeof(icmp4));
+        if (is_icmp_error) sum6 = csum_sub_words(sum6, inner6, sizeof(*inner6));
     }
 
     // Note that there is no L4 checksum update: we are relying on the checksum neutrality
     // of the ipv6 address chosen by netd's ClatdController.
 
+    const __u32 old_len = skb->len;
+
     // Packet mutations begin - point of no return, but if this first modification fails
     // the packet is probably still pristine, so let clatd handle it.
-    if (bpf_skb_change_proto(skb, htons(ETH_P_IP), 0)) {
-        // Mark ingress non-offloaded clat packet for dropping in ip6tables bw_raw_PREROUTING.
-        // Non-offloaded clat packet is going to be handled by clat daemon and ip6tables. The
-        // duplicate one in ip6tables is not necessary.
-        skb->mark = CLAT_MARK;
-        return TC_ACT_PIPE;
+    if (bpf_skb_change_proto(skb, htons(ETH_P_IP), 0)) TC_PUNT_TO_CLATD(CHANGE_PROTO_FAILED);
+
+    // For an ICMP error remove the 20 bytes directly following the (new) IPv4 header.  These
+    // are part of the ICMPv6 and embedded IPv6 headers, both of which are rewritten below.
+    if (adjust_room_supported && is_icmp_error &&
+        bpf_skb_adjust_room(skb, -inner_shrink, BPF_ADJ_ROOM_NET, /*flags*/ 0)) {
+        TC_DROP(ADJUST_ROOM_FAILED);
     }
 
     // This takes care of updating the skb->csum field for a CHECKSUM_COMPLETE packet.
@@ -160,7 +499,7 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
     // thus we need to subtract out the ipv6 header's sum, and add in the ipv4 header's sum.
     // However, by construction of ip.check above the checksum of an ipv4 header is zero.
     // Thus we only need to subtract the ipv6 header's sum, which is the same as adding
-    // in the sum of the bitwise negation of the ipv6 header.
+    // in the sum of the bitwise negation of the ipv6 header (plus any replaced ICMP headers).
     //
     // bpf_csum_update() always succeeds if the skb is CHECKSUM_COMPLETE and returns an error
     // (-ENOTSUPP) if it isn't.  So we just ignore the return code.
@@ -179,6 +518,7 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
     // believe the explicit check is required to keep the in kernel ebpf verifier happy.
     if (data + l2_header_size + sizeof(struct iphdr) > data_end) return TC_ACT_SHOT;
 
+    struct iphdr* new_ip;
     if (is_ethernet) {
         struct ethhdr* new_eth = data;
 
@@ -186,10 +526,31 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
         *new_eth = eth2;
 
         // Copy over the new ipv4 header.
-        *(struct iphdr*)(new_eth + 1) = ip;
+        new_ip = (void*)(new_eth + 1);
+        *new_ip = ip;
     } else {
         // Copy over the new ipv4 header without an ethernet header.
-        *(struct iphdr*)data = ip;
+        new_ip = data;
+        *new_ip = ip;
+    }
+
+    if (adjust_room_supported && is_icmp) {
+        struct icmphdr* new_icmp = (void*)(new_ip + 1);
+        if ((void*)(new_icmp + 1) > data_end) return TC_ACT_SHOT;
+        *new_icmp = icmp4;
+
+        if (is_icmp_error) {
+            struct iphdr* new_inner = (void*)(new_icmp + 1);
+            if ((void*)(new_inner + 1) > data_end) return TC_ACT_SHOT;
+            *new_inner = inner4;
+        }
+    }
+
+    // Note that LRO/GRO packets are counted once, with the overhead of a single IPv6 header.
+    if (stats) {
+        stats->rxPackets++;
+        stats->rxBytes += skb->len - l2_header_size;
+        stats->rxOverheadBytes += old_len - skb->len;
     }
 
     // Redirect, possibly back to same interface, so tcpdump sees packet twice.
@@ -199,30 +560,80 @@ static inline __always_inline int nat64(struct __sk_buff* skb, bool is_ethernet)
     return TC_ACT_PIPE;
 }
 
-DEFINE_BPF_PROG("schedcls/ingress6/clat_ether", AID_ROOT, AID_SYSTEM, sched_cls_ingress6_clat_ether)
+// Note: section names must be unique to prevent programs from appending to each other,
+// so instead the bpf loader will strip everything past the final $ symbol when actually
+// pinning the program into the filesystem.
+//
+// ICMP translation changes the length of the embedded header of error messages through
+// bpf_skb_adjust_room(), which is only usable from tc programs on 4.14+.
+//
+// Hence, these mandatory (must load successfully) implementations for 5.4+ kernels:
+DEFINE_BPF_PROG_KVER("schedcls/ingress6/clat_ether$5_4", AID_ROOT, AID_SYSTEM,
+                     sched_cls_ingress6_clat_ether_5_4, KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat64(skb, /* is_ethernet */ true, /* adjust_room_supported */ true);
+}
+
+DEFINE_BPF_PROG_KVER("schedcls/ingress6/clat_rawip$5_4", AID_ROOT, AID_SYSTEM,
+                     sched_cls_ingress6_clat_rawip_5_4, KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat64(skb, /* is_ethernet */ false, /* adjust_room_supported */ true);
+}
+
+// and these identical optional (may fail to load) implementations for [4.14..5.4) kernels:
+DEFINE_OPTIONAL_BPF_PROG_KVER_RANGE("schedcls/ingress6/clat_ether$4_14", AID_ROOT, AID_SYSTEM,
+                                    sched_cls_ingress6_clat_ether_4_14,
+                                    KVER(4, 14, 0), KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat64(skb, /* is_ethernet */ true, /* adjust_room_supported */ true);
+}
+
+DEFINE_OPTIONAL_BPF_PROG_KVER_RANGE("schedcls/ingress6/clat_rawip$4_14", AID_ROOT, AID_SYSTEM,
+                                    sched_cls_ingress6_clat_rawip_4_14,
+                                    KVER(4, 14, 0), KVER(5, 4, 0))
 (struct __sk_buff* skb) {
-    return nat64(skb, true);
+    return nat64(skb, /* is_ethernet */ false, /* adjust_room_supported */ true);
 }
 
-DEFINE_BPF_PROG("schedcls/ingress6/clat_rawip", AID_ROOT, AID_SYSTEM, sched_cls_ingress6_clat_rawip)
+// and TCP/UDP/GRE/ESP only implementations for [4.9,4.14) and [4.14,5.4) kernels the above
+// failed to load on.  (if the above real 4.14+ program loaded successfully, then bpfloader will
+// have already pinned it at the same location this one would be pinned at and will thus skip
+// loading this one)
+DEFINE_BPF_PROG_KVER_RANGE("schedcls/ingress6/clat_ether$basic", AID_ROOT, AID_SYSTEM,
+                           sched_cls_ingress6_clat_ether_basic, KVER_NONE, KVER(5, 4, 0))
 (struct __sk_buff* skb) {
-    return nat64(skb, false);
+    return nat64(skb, /* is_ethernet */ true, /* adjust_room_supported */ false);
+}
+
+DEFINE_BPF_PROG_KVER_RANGE("schedcls/ingress6/clat_rawip$basic", AID_ROOT, AID_SYSTEM,
+                           sched_cls_ingress6_clat_rawip_basic, KVER_NONE, KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat64(skb, /* is_ethernet */ false, /* adjust_room_supported */ false);
 }
 
 DEFINE_BPF_MAP_GRW(clat_egress4_map, HASH, ClatEgress4Key, ClatEgress4Value, 16, AID_SYSTEM)
 
+// The v4-* interface that the egress program is attached to is always a rawip TUN device,
+// ethernet upstreams are instead handled by pushing an L2 header in nat46() below.
 DEFINE_BPF_PROG("schedcls/egress4/clat_ether", AID_ROOT, AID_SYSTEM, sched_cls_egress4_clat_ether)
 (struct __sk_buff* skb) {
     return TC_ACT_PIPE;
 }
 
-DEFINE_BPF_PROG("schedcls/egress4/clat_rawip", AID_ROOT, AID_SYSTEM, sched_cls_egress4_clat_rawip)
-(struct __sk_buff* skb) {
+static inline __always_inline int nat46(struct __sk_buff* skb, const bool ether_oif_supported,
+                                        const bool adjust_room_supported,
+                                        const bool gso_segs_supported) {
     // Must be meta-ethernet IPv4 frame
     if (skb->protocol != htons(ETH_P_IP)) return TC_ACT_PIPE;
 
+    // This program is only attached to v4-* interfaces, so everything is clat traffic.
+    const ClatStatsKey stats_key = skb->ifindex;
+    ClatStatsValue* const stats = bpf_clat_stats_map_lookup_elem(&stats_key);
+
     // Possibly not needed, but for consistency with nat64 up above
-    try_make_writable(skb, sizeof(struct iphdr));
+    try_make_writable(skb, (adjust_room_supported ? MAX_IPV4_HEADER_SIZE + sizeof(struct icmphdr) +
+                                                            sizeof(struct iphdr)
+                                                  : sizeof(struct iphdr)));
 
     void* data = (void*)(long)skb->data;
     const void* data_end = (void*)(long)skb->data_end;
@@ -232,27 +643,58 @@ DEFINE_BPF_PROG("schedcls/egress4/clat_rawip", AID_ROOT, AID_SYSTEM, sched_cls_e
     if (data + sizeof(*ip4) > data_end) return TC_ACT_PIPE;
 
     // IP version must be 4
-    if (ip4->version != 4) return TC_ACT_PIPE;
+    if (ip4->version != 4) TC_PUNT(INVALID_IP_VERSION);
+
+    // Minimum IPv4 header is 20 bytes == 5 dwords
+    if (ip4->ihl < 5) TC_PUNT(INVALID_IP_HEADER);
 
-    // We cannot handle IP options, just standard 20 byte == 5 dword minimal IPv4 header
-    if (ip4->ihl != 5) return TC_ACT_PIPE;
+    // IPv4 options are dropped in the translation (RFC 7915 section 4.1), but that requires
+    // shrinking the packet, hence the basic implementation only supports the minimal header.
+    if (!adjust_room_supported && ip4->ihl != 5) TC_PUNT(HAS_IP_OPTIONS);
+
+    // (constant for the basic implementation, so the verifier sees fixed offsets only)
+    const int ip4_header_size = adjust_room_supported ? ip4->ihl * 4 : sizeof(struct iphdr);
+    const int options_size = ip4_header_size - sizeof(struct iphdr);
+
+    // Must have the full ipv4 header, including options
+    if (data + ip4_header_size > data_end) TC_PUNT(INVALID_IP_HEADER);
 
     // Calculate the IPv4 one's complement checksum of the IPv4 header.
-    __wsum sum4 = 0;
-    for (int i = 0; i < sizeof(*ip4) / sizeof(__u16); ++i) {
-        sum4 += ((__u16*)ip4)[i];
+    __wsum sum4 = csum_add_words(0, ip4, sizeof(*ip4));
+    if (adjust_room_supported) {
+        const __u16* const options = (const __u16*)(ip4 + 1);
+#pragma unroll
+        for (int i = 0; i < (MAX_IPV4_HEADER_SIZE - sizeof(struct iphdr)) / sizeof(__u16); ++i) {
+            if (i >= options_size / sizeof(__u16)) break;
+            // Already implied by the check above, but the verifier cannot tell.
+            if ((void*)(options + i + 1) > data_end) TC_PUNT(INVALID_IP_HEADER);
+            sum4 += options[i];
+        }
     }
     // Note that sum4 is guaranteed to be non-zero by virtue of ip4->version == 4
     sum4 = (sum4 & 0xFFFF) + (sum4 >> 16);  // collapse u32 into range 1 .. 0x1FFFE
     sum4 = (sum4 & 0xFFFF) + (sum4 >> 16);  // collapse any potential carry into u16
     // for a correct checksum we should get *a* zero, but sum4 must be positive, ie 0xFFFF
-    if (sum4 != 0xFFFF) return TC_ACT_PIPE;
+    if (sum4 != 0xFFFF) TC_PUNT(CHECKSUM);
 
     // Minimum IPv4 total length is the size of the header
-    if (ntohs(ip4->tot_len) < sizeof(*ip4)) return TC_ACT_PIPE;
+    if (ntohs(ip4->tot_len) < ip4_header_size) TC_PUNT(INVALID_IP_HEADER);
+
+    // The reserved flag must not be set
+    if (ip4->frag_off & htons(IP_CE)) TC_PUNT(INVALID_IP_HEADER);
+
+    // Fragments are translated by inserting an IPv6 fragment header (RFC 7915 section 5.1.1),
+    // which again requires growing the packet.  Only the first fragment has an L4 header.
+    const bool is_frag = ip4->frag_off & htons(IP_MF | IP_OFFSET);
+    if (!adjust_room_supported && is_frag) TC_PUNT(IS_IP_FRAG);
+    const bool has_l4_header = !(ip4->frag_off & htons(IP_OFFSET));
 
-    // We are incapable of dealing with IPv4 fragments
-    if (ip4->frag_off & ~htons(IP_DF)) return TC_ACT_PIPE;
+    const void* const l4 = data + ip4_header_size;
+    const struct icmphdr* const icmp4 = l4;                 // used iff ICMP
+    const struct iphdr* const inner4 = (void*)(icmp4 + 1);  // used iff ICMP error
+
+    bool udp_csum_needed = false;
+    __be16 udp_len;  // used iff udp_csum_needed
 
     switch (ip4->protocol) {
         case IPPROTO_TCP:  // For TCP & UDP the checksum neutrality of the chosen IPv6
@@ -260,18 +702,39 @@ DEFINE_BPF_PROG("schedcls/egress4/clat_rawip", AID_ROOT, AID_SYSTEM, sched_cls_e
         case IPPROTO_ESP:  // We do not need to bother looking at GRE/ESP headers,
             break;         // since there is never a checksum to update.
 
-        case IPPROTO_UDP:  // See above comment, but must also have UDP header...
-            if (data + sizeof(*ip4) + sizeof(struct udphdr) > data_end) return TC_ACT_PIPE;
-            const struct udphdr* uh = (const struct udphdr*)(ip4 + 1);
-            // If IPv4/UDP checksum is 0 then fallback to clatd so it can calculate the
-            // checksum.  Otherwise the network or more likely the NAT64 gateway might
-            // drop the packet because in most cases IPv6/UDP packets with a zero checksum
-            // are invalid. See RFC 6935.  TODO: calculate checksum via bpf_csum_diff()
-            if (!uh->check) return TC_ACT_PIPE;
+        case IPPROTO_UDP: {  // See above comment, but must also have UDP header...
+            if (!has_l4_header) break;
+            if (l4 + sizeof(struct udphdr) > data_end) TC_PUNT(SHORT_L4_HEADER);
+            const struct udphdr* uh = l4;
+            // If IPv4/UDP checksum is 0 then we need to calculate the full checksum ourselves,
+            // otherwise the network or more likely the NAT64 gateway might drop the packet
+            // because in most cases IPv6/UDP packets with a zero checksum are invalid.
+            // See RFC 6935.  This is only possible when we hold the entire datagram.
+            //
+            // Nothing reassembles fragmented datagrams: the first fragment is punted to clatd,
+            // which does not translate it either (RFC 7915 section 4.5 allows dropping them),
+            // while the later ones carry no UDP header and are translated below as is.  Such a
+            // datagram could only ever reach the other end with a zero IPv6 UDP checksum, so it
+            // is lost either way.
+            if (uh->check) break;
+            if (!adjust_room_supported) TC_PUNT(UDP_CSUM_ZERO);
+            if (is_frag) TC_PUNT(FRAGMENTED_UDP_CSUM_ZERO);
+            if (ntohs(uh->len) != ntohs(ip4->tot_len) - ip4_header_size) TC_PUNT(UDP_CSUM_ZERO);
+            if (ntohs(uh->len) > UDP_CSUM_MAX_LEN) TC_PUNT(UDP_CSUM_ZERO);
+            udp_csum_needed = true;
+            udp_len = uh->len;
+            break;
+        }
+
+        case IPPROTO_ICMP:  // Translated below, once we know the addresses to use.
+            if (!adjust_room_supported) TC_PUNT(UNSUPPORTED_PROTOCOL);
+            // The ICMPv6 checksum covers the whole message, unlike the ICMP one.
+            if (is_frag) TC_PUNT(ICMP_FRAGMENT);
+            if ((void*)(icmp4 + 1) > data_end) TC_PUNT(SHORT_L4_HEADER);
             break;
 
         default:  // do not know how to handle anything else
-            return TC_ACT_PIPE;
+            TC_PUNT(UNSUPPORTED_PROTOCOL);
     }
 
     ClatEgress4Key k = {
@@ -284,62 +747,281 @@ DEFINE_BPF_PROG("schedcls/egress4/clat_rawip", AID_ROOT, AID_SYSTEM, sched_cls_e
     if (!v) return TC_ACT_PIPE;
 
     // Translating without redirecting doesn't make sense.
-    if (!v->oif) return TC_ACT_PIPE;
+    if (!v->oif) TC_PUNT(NO_OIF);
+
+    // Ethernet output requires bpf_skb_change_head() support from the kernel...
+    if (v->oifIsEthernet && !ether_oif_supported) TC_PUNT(ETHER_OIF_UNSUPPORTED);
+
+    // ...and a resolved next hop neighbour, which ClatCoordinator signals by filling in the
+    // ethertype of the cached mac header.  Until then let clatd handle the packet.
+    if (ether_oif_supported && v->oifIsEthernet && v->macHeader.h_proto != htons(ETH_P_IPV6)) {
+        TC_PUNT(NEIGHBOUR_UNRESOLVED);
+    }
+
+    struct icmp6hdr icmp6;  // used iff is_icmp
+    struct ipv6hdr inner6;  // used iff is_icmp_error
+    bool is_icmp = false;
+    bool is_icmp_error = false;
+
+    if (adjust_room_supported && ip4->protocol == IPPROTO_ICMP) {
+        const int ret = icmp4_to_icmp6(icmp4, &icmp6);
+        if (ret < 0) TC_PUNT(ICMP_UNTRANSLATED);
+        is_icmp = true;
+        is_icmp_error = ret;
+    }
 
-    // This implementation is currently limited to rawip.
-    if (v->oifIsEthernet) return TC_ACT_PIPE;
+    if (is_icmp_error) {
+        // The embedded packet is one we received (and translated on ingress), from a remote
+        // IPv4 address to our IPv4 address.  Its TCP/UDP checksum is neutral to the translation.
+        if ((void*)(inner4 + 1) > data_end) TC_PUNT(ICMP_INVALID_INNER);
+        if (inner4->version != 4 || inner4->ihl != 5) TC_PUNT(ICMP_INVALID_INNER);
+        if (inner4->protocol != IPPROTO_TCP && inner4->protocol != IPPROTO_UDP) {
+            TC_PUNT(ICMP_INVALID_INNER);
+        }
+        if (inner4->daddr != ip4->saddr) TC_PUNT(ICMP_INVALID_INNER);
+        if (ntohs(inner4->tot_len) < sizeof(*inner4)) TC_PUNT(ICMP_INVALID_INNER);
+
+        inner6 = (struct ipv6hdr){
+                .version = 6,
+                .priority = inner4->tos >> 4,
+                .flow_lbl = {(inner4->tos & 0xF) << 4, 0, 0},
+                .payload_len = htons(ntohs(inner4->tot_len) - sizeof(struct iphdr)),
+                .nexthdr = inner4->protocol,
+                .hop_limit = inner4->ttl,
+                .saddr = v->pfx96,
+                .daddr = v->local6,
+        };
+        inner6.saddr.in6_u.u6_addr32[3] = inner4->saddr;
+    }
+
+    // The embedded IPv6 header of a translated ICMP error is 20 bytes longer than the IPv4 one.
+    const int inner_grow = is_icmp_error ? sizeof(struct ipv6hdr) - sizeof(struct iphdr) : 0;
+
+    // The fragment header carries the fragment offset and more fragments flag as is, with the
+    // identification zero extended to 32 bits.
+    struct frag_hdr frag = {
+            .nexthdr = ip4->protocol,
+            .reserved = 0,
+            .frag_off = htons(((ntohs(ip4->frag_off) & IP_OFFSET) << 3) |
+                              ((ip4->frag_off & htons(IP_MF)) ? IP6_MF : 0)),
+            .identification = htonl(ntohs(ip4->id)),
+    };
+    const int frag_header_size = is_frag ? sizeof(frag) : 0;
 
     struct ipv6hdr ip6 = {
             .version = 6,                                    // __u8:4
             .priority = ip4->tos >> 4,                       // __u8:4
             .flow_lbl = {(ip4->tos & 0xF) << 4, 0, 0},       // __u8[3]
-            .payload_len = htons(ntohs(ip4->tot_len) - 20),  // __be16
-            .nexthdr = ip4->protocol,                        // __u8
+            .payload_len = htons(ntohs(ip4->tot_len) - ip4_header_size +   // __be16
+                                 frag_header_size + inner_grow),
+            .nexthdr = is_frag   ? IPPROTO_FRAGMENT                        // __u8
+                       : is_icmp ? IPPROTO_ICMPV6
+                                 : ip4->protocol,
             .hop_limit = ip4->ttl,                           // __u8
             .saddr = v->local6,                              // struct in6_addr
             .daddr = v->pfx96,                               // struct in6_addr
     };
     ip6.daddr.in6_u.u6_addr32[3] = ip4->daddr;
 
+    // The v4-* interface mtu is derived from the path mtu, but lags behind when the latter drops
+    // mid-session.  Let clatd fragment the packet or report the new mtu to the sender instead of
+    // emitting a packet which would be dropped on the path.
+    //
+    // A GSO packet is only segmented after this program, and its length is the total of all the
+    // segments, so checking it would punt every TCP burst.  Its segments were sized for the
+    // v4-* mtu, and bpf_skb_change_proto() shrinks gso_size by the header growth, so they stay
+    // the same size on the IPv6 side; if the path mtu dropped since, the sender learns about it
+    // through the translated packet too big error like for any other packet.  Kernels before 5.1
+    // do not expose gso_segs, so there every oversized packet still goes through clatd.
+    const bool is_gso = gso_segs_supported && skb->gso_segs > 1;
+    if (v->pmtu && !is_gso && sizeof(ip6) + ntohs(ip6.payload_len) > v->pmtu) {
+        TC_PUNT(PMTU_EXCEEDED);
+    }
+
     // Calculate the IPv6 16-bit one's complement checksum of the IPv6 header.
-    __wsum sum6 = 0;
     // We'll end up with a non-zero sum due to ip6.version == 6
-    for (int i = 0; i < sizeof(ip6) / sizeof(__u16); ++i) {
-        sum6 += ((__u16*)&ip6)[i];
+    __wsum sum6 = csum_add_words(0, &ip6, sizeof(ip6));
+    if (is_frag) sum6 = csum_add_words(sum6, &frag, sizeof(frag));
+
+    if (is_icmp) {
+        // Unlike the ICMP checksum, the ICMPv6 checksum also covers a pseudo header.
+        // Given a valid ICMP checksum the sum of the ICMP message is zero, from which we
+        // replace the (ICMP and embedded IPv4) headers.
+        const __be16 pseudo6[] = {ip6.payload_len, htons(IPPROTO_ICMPV6)};
+        __wsum sum = csum_add_words(0, &ip6.saddr, 2 * sizeof(struct in6_addr));
+        sum = csum_add_words(sum, pseudo6, sizeof(pseudo6));
+        sum = csum_sub_words(sum, icmp4, sizeof(*icmp4));
+        sum = csum_add_words(sum, &icmp6, sizeof(icmp6));
+        if (is_icmp_error) {
+            sum = csum_sub_words(sum, inner4, sizeof(*inner4));
+            sum = csum_add_words(sum, &inner6, sizeof(inner6));
+        }
+        icmp6.icmp6_cksum = csum_fold_sum(sum);
+
+        // And the replaced headers need to be reflected in skb->csum (see below).
+        sum6 = csum_sub_words(sum6, icmp4, sizeof(*icmp4));
+        sum6 = csum_add_words(sum6, &icmp6, sizeof(icmp6));
+        if (is_icmp_error) {
+            sum6 = csum_sub_words(sum6, inner4, sizeof(*inner4));
+            sum6 = csum_add_words(sum6, &inner6, sizeof(inner6));
+        }
+    }
+
+    __sum16 udp_check;  // used iff udp_csum_needed
+    if (adjust_room_supported && udp_csum_needed) {
+        // The UDP checksum covers the IPv6 pseudo header and the entire (unmodified) datagram.
+        const __be16 pseudo6[] = {udp_len, htons(IPPROTO_UDP)};
+        __wsum sum = csum_add_words(0, &ip6.saddr, 2 * sizeof(struct in6_addr));
+        sum = csum_add_words(sum, pseudo6, sizeof(pseudo6));
+        const __s64 ret = csum_skb_bytes(skb, ip4_header_size, ntohs(udp_len), sum);
+        if (ret < 0) TC_PUNT(UDP_CSUM_ZERO);
+        // A computed zero checksum is transmitted as all ones (RFC 768).
+        udp_check = csum_fold_sum(ret) ?: 0xFFFF;
+
+        // The previously zero checksum field needs to be reflected in skb->csum (see below).
+        sum6 += udp_check;
     }
 
     // Note that there is no L4 checksum update: we are relying on the checksum neutrality
     // of the ipv6 address chosen by netd's ClatdController.
 
+    const __u32 old_len = skb->len;
+
     // Packet mutations begin - point of no return, but if this first modification fails
     // the packet is probably still pristine, so let clatd handle it.
-    if (bpf_skb_change_proto(skb, htons(ETH_P_IPV6), 0)) return TC_ACT_PIPE;
+    if (bpf_skb_change_proto(skb, htons(ETH_P_IPV6), 0)) TC_PUNT(CHANGE_PROTO_FAILED);
+
+    // Directly following the (new) IPv6 header, remove any IPv4 options, insert room for the
+    // fragment header and for an ICMP error the 20 bytes by which the embedded header grows.
+    // All of these are (re)written below.
+    const int room_diff = frag_header_size + inner_grow - options_size;
+    if (adjust_room_supported && room_diff &&
+        bpf_skb_adjust_room(skb, room_diff, BPF_ADJ_ROOM_NET, /*flags*/ 0)) {
+        TC_DROP(ADJUST_ROOM_FAILED);
+    }
 
     // This takes care of updating the skb->csum field for a CHECKSUM_COMPLETE packet.
     //
     // In such a case, skb->csum is a 16-bit one's complement sum of the entire payload,
     // thus we need to subtract out the ipv4 header's sum, and add in the ipv6 header's sum.
-    // However, we've already verified the ipv4 checksum is correct and thus 0.
-    // Thus we only need to add the ipv6 header's sum.
+    // However, we've already verified the ipv4 checksum (which includes any options) is
+    // correct and thus 0.  Thus we only need to add the ipv6 header's sum (plus the fragment
+    // header and any replaced ICMP or UDP checksum bytes).
     //
     // bpf_csum_update() always succeeds if the skb is CHECKSUM_COMPLETE and returns an error
     // (-ENOTSUPP) if it isn't.  So we just ignore the return code (see above for more details).
     bpf_csum_update(skb, sum6);
 
-    // bpf_skb_change_proto() invalidates all pointers - reload them.
+    if (ether_oif_supported && v->oifIsEthernet) {
+        // Make room for the ethernet header the output interface requires.  The packet has
+        // already been converted to IPv6, so there is no going back to clatd on failure.
+        if (bpf_skb_change_head(skb, sizeof(struct ethhdr), /*flags*/ 0)) {
+            TC_DROP(CHANGE_HEAD_FAILED);
+        }
+    }
+
+    // bpf_skb_change_proto() and bpf_skb_change_head() invalidate all pointers - reload them.
     data = (void*)(long)skb->data;
     data_end = (void*)(long)skb->data_end;
 
-    // I cannot think of any valid way for this error condition to trigger, however I do
-    // believe the explicit check is required to keep the in kernel ebpf verifier happy.
-    if (data + sizeof(ip6) > data_end) return TC_ACT_SHOT;
+    struct ipv6hdr* new_ip6;
+    if (ether_oif_supported && v->oifIsEthernet) {
+        // I cannot think of any valid way for this error condition to trigger, however I do
+        // believe the explicit check is required to keep the in kernel ebpf verifier happy.
+        if (data + sizeof(struct ethhdr) + sizeof(ip6) > data_end) return TC_ACT_SHOT;
+
+        struct ethhdr* new_eth = data;
+
+        // Copy over the cached ethernet header towards the next hop neighbour
+        *new_eth = v->macHeader;
+
+        // Copy over the new ipv6 header.
+        new_ip6 = (void*)(new_eth + 1);
+        *new_ip6 = ip6;
+    } else {
+        // See above comment.
+        if (data + sizeof(ip6) > data_end) return TC_ACT_SHOT;
+
+        // Copy over the new ipv6 header without an ethernet header.
+        new_ip6 = data;
+        *new_ip6 = ip6;
+    }
+
+    if (adjust_room_supported && is_frag) {
+        struct frag_hdr* new_frag = (void*)(new_ip6 + 1);
+        if ((void*)(new_frag + 1) > data_end) return TC_ACT_SHOT;
+        *new_frag = frag;
+    }
+
+    if (adjust_room_supported && is_icmp) {
+        struct icmp6hdr* new_icmp6 = (void*)(new_ip6 + 1);
+        if ((void*)(new_icmp6 + 1) > data_end) return TC_ACT_SHOT;
+        *new_icmp6 = icmp6;
+
+        if (is_icmp_error) {
+            struct ipv6hdr* new_inner6 = (void*)(new_icmp6 + 1);
+            if ((void*)(new_inner6 + 1) > data_end) return TC_ACT_SHOT;
+            *new_inner6 = inner6;
+        }
+    }
+
+    if (adjust_room_supported && udp_csum_needed) {
+        struct udphdr* new_uh = (void*)(new_ip6 + 1);
+        if ((void*)(new_uh + 1) > data_end) return TC_ACT_SHOT;
+        new_uh->check = udp_check;
+    }
 
-    // Copy over the new ipv6 header without an ethernet header.
-    *(struct ipv6hdr*)data = ip6;
+    // Note that TSO/GSO packets are counted once, with the overhead of a single IPv6 header.
+    // Stripped IPv4 options can make the IPv6 packet shorter than the IPv4 one, in which case
+    // there is no overhead to count.
+    if (stats) {
+        const __s64 new_len = skb->len - (ether_oif_supported && v->oifIsEthernet
+                                                  ? sizeof(struct ethhdr) : 0);
+        stats->txPackets++;
+        stats->txBytes += old_len;
+        if (new_len > old_len) stats->txOverheadBytes += new_len - old_len;
+    }
 
     // Redirect to non v4-* interface.  Tcpdump only sees packet after this redirect.
     return bpf_redirect(v->oif, 0 /* this is effectively BPF_F_EGRESS */);
 }
 
+// Note: section names must be unique to prevent programs from appending to each other,
+// so instead the bpf loader will strip everything past the final $ symbol when actually
+// pinning the program into the filesystem.
+//
+// Translating towards an ethernet upstream (ie. wifi) requires pushing an ethernet header via
+// bpf_skb_change_head(), which is only present on 4.14+ (see the identical dance in offload.c),
+// while translating ICMP, fragments and IPv4 options needs bpf_skb_adjust_room() (see above).
+//
+// Hence, this mandatory (must load successfully) implementation for 5.4+ kernels:
+DEFINE_BPF_PROG_KVER("schedcls/egress4/clat_rawip$5_4", AID_ROOT, AID_SYSTEM,
+                     sched_cls_egress4_clat_rawip_5_4, KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat46(skb, /* ether_oif_supported */ true, /* adjust_room_supported */ true,
+                 /* gso_segs_supported */ true);
+}
+
+// and this identical optional (may fail to load) implementation for [4.14..5.4) patched kernels,
+// bar gso_segs which only appeared in 5.1:
+DEFINE_OPTIONAL_BPF_PROG_KVER_RANGE("schedcls/egress4/clat_rawip$4_14", AID_ROOT, AID_SYSTEM,
+                                    sched_cls_egress4_clat_rawip_4_14,
+                                    KVER(4, 14, 0), KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat46(skb, /* ether_oif_supported */ true, /* adjust_room_supported */ true,
+                 /* gso_segs_supported */ false);
+}
+
+// and a rawip upstream, unfragmented TCP/UDP/GRE/ESP only implementation for [4.9,4.14) and
+// unpatched [4.14,5.4) kernels.  (if the above real 4.14+ program loaded successfully, then bpfloader will
+// have already pinned it at the same location this one would be pinned at and will thus skip
+// loading this one)
+DEFINE_BPF_PROG_KVER_RANGE("schedcls/egress4/clat_rawip$basic", AID_ROOT, AID_SYSTEM,
+                           sched_cls_egress4_clat_rawip_basic, KVER_NONE, KVER(5, 4, 0))
+(struct __sk_buff* skb) {
+    return nat46(skb, /* ether_oif_supported */ false, /* adjust_room_supported */ false,
+                 /* gso_segs_supported */ false);
+}
+
 LICENSE("Apache 2.0");
 CRITICAL("netd");
@@ -33,21 +33,117 @@
 #include "bpf_helpers.h"
 #include "dscp_policy.h"
 
-DEFINE_BPF_MAP_GRW(switch_comp_map, ARRAY, int, uint64_t, 1, AID_SYSTEM)
-
-DEFINE_BPF_MAP_GRW(ipv4_socket_to_policies_map_A, HASH, uint64_t, RuleEntry, MAX_POLICIES,
-        AID_SYSTEM)
-DEFINE_BPF_MAP_GRW(ipv4_socket_to_policies_map_B, HASH, uint64_t, RuleEntry, MAX_POLICIES,
-        AID_SYSTEM)
-DEFINE_BPF_MAP_GRW(ipv6_socket_to_policies_map_A, HASH, uint64_t, RuleEntry, MAX_POLICIES,
-        AID_SYSTEM)
-DEFINE_BPF_MAP_GRW(ipv6_socket_to_policies_map_B, HASH, uint64_t, RuleEntry, MAX_POLICIES,
+// TODO: these are already defined in packages/modules/Connectivity/bpf_progs/bpf_net_helpers.h.
+// smove to common location in future.
+static uint64_t (*bpf_get_socket_cookie)(struct __sk_buff* skb) =
+        (void*)BPF_FUNC_get_socket_cookie;
+static int (*bpf_skb_pull_data)(struct __sk_buff* skb, __u32 len) = (void*)BPF_FUNC_skb_pull_data;
+static long (*bpf_skb_ecn_set_ce)(struct __sk_buff* skb) =
+        (void*)BPF_FUNC_skb_ecn_set_ce;
+
+// Bumped by the system server after every policy change, the lowest bit selects the active slot of
+// the classifier. Cached socket entries classified with an older generation are ignored and
+// overwritten.
+DEFINE_BPF_MAP_GRW(policy_generation_map, ARRAY, int, uint32_t, 1, AID_SYSTEM)
+
+DEFINE_BPF_MAP_GRW(ipv4_socket_to_policies_map, LRU_HASH, uint64_t, RuleEntry,
+        MAX_CACHED_SOCKETS, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(ipv6_socket_to_policies_map, LRU_HASH, uint64_t, RuleEntry,
+        MAX_CACHED_SOCKETS, AID_SYSTEM)
+
+DEFINE_BPF_MAP_GRW(ipv4_dscp_tuples_map, HASH, DscpTupleKey, DscpTupleValue,
+        DSCP_SLOTS * MAX_DSCP_TUPLES, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(ipv6_dscp_tuples_map, HASH, DscpTupleKey, DscpTupleValue,
+        DSCP_SLOTS * MAX_DSCP_TUPLES, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(dscp_tuple_masks_map, ARRAY, int, DscpTupleMasks, DSCP_SLOTS, AID_SYSTEM)
+DEFINE_BPF_MAP_GRW(dscp_port_ranges_map, ARRAY, int, DscpPortRanges, DSCP_SLOTS, AID_SYSTEM)
+
+// Packets and bytes marked by each policy, keyed by policy priority.
+DEFINE_BPF_MAP_GRW(dscp_policy_stats_map, PERCPU_ARRAY, int, DscpPolicyStats, MAX_POLICIES,
         AID_SYSTEM)
 
-DEFINE_BPF_MAP_GRW(ipv4_dscp_policies_map, ARRAY, uint32_t, DscpPolicy, MAX_POLICIES,
-        AID_SYSTEM)
-DEFINE_BPF_MAP_GRW(ipv6_dscp_policies_map, ARRAY, uint32_t, DscpPolicy, MAX_POLICIES,
-        AID_SYSTEM)
+static inline __always_inline int count_fields(uint8_t mask) {
+    return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1) +
+           ((mask >> 4) & 1);
+}
+
+// Returns the elementary destination port range of port, i.e. the number of bounds <= port.
+static inline __always_inline uint16_t find_port_range(const DscpPortRanges* ranges,
+                                                       uint16_t port) {
+    uint32_t lo = 0;
+    uint32_t hi = ranges->count < MAX_PORT_BOUNDS ? ranges->count : MAX_PORT_BOUNDS;
+    for (int i = 0; i < PORT_BOUNDS_SEARCH_STEPS; i++) {
+        if (lo >= hi) break;
+        uint32_t mid = (lo + hi) / 2;
+        if (mid >= MAX_PORT_BOUNDS) break;
+        if (ntohs(ranges->bounds[mid]) <= port) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline __always_inline void count_hit(struct __sk_buff* skb, int priority, bool rewritten) {
+    DscpPolicyStats* stats = bpf_dscp_policy_stats_map_lookup_elem(&priority);
+    if (!stats) return;
+    // Per cpu map, so no need for atomics.
+    stats->packets++;
+    stats->bytes += skb->len;
+    if (rewritten) stats->rewrittenPackets++;
+}
+
+// try to make the first 'len' header bytes readable/writable via direct packet access, see
+// bpf_net_helpers.h
+static inline __always_inline void try_make_writable(struct __sk_buff* skb, int len) {
+    if (len > skb->len) len = skb->len;
+    if (skb->data_end - skb->data < len) bpf_skb_pull_data(skb, len);
+}
+
+// Incrementally update an IPv4 header checksum for one changed 16-bit word (RFC 1624).
+static inline __always_inline void csum_replace2(__sum16* sum, __be16 old, __be16 new) {
+    uint32_t csum = (uint16_t)~*sum + (uint16_t)~old + (uint16_t)new;
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    *sum = ~csum;
+}
+
+// Set the DSCP of the packet, keeping its ECN bits. Packets that already carry it are left alone,
+// since the first write may have to unclone the skb. Returns whether the packet was rewritten.
+static inline __always_inline bool set_dscp(struct __sk_buff* skb, bool ipv4, int l2_header_size,
+                                            uint8_t dscp) {
+    try_make_writable(skb, l2_header_size +
+                                   (ipv4 ? sizeof(struct iphdr) : sizeof(struct ipv6hdr)));
+    void* data = (void*)(long)skb->data;
+    const void* data_end = (void*)(long)skb->data_end;
+
+    if (ipv4) {
+        struct iphdr* iph = data + l2_header_size;
+        if ((void*)(iph + 1) > data_end) return false;
+
+        const uint8_t tos = (dscp << 2) | (iph->tos & 3);
+        if (iph->tos == tos) return false;
+
+        // The tos is the second byte of the first 16-bit word of the header.
+        __be16* word = (__be16*)iph;
+        const __be16 old = *word;
+        iph->tos = tos;
+        csum_replace2(&iph->check, old, *word);
+    } else {
+        // The traffic class straddles the first two bytes, after the 4-bit version.
+        uint8_t* hdr = data + l2_header_size;
+        if ((void*)(hdr + sizeof(struct ipv6hdr)) > data_end) return false;
+
+        const uint8_t old_tc = (hdr[0] << 4) | (hdr[1] >> 4);
+        const uint8_t tc = (dscp << 2) | (old_tc & 3);
+        if (old_tc == tc) return false;
+
+        hdr[0] = (hdr[0] & 0xf0) | (tc >> 4);
+        hdr[1] = (hdr[1] & 0x0f) | (tc << 4);
+    }
+    return true;
+}
 
 static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4, bool is_eth) {
     void* data = (void*)(long)skb->data;
@@ -59,13 +155,9 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
     if (data + l2_header_size > data_end) return;
 
     int zero = 0;
-    int hdr_size = 0;
-    uint64_t* selectedMap = bpf_switch_comp_map_lookup_elem(&zero);
-
-    // use this with HASH map so map lookup only happens once policies have been added?
-    if (!selectedMap) {
-        return;
-    }
+    int hdr_size = l2_header_size;
+    const uint32_t* generation = bpf_policy_generation_map_lookup_elem(&zero);
+    if (!generation) return;
 
     // used for map lookup
     uint64_t cookie = bpf_get_socket_cookie(skb);
@@ -77,9 +169,6 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
     uint8_t protocol = 0; // TODO: Use are reserved value? Or int (-1) and cast to uint below?
     struct in6_addr srcIp = {};
     struct in6_addr dstIp = {};
-    uint8_t tos = 0; // Only used for IPv4
-    uint8_t priority = 0; // Only used for IPv6
-    uint8_t flow_lbl = 0; // Only used for IPv6
     if (ipv4) {
         const struct iphdr* const iph = is_eth ? (void*)(eth + 1) : data;
         // Must have ipv4 header
@@ -99,8 +188,7 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
         srcIp.s6_addr32[3] = iph->saddr;
         dstIp.s6_addr32[3] = iph->daddr;
         protocol = iph->protocol;
-        tos = iph->tos;
-        hdr_size = sizeof(struct iphdr);
+        hdr_size += sizeof(struct iphdr);
     } else {
         struct ipv6hdr* ip6h = is_eth ? (void*)(eth + 1) : data;
         // Must have ipv6 header
@@ -111,9 +199,7 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
         srcIp = ip6h->saddr;
         dstIp = ip6h->daddr;
         protocol = ip6h->nexthdr;
-        priority = ip6h->priority;
-        flow_lbl = ip6h->flow_lbl[0];
-        hdr_size = sizeof(struct ipv6hdr);
+        hdr_size += sizeof(struct ipv6hdr);
     }
 
     switch (protocol) {
@@ -142,122 +228,63 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
 
     RuleEntry* existingRule;
     if (ipv4) {
-        if (*selectedMap == MAP_A) {
-            existingRule = bpf_ipv4_socket_to_policies_map_A_lookup_elem(&cookie);
-        } else {
-            existingRule = bpf_ipv4_socket_to_policies_map_B_lookup_elem(&cookie);
-        }
+        existingRule = bpf_ipv4_socket_to_policies_map_lookup_elem(&cookie);
     } else {
-        if (*selectedMap == MAP_A) {
-            existingRule = bpf_ipv6_socket_to_policies_map_A_lookup_elem(&cookie);
-        } else {
-            existingRule = bpf_ipv6_socket_to_policies_map_B_lookup_elem(&cookie);
-        }
+        existingRule = bpf_ipv6_socket_to_policies_map_lookup_elem(&cookie);
     }
 
-    if (existingRule && v6_equal(srcIp, existingRule->srcIp) &&
+    if (existingRule && existingRule->generation == *generation &&
+                v6_equal(srcIp, existingRule->srcIp) &&
                 v6_equal(dstIp, existingRule->dstIp) &&
                 skb->ifindex == existingRule->ifindex &&
                 ntohs(sport) == htons(existingRule->srcPort) &&
                 ntohs(dport) == htons(existingRule->dstPort) &&
                 protocol == existingRule->proto) {
-        if (ipv4) {
-            int ecn = tos & 3;
-            uint8_t newDscpVal = (existingRule->dscpVal << 2) + ecn;
-            int oldDscpVal = tos >> 2;
-            bpf_l3_csum_replace(skb, 1, oldDscpVal, newDscpVal, sizeof(uint8_t));
-            bpf_skb_store_bytes(skb, 1, &newDscpVal, sizeof(uint8_t), 0);
-        } else {
-            uint8_t new_priority = (existingRule->dscpVal >> 2) + 0x60;
-            uint8_t new_flow_label = ((existingRule->dscpVal & 0xf) << 6) + (priority >> 6);
-            bpf_skb_store_bytes(skb, 0, &new_priority, sizeof(uint8_t), 0);
-            bpf_skb_store_bytes(skb, 1, &new_flow_label, sizeof(uint8_t), 0);
-        }
+        const int priority = existingRule->priority;
+        const bool rewritten = set_dscp(skb, ipv4, l2_header_size, existingRule->dscpVal);
+        count_hit(skb, priority, rewritten);
         return;
     }
 
-    // Linear scan ipv4_dscp_policies_map since no stored params match skb.
-    int bestScore = -1;
-    uint32_t bestMatch = 0;
-
-    for (register uint64_t i = 0; i < MAX_POLICIES; i++) {
-        int score = 0;
-        uint8_t tempMask = 0;
-        // Using a uint64 in for loop prevents infinite loop during BPF load,
-        // but the key is uint32, so convert back.
-        uint32_t key = i;
-
-        DscpPolicy* policy;
+    // Look the packet up in every tuple in use, from the most specific ones. The first match wins,
+    // except that among tuples with as many fields the policy with the lowest priority wins.
+    const int slot = *generation & 1;
+    const DscpTupleMasks* masks = bpf_dscp_tuple_masks_map_lookup_elem(&slot);
+    const DscpPortRanges* ranges = bpf_dscp_port_ranges_map_lookup_elem(&slot);
+    if (!masks || !ranges) return;
+
+    const uint16_t dstPortRange = find_port_range(ranges, ntohs(dport));
+    const DscpTupleValue* best = NULL;
+    int bestFields = 0;
+    for (int i = 0; i < MAX_TUPLE_MASKS - 1; i++) {
+        if (i >= masks->count) break;
+        const uint8_t mask = masks->masks[i];
+        const int fields = count_fields(mask);
+        if (best && fields < bestFields) break;
+
+        DscpTupleKey key = {
+            .ifindex = skb->ifindex,
+            .mask = mask,
+            .proto = (mask & PROTO_MASK_FLAG) ? protocol : 0,
+            .srcPort = (mask & SRC_PORT_MASK_FLAG) ? sport : 0,
+            .dstPortRange = (mask & DST_PORT_MASK_FLAG) ? dstPortRange : 0,
+            .slot = slot,
+        };
+        if (mask & SRC_IP_MASK_FLAG) key.srcIp = srcIp;
+        if (mask & DST_IP_MASK_FLAG) key.dstIp = dstIp;
+
+        const DscpTupleValue* match;
         if (ipv4) {
-            policy = bpf_ipv4_dscp_policies_map_lookup_elem(&key);
+            match = bpf_ipv4_dscp_tuples_map_lookup_elem(&key);
         } else {
-            policy = bpf_ipv6_dscp_policies_map_lookup_elem(&key);
-        }
-
-        // If the policy lookup failed, presentFields is 0, or iface index does not match
-        // index on skb buff, then we can continue to next policy.
-        if (!policy || policy->presentFields == 0 || policy->ifindex != skb->ifindex)
-            continue;
-
-        if ((policy->presentFields & SRC_IP_MASK_FLAG) == SRC_IP_MASK_FLAG &&
-                v6_equal(srcIp, policy->srcIp)) {
-            score++;
-            tempMask |= SRC_IP_MASK_FLAG;
-        }
-        if ((policy->presentFields & DST_IP_MASK_FLAG) == DST_IP_MASK_FLAG &&
-                v6_equal(dstIp, policy->dstIp)) {
-            score++;
-            tempMask |= DST_IP_MASK_FLAG;
+            match = bpf_ipv6_dscp_tuples_map_lookup_elem(&key);
         }
-        if ((policy->presentFields & SRC_PORT_MASK_FLAG) == SRC_PORT_MASK_FLAG &&
-                ntohs(sport) == htons(policy->srcPort)) {
-            score++;
-            tempMask |= SRC_PORT_MASK_FLAG;
-        }
-        if ((policy->presentFields & DST_PORT_MASK_FLAG) == DST_PORT_MASK_FLAG &&
-                ntohs(dport) >= htons(policy->dstPortStart) &&
-                ntohs(dport) <= htons(policy->dstPortEnd)) {
-            score++;
-            tempMask |= DST_PORT_MASK_FLAG;
-        }
-        if ((policy->presentFields & PROTO_MASK_FLAG) == PROTO_MASK_FLAG &&
-                protocol == policy->proto) {
-            score++;
-            tempMask |= PROTO_MASK_FLAG;
-        }
-
-        if (score > bestScore && tempMask == policy->presentFields) {
-            bestMatch = i;
-            bestScore = score;
+        if (match && (!best || match->priority < best->priority)) {
+            best = match;
+            bestFields = fields;
         }
     }
-
-    uint8_t new_tos= 0; // Can 0 be used as default forwarding value?
-    uint8_t new_priority = 0;
-    uint8_t new_flow_lbl = 0;
-    if (bestScore > 0) {
-        DscpPolicy* policy;
-        if (ipv4) {
-            policy = bpf_ipv4_dscp_policies_map_lookup_elem(&bestMatch);
-        } else {
-            policy = bpf_ipv6_dscp_policies_map_lookup_elem(&bestMatch);
-        }
-
-        if (policy) {
-            // TODO: if DSCP value is already set ignore?
-            if (ipv4) {
-                int ecn = tos & 3;
-                new_tos = (policy->dscpVal << 2) + ecn;
-            } else {
-                new_priority = (policy->dscpVal >> 2) + 0x60;
-                new_flow_lbl = ((policy->dscpVal & 0xf) << 6) + (flow_lbl >> 6);
-
-                // Set IPv6 curDscp value to stored value and recalulate priority
-                // and flow label during next use.
-                new_tos = policy->dscpVal;
-            }
-        }
-    } else return;
+    if (!best) return;
 
     RuleEntry value = {
         .srcIp = srcIp,
@@ -266,33 +293,19 @@ static inline __always_inline void match_policy(struct __sk_buff* skb, bool ipv4
         .srcPort = sport,
         .dstPort = dport,
         .proto = protocol,
-        .dscpVal = new_tos,
+        .dscpVal = best->dscpVal,
+        .priority = best->priority,
+        .generation = *generation,
     };
 
     //Update map with new policy.
     if (ipv4) {
-        if (*selectedMap == MAP_A) {
-            bpf_ipv4_socket_to_policies_map_A_update_elem(&cookie, &value, BPF_ANY);
-        } else {
-            bpf_ipv4_socket_to_policies_map_B_update_elem(&cookie, &value, BPF_ANY);
-        }
+        bpf_ipv4_socket_to_policies_map_update_elem(&cookie, &value, BPF_ANY);
     } else {
-        if (*selectedMap == MAP_A) {
-            bpf_ipv6_socket_to_policies_map_A_update_elem(&cookie, &value, BPF_ANY);
-        } else {
-            bpf_ipv6_socket_to_policies_map_B_update_elem(&cookie, &value, BPF_ANY);
-        }
+        bpf_ipv6_socket_to_policies_map_update_elem(&cookie, &value, BPF_ANY);
     }
 
-    // Need to store bytes after updating map or program will not load.
-    if (ipv4 && new_tos != (tos & 252)) {
-        int oldDscpVal = tos >> 2;
-        bpf_l3_csum_replace(skb, 1, oldDscpVal, new_tos, sizeof(uint8_t));
-        bpf_skb_store_bytes(skb, 1, &new_tos, sizeof(uint8_t), 0);
-    } else if (!ipv4 && (new_priority != priority || new_flow_lbl != flow_lbl)) {
-        bpf_skb_store_bytes(skb, 0, &new_priority, sizeof(uint8_t), 0);
-        bpf_skb_store_bytes(skb, 1, &new_flow_lbl, sizeof(uint8_t), 0);
-    }
+    count_hit(skb, value.priority, set_dscp(skb, ipv4, l2_header_size, value.dscpVal));
     return;
 }
 
@@ -14,9 +14,9 @@
  * limitations under the License.
  */
 
-#define MAX_POLICIES 16
-#define MAP_A 1
-#define MAP_B 2
+#define MAX_POLICIES 1024
+// Number of sockets whose classification is cached. Least recently used sockets are evicted first.
+#define MAX_CACHED_SOCKETS 16384
 
 #define SRC_IP_MASK_FLAG     1
 #define DST_IP_MASK_FLAG     2
@@ -32,17 +32,8 @@
       (a.s6_addr32[2] ^ b.s6_addr32[2]) | \
       (a.s6_addr32[3] ^ b.s6_addr32[3])) == 0)
 
-// TODO: these are already defined in packages/modules/Connectivity/bpf_progs/bpf_net_helpers.h.
-// smove to common location in future.
-static uint64_t (*bpf_get_socket_cookie)(struct __sk_buff* skb) =
-        (void*)BPF_FUNC_get_socket_cookie;
-static int (*bpf_skb_store_bytes)(struct __sk_buff* skb, __u32 offset, const void* from, __u32 len,
-                                  __u64 flags) = (void*)BPF_FUNC_skb_store_bytes;
-static int (*bpf_l3_csum_replace)(struct __sk_buff* skb, __u32 offset, __u64 from, __u64 to,
-                                  __u64 flags) = (void*)BPF_FUNC_l3_csum_replace;
-static long (*bpf_skb_ecn_set_ce)(struct __sk_buff* skb) =
-        (void*)BPF_FUNC_skb_ecn_set_ce;
-
+// A policy as set by the system server, which mirrors DscpPolicyValue.java. The classifier below is
+// built from these by DscpPolicyManager; the BPF program does not see them.
 typedef struct {
     struct in6_addr srcIp;
     struct in6_addr dstIp;
@@ -57,6 +48,53 @@ typedef struct {
 } DscpPolicy;
 STRUCT_SIZE(DscpPolicy, 2 * 16 + 4 + 3 * 2 + 3 * 1 + 3);  // 48
 
+// Policies are classified by tuple space search. Every combination of presentFields in use is a
+// tuple, and the policies of a tuple are stored in a hash map keyed by the fields of that
+// combination only, so a packet is classified with one lookup per tuple in use. Destination port
+// ranges are split into elementary ranges by the sorted bounds of all the policy ranges; a policy
+// has one tuple entry per elementary range it covers.
+//
+// The classifier has two slots. The system server writes a new policy set into the inactive slot
+// and then bumps the policy generation, whose lowest bit selects the active slot, so the program
+// never sees a partially written set.
+#define DSCP_SLOTS 2
+#define MAX_DSCP_TUPLES 4096
+#define MAX_TUPLE_MASKS 32
+#define MAX_PORT_BOUNDS 512
+#define PORT_BOUNDS_SEARCH_STEPS 10  // ceil(log2(MAX_PORT_BOUNDS + 1))
+
+typedef struct {
+    uint32_t ifindex;
+    uint8_t mask;           // presentFields of the tuple, other fields are zero
+    uint8_t proto;
+    __be16 srcPort;
+    uint16_t dstPortRange;  // Index of the elementary range the destination port is in
+    uint8_t slot;
+    uint8_t pad;
+    struct in6_addr srcIp;
+    struct in6_addr dstIp;
+} DscpTupleKey;
+STRUCT_SIZE(DscpTupleKey, 4 + 2 * 1 + 2 * 2 + 2 + 2 * 16);  // 44
+
+typedef struct {
+    uint32_t priority;  // Lowest wins among matches in tuples with as many fields
+    uint8_t dscpVal;
+    uint8_t pad[3];
+} DscpTupleValue;
+STRUCT_SIZE(DscpTupleValue, 4 + 1 + 3);  // 8
+
+typedef struct {
+    uint8_t count;
+    uint8_t masks[MAX_TUPLE_MASKS - 1];  // Sorted by decreasing number of fields
+} DscpTupleMasks;
+STRUCT_SIZE(DscpTupleMasks, MAX_TUPLE_MASKS);  // 32
+
+typedef struct {
+    uint32_t count;
+    __be16 bounds[MAX_PORT_BOUNDS];  // Sorted, each starts an elementary range
+} DscpPortRanges;
+STRUCT_SIZE(DscpPortRanges, 4 + 2 * MAX_PORT_BOUNDS);  // 1028
+
 typedef struct {
     struct in6_addr srcIp;
     struct in6_addr dstIp;
@@ -65,6 +103,13 @@ typedef struct {
     __be16 dstPort;
     __u8 proto;
     __u8 dscpVal;
-    __u8 pad[2];
+    __u16 priority;    // Priority of the matching policy, to count its hits
+    __u32 generation;  // Policy generation the entry was classified with
 } RuleEntry;
-STRUCT_SIZE(RuleEntry, 2 * 16 + 1 * 4 + 2 * 2 + 2 * 1 + 2);  // 44
\ No newline at end of file
+STRUCT_SIZE(RuleEntry, 2 * 16 + 1 * 4 + 2 * 2 + 2 * 1 + 2 + 4);  // 48
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t rewrittenPackets;  // The other packets already carried the policy's DSCP
+} DscpPolicyStats;
+STRUCT_SIZE(DscpPolicyStats, 3 * 8);  // 24
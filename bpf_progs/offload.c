@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <linux/icmpv6.h>
 #include <linux/if.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
@@ -286,8 +287,110 @@ DEFINE_BPF_PROG("schedcls/tether_downstream6_ether", AID_ROOT, AID_NETWORK_STACK
     return do_forward6(skb, /* is_ethernet */ true, /* downstream */ true);
 }
 
-DEFINE_BPF_PROG("schedcls/tether_upstream6_ether", AID_ROOT, AID_NETWORK_STACK,
-                sched_cls_tether_upstream6_ether)
+// ----- Router Solicitation Responder -----
+
+// Router advertisement templates, indexed by downstream interface.
+DEFINE_BPF_MAP_GRW(tether_ra_map, HASH, TetherRaKey, TetherRaValue, 16, AID_NETWORK_STACK)
+
+// From RFC 4861
+#define ND_ROUTER_SOLICIT 133
+#define ND_HOP_LIMIT 255
+
+#define ETH_IP6_ICMP6_OFFSET(field) (ETH_HLEN + IP6_HLEN + offsetof(struct icmp6hdr, field))
+
+// Answers a router solicitation received on an ethernet downstream with the router advertisement
+// template of that downstream: the solicitation is overwritten with the template, addressed to
+// the solicitor and sent back out of the interface it came in on.
+//
+// Returns TC_ACT_PIPE if the packet is not handled here, in which case a solicitation carries on
+// to the RA daemon. This includes the solicitations beyond the TETHER_RA_MAX_ANSWERS budget.
+static inline __always_inline int maybe_answer_rs(struct __sk_buff* skb) {
+    // Solicitations are sent to the all-routers address. The rare unicast ones are left to the
+    // RA daemon, so that forwarded packets, all unicast, only pay for this comparison.
+    if (skb->pkt_type != PACKET_MULTICAST) return TC_ACT_PIPE;
+
+    // Must be meta-ethernet IPv6 frame
+    if (skb->protocol != htons(ETH_P_IPV6)) return TC_ACT_PIPE;
+
+    struct {
+        struct ethhdr eth;
+        struct ipv6hdr ip6;
+        struct icmp6hdr icmp6;
+    } __attribute__((packed)) rs;
+    if (bpf_skb_load_bytes(skb, 0, &rs, sizeof(rs))) return TC_ACT_PIPE;
+
+    // Must be a valid router solicitation (RFC 4861 section 6.1.1) without extension headers.
+    // Its checksum is not verified: a corrupted solicitation at worst triggers an extra RA.
+    if (rs.eth.h_proto != htons(ETH_P_IPV6)) return TC_ACT_PIPE;
+    if (rs.ip6.version != 6 || rs.ip6.nexthdr != IPPROTO_ICMPV6) return TC_ACT_PIPE;
+    if (rs.ip6.hop_limit != ND_HOP_LIMIT) return TC_ACT_PIPE;
+    if (rs.icmp6.icmp6_type != ND_ROUTER_SOLICIT || rs.icmp6.icmp6_code) return TC_ACT_PIPE;
+
+    TetherRaKey k = skb->ifindex;
+    TetherRaValue* v = bpf_tether_ra_map_lookup_elem(&k);
+
+    // No template yet (or the RA daemon has nothing to announce), let the RA daemon answer.
+    if (!v) return TC_ACT_PIPE;
+
+    const uint32_t len = v->len;
+    if (len < ETH_HLEN + IP6_HLEN + sizeof(struct icmp6hdr)) return TC_ACT_PIPE;
+    if (len > TETHER_RA_FRAME_MAX_LEN) return TC_ACT_PIPE;
+
+    // Budget exhausted, let the RA daemon answer. Concurrent solicitations on several cpus may
+    // both start a new window, which at worst answers a few more than the budget.
+    const uint32_t window = bpf_ktime_get_ns() >> TETHER_RA_WINDOW_SHIFT;
+    if (v->rsWindow != window) {
+        v->rsWindow = window;
+        v->rsAnswered = 0;
+    }
+    if (__sync_fetch_and_add(&v->rsAnswered, 1) >= TETHER_RA_MAX_ANSWERS) return TC_ACT_PIPE;
+
+    // Reply to the solicitor, or to all nodes if it does not have an address yet.
+    struct in6_addr dst = rs.ip6.saddr;
+    uint8_t dst_mac[ETH_ALEN];
+    __builtin_memcpy(dst_mac, rs.eth.h_source, ETH_ALEN);
+    if (!(dst.s6_addr32[0] | dst.s6_addr32[1] | dst.s6_addr32[2] | dst.s6_addr32[3])) {
+        dst.s6_addr32[0] = htonl(0xff020000);  // ff02::1
+        dst.s6_addr32[3] = htonl(1);
+        const uint8_t all_nodes_mac[ETH_ALEN] = { 0x33, 0x33, 0, 0, 0, 1 };
+        __builtin_memcpy(dst_mac, all_nodes_mac, ETH_ALEN);
+    }
+
+    // The solicitation is unchanged if this fails.
+    if (bpf_skb_change_tail(skb, len, 0)) return TC_ACT_PIPE;
+
+    // From here on the solicitation is gone, drop what is left if anything fails.
+    if (bpf_skb_store_bytes(skb, 0, v->frame, len, 0)) return TC_ACT_SHOT;
+    if (bpf_skb_store_bytes(skb, offsetof(struct ethhdr, h_dest), dst_mac, ETH_ALEN, 0)) {
+        return TC_ACT_SHOT;
+    }
+    if (bpf_skb_store_bytes(skb, ETH_IP6_OFFSET(daddr), &dst, sizeof(dst), 0)) return TC_ACT_SHOT;
+
+    // The template checksum covers a zero destination address, add the actual one.
+    const __s64 diff = bpf_csum_diff(NULL, 0, (__be32*)&dst, sizeof(dst), 0);
+    if (diff < 0) return TC_ACT_SHOT;
+    if (bpf_l4_csum_replace(skb, ETH_IP6_ICMP6_OFFSET(icmp6_cksum), 0, diff, BPF_F_PSEUDO_HDR)) {
+        return TC_ACT_SHOT;
+    }
+
+    return bpf_redirect(skb->ifindex, 0 /* this is effectively BPF_F_EGRESS */);
+}
+
+// bpf_skb_store_bytes() only accepts a map value and a variable length since 4.14, so this
+// optional (may fail to load) implementation answers solicitations on 4.14+ kernels,
+DEFINE_OPTIONAL_BPF_PROG_KVER("schedcls/tether_upstream6_ether$4_14", AID_ROOT, AID_NETWORK_STACK,
+                              sched_cls_tether_upstream6_ether_4_14, KVER(4, 14, 0))
+(struct __sk_buff* skb) {
+    const int ret = maybe_answer_rs(skb);
+    if (ret != TC_ACT_PIPE) return ret;
+    return do_forward6(skb, /* is_ethernet */ true, /* downstream */ false);
+}
+
+// and this forward-only one leaves all solicitations to the RA daemon on older kernels, or if the
+// above failed to load. (if the above loaded successfully, then bpfloader will have already pinned
+// it at the same location this one would be pinned at and will thus skip loading this one)
+DEFINE_BPF_PROG("schedcls/tether_upstream6_ether$forward", AID_ROOT, AID_NETWORK_STACK,
+                sched_cls_tether_upstream6_ether_forward)
 (struct __sk_buff* skb) {
     return do_forward6(skb, /* is_ethernet */ true, /* downstream */ false);
 }
@@ -22,6 +22,9 @@
 #include <linux/tcp.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <DnsProxydProtocol.h> // NETID_USE_LOCAL_NAMESERVERS
 #include <nativehelper/JNIPlatformHelp.h>
@@ -36,6 +39,8 @@ namespace android {
 constexpr int MAXPACKETSIZE = 8 * 1024;
 // FrameworkListener limits the size of commands to 4096 bytes.
 constexpr int MAXCMDSIZE = 4096;
+// Each query of a batch holds a socket to the resolver until it is answered or cancelled.
+constexpr int MAX_BATCH_QUERIES = 64;
 
 static volatile jclass class_Network = 0;
 static volatile jmethodID method_fromNetworkHandle = 0;
@@ -187,6 +192,129 @@ static void android_net_utils_resNetworkCancel(JNIEnv *env, jobject thiz, jobjec
     jniSetFileDescriptorOfFD(env, javaFd, -1);
 }
 
+static int64_t monotonicMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Issues all queries at once and collects their answers as they arrive on a single epoll fd,
+// instead of one fd watch and one JNI round trip per query. Queries that fail or are still
+// pending after timeoutMs are reported in errors and have a null response.
+static jobjectArray android_net_utils_resNetworkQueryBatch(JNIEnv *env, jobject thiz,
+        jlong netHandle, jobjectArray dnames, jint ns_class, jint ns_type, jint flags,
+        jint timeoutMs, jintArray errors) {
+    if (dnames == nullptr || errors == nullptr) {
+        jniThrowNullPointerException(env, dnames == nullptr ? "dnames" : "errors");
+        return nullptr;
+    }
+    const jsize count = env->GetArrayLength(dnames);
+    if (count > MAX_BATCH_QUERIES || env->GetArrayLength(errors) != count) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "invalid batch of %d queries", count);
+        return nullptr;
+    }
+
+    jclass class_DnsResponse = env->FindClass("android/net/DnsResolver$DnsResponse");
+    jmethodID ctor = env->GetMethodID(class_DnsResponse, "<init>", "([BI)V");
+    jobjectArray responses = env->NewObjectArray(count, class_DnsResponse, nullptr);
+    if (responses == nullptr || count == 0) return responses;
+
+    const int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        jniThrowErrnoException(env, "resNetworkQueryBatch", errno);
+        return nullptr;
+    }
+
+    // Send every query before waiting for any, so that they are resolved concurrently.
+    int fds[MAX_BATCH_QUERIES];
+    jint errs[MAX_BATCH_QUERIES];
+    int pending = 0;
+    for (jsize i = 0; i < count; i++) {
+        fds[i] = -1;
+        errs[i] = ETIMEDOUT;
+        jstring dname = (jstring) env->GetObjectArrayElement(dnames, i);
+        if (dname == nullptr) {
+            errs[i] = EINVAL;
+            continue;
+        }
+        const jsize byteCountUTF8 = env->GetStringUTFLength(dname);
+        char queryname[byteCountUTF8 + 1];
+        memset(queryname, 0, (byteCountUTF8 + 1) * sizeof(char));
+        env->GetStringUTFRegion(dname, 0, env->GetStringLength(dname), queryname);
+        env->DeleteLocalRef(dname);
+
+        const int fd = android_res_nquery(netHandle, queryname, ns_class, ns_type, flags);
+        if (fd < 0) {
+            errs[i] = -fd;
+            continue;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            errs[i] = errno;
+            android_res_cancel(fd);
+            continue;
+        }
+        fds[i] = fd;
+        pending++;
+    }
+
+    uint8_t buf[MAXPACKETSIZE];
+    epoll_event events[MAX_BATCH_QUERIES];
+    const int64_t deadline = monotonicMs() + timeoutMs;
+    bool failed = false;
+    while (pending > 0 && !failed) {
+        const int64_t remaining = deadline - monotonicMs();
+        if (remaining <= 0) break;
+        const int n = epoll_wait(epfd, events, MAX_BATCH_QUERIES, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("resNetworkQueryBatch: epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (int e = 0; e < n && !failed; e++) {
+            const uint32_t i = events[e].data.u32;
+            int rcode;
+            // Closes the fd, which also removes it from the epoll set.
+            const int res = android_res_nresult(fds[i], &rcode, buf, MAXPACKETSIZE);
+            fds[i] = -1;
+            pending--;
+            if (res < 0) {
+                errs[i] = -res;
+                continue;
+            }
+
+            jbyteArray answer = env->NewByteArray(res);
+            if (answer == nullptr) {
+                failed = true;
+                break;
+            }
+            env->SetByteArrayRegion(answer, 0, res, reinterpret_cast<jbyte*>(buf));
+            jobject response = env->NewObject(class_DnsResponse, ctor, answer, rcode);
+            env->DeleteLocalRef(answer);
+            if (response == nullptr) {
+                failed = true;
+                break;
+            }
+            env->SetObjectArrayElement(responses, i, response);
+            env->DeleteLocalRef(response);
+            errs[i] = 0;
+        }
+    }
+
+    // Cancel the queries that timed out, or all of them if an exception is pending.
+    for (jsize i = 0; i < count; i++) {
+        if (fds[i] >= 0) android_res_cancel(fds[i]);
+    }
+    close(epfd);
+    if (failed) return nullptr;
+
+    env->SetIntArrayRegion(errors, 0, count, errs);
+    return responses;
+}
+
 static jobject android_net_utils_getDnsNetwork(JNIEnv *env, jobject thiz) {
     net_handle_t dnsNetHandle = NETWORK_UNSPECIFIED;
     if (int res = android_getprocdns(&dnsNetHandle) < 0) {
@@ -258,6 +386,7 @@ static const JNINativeMethod gNetworkUtilMethods[] = {
     { "resNetworkQuery", "(JLjava/lang/String;III)Ljava/io/FileDescriptor;", (void*) android_net_utils_resNetworkQuery },
     { "resNetworkResult", "(Ljava/io/FileDescriptor;)Landroid/net/DnsResolver$DnsResponse;", (void*) android_net_utils_resNetworkResult },
     { "resNetworkCancel", "(Ljava/io/FileDescriptor;)V", (void*) android_net_utils_resNetworkCancel },
+    { "resNetworkQueryBatch", "(J[Ljava/lang/String;IIII[I)[Landroid/net/DnsResolver$DnsResponse;", (void*) android_net_utils_resNetworkQueryBatch },
     { "getDnsNetwork", "()Landroid/net/Network;", (void*) android_net_utils_getDnsNetwork },
 };
 // clang-format on
@@ -34,6 +34,7 @@ import java.net.InetAddress;
 import java.net.SocketException;
 import java.net.UnknownHostException;
 import java.util.Locale;
+import java.util.Objects;
 import java.util.TreeSet;
 
 /**
@@ -159,6 +160,36 @@ public class NetworkUtils {
      */
     public static native void resNetworkCancel(FileDescriptor fd);
 
+    /** Maximum number of queries in a single {@link #resNetworkQueryBatch} call. */
+    public static final int MAX_BATCH_QUERIES = 64;
+
+    private static native DnsResolver.DnsResponse[] resNetworkQueryBatch(long netHandle,
+            String[] dnames, int nsClass, int nsType, int flags, int timeoutMs, int[] errors)
+            throws ErrnoException;
+
+    /**
+     * DNS resolver series jni method.
+     * Look up the {@code nsClass} {@code nsType} Resource Records (RR) associated with each
+     * Domain Name of {@code dnames} on the network designated by {@code netId}. All queries are
+     * issued at once and their answers collected by a single epoll loop, blocking the calling
+     * thread for up to {@code timeoutMs}; queries still unanswered by then are cancelled.
+     * {@code flags} is an additional config to control actual querying behavior.
+     * @param errors filled with 0 for each answered query, or the errno of the failed query,
+     *               ETIMEDOUT if it was not answered in time. Must be as long as {@code dnames}.
+     * @return the DnsResponses in the order of {@code dnames}, null for the failed queries
+     * @throws NullPointerException if {@code dnames} or {@code errors} is null.
+     * @throws IllegalArgumentException if there are more than {@link #MAX_BATCH_QUERIES}
+     *         queries, or {@code errors} is not as long as {@code dnames}.
+     */
+    public static DnsResolver.DnsResponse[] resNetworkQueryBatch(int netId, String[] dnames,
+            int nsClass, int nsType, int flags, int timeoutMs, int[] errors)
+            throws ErrnoException {
+        Objects.requireNonNull(dnames, "dnames");
+        Objects.requireNonNull(errors, "errors");
+        return resNetworkQueryBatch(new Network(netId).getNetworkHandle(), dnames, nsClass,
+                nsType, flags, timeoutMs, errors);
+    }
+
     /**
      * DNS resolver series jni method.
      * Attempts to get network which resolver will use if no network is explicitly selected.
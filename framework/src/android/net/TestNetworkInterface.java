@@ -32,6 +32,9 @@ public final class TestNetworkInterface implements Parcelable {
     private final ParcelFileDescriptor mFileDescriptor;
     @NonNull
     private final String mInterfaceName;
+    // The queues of a multi-queue interface other than the first one, mFileDescriptor.
+    @NonNull
+    private final ParcelFileDescriptor[] mQueueFileDescriptors;
 
     @Override
     public int describeContents() {
@@ -42,16 +45,25 @@ public final class TestNetworkInterface implements Parcelable {
     public void writeToParcel(@NonNull Parcel out, int flags) {
         out.writeParcelable(mFileDescriptor, PARCELABLE_WRITE_RETURN_VALUE);
         out.writeString(mInterfaceName);
+        out.writeTypedArray(mQueueFileDescriptors, PARCELABLE_WRITE_RETURN_VALUE);
     }
 
     public TestNetworkInterface(@NonNull ParcelFileDescriptor pfd, @NonNull String intf) {
+        this(pfd, intf, new ParcelFileDescriptor[0]);
+    }
+
+    /** @hide */
+    public TestNetworkInterface(@NonNull ParcelFileDescriptor pfd, @NonNull String intf,
+            @NonNull ParcelFileDescriptor[] queuePfds) {
         mFileDescriptor = pfd;
         mInterfaceName = intf;
+        mQueueFileDescriptors = queuePfds;
     }
 
     private TestNetworkInterface(@NonNull Parcel in) {
         mFileDescriptor = in.readParcelable(ParcelFileDescriptor.class.getClassLoader());
         mInterfaceName = in.readString();
+        mQueueFileDescriptors = in.createTypedArray(ParcelFileDescriptor.CREATOR);
     }
 
     @NonNull
@@ -64,6 +76,17 @@ public final class TestNetworkInterface implements Parcelable {
         return mInterfaceName;
     }
 
+    /**
+     * Returns the file descriptors of the queues of a multi-queue interface, other than the one
+     * returned by {@link #getFileDescriptor}. Empty for a single queue interface.
+     *
+     * @hide
+     */
+    @NonNull
+    public ParcelFileDescriptor[] getQueueFileDescriptors() {
+        return mQueueFileDescriptors;
+    }
+
     @NonNull
     public static final Parcelable.Creator<TestNetworkInterface> CREATOR =
             new Parcelable.Creator<TestNetworkInterface>() {
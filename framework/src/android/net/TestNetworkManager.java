@@ -51,6 +51,33 @@ public class TestNetworkManager {
      */
     public static final String CLAT_INTERFACE_PREFIX = "v4-";
 
+    /**
+     * Flag for {@link #createTunTapInterface}: packets read from and written to the interface
+     * start with a virtio_net_hdr, and checksum and segmentation offloads are enabled.
+     * @hide
+     */
+    public static final int TUNTAP_VNET_HDR = 1 << 0;
+
+    /**
+     * Flag for {@link #createTunTapInterface}: packets written to the interface are received
+     * through NAPI, as on a real network device.
+     * @hide
+     */
+    public static final int TUNTAP_NAPI = 1 << 1;
+
+    /**
+     * Flag for {@link #createTunTapInterface}: packets written to the interface may be split in
+     * fragments, which NAPI reassembles. Requires a TAP interface and {@link #TUNTAP_NAPI}.
+     * @hide
+     */
+    public static final int TUNTAP_NAPI_FRAGS = 1 << 2;
+
+    /**
+     * The maximum number of queues of a TUN or TAP interface, from the kernel's MAX_TAP_QUEUES.
+     * @hide
+     */
+    public static final int TUNTAP_MAX_QUEUES = 256;
+
     @NonNull private static final String TAG = TestNetworkManager.class.getSimpleName();
 
     @NonNull private final ITestNetworkManager mService;
@@ -173,6 +200,34 @@ public class TestNetworkManager {
         }
     }
 
+    /**
+     * Create a tun or tap interface for throughput testing purposes
+     *
+     * @param isTun whether to create a TUN interface rather than a TAP interface.
+     * @param bringUp whether to bring up the interface before returning it.
+     * @param linkAddrs the LinkAddresses to assign to the interface.
+     * @param numQueues the number of queues of the interface, at most
+     *     {@link #TUNTAP_MAX_QUEUES}. More than one creates a multi-queue interface, whose
+     *     packets are spread over one file descriptor per queue.
+     * @param flags a combination of the TUNTAP_* flags.
+     * @return The interface, whose {@link TestNetworkInterface#getFileDescriptor} is the first
+     *     queue and {@link TestNetworkInterface#getQueueFileDescriptors} the others. Close all
+     *     of them to tear down the interface.
+     * @hide
+     */
+    @RequiresPermission(Manifest.permission.MANAGE_TEST_NETWORKS)
+    @NonNull
+    public TestNetworkInterface createTunTapInterface(boolean isTun, boolean bringUp,
+            @NonNull Collection<LinkAddress> linkAddrs, int numQueues, int flags) {
+        try {
+            final LinkAddress[] arr = new LinkAddress[linkAddrs.size()];
+            return mService.createTunTapInterface(isTun, bringUp, linkAddrs.toArray(arr),
+                    numQueues, flags);
+        } catch (RemoteException e) {
+            throw e.rethrowFromSystemServer();
+        }
+    }
+
     /**
      * Create a tap interface for testing purposes
      *
@@ -27,6 +27,7 @@
 #include <private/android_filesystem_config.h>
 
 #include "BpfSyscallWrappers.h"
+#include "ConnectivityTrace.h"
 
 namespace android {
 namespace net {
@@ -127,6 +128,7 @@ bool BpfHandler::hasUpdateDeviceStatsPermission(uid_t uid) {
 }
 
 int BpfHandler::tagSocket(int sockFd, uint32_t tag, uid_t chargeUid, uid_t realUid) {
+    CONNECTIVITY_TRACE("BpfHandler::tagSocket");
     std::lock_guard guard(mMutex);
     if (chargeUid != realUid && !hasUpdateDeviceStatsPermission(realUid)) {
         return -EPERM;
@@ -206,12 +208,17 @@ int BpfHandler::tagSocket(int sockFd, uint32_t tag, uid_t chargeUid, uid_t realU
     BpfMap<StatsKey, StatsValue>& currentMap =
             (configuration.value() == SELECT_MAP_A) ? mStatsMapA : mStatsMapB;
     // HACK: mStatsMapB becomes RW BpfMap here, but countUidStatsEntries doesn't modify so it works
-    base::Result<void> res = currentMap.iterate(countUidStatsEntries);
+    base::Result<void> res;
+    {
+        CONNECTIVITY_TRACE("countUidStatsEntries");
+        res = currentMap.iterate(countUidStatsEntries);
+    }
     if (!res.ok()) {
         ALOGE("Failed to count the stats entry in map %d: %s", currentMap.getMap().get(),
               strerror(res.error().code()));
         return -res.error().code();
     }
+    CONNECTIVITY_TRACE_COUNT("BpfHandler::tagSocket:statsEntries", totalEntryCount);
 
     if (totalEntryCount > mTotalUidStatsEntriesLimit ||
         perUidEntryCount > mPerUidStatsEntriesLimit) {
@@ -235,6 +242,7 @@ int BpfHandler::tagSocket(int sockFd, uint32_t tag, uid_t chargeUid, uid_t realU
 }
 
 int BpfHandler::untagSocket(int sockFd) {
+    CONNECTIVITY_TRACE("BpfHandler::untagSocket");
     std::lock_guard guard(mMutex);
     uint64_t sock_cookie = getSocketCookie(sockFd);
 
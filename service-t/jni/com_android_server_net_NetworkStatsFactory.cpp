@@ -32,6 +32,8 @@
 #include <utils/Log.h>
 #include <utils/misc.h>
 
+#include "ConnectivityMetrics.h"
+#include "ConnectivityTrace.h"
 #include "android-base/unique_fd.h"
 #include "bpf/BpfUtils.h"
 #include "netdbpf/BpfNetworkStats.h"
@@ -207,6 +209,8 @@ static int legacyReadNetworkStatsDetail(std::vector<stats_line>* lines,
 
 static int statsLinesToNetworkStats(JNIEnv* env, jclass clazz, jobject stats,
                             std::vector<stats_line>& lines) {
+    CONNECTIVITY_TRACE("statsLinesToNetworkStats");
+    CONNECTIVITY_TRACE_COUNT("statsLinesToNetworkStats:lines", lines.size());
     int size = lines.size();
 
     bool grow = size > env->GetIntField(stats, gNetworkStatsClassInfo.capacity);
@@ -301,8 +305,12 @@ static int readNetworkStatsDetail(JNIEnv* env, jclass clazz, jobject stats, jstr
 
 
     if (useBpfStats) {
-        if (parseBpfNetworkStatsDetail(&lines, limitIfaces, limitTag, limitUid) < 0)
+        // libnetworkstats is a separate library, so its latency is recorded by the caller.
+        net::ScopedLatency latency(net::Metric::PARSE_NETWORK_STATS_DETAIL);
+        if (parseBpfNetworkStatsDetail(&lines, limitIfaces, limitTag, limitUid) < 0) {
+            latency.setFailed();
             return -1;
+        }
     } else {
         ScopedUtfChars path8(env, path);
         if (path8.c_str() == NULL) {
@@ -320,8 +328,13 @@ static int readNetworkStatsDetail(JNIEnv* env, jclass clazz, jobject stats, jstr
 static int readNetworkStatsDev(JNIEnv* env, jclass clazz, jobject stats) {
     std::vector<stats_line> lines;
 
-    if (parseBpfNetworkStatsDev(&lines) < 0)
+    {
+        net::ScopedLatency latency(net::Metric::PARSE_NETWORK_STATS_DEV);
+        if (parseBpfNetworkStatsDev(&lines) < 0) {
+            latency.setFailed();
             return -1;
+        }
+    }
 
     return statsLinesToNetworkStats(env, clazz, stats, lines);
 }
@@ -22,6 +22,7 @@
 #include <utils/Log.h>
 #include <utils/misc.h>
 
+#include "ConnectivityTrace.h"
 #include "android-base/file.h"
 #include "android-base/strings.h"
 #include "android-base/unique_fd.h"
@@ -44,19 +45,6 @@ using base::Result;
 // from the config value.
 static constexpr char const* STATS_MAP_PATH[] = {STATS_MAP_B_PATH, STATS_MAP_A_PATH};
 
-int bpfGetUidStatsInternal(uid_t uid, Stats* stats,
-                           const BpfMap<uint32_t, StatsValue>& appUidStatsMap) {
-    auto statsEntry = appUidStatsMap.readValue(uid);
-    if (statsEntry.ok()) {
-        stats->rxPackets = statsEntry.value().rxPackets;
-        stats->txPackets = statsEntry.value().txPackets;
-        stats->rxBytes = statsEntry.value().rxBytes;
-        stats->txBytes = statsEntry.value().txBytes;
-    }
-    return (statsEntry.ok() || statsEntry.error().code() == ENOENT) ? 0
-                                                                    : -statsEntry.error().code();
-}
-
 int bpfGetUidStats(uid_t uid, Stats* stats) {
     BpfMapRO<uint32_t, StatsValue> appUidStatsMap(APP_UID_STATS_MAP_PATH);
 
@@ -68,37 +56,6 @@ int bpfGetUidStats(uid_t uid, Stats* stats) {
     return bpfGetUidStatsInternal(uid, stats, appUidStatsMap);
 }
 
-int bpfGetIfaceStatsInternal(const char* iface, Stats* stats,
-                             const BpfMap<uint32_t, StatsValue>& ifaceStatsMap,
-                             const BpfMap<uint32_t, IfaceValue>& ifaceNameMap) {
-    int64_t unknownIfaceBytesTotal = 0;
-    stats->tcpRxPackets = -1;
-    stats->tcpTxPackets = -1;
-    const auto processIfaceStats =
-            [iface, stats, &ifaceNameMap, &unknownIfaceBytesTotal](
-                    const uint32_t& key,
-                    const BpfMap<uint32_t, StatsValue>& ifaceStatsMap) -> Result<void> {
-        char ifname[IFNAMSIZ];
-        if (getIfaceNameFromMap(ifaceNameMap, ifaceStatsMap, key, ifname, key,
-                                &unknownIfaceBytesTotal)) {
-            return Result<void>();
-        }
-        if (!iface || !strcmp(iface, ifname)) {
-            Result<StatsValue> statsEntry = ifaceStatsMap.readValue(key);
-            if (!statsEntry.ok()) {
-                return statsEntry.error();
-            }
-            stats->rxPackets += statsEntry.value().rxPackets;
-            stats->txPackets += statsEntry.value().txPackets;
-            stats->rxBytes += statsEntry.value().rxBytes;
-            stats->txBytes += statsEntry.value().txBytes;
-        }
-        return Result<void>();
-    };
-    auto res = ifaceStatsMap.iterate(processIfaceStats);
-    return res.ok() ? 0 : -res.error().code();
-}
-
 int bpfGetIfaceStats(const char* iface, Stats* stats) {
     BpfMapRO<uint32_t, StatsValue> ifaceStatsMap(IFACE_STATS_MAP_PATH);
     int ret;
@@ -130,62 +87,10 @@ stats_line populateStatsEntry(const StatsKey& statsKey, const StatsValue& statsE
     return newLine;
 }
 
-int parseBpfNetworkStatsDetailInternal(std::vector<stats_line>* lines,
-                                       const std::vector<std::string>& limitIfaces, int limitTag,
-                                       int limitUid, const BpfMap<StatsKey, StatsValue>& statsMap,
-                                       const BpfMap<uint32_t, IfaceValue>& ifaceMap) {
-    int64_t unknownIfaceBytesTotal = 0;
-    const auto processDetailUidStats =
-            [lines, &limitIfaces, &limitTag, &limitUid, &unknownIfaceBytesTotal, &ifaceMap](
-                    const StatsKey& key,
-                    const BpfMap<StatsKey, StatsValue>& statsMap) -> Result<void> {
-        char ifname[IFNAMSIZ];
-        if (getIfaceNameFromMap(ifaceMap, statsMap, key.ifaceIndex, ifname, key,
-                                &unknownIfaceBytesTotal)) {
-            return Result<void>();
-        }
-        std::string ifnameStr(ifname);
-        if (limitIfaces.size() > 0 &&
-            std::find(limitIfaces.begin(), limitIfaces.end(), ifnameStr) == limitIfaces.end()) {
-            // Nothing matched; skip this line.
-            return Result<void>();
-        }
-        if (limitTag != TAG_ALL && uint32_t(limitTag) != key.tag) {
-            return Result<void>();
-        }
-        if (limitUid != UID_ALL && uint32_t(limitUid) != key.uid) {
-            return Result<void>();
-        }
-        Result<StatsValue> statsEntry = statsMap.readValue(key);
-        if (!statsEntry.ok()) {
-            return base::ResultError(statsEntry.error().message(), statsEntry.error().code());
-        }
-        lines->push_back(populateStatsEntry(key, statsEntry.value(), ifname));
-        return Result<void>();
-    };
-    Result<void> res = statsMap.iterate(processDetailUidStats);
-    if (!res.ok()) {
-        ALOGE("failed to iterate per uid Stats map for detail traffic stats: %s",
-              strerror(res.error().code()));
-        return -res.error().code();
-    }
-
-    // Since eBPF use hash map to record stats, network stats collected from
-    // eBPF will be out of order. And the performance of findIndexHinted in
-    // NetworkStats will also be impacted.
-    //
-    // Furthermore, since the StatsKey contains iface index, the network stats
-    // reported to framework would create items with the same iface, uid, tag
-    // and set, which causes NetworkStats maps wrong item to subtract.
-    //
-    // Thus, the stats needs to be properly sorted and grouped before reported.
-    groupNetworkStats(lines);
-    return 0;
-}
-
 int parseBpfNetworkStatsDetail(std::vector<stats_line>* lines,
                                const std::vector<std::string>& limitIfaces, int limitTag,
                                int limitUid) {
+    CONNECTIVITY_TRACE("parseBpfNetworkStatsDetail");
     BpfMapRO<uint32_t, IfaceValue> ifaceIndexNameMap(IFACE_INDEX_NAME_MAP_PATH);
     if (!ifaceIndexNameMap.isValid()) {
         int ret = -errno;
@@ -222,6 +127,7 @@ int parseBpfNetworkStatsDetail(std::vector<stats_line>* lines,
         return ret;
     }
 
+    CONNECTIVITY_TRACE("clearStatsMap");
     Result<void> res = statsMap.clear();
     if (!res.ok()) {
         ALOGE("Clean up current stats map failed: %s", strerror(res.error().code()));
@@ -231,37 +137,8 @@ int parseBpfNetworkStatsDetail(std::vector<stats_line>* lines,
     return 0;
 }
 
-int parseBpfNetworkStatsDevInternal(std::vector<stats_line>* lines,
-                                    const BpfMap<uint32_t, StatsValue>& statsMap,
-                                    const BpfMap<uint32_t, IfaceValue>& ifaceMap) {
-    int64_t unknownIfaceBytesTotal = 0;
-    const auto processDetailIfaceStats = [lines, &unknownIfaceBytesTotal, &ifaceMap, &statsMap](
-                                             const uint32_t& key, const StatsValue& value,
-                                             const BpfMap<uint32_t, StatsValue>&) {
-        char ifname[IFNAMSIZ];
-        if (getIfaceNameFromMap(ifaceMap, statsMap, key, ifname, key, &unknownIfaceBytesTotal)) {
-            return Result<void>();
-        }
-        StatsKey fakeKey = {
-                .uid = (uint32_t)UID_ALL,
-                .tag = (uint32_t)TAG_NONE,
-                .counterSet = (uint32_t)SET_ALL,
-        };
-        lines->push_back(populateStatsEntry(fakeKey, value, ifname));
-        return Result<void>();
-    };
-    Result<void> res = statsMap.iterateWithValue(processDetailIfaceStats);
-    if (!res.ok()) {
-        ALOGE("failed to iterate per uid Stats map for detail traffic stats: %s",
-              strerror(res.error().code()));
-        return -res.error().code();
-    }
-
-    groupNetworkStats(lines);
-    return 0;
-}
-
 int parseBpfNetworkStatsDev(std::vector<stats_line>* lines) {
+    CONNECTIVITY_TRACE("parseBpfNetworkStatsDev");
     int ret = 0;
     BpfMapRO<uint32_t, IfaceValue> ifaceIndexNameMap(IFACE_INDEX_NAME_MAP_PATH);
     if (!ifaceIndexNameMap.isValid()) {
@@ -285,6 +162,7 @@ uint64_t combineUidTag(const uid_t uid, const uint32_t tag) {
 
 void groupNetworkStats(std::vector<stats_line>* lines) {
     if (lines->size() <= 1) return;
+    CONNECTIVITY_TRACE("groupNetworkStats");
     std::sort(lines->begin(), lines->end());
 
     // Similar to std::unique(), but aggregates the duplicates rather than discarding them.
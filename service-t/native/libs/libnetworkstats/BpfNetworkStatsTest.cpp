@@ -33,6 +33,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
+#include "FakeBpfMap.h"
 #include "bpf/BpfMap.h"
 #include "bpf/BpfUtils.h"
 #include "netdbpf/BpfNetworkStats.h"
@@ -70,29 +71,27 @@ constexpr uint32_t UNKNOWN_IFACE = 0;
 class BpfNetworkStatsHelperTest : public testing::Test {
   protected:
     BpfNetworkStatsHelperTest() {}
-    BpfMap<uint64_t, UidTagValue> mFakeCookieTagMap;
-    BpfMap<uint32_t, StatsValue> mFakeAppUidStatsMap;
-    BpfMap<StatsKey, StatsValue> mFakeStatsMap;
-    BpfMap<uint32_t, IfaceValue> mFakeIfaceIndexNameMap;
-    BpfMap<uint32_t, StatsValue> mFakeIfaceStatsMap;
+    FakeBpfMap<uint64_t, UidTagValue> mFakeCookieTagMap;
+    FakeBpfMap<uint32_t, StatsValue> mFakeAppUidStatsMap;
+    FakeBpfMap<StatsKey, StatsValue> mFakeStatsMap;
+    FakeBpfMap<uint32_t, IfaceValue> mFakeIfaceIndexNameMap;
+    FakeBpfMap<uint32_t, StatsValue> mFakeIfaceStatsMap;
 
     void SetUp() {
-        ASSERT_EQ(0, setrlimitForTest());
+        mFakeCookieTagMap = FakeBpfMap<uint64_t, UidTagValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+        ASSERT_TRUE(mFakeCookieTagMap.isValid());
 
-        mFakeCookieTagMap = BpfMap<uint64_t, UidTagValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE, 0);
-        ASSERT_LE(0, mFakeCookieTagMap.getMap());
+        mFakeAppUidStatsMap = FakeBpfMap<uint32_t, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+        ASSERT_TRUE(mFakeAppUidStatsMap.isValid());
 
-        mFakeAppUidStatsMap = BpfMap<uint32_t, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE, 0);
-        ASSERT_LE(0, mFakeAppUidStatsMap.getMap());
+        mFakeStatsMap = FakeBpfMap<StatsKey, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+        ASSERT_TRUE(mFakeStatsMap.isValid());
 
-        mFakeStatsMap = BpfMap<StatsKey, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE, 0);
-        ASSERT_LE(0, mFakeStatsMap.getMap());
+        mFakeIfaceIndexNameMap = FakeBpfMap<uint32_t, IfaceValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+        ASSERT_TRUE(mFakeIfaceIndexNameMap.isValid());
 
-        mFakeIfaceIndexNameMap = BpfMap<uint32_t, IfaceValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE, 0);
-        ASSERT_LE(0, mFakeIfaceIndexNameMap.getMap());
-
-        mFakeIfaceStatsMap = BpfMap<uint32_t, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE, 0);
-        ASSERT_LE(0, mFakeIfaceStatsMap.getMap());
+        mFakeIfaceStatsMap = FakeBpfMap<uint32_t, StatsValue>(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+        ASSERT_TRUE(mFakeIfaceStatsMap.isValid());
     }
 
     void expectUidTag(uint64_t cookie, uid_t uid, uint32_t tag) {
@@ -103,7 +102,7 @@ class BpfNetworkStatsHelperTest : public testing::Test {
     }
 
     void populateFakeStats(uid_t uid, uint32_t tag, uint32_t ifaceIndex, uint32_t counterSet,
-                           StatsValue value, BpfMap<StatsKey, StatsValue>& map) {
+                           StatsValue value, FakeBpfMap<StatsKey, StatsValue>& map) {
         StatsKey key = {
             .uid = (uint32_t)uid, .tag = tag, .counterSet = counterSet, .ifaceIndex = ifaceIndex};
         EXPECT_RESULT_OK(map.writeValue(key, value, BPF_ANY));
@@ -175,7 +174,8 @@ TEST_F(BpfNetworkStatsHelperTest, TestBpfIterateMap) {
     int totalCount = 0;
     int totalSum = 0;
     const auto iterateWithoutDeletion =
-            [&totalCount, &totalSum](const uint64_t& key, const BpfMap<uint64_t, UidTagValue>&) {
+            [&totalCount, &totalSum](const uint64_t& key,
+                                     const FakeBpfMap<uint64_t, UidTagValue>&) {
                 EXPECT_GE((uint64_t)5, key);
                 totalCount++;
                 totalSum += key;
@@ -16,6 +16,7 @@
 
 #define LOG_TAG "TrafficControllerJni"
 
+#include "ConnectivityMetrics.h"
 #include "TrafficController.h"
 
 #include <bpf_shared.h>
@@ -29,6 +30,7 @@
 #include <vector>
 
 
+using android::net::ConnectivityMetrics;
 using android::net::TrafficController;
 using android::netdutils::Status;
 
@@ -183,6 +185,14 @@ static jint native_swapActiveStatsMap(JNIEnv* env, jobject clazz) {
     return (jint)status.code();
 }
 
+static jint native_setBpfProgramStatsEnabled(JNIEnv* env, jobject clazz, jboolean enable) {
+    Status status = mTc.setBpfProgramStatsEnabled(enable);
+    if (!isOk(status)) {
+        ALOGE("%s failed, error code = %d", __func__, status.code());
+    }
+    return (jint)status.code();
+}
+
 static void native_setPermissionForUids(JNIEnv* env, jobject clazz, jint permission,
                                       jintArray jUids) {
     ScopedIntArrayRO uids(env, jUids);
@@ -203,6 +213,15 @@ static void native_dump(JNIEnv* env, jobject clazz, jobject javaFd, jboolean ver
     mTc.dump(fd, verbose);
 }
 
+// Returns ConnectivityMetrics::SNAPSHOT_FIELDS values for each native metric.
+static jlongArray native_getNativeMetrics(JNIEnv* env, jobject clazz) {
+    const std::vector<int64_t> values = ConnectivityMetrics::snapshot();
+    jlongArray ret = env->NewLongArray(values.size());
+    if (ret == nullptr) return nullptr;
+    env->SetLongArrayRegion(ret, 0, values.size(), reinterpret_cast<const jlong*>(values.data()));
+    return ret;
+}
+
 /*
  * JNI registration.
  */
@@ -235,6 +254,10 @@ static const JNINativeMethod gMethods[] = {
     (void*)native_setPermissionForUids},
     {"native_dump", "(Ljava/io/FileDescriptor;Z)V",
     (void*)native_dump},
+    {"native_getNativeMetrics", "()[J",
+    (void*)native_getNativeMetrics},
+    {"native_setBpfProgramStatsEnabled", "(Z)I",
+    (void*)native_setBpfProgramStatsEnabled},
 };
 // clang-format on
 
@@ -33,6 +33,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <vector>
+
 #include <log/log.h>
 
 #include "jni.h"
@@ -41,6 +43,11 @@
 #include <nativehelper/JNIHelp.h>
 #include <nativehelper/ScopedUtfChars.h>
 
+// Sync from TestNetworkManager.java
+#define TUNTAP_VNET_HDR (1 << 0)
+#define TUNTAP_NAPI (1 << 1)
+#define TUNTAP_NAPI_FRAGS (1 << 2)
+
 namespace android {
 
 //------------------------------------------------------------------------------
@@ -51,16 +58,34 @@ static void throwException(JNIEnv* env, int error, const char* action, const cha
     jniThrowException(env, "java/lang/IllegalStateException", msg.c_str());
 }
 
-static int createTunTapInterface(JNIEnv* env, bool isTun, const char* iface) {
-    base::unique_fd tun(open("/dev/tun", O_RDWR | O_NONBLOCK));
+static bool createTunTapInterface(JNIEnv* env, bool isTun, const char* iface, int numQueues,
+                                  int flags, std::vector<base::unique_fd>* queues) {
     ifreq ifr{};
 
-    // Allocate interface.
+    // Allocate interface, then attach every other queue to it by allocating it again.
     ifr.ifr_flags = (isTun ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
+    if (numQueues > 1) ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (flags & TUNTAP_VNET_HDR) ifr.ifr_flags |= IFF_VNET_HDR;
+    if (flags & TUNTAP_NAPI) ifr.ifr_flags |= IFF_NAPI;
+    if (flags & TUNTAP_NAPI_FRAGS) ifr.ifr_flags |= IFF_NAPI_FRAGS;
     strlcpy(ifr.ifr_name, iface, IFNAMSIZ);
-    if (ioctl(tun.get(), TUNSETIFF, &ifr)) {
-        throwException(env, errno, "allocating", ifr.ifr_name);
-        return -1;
+    for (int i = 0; i < numQueues; i++) {
+        base::unique_fd tun(open("/dev/tun", O_RDWR | O_NONBLOCK));
+        if (ioctl(tun.get(), TUNSETIFF, &ifr)) {
+            throwException(env, errno, i ? "attaching queue to" : "allocating", ifr.ifr_name);
+            return false;
+        }
+        queues->push_back(std::move(tun));
+    }
+
+    // Let the kernel pass checksum offloaded and GSO packets with their virtio_net_hdr rather
+    // than checksumming and segmenting them. Offloads are per interface, not per queue.
+    if (flags & TUNTAP_VNET_HDR) {
+        const unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+        if (ioctl(queues->front().get(), TUNSETOFFLOAD, offloads)) {
+            throwException(env, errno, "setting offloads of", ifr.ifr_name);
+            return false;
+        }
     }
 
     // Activate interface using an unconnected datagram socket.
@@ -71,31 +96,41 @@ static int createTunTapInterface(JNIEnv* env, bool isTun, const char* iface) {
 
     if (ioctl(inet6CtrlSock.get(), SIOCSIFFLAGS, &ifr)) {
         throwException(env, errno, "activating", ifr.ifr_name);
-        return -1;
+        return false;
     }
 
-    return tun.release();
+    return true;
 }
 
 //------------------------------------------------------------------------------
 
-static jint create(JNIEnv* env, jobject /* thiz */, jboolean isTun, jstring jIface) {
+static jintArray create(JNIEnv* env, jobject /* thiz */, jboolean isTun, jstring jIface,
+                        jint numQueues, jint flags) {
     ScopedUtfChars iface(env, jIface);
     if (!iface.c_str()) {
         jniThrowNullPointerException(env, "iface");
-        return -1;
+        return nullptr;
     }
 
-    int tun = createTunTapInterface(env, isTun, iface.c_str());
-
     // Any exceptions will be thrown from the createTunTapInterface call
-    return tun;
+    std::vector<base::unique_fd> queues;
+    if (!createTunTapInterface(env, isTun, iface.c_str(), numQueues, flags, &queues)) {
+        return nullptr;
+    }
+
+    jintArray fds = env->NewIntArray(queues.size());
+    if (fds == nullptr) return nullptr;
+    for (size_t i = 0; i < queues.size(); i++) {
+        const jint fd = queues[i].release();
+        env->SetIntArrayRegion(fds, i, 1, &fd);
+    }
+    return fds;
 }
 
 //------------------------------------------------------------------------------
 
 static const JNINativeMethod gMethods[] = {
-    {"jniCreateTunTap", "(ZLjava/lang/String;)I", (void*)create},
+    {"jniCreateTunTap", "(ZLjava/lang/String;II)[I", (void*)create},
 };
 
 int register_com_android_server_TestNetworkService(JNIEnv* env) {
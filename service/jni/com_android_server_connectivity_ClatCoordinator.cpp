@@ -19,21 +19,32 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <linux/if_ether.h>
 #include <linux/if_tun.h>
 #include <linux/ioctl.h>
 #include <log/log.h>
 #include <nativehelper/JNIHelp.h>
 #include <net/if.h>
+#include <poll.h>
 #include <spawn.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <unistd.h>
 #include <string>
+#include <vector>
 
+#include <android-base/unique_fd.h>
+
+#include <BpfPerCpu.h>
 #include <bpf/BpfMap.h>
 #include <bpf/BpfUtils.h>
 #include <bpf_shared.h>
 #include <netjniutils/netjniutils.h>
 #include <private/android_filesystem_config.h>
 
+#include "ConnectivityMetrics.h"
+#include "ConnectivityTrace.h"
+#include "libclat/clatengine.h"
 #include "libclat/clatutils.h"
 #include "nativehelper/scoped_utf_chars.h"
 
@@ -47,6 +58,8 @@
 
 #define DEVICEPREFIX "v4-"
 
+#define CLAT_STATS_MAP_PATH "/sys/fs/bpf/net_shared/map_clatd_clat_stats_map"
+
 namespace android {
 static const char* kClatdPath = "/apex/com.android.tethering/bin/for-system/clatd";
 
@@ -127,9 +140,18 @@ jstring com_android_server_connectivity_ClatCoordinator_generateIpv6Address(
     return env->NewStringUTF(addrstr);
 }
 
-static jint com_android_server_connectivity_ClatCoordinator_createTunInterface(JNIEnv* env,
-                                                                               jobject clazz,
-                                                                               jstring tuniface) {
+// Offloads the tun interface accepts when it has a virtio_net_hdr: checksum offload plus TSO, so
+// that coalesced TCP super-packets cross the tun device in a single read/write. UDP segmentation
+// offload is only supported by newer kernels, so it is requested separately.
+static constexpr unsigned int TUN_OFFLOADS = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+#ifdef TUN_F_USO4
+static constexpr unsigned int TUN_UDP_OFFLOADS = TUN_F_USO4 | TUN_F_USO6;
+#else
+static constexpr unsigned int TUN_UDP_OFFLOADS = 0;
+#endif
+
+static jint com_android_server_connectivity_ClatCoordinator_createTunInterface(
+        JNIEnv* env, jobject clazz, jstring tuniface, jboolean multiQueue, jboolean vnetHdr) {
     ScopedUtfChars v4interface(env, tuniface);
 
     // open the tun device in non blocking mode as required by clatd
@@ -140,8 +162,11 @@ static jint com_android_server_connectivity_ClatCoordinator_createTunInterface(J
         return -1;
     }
 
+    // With IFF_MULTI_QUEUE, every further call with the same interface name attaches a new queue
+    // to the existing interface and returns its fd.
     struct ifreq ifr = {
-            .ifr_flags = IFF_TUN,
+            .ifr_flags = static_cast<short>(IFF_TUN | (multiQueue ? IFF_MULTI_QUEUE : 0) |
+                                            (vnetHdr ? IFF_VNET_HDR : 0)),
     };
     strlcpy(ifr.ifr_name, v4interface.c_str(), sizeof(ifr.ifr_name));
 
@@ -152,6 +177,24 @@ static jint com_android_server_connectivity_ClatCoordinator_createTunInterface(J
         return -1;
     }
 
+    if (vnetHdr) {
+        int hdrLen = sizeof(net::clat::tun_vnet_hdr);
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdrLen)) {
+            close(fd);
+            jniThrowExceptionFmt(env, "java/io/IOException", "ioctl(TUNSETVNETHDRSZ) failed (%s)",
+                                 strerror(errno));
+            return -1;
+        }
+
+        if ((TUN_UDP_OFFLOADS == 0 || ioctl(fd, TUNSETOFFLOAD, TUN_OFFLOADS | TUN_UDP_OFFLOADS)) &&
+            ioctl(fd, TUNSETOFFLOAD, TUN_OFFLOADS)) {
+            close(fd);
+            jniThrowExceptionFmt(env, "java/io/IOException", "ioctl(TUNSETOFFLOAD) failed (%s)",
+                                 strerror(errno));
+            return -1;
+        }
+    }
+
     return fd;
 }
 
@@ -176,6 +219,82 @@ static jint com_android_server_connectivity_ClatCoordinator_detectMtu(JNIEnv* en
     return ret;
 }
 
+static jint com_android_server_connectivity_ClatCoordinator_getRouteMtu(JNIEnv* env,
+                                                                        jobject clazz,
+                                                                        jstring platSubnet,
+                                                                        jint plat_suffix,
+                                                                        jint mark) {
+    ScopedUtfChars platSubnetStr(env, platSubnet);
+
+    in6_addr plat_subnet;
+    if (inet_pton(AF_INET6, platSubnetStr.c_str(), &plat_subnet) != 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid plat prefix address %s",
+                             platSubnetStr.c_str());
+        return -1;
+    }
+
+    int ret = net::clat::get_route_mtu(&plat_subnet, plat_suffix, mark);
+    if (ret < 0) {
+        throwIOException(env, "get route mtu failed", -ret);
+        return -1;
+    }
+
+    return ret;
+}
+
+static jint com_android_server_connectivity_ClatCoordinator_openRouteMonitor(JNIEnv* env,
+                                                                             jobject clazz) {
+    int sock = net::clat::open_route_monitor();
+    if (sock < 0) {
+        throwIOException(env, "open route monitor failed", -sock);
+        return -1;
+    }
+    return sock;
+}
+
+static jint com_android_server_connectivity_ClatCoordinator_readRouteMonitor(JNIEnv* env,
+                                                                             jobject clazz,
+                                                                             jobject javaFd) {
+    int sock = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    if (sock < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid file descriptor");
+        return -1;
+    }
+
+    int ret = net::clat::read_route_monitor(sock);
+    if (ret < 0) {
+        throwIOException(env, "read route monitor failed", -ret);
+        return -1;
+    }
+    return ret;
+}
+
+static jstring com_android_server_connectivity_ClatCoordinator_getNextHopMac(
+        JNIEnv* env, jobject clazz, jstring platSubnet, jint plat_suffix, jint ifindex,
+        jint mark) {
+    ScopedUtfChars platSubnetStr(env, platSubnet);
+
+    in6_addr plat_subnet;
+    if (inet_pton(AF_INET6, platSubnetStr.c_str(), &plat_subnet) != 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid plat prefix address %s",
+                             platSubnetStr.c_str());
+        return nullptr;
+    }
+
+    uint8_t mac[ETH_ALEN];
+    int ret = net::clat::get_next_hop_mac(&plat_subnet, plat_suffix, ifindex, mark, mac);
+    if (ret < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "get next hop mac failed: %s",
+                             strerror(-ret));
+        return nullptr;
+    }
+
+    char macstr[sizeof("00:00:00:00:00:00")];
+    snprintf(macstr, sizeof(macstr), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2],
+             mac[3], mac[4], mac[5]);
+    return env->NewStringUTF(macstr);
+}
+
 static jint com_android_server_connectivity_ClatCoordinator_openPacketSocket(JNIEnv* env,
                                                                               jobject clazz) {
     // Will eventually be bound to htons(ETH_P_IPV6) protocol,
@@ -234,7 +353,7 @@ static void com_android_server_connectivity_ClatCoordinator_addAnycastSetsockopt
 }
 
 static void com_android_server_connectivity_ClatCoordinator_configurePacketSocket(
-        JNIEnv* env, jobject clazz, jobject javaFd, jstring addr6, jint ifindex) {
+        JNIEnv* env, jobject clazz, jobject javaFd, jstring addr6, jint ifindex, jboolean rxRing) {
     ScopedUtfChars addrStr(env, addr6);
 
     int sock = netjniutils::GetNativeFileDescriptor(env, javaFd);
@@ -250,6 +369,16 @@ static void com_android_server_connectivity_ClatCoordinator_configurePacketSocke
         return;
     }
 
+    // The ring must be set up before the socket is bound, so that no packet is queued to the
+    // socket receive queue that the ring owner would never read.
+    if (rxRing) {
+        int ret = net::clat::configure_packet_ring(sock);
+        if (ret < 0) {
+            throwIOException(env, "configure packet ring failed", -ret);
+            return;
+        }
+    }
+
     int ret = net::clat::configure_packet_socket(sock, &addr, ifindex);
     if (ret < 0) {
         throwIOException(env, "configure packet socket failed", -ret);
@@ -257,9 +386,30 @@ static void com_android_server_connectivity_ClatCoordinator_configurePacketSocke
     }
 }
 
-static jint com_android_server_connectivity_ClatCoordinator_startClatd(
-        JNIEnv* env, jobject clazz, jobject tunJavaFd, jobject readSockJavaFd,
-        jobject writeSockJavaFd, jstring iface, jstring pfx96, jstring v4, jstring v6) {
+// Fetches the fd of each queue of the tun interface. Throws and returns false on failure.
+static bool getTunFds(JNIEnv* env, jobjectArray tunJavaFds, std::vector<int>* tunFds) {
+    const jsize tunQueues = env->GetArrayLength(tunJavaFds);
+    if (tunQueues < 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "No tun file descriptor");
+        return false;
+    }
+    for (jsize i = 0; i < tunQueues; i++) {
+        jobject tunJavaFd = env->GetObjectArrayElement(tunJavaFds, i);
+        int tunFd = netjniutils::GetNativeFileDescriptor(env, tunJavaFd);
+        env->DeleteLocalRef(tunJavaFd);
+        if (tunFd < 0) {
+            jniThrowExceptionFmt(env, "java/io/IOException", "Invalid tun file descriptor");
+            return false;
+        }
+        tunFds->push_back(tunFd);
+    }
+    return true;
+}
+
+static jint startClatdProcess(JNIEnv* env, jobject tunJavaFd, jobject readSockJavaFd,
+                              jobject writeSockJavaFd, jstring iface, jstring pfx96, jstring v4,
+                              jstring v6) {
+    CONNECTIVITY_TRACE("startClatd");
     ScopedUtfChars ifaceStr(env, iface);
     ScopedUtfChars pfx96Str(env, pfx96);
     ScopedUtfChars v4Str(env, v4);
@@ -371,13 +521,43 @@ static jint com_android_server_connectivity_ClatCoordinator_startClatd(
     return pid;
 }
 
+static jint com_android_server_connectivity_ClatCoordinator_startClatd(
+        JNIEnv* env, jobject clazz, jobject tunJavaFd, jobject readSockJavaFd,
+        jobject writeSockJavaFd, jstring iface, jstring pfx96, jstring v4, jstring v6) {
+    net::ScopedLatency latency(net::Metric::CLAT_START);
+    const jint pid = startClatdProcess(env, tunJavaFd, readSockJavaFd, writeSockJavaFd, iface,
+                                       pfx96, v4, v6);
+    latency.setFailed(env->ExceptionCheck());
+    return pid;
+}
+
 // Stop clatd process. SIGTERM with timeout first, if fail, SIGKILL.
 // See stopProcess() in system/netd/server/NetdConstants.cpp.
 // TODO: have a function stopProcess(int pid, const char *name) in common location and call it.
 static constexpr int WAITPID_ATTEMPTS = 50;
 static constexpr int WAITPID_RETRY_INTERVAL_US = 100000;
+static constexpr int STOP_TIMEOUT_MS = WAITPID_ATTEMPTS * WAITPID_RETRY_INTERVAL_US / 1000;
 
-static void stopClatdProcess(int pid) {
+// bionic only has wrappers for these from API level 31.
+static int pidfdOpen(pid_t pid) {
+    return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static int pidfdSendSignal(int pidfd, int sig) {
+    return syscall(__NR_pidfd_send_signal, pidfd, sig, nullptr, 0);
+}
+
+static void reapClatdProcess(int pid) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+        ALOGE("Error waiting for clatd child process %d: %s", pid, strerror(errno));
+    } else {
+        ALOGD("clatd process %d terminated status=%d", pid, status);
+    }
+}
+
+// Used on kernels without pidfd support (before 5.3).
+static void stopClatdProcessLegacy(int pid) {
     int err = kill(pid, SIGTERM);
     if (err) {
         err = errno;
@@ -408,6 +588,63 @@ static void stopClatdProcess(int pid) {
     }
 }
 
+// Opens a pidfd for clatd and sends it SIGTERM.
+// returns: the pidfd on success, -errno on failure
+static int signalClatdStop(int pid) {
+    CONNECTIVITY_TRACE("signalClatdStop");
+    base::unique_fd pidfd(pidfdOpen(pid));
+    if (pidfd == -1) return -errno;
+
+    if (pidfdSendSignal(pidfd, SIGTERM)) {
+        int err = errno;
+        ALOGE("Error killing clatd child process %d: %s", pid, strerror(err));
+        if (err == ESRCH) return -err;
+    }
+    return pidfd.release();
+}
+
+// Waits for clatd to exit after signalClatdStop, escalating to SIGKILL after timeoutMs, and reaps
+// it. The pidfd becomes readable as soon as the process exits, so unlike polling waitpid() this
+// returns as soon as clatd is gone.
+static void waitClatdStop(int pidfd, int pid, int timeoutMs) {
+    CONNECTIVITY_TRACE("waitClatdStop");
+    struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeoutMs);
+    } while (ret == -1 && errno == EINTR);
+
+    // Reaping blocks until clatd exits, so unless it is known to have exited already, kill it.
+    if (ret <= 0) {
+        if (ret < 0) {
+            ALOGE("Error polling clatd pid=%d: %s, try SIGKILL", pid, strerror(errno));
+        } else {
+            ALOGE("Failed to SIGTERM clatd pid=%d, try SIGKILL", pid);
+        }
+        // clatd is our unreaped child, so its pid cannot have been reused yet.
+        if (pidfdSendSignal(pidfd, SIGKILL) && kill(pid, SIGKILL)) {
+            ALOGE("Error sending SIGKILL to clatd pid=%d: %s", pid, strerror(errno));
+        }
+    }
+    reapClatdProcess(pid);
+}
+
+static void stopClatdProcess(int pid) {
+    CONNECTIVITY_TRACE("stopClatd");
+    int pidfd = signalClatdStop(pid);
+    if (pidfd == -ESRCH) {
+        ALOGE("clatd child process %d unexpectedly disappeared", pid);
+        return;
+    }
+    if (pidfd < 0) {
+        stopClatdProcessLegacy(pid);
+        return;
+    }
+
+    waitClatdStop(pidfd, pid, STOP_TIMEOUT_MS);
+    close(pidfd);
+}
+
 static void com_android_server_connectivity_ClatCoordinator_stopClatd(JNIEnv* env, jobject clazz,
                                                                       jstring iface, jstring pfx96,
                                                                       jstring v4, jstring v6,
@@ -422,11 +659,115 @@ static void com_android_server_connectivity_ClatCoordinator_stopClatd(JNIEnv* en
         return;
     }
 
+    net::ScopedLatency latency(net::Metric::CLAT_STOP);
     stopClatdProcess(pid);
 }
 
-static jlong com_android_server_connectivity_ClatCoordinator_tagSocketAsClat(
-        JNIEnv* env, jobject clazz, jobject sockJavaFd) {
+static jint com_android_server_connectivity_ClatCoordinator_signalClatdStop(JNIEnv* env,
+                                                                            jobject clazz,
+                                                                            jint pid) {
+    if (pid <= 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid pid");
+        return -1;
+    }
+
+    int pidfd = signalClatdStop(pid);
+    if (pidfd < 0) {
+        throwIOException(env, "signal clatd stop failed", -pidfd);
+        return -1;
+    }
+    return pidfd;
+}
+
+static void com_android_server_connectivity_ClatCoordinator_waitClatdStop(JNIEnv* env,
+                                                                          jobject clazz,
+                                                                          jobject pidJavaFd,
+                                                                          jint pid,
+                                                                          jint timeoutMs) {
+    int pidfd = netjniutils::GetNativeFileDescriptor(env, pidJavaFd);
+    if (pidfd < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid pidfd");
+        return;
+    }
+
+    net::ScopedLatency latency(net::Metric::CLAT_STOP);
+    waitClatdStop(pidfd, pid, timeoutMs);
+}
+
+static jlong com_android_server_connectivity_ClatCoordinator_startClatEngine(
+        JNIEnv* env, jobject clazz, jobjectArray tunJavaFds, jboolean vnetHdr,
+        jobject readSockJavaFd, jboolean packetRing, jobject writeSockJavaFd, jstring pfx96,
+        jstring v4, jstring v6) {
+    ScopedUtfChars pfx96Str(env, pfx96);
+    ScopedUtfChars v4Str(env, v4);
+    ScopedUtfChars v6Str(env, v6);
+
+    net::clat::ClatEngineConfig config = {
+            .vnetHdr = (bool)vnetHdr,
+            .packetRing = (bool)packetRing,
+    };
+    if (!getTunFds(env, tunJavaFds, &config.tunFds)) return 0;
+
+    config.readSock6 = netjniutils::GetNativeFileDescriptor(env, readSockJavaFd);
+    if (config.readSock6 < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid read socket");
+        return 0;
+    }
+
+    config.writeSock6 = netjniutils::GetNativeFileDescriptor(env, writeSockJavaFd);
+    if (config.writeSock6 < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid write socket");
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, pfx96Str.c_str(), &config.addrs.pfx96) != 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid prefix %s", pfx96Str.c_str());
+        return 0;
+    }
+    if (inet_pton(AF_INET, v4Str.c_str(), &config.addrs.local4) != 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid IPv4 address %s",
+                             v4Str.c_str());
+        return 0;
+    }
+    if (inet_pton(AF_INET6, v6Str.c_str(), &config.addrs.local6) != 1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid IPv6 address %s",
+                             v6Str.c_str());
+        return 0;
+    }
+
+    int error = 0;
+    std::unique_ptr<net::clat::ClatEngine> engine = net::clat::ClatEngine::start(config, &error);
+    if (engine == nullptr) {
+        throwIOException(env, "start clat engine failed", -error);
+        return 0;
+    }
+    return reinterpret_cast<jlong>(engine.release());
+}
+
+static void com_android_server_connectivity_ClatCoordinator_stopClatEngine(JNIEnv* env,
+                                                                           jobject clazz,
+                                                                           jlong handle) {
+    if (handle == 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid clat engine");
+        return;
+    }
+
+    // Joins the translation thread, which notices the stop request within one epoll wakeup.
+    delete reinterpret_cast<net::clat::ClatEngine*>(handle);
+}
+
+static void com_android_server_connectivity_ClatCoordinator_setClatEngineMtu(JNIEnv* env,
+                                                                             jobject clazz,
+                                                                             jlong handle,
+                                                                             jint mtu) {
+    if (handle == 0 || mtu < 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid clat engine or mtu %d", mtu);
+        return;
+    }
+    reinterpret_cast<net::clat::ClatEngine*>(handle)->setPathMtu(mtu);
+}
+
+static jlong tagSocketAsClat(JNIEnv* env, jobject sockJavaFd) {
     int sockFd = netjniutils::GetNativeFileDescriptor(env, sockJavaFd);
     if (sockFd < 0) {
         jniThrowExceptionFmt(env, "java/io/IOException", "Invalid socket file descriptor");
@@ -461,6 +802,14 @@ static jlong com_android_server_connectivity_ClatCoordinator_tagSocketAsClat(
     return static_cast<jlong>(sock_cookie);
 }
 
+static jlong com_android_server_connectivity_ClatCoordinator_tagSocketAsClat(
+        JNIEnv* env, jobject clazz, jobject sockJavaFd) {
+    net::ScopedLatency latency(net::Metric::CLAT_TAG_SOCKET);
+    const jlong cookie = tagSocketAsClat(env, sockJavaFd);
+    latency.setFailed(env->ExceptionCheck());
+    return cookie;
+}
+
 static void com_android_server_connectivity_ClatCoordinator_untagSocket(JNIEnv* env, jobject clazz,
                                                                         jlong cookie) {
     uint64_t sock_cookie = static_cast<uint64_t>(cookie);
@@ -491,6 +840,89 @@ static void com_android_server_connectivity_ClatCoordinator_untagSocket(JNIEnv*
     return;
 }
 
+static void com_android_server_connectivity_ClatCoordinator_createClatStats(JNIEnv* env,
+                                                                            jobject clazz,
+                                                                            jint v4ifIndex) {
+    base::unique_fd mapFd(bpf::mapRetrieveRW(CLAT_STATS_MAP_PATH));
+    if (mapFd < 0) {
+        throwIOException(env, "failed to open the clat stats map", errno);
+        return;
+    }
+
+    const ClatStatsKey key = static_cast<ClatStatsKey>(v4ifIndex);
+    const std::vector<ClatStatsValue> values = bpf::makePerCpuValues<ClatStatsValue>();
+    if (bpf::writeToMapEntry(mapFd, &key, values.data(), BPF_ANY)) {
+        throwIOException(env, "failed to create clat stats", errno);
+        return;
+    }
+}
+
+static void com_android_server_connectivity_ClatCoordinator_deleteClatStats(JNIEnv* env,
+                                                                            jobject clazz,
+                                                                            jint v4ifIndex) {
+    base::unique_fd mapFd(bpf::mapRetrieveRW(CLAT_STATS_MAP_PATH));
+    if (mapFd < 0) {
+        throwIOException(env, "failed to open the clat stats map", errno);
+        return;
+    }
+
+    const ClatStatsKey key = static_cast<ClatStatsKey>(v4ifIndex);
+    if (bpf::deleteMapEntry(mapFd, &key) && errno != ENOENT) {
+        throwIOException(env, "failed to delete clat stats", errno);
+        return;
+    }
+}
+
+// Returns the clat stats of the given v4-* interface summed over all cpus, laid out as the
+// uint64_t fields of ClatStatsValue in order, with the punt counters last.
+static jlongArray com_android_server_connectivity_ClatCoordinator_getClatStats(JNIEnv* env,
+                                                                              jobject clazz,
+                                                                              jint v4ifIndex) {
+    base::unique_fd mapFd(bpf::mapRetrieveRO(CLAT_STATS_MAP_PATH));
+    if (mapFd < 0) {
+        throwIOException(env, "failed to open the clat stats map", errno);
+        return nullptr;
+    }
+
+    const ClatStatsKey key = static_cast<ClatStatsKey>(v4ifIndex);
+    std::vector<ClatStatsValue> values;
+    if (bpf::findPerCpuMapEntry(mapFd, key, &values)) {
+        throwIOException(env, "failed to read clat stats", errno);
+        return nullptr;
+    }
+
+    ClatStatsValue total = {};
+    for (const ClatStatsValue& v : values) {
+        total.rxPackets += v.rxPackets;
+        total.rxBytes += v.rxBytes;
+        total.rxOverheadBytes += v.rxOverheadBytes;
+        total.txPackets += v.txPackets;
+        total.txBytes += v.txBytes;
+        total.txOverheadBytes += v.txOverheadBytes;
+        for (int i = 0; i < BPF_CLAT_ERR__MAX; i++) {
+            total.punts[i] += v.punts[i];
+        }
+    }
+
+    static_assert(sizeof(ClatStatsValue) % sizeof(uint64_t) == 0);
+    const jsize size = sizeof(ClatStatsValue) / sizeof(uint64_t);
+    jlongArray ret = env->NewLongArray(size);
+    if (ret == nullptr) return nullptr;
+    env->SetLongArrayRegion(ret, 0, size, reinterpret_cast<const jlong*>(&total));
+    return ret;
+}
+
+static jobjectArray com_android_server_connectivity_ClatCoordinator_getClatErrorNames(
+        JNIEnv* env, jobject clazz) {
+    jobjectArray ret = env->NewObjectArray(BPF_CLAT_ERR__MAX, env->FindClass("java/lang/String"),
+                                           nullptr);
+    if (ret == nullptr) return nullptr;
+    for (int i = 0; i < BPF_CLAT_ERR__MAX; i++) {
+        env->SetObjectArrayElement(ret, i, env->NewStringUTF(bpf_clat_errors[i]));
+    }
+    return ret;
+}
+
 /*
  * JNI registration.
  */
@@ -501,17 +933,25 @@ static const JNINativeMethod gMethods[] = {
         {"native_generateIpv6Address",
          "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;I)Ljava/lang/String;",
          (void*)com_android_server_connectivity_ClatCoordinator_generateIpv6Address},
-        {"native_createTunInterface", "(Ljava/lang/String;)I",
+        {"native_createTunInterface", "(Ljava/lang/String;ZZ)I",
          (void*)com_android_server_connectivity_ClatCoordinator_createTunInterface},
         {"native_detectMtu", "(Ljava/lang/String;II)I",
          (void*)com_android_server_connectivity_ClatCoordinator_detectMtu},
+        {"native_getRouteMtu", "(Ljava/lang/String;II)I",
+         (void*)com_android_server_connectivity_ClatCoordinator_getRouteMtu},
+        {"native_openRouteMonitor", "()I",
+         (void*)com_android_server_connectivity_ClatCoordinator_openRouteMonitor},
+        {"native_readRouteMonitor", "(Ljava/io/FileDescriptor;)I",
+         (void*)com_android_server_connectivity_ClatCoordinator_readRouteMonitor},
+        {"native_getNextHopMac", "(Ljava/lang/String;III)Ljava/lang/String;",
+         (void*)com_android_server_connectivity_ClatCoordinator_getNextHopMac},
         {"native_openPacketSocket", "()I",
          (void*)com_android_server_connectivity_ClatCoordinator_openPacketSocket},
         {"native_openRawSocket6", "(I)I",
          (void*)com_android_server_connectivity_ClatCoordinator_openRawSocket6},
         {"native_addAnycastSetsockopt", "(Ljava/io/FileDescriptor;Ljava/lang/String;I)V",
          (void*)com_android_server_connectivity_ClatCoordinator_addAnycastSetsockopt},
-        {"native_configurePacketSocket", "(Ljava/io/FileDescriptor;Ljava/lang/String;I)V",
+        {"native_configurePacketSocket", "(Ljava/io/FileDescriptor;Ljava/lang/String;IZ)V",
          (void*)com_android_server_connectivity_ClatCoordinator_configurePacketSocket},
         {"native_startClatd",
          "(Ljava/io/FileDescriptor;Ljava/io/FileDescriptor;Ljava/io/FileDescriptor;Ljava/lang/"
@@ -520,10 +960,30 @@ static const JNINativeMethod gMethods[] = {
         {"native_stopClatd",
          "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;I)V",
          (void*)com_android_server_connectivity_ClatCoordinator_stopClatd},
+        {"native_signalClatdStop", "(I)I",
+         (void*)com_android_server_connectivity_ClatCoordinator_signalClatdStop},
+        {"native_waitClatdStop", "(Ljava/io/FileDescriptor;II)V",
+         (void*)com_android_server_connectivity_ClatCoordinator_waitClatdStop},
+        {"native_startClatEngine",
+         "([Ljava/io/FileDescriptor;ZLjava/io/FileDescriptor;ZLjava/io/FileDescriptor;Ljava/lang/"
+         "String;Ljava/lang/String;Ljava/lang/String;)J",
+         (void*)com_android_server_connectivity_ClatCoordinator_startClatEngine},
+        {"native_stopClatEngine", "(J)V",
+         (void*)com_android_server_connectivity_ClatCoordinator_stopClatEngine},
+        {"native_setClatEngineMtu", "(JI)V",
+         (void*)com_android_server_connectivity_ClatCoordinator_setClatEngineMtu},
         {"native_tagSocketAsClat", "(Ljava/io/FileDescriptor;)J",
          (void*)com_android_server_connectivity_ClatCoordinator_tagSocketAsClat},
         {"native_untagSocket", "(J)V",
          (void*)com_android_server_connectivity_ClatCoordinator_untagSocket},
+        {"native_createClatStats", "(I)V",
+         (void*)com_android_server_connectivity_ClatCoordinator_createClatStats},
+        {"native_deleteClatStats", "(I)V",
+         (void*)com_android_server_connectivity_ClatCoordinator_deleteClatStats},
+        {"native_getClatStats", "(I)[J",
+         (void*)com_android_server_connectivity_ClatCoordinator_getClatStats},
+        {"native_getClatErrorNames", "()[Ljava/lang/String;",
+         (void*)com_android_server_connectivity_ClatCoordinator_getClatErrorNames},
 };
 
 int register_com_android_server_connectivity_ClatCoordinator(JNIEnv* env) {
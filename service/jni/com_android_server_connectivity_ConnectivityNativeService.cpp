@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ConnectivityNativeServiceJni"
+
+#include <jni.h>
+#include <log/log.h>
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/ScopedPrimitiveArray.h>
+
+#include <vector>
+
+#include "BindPortBlocker.h"
+
+using android::net::BindPortBlocker;
+using android::net::BlockedBindCount;
+using android::netdutils::Status;
+using android::netdutils::StatusOr;
+
+static BindPortBlocker sBindPortBlocker;
+
+namespace android {
+
+static void native_init(JNIEnv* env, jclass clazz) {
+    Status status = sBindPortBlocker.start();
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+        jniThrowErrnoException(env, "BindPortBlocker::start", status.code());
+    }
+}
+
+static jint native_setPortRange(JNIEnv* env, jclass clazz, jint bitmaps, jint first, jint last,
+                                jboolean blocked) {
+    Status status = sBindPortBlocker.setPortRange(bitmaps, first, last, blocked);
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+    }
+    return (jint)status.code();
+}
+
+static jint native_setPorts(JNIEnv* env, jclass clazz, jint bitmaps, jintArray jPorts,
+                            jboolean blocked) {
+    ScopedIntArrayRO ports(env, jPorts);
+    if (ports.get() == nullptr) return EINVAL;
+
+    // Ports are validated by the caller.
+    const std::vector<uint16_t> portList(ports.get(), ports.get() + ports.size());
+    Status status = sBindPortBlocker.setPorts(bitmaps, portList, blocked);
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+    }
+    return (jint)status.code();
+}
+
+static jint native_clear(JNIEnv* env, jclass clazz) {
+    Status status = sBindPortBlocker.clear();
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+    }
+    return (jint)status.code();
+}
+
+// Returns the blocked ports of the given bitmaps, port p being bit (p & 63) of element (p >> 6).
+static jlongArray native_getBitmap(JNIEnv* env, jclass clazz, jint bitmaps) {
+    StatusOr<std::vector<uint64_t>> bitmap = sBindPortBlocker.getBitmap(bitmaps);
+    if (!isOk(bitmap)) {
+        jniThrowErrnoException(env, "BindPortBlocker::getBitmap", bitmap.status().code());
+        return nullptr;
+    }
+
+    const std::vector<uint64_t>& words = bitmap.value();
+    jlongArray ret = env->NewLongArray(words.size());
+    if (ret == nullptr) return nullptr;
+    env->SetLongArrayRegion(ret, 0, words.size(), reinterpret_cast<const jlong*>(words.data()));
+    return ret;
+}
+
+// Returns the denied binds as (uid, port, protocol, count) quadruplets, most denied first.
+static jlongArray native_getBlockedBindCounts(JNIEnv* env, jclass clazz) {
+    StatusOr<std::vector<BlockedBindCount>> counts = sBindPortBlocker.getBlockedBindCounts();
+    if (!isOk(counts)) {
+        jniThrowErrnoException(env, "BindPortBlocker::getBlockedBindCounts",
+                               counts.status().code());
+        return nullptr;
+    }
+
+    std::vector<jlong> values;
+    for (const BlockedBindCount& c : counts.value()) {
+        values.insert(values.end(), {(jlong)c.key.uid, (jlong)c.key.port, (jlong)c.key.protocol,
+                                     (jlong)c.count});
+    }
+    jlongArray ret = env->NewLongArray(values.size());
+    if (ret == nullptr) return nullptr;
+    env->SetLongArrayRegion(ret, 0, values.size(), values.data());
+    return ret;
+}
+
+/*
+ * JNI registration.
+ */
+// clang-format off
+static const JNINativeMethod gMethods[] = {
+    /* name, signature, funcPtr */
+    {"native_init", "()V",
+    (void*)native_init},
+    {"native_setPortRange", "(IIIZ)I",
+    (void*)native_setPortRange},
+    {"native_setPorts", "(I[IZ)I",
+    (void*)native_setPorts},
+    {"native_clear", "()I",
+    (void*)native_clear},
+    {"native_getBitmap", "(I)[J",
+    (void*)native_getBitmap},
+    {"native_getBlockedBindCounts", "()[J",
+    (void*)native_getBlockedBindCounts},
+};
+// clang-format on
+
+int register_com_android_server_connectivity_ConnectivityNativeService(JNIEnv* env) {
+    return jniRegisterNativeMethods(env,
+    "com/android/server/connectivity/ConnectivityNativeService",
+    gMethods, NELEM(gMethods));
+}
+
+}; // namespace android
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DscpPolicyTrackerJni"
+
+#include <jni.h>
+#include <log/log.h>
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/ScopedPrimitiveArray.h>
+#include <string.h>
+
+#include "DscpPolicyManager.h"
+
+using android::net::DscpPolicyManager;
+using android::net::DscpPolicySet;
+using android::netdutils::Status;
+using android::netdutils::StatusOr;
+
+static DscpPolicyManager sDscpPolicyManager;
+
+namespace android {
+
+static void native_init(JNIEnv* env, jclass clazz) {
+    Status status = sDscpPolicyManager.start();
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+        jniThrowErrnoException(env, "DscpPolicyManager::start", status.code());
+    }
+}
+
+// Policies are passed as the DscpPolicyValue structs laid out back to back, with their priorities
+// in the same order.
+static bool toPolicySet(JNIEnv* env, jintArray jPriorities, jbyteArray jPolicies,
+                        DscpPolicySet* policies) {
+    ScopedIntArrayRO priorities(env, jPriorities);
+    ScopedByteArrayRO bytes(env, jPolicies);
+    if (priorities.get() == nullptr || bytes.get() == nullptr) return false;
+    if (bytes.size() != priorities.size() * sizeof(DscpPolicy)) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                             "%zu bytes of policies for %zu priorities", bytes.size(),
+                             priorities.size());
+        return false;
+    }
+
+    for (size_t i = 0; i < priorities.size(); i++) {
+        DscpPolicy policy;
+        memcpy(&policy, bytes.get() + i * sizeof(DscpPolicy), sizeof(DscpPolicy));
+        (*policies)[static_cast<uint32_t>(priorities[i])] = policy;
+    }
+    return true;
+}
+
+static jint native_setPolicies(JNIEnv* env, jclass clazz, jintArray ipv4Priorities,
+                               jbyteArray ipv4Policies, jintArray ipv6Priorities,
+                               jbyteArray ipv6Policies) {
+    DscpPolicySet ipv4;
+    DscpPolicySet ipv6;
+    if (!toPolicySet(env, ipv4Priorities, ipv4Policies, &ipv4) ||
+        !toPolicySet(env, ipv6Priorities, ipv6Policies, &ipv6)) {
+        return -1;
+    }
+
+    Status status = sDscpPolicyManager.setPolicies(ipv4, ipv6);
+    if (!isOk(status)) {
+        ALOGE("%s failed: %s", __func__, status.msg().c_str());
+    }
+    return (jint)status.code();
+}
+
+// Returns the packets and bytes matched by the policy of the given priority, and how many of
+// those packets were rewritten.
+static jlongArray native_getPolicyStats(JNIEnv* env, jclass clazz, jint priority) {
+    StatusOr<DscpPolicyStats> stats = sDscpPolicyManager.getPolicyStats(priority);
+    if (!isOk(stats)) {
+        jniThrowErrnoException(env, "DscpPolicyManager::getPolicyStats",
+                               stats.status().code());
+        return nullptr;
+    }
+
+    const jlong values[] = {(jlong)stats.value().packets, (jlong)stats.value().bytes,
+                            (jlong)stats.value().rewrittenPackets};
+    jlongArray ret = env->NewLongArray(NELEM(values));
+    if (ret == nullptr) return nullptr;
+    env->SetLongArrayRegion(ret, 0, NELEM(values), values);
+    return ret;
+}
+
+/*
+ * JNI registration.
+ */
+// clang-format off
+static const JNINativeMethod gMethods[] = {
+    /* name, signature, funcPtr */
+    {"native_init", "()V",
+    (void*)native_init},
+    {"native_setPolicies", "([I[B[I[B)I",
+    (void*)native_setPolicies},
+    {"native_getPolicyStats", "(I)[J",
+    (void*)native_getPolicyStats},
+};
+// clang-format on
+
+int register_com_android_server_connectivity_DscpPolicyTracker(JNIEnv* env) {
+    return jniRegisterNativeMethods(env,
+    "com/android/server/connectivity/DscpPolicyTracker",
+    gMethods, NELEM(gMethods));
+}
+
+}; // namespace android
@@ -23,6 +23,8 @@ namespace android {
 
 int register_com_android_server_TestNetworkService(JNIEnv* env);
 int register_com_android_server_connectivity_ClatCoordinator(JNIEnv* env);
+int register_com_android_server_connectivity_ConnectivityNativeService(JNIEnv* env);
+int register_com_android_server_connectivity_DscpPolicyTracker(JNIEnv* env);
 int register_com_android_server_BpfNetMaps(JNIEnv* env);
 int register_android_server_net_NetworkStatsFactory(JNIEnv* env);
 int register_android_server_net_NetworkStatsService(JNIEnv* env);
@@ -46,6 +48,14 @@ extern "C" jint JNI_OnLoad(JavaVM* vm, void*) {
         return JNI_ERR;
     }
 
+    if (register_com_android_server_connectivity_DscpPolicyTracker(env) < 0) {
+        return JNI_ERR;
+    }
+
+    if (register_com_android_server_connectivity_ConnectivityNativeService(env) < 0) {
+        return JNI_ERR;
+    }
+
     if (android::modules::sdklevel::IsAtLeastT()) {
         if (register_android_server_net_NetworkStatsFactory(env) < 0) {
             return JNI_ERR;
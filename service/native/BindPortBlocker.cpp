@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "BindPortBlocker"
+
+#include "BindPortBlocker.h"
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/unique_fd.h>
+#include <log/log.h>
+
+#include "BpfPerCpu.h"
+
+namespace android {
+namespace net {
+
+using netdutils::Status;
+using netdutils::statusFromErrno;
+using netdutils::StatusOr;
+
+static uint64_t toPtr(const void* p) {
+    return reinterpret_cast<uintptr_t>(p);
+}
+
+void BindPortBlocker::applyPorts(uint32_t bitmaps, uint16_t first, uint16_t last, bool blocked,
+                                 BlockedPorts* words) {
+    for (int bitmap = 0; bitmap < BLOCKED_PORTS_BITMAPS; bitmap++) {
+        if (!(bitmaps & (1 << bitmap))) continue;
+        uint64_t* const base = words->data() + bitmap * BLOCKED_PORTS_WORDS;
+        for (uint32_t word = first >> 6; word <= static_cast<uint32_t>(last >> 6); word++) {
+            // The bits of [first, last] that fall within this word.
+            const uint32_t lo = (word == static_cast<uint32_t>(first >> 6)) ? (first & 63) : 0;
+            const uint32_t hi = (word == static_cast<uint32_t>(last >> 6)) ? (last & 63) : 63;
+            const uint64_t mask = (~0ULL >> (63 - hi)) & (~0ULL << lo);
+            if (blocked) {
+                base[word] |= mask;
+            } else {
+                base[word] &= ~mask;
+            }
+        }
+    }
+}
+
+std::pair<std::vector<uint32_t>, std::vector<uint64_t>> BindPortBlocker::diffWords(
+        const BlockedPorts& before, const BlockedPorts& after) {
+    std::pair<std::vector<uint32_t>, std::vector<uint64_t>> changed;
+    for (uint32_t key = 0; key < after.size(); key++) {
+        if (key < before.size() && before[key] == after[key]) continue;
+        changed.first.push_back(key);
+        changed.second.push_back(after[key]);
+    }
+    return changed;
+}
+
+Status BindPortBlocker::start() {
+    std::lock_guard guard(mMutex);
+    RETURN_IF_NOT_OK(mBlockedPortsMap.init(BLOCKED_PORTS_MAP_PATH));
+    mStatsMapFd.reset(bpf::mapRetrieveRW(BLOCKED_BIND_STATS_MAP_PATH));
+    if (mStatsMapFd < 0) {
+        return statusFromErrno(errno, "failed to open the blocked bind stats map");
+    }
+    return netdutils::status::ok;
+}
+
+StatusOr<BlockedPorts> BindPortBlocker::readAll() {
+    BlockedPorts words(BLOCKED_PORTS_MAP_SIZE);
+    if (mBatchSupported) {
+        std::vector<uint32_t> keys(BLOCKED_PORTS_MAP_SIZE);
+        std::vector<uint64_t> values(BLOCKED_PORTS_MAP_SIZE);
+        uint32_t inBatch = 0;
+        uint32_t outBatch = 0;
+        size_t done = 0;
+        while (done < BLOCKED_PORTS_MAP_SIZE) {
+            bpf_attr attr = {};
+            attr.batch.map_fd = mBlockedPortsMap.getMap().get();
+            attr.batch.in_batch = done ? toPtr(&inBatch) : 0;
+            attr.batch.out_batch = toPtr(&outBatch);
+            attr.batch.keys = toPtr(&keys[done]);
+            attr.batch.values = toPtr(&values[done]);
+            attr.batch.count = BLOCKED_PORTS_MAP_SIZE - done;
+            const int ret = syscall(__NR_bpf, BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+            if (ret && errno == EINVAL && done == 0) {
+                // Array maps only support batch operations since 5.6, block.c needs 5.4.
+                ALOGI("Batch operations not supported, falling back to per word updates");
+                mBatchSupported = false;
+                break;
+            }
+            if (ret && errno != ENOENT) {
+                return statusFromErrno(errno, "BPF_MAP_LOOKUP_BATCH failed");
+            }
+            done += attr.batch.count;
+            // ENOENT means there are no more entries after the ones just returned.
+            if (ret || attr.batch.count == 0) break;
+            inBatch = outBatch;
+        }
+        if (mBatchSupported) {
+            for (size_t i = 0; i < done; i++) {
+                if (keys[i] < words.size()) words[keys[i]] = values[i];
+            }
+            return words;
+        }
+    }
+
+    for (uint32_t key = 0; key < BLOCKED_PORTS_MAP_SIZE; key++) {
+        auto value = mBlockedPortsMap.readValue(key);
+        if (!value.ok()) {
+            return statusFromErrno(value.error().code(), "failed to read blocked ports word " +
+                                                                 std::to_string(key));
+        }
+        words[key] = value.value();
+    }
+    return words;
+}
+
+Status BindPortBlocker::writeChanged(const BlockedPorts& before, const BlockedPorts& after) {
+    const auto [keys, values] = diffWords(before, after);
+    if (keys.empty()) return netdutils::status::ok;
+
+    if (mBatchSupported) {
+        bpf_attr attr = {};
+        attr.batch.map_fd = mBlockedPortsMap.getMap().get();
+        attr.batch.keys = toPtr(keys.data());
+        attr.batch.values = toPtr(values.data());
+        attr.batch.count = keys.size();
+        attr.batch.elem_flags = BPF_ANY;
+        if (syscall(__NR_bpf, BPF_MAP_UPDATE_BATCH, &attr, sizeof(attr))) {
+            return statusFromErrno(errno, "BPF_MAP_UPDATE_BATCH failed after " +
+                                                  std::to_string(attr.batch.count) + " words");
+        }
+        return netdutils::status::ok;
+    }
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        RETURN_IF_NOT_OK(mBlockedPortsMap.writeValue(keys[i], values[i], BPF_ANY));
+    }
+    return netdutils::status::ok;
+}
+
+Status BindPortBlocker::setPortRange(uint32_t bitmaps, uint16_t first, uint16_t last,
+                                     bool blocked) {
+    if (first > last || (bitmaps & ~BLOCK_ALL)) {
+        return statusFromErrno(EINVAL, "invalid port range " + std::to_string(first) + "-" +
+                                               std::to_string(last));
+    }
+    std::lock_guard guard(mMutex);
+    ASSIGN_OR_RETURN(const BlockedPorts before, readAll());
+    BlockedPorts after = before;
+    applyPorts(bitmaps, first, last, blocked, &after);
+    return writeChanged(before, after);
+}
+
+Status BindPortBlocker::setPorts(uint32_t bitmaps, const std::vector<uint16_t>& ports,
+                                 bool blocked) {
+    if (bitmaps & ~BLOCK_ALL) {
+        return statusFromErrno(EINVAL, "invalid bitmaps " + std::to_string(bitmaps));
+    }
+    std::lock_guard guard(mMutex);
+    ASSIGN_OR_RETURN(const BlockedPorts before, readAll());
+    BlockedPorts after = before;
+    for (uint16_t port : ports) {
+        applyPorts(bitmaps, port, port, blocked, &after);
+    }
+    return writeChanged(before, after);
+}
+
+Status BindPortBlocker::clear() {
+    std::lock_guard guard(mMutex);
+    ASSIGN_OR_RETURN(const BlockedPorts before, readAll());
+    return writeChanged(before, BlockedPorts(BLOCKED_PORTS_MAP_SIZE));
+}
+
+StatusOr<std::vector<uint64_t>> BindPortBlocker::getBitmap(uint32_t bitmaps) {
+    if (bitmaps & ~BLOCK_ALL) {
+        return statusFromErrno(EINVAL, "invalid bitmaps " + std::to_string(bitmaps));
+    }
+    std::lock_guard guard(mMutex);
+    ASSIGN_OR_RETURN(const BlockedPorts words, readAll());
+    std::vector<uint64_t> bitmap(BLOCKED_PORTS_WORDS);
+    for (int b = 0; b < BLOCKED_PORTS_BITMAPS; b++) {
+        if (!(bitmaps & (1 << b))) continue;
+        for (size_t i = 0; i < BLOCKED_PORTS_WORDS; i++) {
+            bitmap[i] |= words[b * BLOCKED_PORTS_WORDS + i];
+        }
+    }
+    return bitmap;
+}
+
+StatusOr<std::vector<BlockedBindCount>> BindPortBlocker::getBlockedBindCounts() {
+    std::lock_guard guard(mMutex);
+    // The stats map is per cpu.
+    std::vector<uint64_t> values;
+
+    std::vector<BlockedBindCount> counts;
+    BlockedBindKey key;
+    BlockedBindKey next;
+    int ret = bpf::getFirstMapKey(mStatsMapFd, &next);
+    while (ret == 0) {
+        key = next;
+        if (bpf::findPerCpuMapEntry(mStatsMapFd, key, &values) == 0) {
+            BlockedBindCount count = {.key = key, .count = 0};
+            for (uint64_t v : values) count.count += v;
+            counts.push_back(count);
+        } else if (errno != ENOENT) {
+            // ENOENT means the entry was just evicted by a more recent denial.
+            return statusFromErrno(errno, "failed to read blocked bind stats");
+        }
+        ret = bpf::getNextMapKey(mStatsMapFd, &key, &next);
+    }
+    if (errno != ENOENT) {
+        return statusFromErrno(errno, "failed to iterate blocked bind stats");
+    }
+
+    std::sort(counts.begin(), counts.end(),
+              [](const BlockedBindCount& a, const BlockedBindCount& b) {
+                  return a.count > b.count;
+              });
+    return counts;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * BindPortBlockerTest.cpp - unit tests for BindPortBlocker.cpp
+ */
+
+#include <gtest/gtest.h>
+
+#include "BindPortBlocker.h"
+
+namespace android {
+namespace net {
+
+static bool isSet(const BlockedPorts& words, BlockedPortsBitmap bitmap, uint16_t port) {
+    return (words[bitmap * BLOCKED_PORTS_WORDS + (port >> 6)] >> (port & 63)) & 1;
+}
+
+TEST(BindPortBlockerTest, ApplyRangeWithinOneWord) {
+    BlockedPorts words(BLOCKED_PORTS_MAP_SIZE);
+    BindPortBlocker::applyPorts(BLOCK_TCP, 130, 140, true, &words);
+    EXPECT_EQ(0x7ffULL << 2, words[2]);
+    EXPECT_EQ(0U, words[BLOCKED_PORTS_WORDS + 2]);
+}
+
+TEST(BindPortBlockerTest, ApplyRangeAcrossWords) {
+    BlockedPorts words(BLOCKED_PORTS_MAP_SIZE);
+    BindPortBlocker::applyPorts(BLOCK_ALL, 60, 200, true, &words);
+    for (BlockedPortsBitmap bitmap : {BLOCKED_PORTS_TCP, BLOCKED_PORTS_UDP}) {
+        EXPECT_FALSE(isSet(words, bitmap, 59));
+        EXPECT_TRUE(isSet(words, bitmap, 60));
+        EXPECT_EQ(~0ULL, words[bitmap * BLOCKED_PORTS_WORDS + 1]);
+        EXPECT_EQ(~0ULL, words[bitmap * BLOCKED_PORTS_WORDS + 2]);
+        EXPECT_TRUE(isSet(words, bitmap, 200));
+        EXPECT_FALSE(isSet(words, bitmap, 201));
+    }
+
+    BindPortBlocker::applyPorts(BLOCK_UDP, 0, 65535, false, &words);
+    EXPECT_TRUE(isSet(words, BLOCKED_PORTS_TCP, 100));
+    for (size_t i = 0; i < BLOCKED_PORTS_WORDS; i++) {
+        EXPECT_EQ(0U, words[BLOCKED_PORTS_WORDS + i]);
+    }
+}
+
+TEST(BindPortBlockerTest, ApplyHighestPort) {
+    BlockedPorts words(BLOCKED_PORTS_MAP_SIZE);
+    BindPortBlocker::applyPorts(BLOCK_UDP, 65535, 65535, true, &words);
+    EXPECT_EQ(1ULL << 63, words[BLOCKED_PORTS_MAP_SIZE - 1]);
+}
+
+TEST(BindPortBlockerTest, DiffWords) {
+    BlockedPorts before(BLOCKED_PORTS_MAP_SIZE);
+    before[3] = 1;
+    BlockedPorts after = before;
+    EXPECT_TRUE(BindPortBlocker::diffWords(before, after).first.empty());
+
+    BindPortBlocker::applyPorts(BLOCK_ALL, 192, 192, true, &after);
+    const auto [keys, values] = BindPortBlocker::diffWords(before, after);
+    ASSERT_EQ(1U, keys.size());
+    EXPECT_EQ(BLOCKED_PORTS_WORDS + 3U, keys[0]);
+    EXPECT_EQ(1U, values[0]);
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ConnectivityMetrics"
+
+#include "ConnectivityMetrics.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+namespace android {
+namespace net {
+
+using netdutils::DumpWriter;
+using netdutils::ScopedIndent;
+
+static const char* const kMetricNames[] = {
+        "swapActiveStatsMap",      "replaceUidOwnerMap", "parseBpfNetworkStatsDetail",
+        "parseBpfNetworkStatsDev", "clatTagSocket",      "clatStart",
+        "clatStop",
+};
+static_assert(sizeof(kMetricNames) / sizeof(kMetricNames[0]) ==
+              static_cast<size_t>(Metric::COUNT));
+
+std::array<LatencyHistogram, static_cast<size_t>(Metric::COUNT)> ConnectivityMetrics::sHistograms;
+
+int LatencyHistogram::bucketOf(uint64_t latencyUs) {
+    if (latencyUs < SUB_BUCKETS) return latencyUs;
+    const int power = 63 - __builtin_clzll(latencyUs);
+    const int sub = (latencyUs >> (power - SUB_BUCKETS_BITS)) & (SUB_BUCKETS - 1);
+    return std::min((power - SUB_BUCKETS_BITS + 1) * SUB_BUCKETS + sub, NUM_BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::bucketLowerBoundUs(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    const int power = bucket / SUB_BUCKETS + SUB_BUCKETS_BITS - 1;
+    const uint64_t sub = bucket % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (power - SUB_BUCKETS_BITS);
+}
+
+void LatencyHistogram::record(uint64_t latencyUs, bool failed) {
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    if (failed) mFailures.fetch_add(1, std::memory_order_relaxed);
+    mTotalUs.fetch_add(latencyUs, std::memory_order_relaxed);
+    mBuckets[bucketOf(latencyUs)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = mMaxUs.load(std::memory_order_relaxed);
+    while (latencyUs > max &&
+           !mMaxUs.compare_exchange_weak(max, latencyUs, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t LatencyHistogram::percentileUs(double percentile) const {
+    // Buckets are read one by one, so sum them rather than trusting mCount.
+    std::array<uint64_t, NUM_BUCKETS> buckets;
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        buckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+        total += buckets[i];
+    }
+    if (total == 0) return 0;
+
+    const uint64_t rank = std::max<uint64_t>(1, total * percentile / 100);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return bucketLowerBoundUs(i);
+    }
+    return bucketLowerBoundUs(NUM_BUCKETS - 1);
+}
+
+void ConnectivityMetrics::record(Metric metric, uint64_t latencyUs, bool failed) {
+    sHistograms[static_cast<size_t>(metric)].record(latencyUs, failed);
+}
+
+const LatencyHistogram& ConnectivityMetrics::get(Metric metric) {
+    return sHistograms[static_cast<size_t>(metric)];
+}
+
+std::vector<int64_t> ConnectivityMetrics::snapshot() {
+    std::vector<int64_t> values;
+    values.reserve(sHistograms.size() * SNAPSHOT_FIELDS);
+    for (const LatencyHistogram& h : sHistograms) {
+        values.insert(values.end(),
+                      {(int64_t)h.count(), (int64_t)h.failures(), (int64_t)h.totalUs(),
+                       (int64_t)h.maxUs(), (int64_t)h.percentileUs(50),
+                       (int64_t)h.percentileUs(99)});
+    }
+    return values;
+}
+
+void ConnectivityMetrics::dump(DumpWriter& dw) {
+    dw.blankline();
+    dw.println("Native metrics (latencies in us):");
+    ScopedIndent indent(dw);
+    dw.println("name count failures avg p50 p90 p99 max");
+    for (size_t i = 0; i < sHistograms.size(); i++) {
+        const LatencyHistogram& h = sHistograms[i];
+        const uint64_t count = h.count();
+        dw.println("%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                   " %" PRIu64,
+                   kMetricNames[i], count, h.failures(), count ? h.totalUs() / count : 0,
+                   h.percentileUs(50), h.percentileUs(90), h.percentileUs(99), h.maxUs());
+    }
+}
+
+}  // namespace net
+}  // namespace android
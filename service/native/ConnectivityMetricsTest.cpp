@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * ConnectivityMetricsTest.cpp - unit tests for ConnectivityMetrics.cpp
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "ConnectivityMetrics.h"
+
+namespace android {
+namespace net {
+
+TEST(ConnectivityMetricsTest, Buckets) {
+    for (uint64_t us = 0; us < 4; us++) {
+        EXPECT_EQ((int)us, LatencyHistogram::bucketOf(us));
+    }
+    // Each bucket holds the latencies from its lower bound to the next one's.
+    for (int b = 0; b < LatencyHistogram::NUM_BUCKETS - 1; b++) {
+        const uint64_t lo = LatencyHistogram::bucketLowerBoundUs(b);
+        const uint64_t next = LatencyHistogram::bucketLowerBoundUs(b + 1);
+        ASSERT_LT(lo, next);
+        EXPECT_EQ(b, LatencyHistogram::bucketOf(lo));
+        EXPECT_EQ(b, LatencyHistogram::bucketOf(next - 1));
+        // Log-linear: a bucket is at most a quarter of its lower bound wide.
+        if (b >= LatencyHistogram::SUB_BUCKETS) {
+            EXPECT_LE(next - lo, lo / 4);
+        }
+    }
+    EXPECT_EQ(LatencyHistogram::NUM_BUCKETS - 1, LatencyHistogram::bucketOf(UINT64_MAX));
+}
+
+TEST(ConnectivityMetricsTest, Record) {
+    LatencyHistogram h;
+    EXPECT_EQ(0U, h.percentileUs(50));
+    for (uint64_t us = 1; us <= 100; us++) {
+        h.record(us, us % 10 == 0);
+    }
+    EXPECT_EQ(100U, h.count());
+    EXPECT_EQ(10U, h.failures());
+    EXPECT_EQ(5050U, h.totalUs());
+    EXPECT_EQ(100U, h.maxUs());
+    // The 50th latency is 50us, in the [48, 56) bucket.
+    EXPECT_EQ(48U, h.percentileUs(50));
+    EXPECT_EQ(96U, h.percentileUs(99));
+}
+
+TEST(ConnectivityMetricsTest, ConcurrentRecord) {
+    LatencyHistogram h;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&h, t] {
+            for (int i = 0; i < 1000; i++) h.record(t * 1000 + i, false);
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    EXPECT_EQ(4000U, h.count());
+    EXPECT_EQ(3999U, h.maxUs());
+}
+
+TEST(ConnectivityMetricsTest, Snapshot) {
+    const std::vector<int64_t> before = ConnectivityMetrics::snapshot();
+    ASSERT_EQ(static_cast<size_t>(Metric::COUNT) * ConnectivityMetrics::SNAPSHOT_FIELDS,
+              before.size());
+    {
+        ScopedLatency latency(Metric::CLAT_START);
+        latency.setFailed();
+    }
+    const std::vector<int64_t> after = ConnectivityMetrics::snapshot();
+    const size_t base =
+            static_cast<size_t>(Metric::CLAT_START) * ConnectivityMetrics::SNAPSHOT_FIELDS;
+    EXPECT_EQ(before[base] + 1, after[base]);
+    EXPECT_EQ(before[base + 1] + 1, after[base + 1]);
+    EXPECT_EQ(1U, ConnectivityMetrics::get(Metric::CLAT_START).count());
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DscpPolicyManager"
+
+#include "DscpPolicyManager.h"
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+
+#include <android-base/unique_fd.h>
+#include <log/log.h>
+
+#include "BpfPerCpu.h"
+
+namespace android {
+namespace net {
+
+using base::unique_fd;
+using bpf::BpfMap;
+using bpf::synchronizeKernelRCU;
+using netdutils::Status;
+using netdutils::statusFromErrno;
+using netdutils::StatusOr;
+
+static constexpr uint8_t ALL_FIELDS = SRC_IP_MASK_FLAG | DST_IP_MASK_FLAG | SRC_PORT_MASK_FLAG |
+                                      DST_PORT_MASK_FLAG | PROTO_MASK_FLAG;
+
+// Number of keys deleted per BPF_MAP_DELETE_BATCH call.
+static constexpr size_t DELETE_BATCH_SIZE = 256;
+
+static bool isV4Mapped(const in6_addr& addr) {
+    return IN6_IS_ADDR_V4MAPPED(&addr);
+}
+
+static Status validatePolicy(uint32_t priority, const DscpPolicy& policy, bool ipv4) {
+    if (priority >= MAX_POLICIES) {
+        return statusFromErrno(EINVAL, "invalid priority " + std::to_string(priority));
+    }
+    if (policy.ifindex == 0 || policy.dscpVal > 63 || (policy.presentFields & ~ALL_FIELDS)) {
+        return statusFromErrno(EINVAL, "invalid policy " + std::to_string(priority));
+    }
+    if ((policy.presentFields & DST_PORT_MASK_FLAG) &&
+        ntohs(policy.dstPortStart) > ntohs(policy.dstPortEnd)) {
+        return statusFromErrno(EINVAL, "invalid port range in policy " + std::to_string(priority));
+    }
+    if (((policy.presentFields & SRC_IP_MASK_FLAG) && isV4Mapped(policy.srcIp) != ipv4) ||
+        ((policy.presentFields & DST_IP_MASK_FLAG) && isV4Mapped(policy.dstIp) != ipv4)) {
+        return statusFromErrno(EINVAL,
+                               "wrong address family in policy " + std::to_string(priority));
+    }
+    return netdutils::status::ok;
+}
+
+static int countFields(uint8_t mask) {
+    return __builtin_popcount(mask);
+}
+
+uint16_t DscpPolicyManager::findPortRange(const DscpPortRanges& ranges, uint16_t port) {
+    const uint32_t count = std::min<uint32_t>(ranges.count, MAX_PORT_BOUNDS);
+    const auto it = std::upper_bound(ranges.bounds, ranges.bounds + count, port,
+                                     [](uint16_t p, __be16 bound) { return p < ntohs(bound); });
+    return it - ranges.bounds;
+}
+
+static Status buildTuples(const DscpPolicySet& policies, const DscpPortRanges& ranges,
+                          uint8_t slot, DscpTuples* tuples) {
+    // Policies are iterated by increasing priority, so the first policy to claim a key wins.
+    for (const auto& [priority, policy] : policies) {
+        const uint8_t mask = policy.presentFields;
+        if (mask == 0) continue;
+
+        const bool hasDstPort = mask & DST_PORT_MASK_FLAG;
+        const uint16_t first =
+                hasDstPort ? DscpPolicyManager::findPortRange(ranges, ntohs(policy.dstPortStart))
+                           : 0;
+        const uint16_t last =
+                hasDstPort ? DscpPolicyManager::findPortRange(ranges, ntohs(policy.dstPortEnd))
+                           : 0;
+        for (uint32_t range = first; range <= last; range++) {
+            DscpTupleKey key = {};
+            key.ifindex = policy.ifindex;
+            key.mask = mask;
+            key.proto = (mask & PROTO_MASK_FLAG) ? policy.proto : 0;
+            key.srcPort = (mask & SRC_PORT_MASK_FLAG) ? policy.srcPort : 0;
+            key.dstPortRange = range;
+            key.slot = slot;
+            if (mask & SRC_IP_MASK_FLAG) key.srcIp = policy.srcIp;
+            if (mask & DST_IP_MASK_FLAG) key.dstIp = policy.dstIp;
+
+            DscpTupleValue value = {};
+            value.priority = priority;
+            value.dscpVal = policy.dscpVal;
+            tuples->emplace(key, value);
+        }
+        if (tuples->size() > MAX_DSCP_TUPLES) {
+            return statusFromErrno(E2BIG, "too many tuples: " + std::to_string(tuples->size()));
+        }
+    }
+    return netdutils::status::ok;
+}
+
+StatusOr<DscpClassifier> DscpPolicyManager::buildClassifier(const DscpPolicySet& ipv4Policies,
+                                                            const DscpPolicySet& ipv6Policies,
+                                                            uint8_t slot) {
+    // Most specific masks first, and equally specific ones by value to keep the order stable.
+    const auto moreSpecific = [](uint8_t a, uint8_t b) {
+        return countFields(a) != countFields(b) ? countFields(a) > countFields(b) : a < b;
+    };
+    std::set<uint8_t, decltype(moreSpecific)> masks(moreSpecific);
+    std::set<uint32_t> bounds;
+    for (const auto* policies : {&ipv4Policies, &ipv6Policies}) {
+        const bool ipv4 = policies == &ipv4Policies;
+        for (const auto& [priority, policy] : *policies) {
+            RETURN_IF_NOT_OK(validatePolicy(priority, policy, ipv4));
+            if (policy.presentFields == 0) continue;
+            masks.insert(policy.presentFields);
+            if (!(policy.presentFields & DST_PORT_MASK_FLAG)) continue;
+            bounds.insert(ntohs(policy.dstPortStart));
+            if (ntohs(policy.dstPortEnd) < 0xffff) bounds.insert(ntohs(policy.dstPortEnd) + 1);
+        }
+    }
+    if (bounds.size() > MAX_PORT_BOUNDS) {
+        return statusFromErrno(E2BIG, "too many port range bounds: " +
+                                              std::to_string(bounds.size()));
+    }
+
+    DscpClassifier classifier = {};
+    // There are fewer combinations of the five fields than MAX_TUPLE_MASKS.
+    for (uint8_t mask : masks) {
+        classifier.masks.masks[classifier.masks.count++] = mask;
+    }
+    for (uint32_t bound : bounds) {
+        classifier.portRanges.bounds[classifier.portRanges.count++] = htons(bound);
+    }
+    RETURN_IF_NOT_OK(
+            buildTuples(ipv4Policies, classifier.portRanges, slot, &classifier.ipv4Tuples));
+    RETURN_IF_NOT_OK(
+            buildTuples(ipv6Policies, classifier.portRanges, slot, &classifier.ipv6Tuples));
+    return classifier;
+}
+
+// Deletes the given keys with BPF_MAP_DELETE_BATCH. Keys that are already gone, e.g. evicted from
+// an LRU map, are skipped.
+template <class Key>
+static Status deleteInBatches(const unique_fd& mapFd, const std::vector<Key>& keys) {
+    size_t done = 0;
+    while (done < keys.size()) {
+        bpf_attr attr = {};
+        attr.batch.map_fd = mapFd.get();
+        attr.batch.keys = reinterpret_cast<uintptr_t>(&keys[done]);
+        attr.batch.count = std::min(DELETE_BATCH_SIZE, keys.size() - done);
+        if (syscall(__NR_bpf, BPF_MAP_DELETE_BATCH, &attr, sizeof(attr)) == 0) {
+            done += attr.batch.count;
+        } else if (errno == ENOENT) {
+            // The kernel stops at the missing key, and reports how many were deleted before it.
+            done += attr.batch.count + 1;
+        } else {
+            return statusFromErrno(errno, "BPF_MAP_DELETE_BATCH failed");
+        }
+    }
+    return netdutils::status::ok;
+}
+
+DscpPolicyManager::~DscpPolicyManager() {
+    {
+        std::lock_guard guard(mCleanupMutex);
+        mStopCleanup = true;
+    }
+    mCleanupCv.notify_all();
+    if (mCleanupThread.joinable()) mCleanupThread.join();
+}
+
+Status DscpPolicyManager::start() {
+    {
+        std::lock_guard guard(mMutex);
+        if (mCleanupThread.joinable()) return statusFromErrno(EALREADY, "already started");
+        RETURN_IF_NOT_OK(mIpv4TuplesMap.init(DSCP_POLICY_MAP_PATH("ipv4_dscp_tuples")));
+        RETURN_IF_NOT_OK(mIpv6TuplesMap.init(DSCP_POLICY_MAP_PATH("ipv6_dscp_tuples")));
+        RETURN_IF_NOT_OK(mTupleMasksMap.init(DSCP_POLICY_MAP_PATH("dscp_tuple_masks")));
+        RETURN_IF_NOT_OK(mPortRangesMap.init(DSCP_POLICY_MAP_PATH("dscp_port_ranges")));
+        RETURN_IF_NOT_OK(mGenerationMap.init(DSCP_POLICY_MAP_PATH("policy_generation")));
+        RETURN_IF_NOT_OK(mIpv4SocketMap.init(DSCP_POLICY_MAP_PATH("ipv4_socket_to_policies")));
+        RETURN_IF_NOT_OK(mIpv6SocketMap.init(DSCP_POLICY_MAP_PATH("ipv6_socket_to_policies")));
+        mStatsMapFd.reset(bpf::mapRetrieveRW(DSCP_POLICY_MAP_PATH("dscp_policy_stats")));
+        if (mStatsMapFd < 0) {
+            return statusFromErrno(errno, "failed to open the DSCP policy stats map");
+        }
+
+        // No program still uses the inactive slot written by a previous system server.
+        auto generation = mGenerationMap.readValue(0);
+        if (!generation.ok()) {
+            return statusFromErrno(generation.error().code(),
+                                   "failed to read the policy generation");
+        }
+        {
+            std::lock_guard cleanupGuard(mCleanupMutex);
+            mActiveGeneration = mSyncedGeneration = generation.value();
+        }
+        mCleanupThread = std::thread(&DscpPolicyManager::runCleanup, this);
+    }
+    // The maps outlive the system server, start from an empty policy set like its callers.
+    return setPolicies({}, {});
+}
+
+Status DscpPolicyManager::clearSlot(uint8_t slot) {
+    for (auto* map : {&mIpv4TuplesMap, &mIpv6TuplesMap}) {
+        std::vector<DscpTupleKey> keys;
+        const auto getSlotKeys = [&keys, slot](const DscpTupleKey& key,
+                                               const BpfMap<DscpTupleKey, DscpTupleValue>&) {
+            if (key.slot == slot) keys.push_back(key);
+            return base::Result<void>();
+        };
+        RETURN_IF_NOT_OK(map->iterate(getSlotKeys));
+        RETURN_IF_NOT_OK(deleteInBatches(map->getMap(), keys));
+    }
+    return netdutils::status::ok;
+}
+
+Status DscpPolicyManager::writeSlot(const DscpClassifier& classifier, uint8_t slot) {
+    for (const auto& [key, value] : classifier.ipv4Tuples) {
+        RETURN_IF_NOT_OK(mIpv4TuplesMap.writeValue(key, value, BPF_ANY));
+    }
+    for (const auto& [key, value] : classifier.ipv6Tuples) {
+        RETURN_IF_NOT_OK(mIpv6TuplesMap.writeValue(key, value, BPF_ANY));
+    }
+    RETURN_IF_NOT_OK(mPortRangesMap.writeValue(slot, classifier.portRanges, BPF_ANY));
+    RETURN_IF_NOT_OK(mTupleMasksMap.writeValue(slot, classifier.masks, BPF_ANY));
+    return netdutils::status::ok;
+}
+
+// Deletes the entries of generations before the given one. Newer entries may already exist if the
+// policies changed again in the meantime.
+Status DscpPolicyManager::clearSocketCache(uint32_t generation) {
+    for (auto* map : {&mIpv4SocketMap, &mIpv6SocketMap}) {
+        std::vector<uint64_t> cookies;
+        const auto getStaleCookies = [&cookies, generation](const uint64_t& cookie,
+                                                            const RuleEntry& entry,
+                                                            const BpfMap<uint64_t, RuleEntry>&) {
+            // Generations wrap around.
+            if ((int32_t)(entry.generation - generation) < 0) cookies.push_back(cookie);
+            return base::Result<void>();
+        };
+        RETURN_IF_NOT_OK(map->iterateWithValue(getStaleCookies));
+        RETURN_IF_NOT_OK(deleteInBatches(map->getMap(), cookies));
+    }
+    return netdutils::status::ok;
+}
+
+static bool samePolicy(const DscpPolicySet& a, const DscpPolicySet& b, uint32_t priority) {
+    const auto itA = a.find(priority);
+    const auto itB = b.find(priority);
+    if (itA == a.end() || itB == b.end()) return itA == a.end() && itB == b.end();
+    return memcmp(&itA->second, &itB->second, sizeof(DscpPolicy)) == 0;
+}
+
+Status DscpPolicyManager::resetChangedStats(const DscpPolicySet& ipv4Policies,
+                                            const DscpPolicySet& ipv6Policies) {
+    const std::vector<DscpPolicyStats> zero = bpf::makePerCpuValues<DscpPolicyStats>();
+    for (const auto* policies : {&ipv4Policies, &ipv6Policies}) {
+        for (const auto& [priority, policy] : *policies) {
+            if (samePolicy(ipv4Policies, mIpv4Policies, priority) &&
+                samePolicy(ipv6Policies, mIpv6Policies, priority)) {
+                continue;
+            }
+            const int key = priority;
+            if (bpf::writeToMapEntry(mStatsMapFd, &key, zero.data(), BPF_EXIST)) {
+                return statusFromErrno(errno, "failed to reset stats of policy " +
+                                                      std::to_string(priority));
+            }
+        }
+    }
+    return netdutils::status::ok;
+}
+
+Status DscpPolicyManager::setPolicies(const DscpPolicySet& ipv4Policies,
+                                      const DscpPolicySet& ipv6Policies) {
+    std::lock_guard guard(mMutex);
+
+    auto generation = mGenerationMap.readValue(0);
+    if (!generation.ok()) {
+        return statusFromErrno(generation.error().code(), "failed to read the policy generation");
+    }
+    const uint32_t newGeneration = generation.value() + 1;
+    const uint8_t slot = newGeneration & 1;
+
+    ASSIGN_OR_RETURN(const DscpClassifier classifier,
+                     buildClassifier(ipv4Policies, ipv6Policies, slot));
+    if (!mCleanupThread.joinable()) return statusFromErrno(EAGAIN, "not started");
+
+    {
+        // Programs which started before the current generation was activated may still classify
+        // with the inactive slot.
+        std::lock_guard cleanupGuard(mCleanupMutex);
+        while (mSyncedGeneration != generation.value()) mCleanupCv.wait(mCleanupMutex);
+    }
+
+    // The inactive slot still holds the previous policy set, or part of a failed update.
+    RETURN_IF_NOT_OK(clearSlot(slot));
+    RETURN_IF_NOT_OK(writeSlot(classifier, slot));
+    RETURN_IF_NOT_OK(mGenerationMap.writeValue(0, newGeneration, BPF_ANY));
+    {
+        std::lock_guard cleanupGuard(mCleanupMutex);
+        mActiveGeneration = newGeneration;
+    }
+    mCleanupCv.notify_all();
+
+    const Status res = resetChangedStats(ipv4Policies, ipv6Policies);
+    if (!isOk(res)) ALOGE("%s", res.msg().c_str());
+    mIpv4Policies = ipv4Policies;
+    mIpv6Policies = ipv6Policies;
+    return netdutils::status::ok;
+}
+
+void DscpPolicyManager::runCleanup() {
+    while (true) {
+        uint32_t generation;
+        {
+            std::lock_guard guard(mCleanupMutex);
+            while (!mStopCleanup && mSyncedGeneration == mActiveGeneration) {
+                mCleanupCv.wait(mCleanupMutex);
+            }
+            if (mStopCleanup) return;
+            generation = mActiveGeneration;
+        }
+
+        // See TrafficController::swapActiveStatsMap.
+        const int ret = synchronizeKernelRCU();
+        if (ret) ALOGE("synchronize_rcu() failed: %s", strerror(-ret));
+        {
+            std::lock_guard guard(mCleanupMutex);
+            mSyncedGeneration = generation;
+        }
+        mCleanupCv.notify_all();
+
+        // Cache entries of older generations are ignored anyway, this frees them for other
+        // sockets.
+        if (ret == 0) {
+            const Status res = clearSocketCache(generation);
+            if (!isOk(res)) ALOGE("Failed to clear the socket cache: %s", res.msg().c_str());
+        }
+    }
+}
+
+StatusOr<DscpPolicyStats> DscpPolicyManager::getPolicyStats(uint32_t priority) {
+    std::lock_guard guard(mMutex);
+    if (priority >= MAX_POLICIES) {
+        return statusFromErrno(EINVAL, "invalid priority " + std::to_string(priority));
+    }
+
+    const int key = priority;
+    std::vector<DscpPolicyStats> values;
+    if (bpf::findPerCpuMapEntry(mStatsMapFd, key, &values)) {
+        return statusFromErrno(errno, "failed to read stats of policy " +
+                                              std::to_string(priority));
+    }
+
+    DscpPolicyStats total = {};
+    for (const DscpPolicyStats& v : values) {
+        total.packets += v.packets;
+        total.bytes += v.bytes;
+        total.rewrittenPackets += v.rewrittenPackets;
+    }
+    return total;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DscpPolicyManagerTest.cpp - unit tests for DscpPolicyManager.cpp
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include <gtest/gtest.h>
+
+#include "DscpPolicyManager.h"
+
+namespace android {
+namespace net {
+
+using netdutils::StatusOr;
+
+constexpr uint32_t TEST_IFINDEX = 42;
+constexpr uint8_t UDP = IPPROTO_UDP;
+
+static DscpPolicy makePolicy(uint8_t dscp, uint8_t proto, int dstPortStart, int dstPortEnd) {
+    DscpPolicy policy = {};
+    policy.ifindex = TEST_IFINDEX;
+    policy.dscpVal = dscp;
+    policy.proto = proto;
+    policy.presentFields = PROTO_MASK_FLAG;
+    if (dstPortStart >= 0) {
+        policy.dstPortStart = htons(dstPortStart);
+        policy.dstPortEnd = htons(dstPortEnd);
+        policy.presentFields |= DST_PORT_MASK_FLAG;
+    }
+    return policy;
+}
+
+static DscpTupleKey makeKey(uint8_t mask, uint16_t dstPortRange, uint8_t slot) {
+    DscpTupleKey key = {};
+    key.ifindex = TEST_IFINDEX;
+    key.mask = mask;
+    key.proto = UDP;
+    key.dstPortRange = dstPortRange;
+    key.slot = slot;
+    return key;
+}
+
+TEST(DscpPolicyManagerTest, FindPortRange) {
+    DscpPortRanges ranges = {};
+    EXPECT_EQ(0, DscpPolicyManager::findPortRange(ranges, 443));
+
+    ranges.count = 3;
+    ranges.bounds[0] = htons(100);
+    ranges.bounds[1] = htons(200);
+    ranges.bounds[2] = htons(300);
+    EXPECT_EQ(0, DscpPolicyManager::findPortRange(ranges, 0));
+    EXPECT_EQ(0, DscpPolicyManager::findPortRange(ranges, 99));
+    EXPECT_EQ(1, DscpPolicyManager::findPortRange(ranges, 100));
+    EXPECT_EQ(1, DscpPolicyManager::findPortRange(ranges, 199));
+    EXPECT_EQ(2, DscpPolicyManager::findPortRange(ranges, 200));
+    EXPECT_EQ(3, DscpPolicyManager::findPortRange(ranges, 65535));
+}
+
+TEST(DscpPolicyManagerTest, MasksSortedBySpecificity) {
+    DscpPolicy dstIpPolicy = {};
+    dstIpPolicy.ifindex = TEST_IFINDEX;
+    dstIpPolicy.presentFields = DST_IP_MASK_FLAG;
+    inet_pton(AF_INET6, "2001:db8::1", &dstIpPolicy.dstIp);
+
+    const DscpPolicySet ipv6 = {
+            {0, makePolicy(1, UDP, -1, -1)},
+            {1, makePolicy(2, UDP, 443, 443)},
+            {2, dstIpPolicy},
+    };
+    StatusOr<DscpClassifier> classifier = DscpPolicyManager::buildClassifier({}, ipv6, 0);
+    ASSERT_TRUE(isOk(classifier));
+
+    const DscpTupleMasks& masks = classifier.value().masks;
+    ASSERT_EQ(3, masks.count);
+    EXPECT_EQ(DST_PORT_MASK_FLAG | PROTO_MASK_FLAG, masks.masks[0]);
+    // Equally specific masks are ordered by value.
+    EXPECT_EQ(DST_IP_MASK_FLAG, masks.masks[1]);
+    EXPECT_EQ(PROTO_MASK_FLAG, masks.masks[2]);
+    EXPECT_EQ(0U, classifier.value().ipv4Tuples.size());
+    EXPECT_EQ(3U, classifier.value().ipv6Tuples.size());
+}
+
+TEST(DscpPolicyManagerTest, PortRangesSplitIntoElementaryRanges) {
+    const DscpPolicySet ipv4 = {
+            {0, makePolicy(1, UDP, 1000, 1999)},
+            {1, makePolicy(2, UDP, 1500, 65535)},
+    };
+    StatusOr<DscpClassifier> classifier = DscpPolicyManager::buildClassifier(ipv4, {}, 1);
+    ASSERT_TRUE(isOk(classifier));
+
+    // Bounds 1000, 1500 and 2000 give ranges [0, 1000), [1000, 1500), [1500, 2000) and
+    // [2000, 65535].
+    EXPECT_EQ(3U, classifier.value().portRanges.count);
+    const DscpTuples& tuples = classifier.value().ipv4Tuples;
+    const uint8_t mask = DST_PORT_MASK_FLAG | PROTO_MASK_FLAG;
+    ASSERT_EQ(3U, tuples.size());
+    EXPECT_EQ(0U, tuples.count(makeKey(mask, 0, 1)));
+    EXPECT_EQ(0U, tuples.at(makeKey(mask, 1, 1)).priority);
+    // Both policies cover [1500, 2000): the one with the lowest priority wins.
+    EXPECT_EQ(0U, tuples.at(makeKey(mask, 2, 1)).priority);
+    EXPECT_EQ(1, tuples.at(makeKey(mask, 2, 1)).dscpVal);
+    EXPECT_EQ(1U, tuples.at(makeKey(mask, 3, 1)).priority);
+    EXPECT_EQ(2, tuples.at(makeKey(mask, 3, 1)).dscpVal);
+}
+
+TEST(DscpPolicyManagerTest, TooManyPortRanges) {
+    DscpPolicySet ipv4;
+    for (int i = 0; i < MAX_PORT_BOUNDS / 2 + 1; i++) {
+        ipv4[i] = makePolicy(1, UDP, 2 * i + 1, 2 * i + 1);
+    }
+    StatusOr<DscpClassifier> classifier = DscpPolicyManager::buildClassifier(ipv4, {}, 0);
+    EXPECT_EQ(E2BIG, classifier.status().code());
+}
+
+TEST(DscpPolicyManagerTest, InvalidPolicies) {
+    DscpPolicy badDscp = makePolicy(64, UDP, -1, -1);
+    EXPECT_EQ(EINVAL, DscpPolicyManager::buildClassifier({{0, badDscp}}, {}, 0).status().code());
+
+    DscpPolicy badRange = makePolicy(1, UDP, 2000, 1000);
+    EXPECT_EQ(EINVAL, DscpPolicyManager::buildClassifier({{0, badRange}}, {}, 0).status().code());
+
+    DscpPolicy ipv6Address = makePolicy(1, UDP, -1, -1);
+    ipv6Address.presentFields |= DST_IP_MASK_FLAG;
+    inet_pton(AF_INET6, "2001:db8::1", &ipv6Address.dstIp);
+    EXPECT_EQ(EINVAL,
+              DscpPolicyManager::buildClassifier({{0, ipv6Address}}, {}, 0).status().code());
+    EXPECT_TRUE(isOk(DscpPolicyManager::buildClassifier({}, {{0, ipv6Address}}, 0)));
+
+    const DscpPolicy policy = makePolicy(1, UDP, -1, -1);
+    EXPECT_EQ(EINVAL,
+              DscpPolicyManager::buildClassifier({{MAX_POLICIES, policy}}, {}, 0).status().code());
+}
+
+}  // namespace net
+}  // namespace android
@@ -15,6 +15,7 @@
  */
 
 #define LOG_TAG "TrafficController"
+#include <dirent.h>
 #include <inttypes.h>
 #include <linux/if_ether.h>
 #include <linux/in.h>
@@ -30,6 +31,8 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
 #include <map>
 #include <mutex>
 #include <unordered_set>
@@ -44,8 +47,11 @@
 #include <netdutils/Utils.h>
 #include <private/android_filesystem_config.h>
 
+#include "ConnectivityMetrics.h"
+#include "ConnectivityTrace.h"
 #include "TrafficController.h"
 #include "bpf/BpfMap.h"
+#include "bpf/BpfUtils.h"
 #include "netdutils/DumpWriter.h"
 
 namespace android {
@@ -195,6 +201,7 @@ Status TrafficController::initMaps() {
 }
 
 Status TrafficController::start() {
+    CONNECTIVITY_TRACE("TrafficController::start");
     RETURN_IF_NOT_OK(initMaps());
 
     // Fetch the list of currently-existing interfaces. At this point NetlinkHandler is
@@ -245,6 +252,7 @@ Status TrafficController::start() {
 }
 
 int TrafficController::addInterface(const char* name, uint32_t ifaceIndex) {
+    CONNECTIVITY_TRACE("TrafficController::addInterface");
     IfaceValue iface;
     if (ifaceIndex == 0) {
         ALOGE("Unknown interface %s(%d)", name, ifaceIndex);
@@ -315,6 +323,7 @@ Status TrafficController::addRule(uint32_t uid, UidOwnerMatchType match, uint32_
 
 Status TrafficController::updateUidOwnerMap(const uint32_t uid,
                                             UidOwnerMatchType matchType, IptOp op) {
+    CONNECTIVITY_TRACE("TrafficController::updateUidOwnerMap");
     std::lock_guard guard(mMutex);
     if (op == IptOpDelete) {
         RETURN_IF_NOT_OK(removeRule(uid, matchType));
@@ -355,6 +364,7 @@ FirewallType TrafficController::getFirewallType(ChildChain chain) {
 
 int TrafficController::changeUidOwnerRule(ChildChain chain, uid_t uid, FirewallRule rule,
                                           FirewallType type) {
+    CONNECTIVITY_TRACE("TrafficController::changeUidOwnerRule");
     Status res;
     switch (chain) {
         case DOZABLE:
@@ -423,6 +433,8 @@ Status TrafficController::replaceRulesInMap(const UidOwnerMatchType match,
 
 Status TrafficController::addUidInterfaceRules(const int iif,
                                                const std::vector<int32_t>& uidsToAdd) {
+    CONNECTIVITY_TRACE("TrafficController::addUidInterfaceRules");
+    CONNECTIVITY_TRACE_COUNT("TrafficController::addUidInterfaceRules:uids", uidsToAdd.size());
     std::lock_guard guard(mMutex);
 
     for (auto uid : uidsToAdd) {
@@ -435,6 +447,9 @@ Status TrafficController::addUidInterfaceRules(const int iif,
 }
 
 Status TrafficController::removeUidInterfaceRules(const std::vector<int32_t>& uidsToDelete) {
+    CONNECTIVITY_TRACE("TrafficController::removeUidInterfaceRules");
+    CONNECTIVITY_TRACE_COUNT("TrafficController::removeUidInterfaceRules:uids",
+                             uidsToDelete.size());
     std::lock_guard guard(mMutex);
 
     for (auto uid : uidsToDelete) {
@@ -448,6 +463,9 @@ Status TrafficController::removeUidInterfaceRules(const std::vector<int32_t>& ui
 
 int TrafficController::replaceUidOwnerMap(const std::string& name, bool isAllowlist __unused,
                                           const std::vector<int32_t>& uids) {
+    CONNECTIVITY_TRACE("TrafficController::replaceUidOwnerMap");
+    CONNECTIVITY_TRACE_COUNT("TrafficController::replaceUidOwnerMap:uids", uids.size());
+    ScopedLatency latency(Metric::REPLACE_UID_OWNER_MAP);
     // FirewallRule rule = isAllowlist ? ALLOW : DENY;
     // FirewallType type = isAllowlist ? ALLOWLIST : DENYLIST;
     Status res;
@@ -469,16 +487,19 @@ int TrafficController::replaceUidOwnerMap(const std::string& name, bool isAllowl
         res = replaceRulesInMap(OEM_DENY_3_MATCH, uids);
     } else {
         ALOGE("unknown chain name: %s", name.c_str());
+        latency.setFailed();
         return -EINVAL;
     }
     if (!isOk(res)) {
         ALOGE("Failed to clean up chain: %s: %s", name.c_str(), res.msg().c_str());
+        latency.setFailed();
         return -res.code();
     }
     return 0;
 }
 
 int TrafficController::toggleUidOwnerMap(ChildChain chain, bool enable) {
+    CONNECTIVITY_TRACE("TrafficController::toggleUidOwnerMap");
     std::lock_guard guard(mMutex);
     uint32_t key = UID_RULES_CONFIGURATION_KEY;
     auto oldConfigure = mConfigurationMap.readValue(key);
@@ -528,6 +549,9 @@ int TrafficController::toggleUidOwnerMap(ChildChain chain, bool enable) {
 }
 
 Status TrafficController::swapActiveStatsMap() {
+    CONNECTIVITY_TRACE("TrafficController::swapActiveStatsMap");
+    // Declared before the lock, so that waiting for a concurrent dump or update is counted too.
+    ScopedLatency latency(Metric::SWAP_ACTIVE_STATS_MAP);
     std::lock_guard guard(mMutex);
 
     uint32_t key = CURRENT_STATS_MAP_CONFIGURATION_KEY;
@@ -535,6 +559,7 @@ Status TrafficController::swapActiveStatsMap() {
     if (!oldConfigure.ok()) {
         ALOGE("Cannot read the old configuration from map: %s",
               oldConfigure.error().message().c_str());
+        latency.setFailed();
         return Status(oldConfigure.error().code(), oldConfigure.error().message());
     }
 
@@ -546,6 +571,7 @@ Status TrafficController::swapActiveStatsMap() {
                                             BPF_EXIST);
     if (!res.ok()) {
         ALOGE("Failed to toggle the stats map: %s", strerror(res.error().code()));
+        latency.setFailed();
         return res;
     }
     // After changing the config, we need to make sure all the current running
@@ -557,15 +583,22 @@ Status TrafficController::swapActiveStatsMap() {
     // map configuration. So once this function returns we can safely modify the
     // old stats map without concerning about race between the kernel and
     // userspace.
-    int ret = synchronizeKernelRCU();
+    int ret;
+    {
+        CONNECTIVITY_TRACE("synchronizeKernelRCU");
+        ret = synchronizeKernelRCU();
+    }
     if (ret) {
         ALOGE("map swap synchronize_rcu() ended with failure: %s", strerror(-ret));
+        latency.setFailed();
         return statusFromErrno(-ret, "map swap synchronize_rcu() failed");
     }
     return netdutils::status::ok;
 }
 
 void TrafficController::setPermissionForUids(int permission, const std::vector<uid_t>& uids) {
+    CONNECTIVITY_TRACE("TrafficController::setPermissionForUids");
+    CONNECTIVITY_TRACE_COUNT("TrafficController::setPermissionForUids:uids", uids.size());
     std::lock_guard guard(mMutex);
     if (permission == INetd::PERMISSION_UNINSTALLED) {
         for (uid_t uid : uids) {
@@ -627,6 +660,83 @@ std::string getMapStatus(const base::unique_fd& map_fd, const char* path) {
     return StringPrintf("OK");
 }
 
+StatusOr<TrafficController::BpfProgramStats> TrafficController::getBpfProgramStats(
+        const char* path) {
+    unique_fd prog(bpf::retrieveProgram(path));
+    if (!prog.ok()) return statusFromErrno(errno, StringPrintf("Cannot open %s", path));
+
+    bpf_prog_info info = {};
+    bpf_attr attr = {};
+    attr.info.bpf_fd = prog.get();
+    attr.info.info_len = sizeof(info);
+    attr.info.info = reinterpret_cast<uint64_t>(&info);
+    if (syscall(__NR_bpf, BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr)) != 0) {
+        return statusFromErrno(errno, StringPrintf("Cannot get info of %s", path));
+    }
+    return BpfProgramStats{.runCnt = info.run_cnt, .runTimeNs = info.run_time_ns};
+}
+
+Status TrafficController::setBpfProgramStatsEnabled(bool enable) {
+    std::lock_guard guard(mMutex);
+    if (!enable) {
+        mBpfStatsFd.reset();
+        return netdutils::status::ok;
+    }
+    if (mBpfStatsFd.ok()) return netdutils::status::ok;
+
+    bpf_attr attr = {};
+    attr.enable_stats.type = BPF_STATS_RUN_TIME;
+    // Needs kernel 5.8, older ones fail with EINVAL.
+    mBpfStatsFd.reset(syscall(__NR_bpf, BPF_ENABLE_STATS, &attr, sizeof(attr)));
+    if (!mBpfStatsFd.ok()) return statusFromErrno(errno, "BPF_ENABLE_STATS failed");
+    return netdutils::status::ok;
+}
+
+// The pinned programs of netd.c, clatd.c, dscp_policy.c, block.c and offload.c, sorted by path.
+std::vector<std::string> listBpfPrograms() {
+    static const std::pair<const char*, const char*> kProgramDirs[] = {
+            {BPF_NETD_PATH, "prog_netd_"},
+            {"/sys/fs/bpf/net_shared/", "prog_clatd_"},
+            {"/sys/fs/bpf/net_shared/", "prog_dscp_policy_"},
+            {"/sys/fs/bpf/net_shared/", "prog_block_"},
+            {"/sys/fs/bpf/tethering/", "prog_offload_"},
+    };
+    std::vector<std::string> paths;
+    for (const auto& [dirPath, prefix] : kProgramDirs) {
+        std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(dirPath), closedir);
+        if (!dir) continue;
+        while (const dirent* entry = readdir(dir.get())) {
+            if (base::StartsWith(entry->d_name, prefix)) {
+                paths.push_back(std::string(dirPath) + entry->d_name);
+            }
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+// Reads the run counters of all programs. They only grow while BPF_ENABLE_STATS is held.
+std::vector<std::string> getBpfProgramStatsLines() {
+    std::vector<std::string> lines;
+    for (const std::string& path : listBpfPrograms()) {
+        // Strip the directory and "prog_", e.g. "netd_cgroupskb_ingress_stats".
+        const std::string name = path.substr(path.rfind('/') + 1 + strlen("prog_"));
+        StatusOr<TrafficController::BpfProgramStats> stats =
+                TrafficController::getBpfProgramStats(path.c_str());
+        if (!isOk(stats)) {
+            lines.push_back(StringPrintf("%s %s", name.c_str(), toString(stats).c_str()));
+            continue;
+        }
+        const uint64_t runCnt = stats.value().runCnt;
+        const uint64_t runTimeNs = stats.value().runTimeNs;
+        lines.push_back(StringPrintf("%s run_cnt=%" PRIu64 " run_time_ns=%" PRIu64
+                                     " avg_ns=%" PRIu64,
+                                     name.c_str(), runCnt, runTimeNs,
+                                     runCnt ? runTimeNs / runCnt : 0));
+    }
+    return lines;
+}
+
 // NOLINTNEXTLINE(google-runtime-references): grandfathered pass by non-const reference
 void dumpBpfMap(const std::string& mapName, DumpWriter& dw, const std::string& header) {
     dw.blankline();
@@ -637,6 +747,7 @@ void dumpBpfMap(const std::string& mapName, DumpWriter& dw, const std::string& h
 }
 
 void TrafficController::dump(int fd, bool verbose) {
+    CONNECTIVITY_TRACE("TrafficController::dump");
     std::lock_guard guard(mMutex);
     DumpWriter dw(fd);
 
@@ -678,6 +789,21 @@ void TrafficController::dump(int fd, bool verbose) {
     dw.println("xt_bpf bandwidth denylist program status: %s",
                getProgramStatus(XT_BPF_DENYLIST_PROG_PATH).c_str());
 
+    dw.blankline();
+    if (mBpfStatsFd.ok()) {
+        dw.println("BPF program run stats (since enabled):");
+    } else {
+        dw.println("BPF program run stats (not enabled, may be stale):");
+    }
+    {
+        ScopedIndent indentBpfStats(dw);
+        for (const std::string& line : getBpfProgramStatsLines()) {
+            dw.println(line);
+        }
+    }
+
+    ConnectivityMetrics::dump(dw);
+
     if (!verbose) {
         return;
     }
@@ -687,6 +813,9 @@ void TrafficController::dump(int fd, bool verbose) {
 
     ScopedIndent indentForMapContent(dw);
 
+    // TODO: read the large maps through bpf_map_elem iterators, a few read() calls per map instead
+    // of two syscalls per entry, once the bpfloader can load "iter/" programs.
+
     // Print CookieTagMap content.
     dumpBpfMap("mCookieTagMap", dw, "");
     const auto printCookieTagInfo = [&dw](const uint64_t& key, const UidTagValue& value,
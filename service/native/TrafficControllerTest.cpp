@@ -110,6 +110,11 @@ class TrafficControllerTest : public ::testing::Test {
         mTc.mPrivilegedUser.clear();
     }
 
+    int getBpfStatsFd() {
+        std::lock_guard guard(mTc.mMutex);
+        return mTc.mBpfStatsFd.get();
+    }
+
     void populateFakeStats(uint64_t cookie, uint32_t uid, uint32_t tag, StatsKey* key) {
         UidTagValue cookieMapkey = {.uid = (uint32_t)uid, .tag = tag};
         EXPECT_RESULT_OK(mFakeCookieTagMap.writeValue(cookie, cookieMapkey, BPF_ANY));
@@ -623,6 +628,22 @@ TEST_F(TrafficControllerTest, TestGrantWrongPermission) {
     expectUidPermissionMapValues(appUids, INetd::PERMISSION_NONE);
 }
 
+TEST_F(TrafficControllerTest, TestBpfProgramStats) {
+    EXPECT_FALSE(isOk(TrafficController::getBpfProgramStats("/sys/fs/bpf/does_not_exist")));
+    EXPECT_TRUE(isOk(TrafficController::getBpfProgramStats(BPF_INGRESS_PROG_PATH)));
+
+    Status res = mTc.setBpfProgramStatsEnabled(true);
+    if (res.code() == EINVAL) GTEST_SKIP() << "BPF_ENABLE_STATS needs kernel 5.8";
+    ASSERT_TRUE(isOk(res));
+    // Enabling twice keeps the same fd.
+    const int statsFd = getBpfStatsFd();
+    EXPECT_TRUE(isOk(mTc.setBpfProgramStatsEnabled(true)));
+    EXPECT_EQ(statsFd, getBpfStatsFd());
+
+    EXPECT_TRUE(isOk(mTc.setBpfProgramStatsEnabled(false)));
+    EXPECT_EQ(-1, getBpfStatsFd());
+}
+
 TEST_F(TrafficControllerTest, TestGrantDuplicatePermissionSlientlyFail) {
     std::vector<uid_t> appUids = {TEST_UID, TEST_UID2, TEST_UID3};
 
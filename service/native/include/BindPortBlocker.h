@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/types.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "android-base/thread_annotations.h"
+#include "block.h"
+#include "bpf/BpfMap.h"
+#include "netdutils/StatusOr.h"
+
+namespace android {
+namespace net {
+
+#define BLOCKED_PORTS_MAP_PATH "/sys/fs/bpf/net_shared/map_block_blocked_ports_map"
+#define BLOCKED_BIND_STATS_MAP_PATH "/sys/fs/bpf/net_shared/map_block_blocked_bind_stats_map"
+
+// Bitmasks of the BlockedPortsBitmap an operation applies to.
+constexpr uint32_t BLOCK_TCP = 1 << BLOCKED_PORTS_TCP;
+constexpr uint32_t BLOCK_UDP = 1 << BLOCKED_PORTS_UDP;
+constexpr uint32_t BLOCK_ALL = BLOCK_TCP | BLOCK_UDP;
+
+// The whole content of blocked_ports_map, indexed by map key.
+using BlockedPorts = std::vector<uint64_t>;
+
+// How many binds of a uid to a port were denied, summed over all cpus.
+struct BlockedBindCount {
+    BlockedBindKey key;
+    uint64_t count;
+};
+
+// Owns the bitmaps of block.c. Every update reads the bitmaps, computes the new words and writes
+// the changed ones back in one BPF_MAP_UPDATE_BATCH, so a range of ports costs a handful of
+// syscalls rather than one binder call and one map update per port.
+class BindPortBlocker {
+  public:
+    netdutils::Status start() EXCLUDES(mMutex);
+
+    // Blocks or unblocks the ports in [first, last] in the bitmaps of the given BLOCK_* mask.
+    netdutils::Status setPortRange(uint32_t bitmaps, uint16_t first, uint16_t last, bool blocked)
+            EXCLUDES(mMutex);
+
+    // Blocks or unblocks the given ports in the bitmaps of the given BLOCK_* mask.
+    netdutils::Status setPorts(uint32_t bitmaps, const std::vector<uint16_t>& ports, bool blocked)
+            EXCLUDES(mMutex);
+
+    // Unblocks every port of every protocol.
+    netdutils::Status clear() EXCLUDES(mMutex);
+
+    // Returns the bitmaps of the given BLOCK_* mask ORed together, BLOCKED_PORTS_WORDS long.
+    netdutils::StatusOr<std::vector<uint64_t>> getBitmap(uint32_t bitmaps) EXCLUDES(mMutex);
+
+    // Returns the denied binds of the (uid, port, protocol) tuples still in the stats map, most
+    // denied first.
+    netdutils::StatusOr<std::vector<BlockedBindCount>> getBlockedBindCounts() EXCLUDES(mMutex);
+
+    // Sets or clears the bits of the given ports in a copy of the map content.
+    static void applyPorts(uint32_t bitmaps, uint16_t first, uint16_t last, bool blocked,
+                           BlockedPorts* words);
+
+    // Returns the keys and values of the words that differ between the two map contents.
+    static std::pair<std::vector<uint32_t>, std::vector<uint64_t>> diffWords(
+            const BlockedPorts& before, const BlockedPorts& after);
+
+  private:
+    netdutils::StatusOr<BlockedPorts> readAll() REQUIRES(mMutex);
+    netdutils::Status writeChanged(const BlockedPorts& before, const BlockedPorts& after)
+            REQUIRES(mMutex);
+
+    bpf::BpfMap<uint32_t, uint64_t> mBlockedPortsMap GUARDED_BY(mMutex);
+    // Per cpu, so only accessed through its fd.
+    base::unique_fd mStatsMapFd GUARDED_BY(mMutex);
+    // Whether the kernel supports batch operations on array maps, i.e. is at least 5.6.
+    bool mBatchSupported GUARDED_BY(mMutex) = true;
+
+    std::mutex mMutex;
+};
+
+}  // namespace net
+}  // namespace android
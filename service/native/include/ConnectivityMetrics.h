@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android {
+namespace net {
+
+// The native control plane operations whose latency is recorded. Append only: the order is that
+// of the values returned by ConnectivityMetrics::snapshot().
+enum class Metric {
+    SWAP_ACTIVE_STATS_MAP,
+    REPLACE_UID_OWNER_MAP,
+    PARSE_NETWORK_STATS_DETAIL,
+    PARSE_NETWORK_STATS_DEV,
+    CLAT_TAG_SOCKET,
+    CLAT_START,
+    CLAT_STOP,
+    COUNT,
+};
+
+// A log-linear histogram of latencies in microseconds: 4 linear buckets per power of two, so any
+// latency is reported within 25% of its value, from 1us up to about 70s. Updates are relaxed
+// atomic increments, so recording never blocks and concurrent readers may see a snapshot that is
+// a few updates behind.
+class LatencyHistogram {
+  public:
+    static constexpr int SUB_BUCKETS_BITS = 2;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKETS_BITS;
+    static constexpr int MAX_POWER = 26;
+    static constexpr int NUM_BUCKETS = (MAX_POWER - SUB_BUCKETS_BITS + 2) * SUB_BUCKETS;
+
+    void record(uint64_t latencyUs, bool failed);
+
+    uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+    uint64_t failures() const { return mFailures.load(std::memory_order_relaxed); }
+    uint64_t totalUs() const { return mTotalUs.load(std::memory_order_relaxed); }
+    uint64_t maxUs() const { return mMaxUs.load(std::memory_order_relaxed); }
+
+    // Returns the lower bound of the bucket holding the given percentile, or 0 if empty.
+    uint64_t percentileUs(double percentile) const;
+
+    static int bucketOf(uint64_t latencyUs);
+    static uint64_t bucketLowerBoundUs(int bucket);
+
+  private:
+    std::atomic<uint64_t> mCount = 0;
+    std::atomic<uint64_t> mFailures = 0;
+    std::atomic<uint64_t> mTotalUs = 0;
+    std::atomic<uint64_t> mMaxUs = 0;
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> mBuckets = {};
+};
+
+// Process wide registry of the latency histograms of each Metric.
+class ConnectivityMetrics {
+  public:
+    // Values returned by snapshot() for each metric, in order.
+    static constexpr int SNAPSHOT_FIELDS = 6;  // count, failures, total, max, p50, p99
+
+    static void record(Metric metric, uint64_t latencyUs, bool failed);
+
+    static const LatencyHistogram& get(Metric metric);
+
+    // Returns SNAPSHOT_FIELDS values for each metric, in the order of Metric.
+    static std::vector<int64_t> snapshot();
+
+    static void dump(netdutils::DumpWriter& dw);
+
+  private:
+    static std::array<LatencyHistogram, static_cast<size_t>(Metric::COUNT)> sHistograms;
+};
+
+// Records the time from its construction to its destruction in the histogram of a metric.
+class ScopedLatency {
+  public:
+    explicit ScopedLatency(Metric metric) : mMetric(metric), mStartUs(nowUs()) {}
+    ~ScopedLatency() { ConnectivityMetrics::record(mMetric, nowUs() - mStartUs, mFailed); }
+
+    // Counts the operation as failed, e.g. when returning an error.
+    void setFailed(bool failed = true) { mFailed = failed; }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+  private:
+    static uint64_t nowUs() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+
+    const Metric mMetric;
+    const uint64_t mStartUs;
+    bool mFailed = false;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/types.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "android-base/thread_annotations.h"
+#include "bpf/BpfMap.h"
+#include "dscp_policy.h"
+#include "netdutils/StatusOr.h"
+
+namespace android {
+namespace net {
+
+#define DSCP_POLICY_MAP_PATH(name) "/sys/fs/bpf/net_shared/map_dscp_policy_" name "_map"
+
+// Policies keyed by priority. Among the matching policies with the most fields present, the one
+// with the lowest priority wins.
+using DscpPolicySet = std::map<uint32_t, DscpPolicy>;
+
+// Tuple keys are zero initialized, padding included, so they can be compared bytewise.
+struct DscpTupleKeyLess {
+    bool operator()(const DscpTupleKey& a, const DscpTupleKey& b) const {
+        return memcmp(&a, &b, sizeof(a)) < 0;
+    }
+};
+using DscpTuples = std::map<DscpTupleKey, DscpTupleValue, DscpTupleKeyLess>;
+
+// The content of one slot of the classifier in dscp_policy.c.
+struct DscpClassifier {
+    DscpTuples ipv4Tuples;
+    DscpTuples ipv6Tuples;
+    DscpTupleMasks masks;
+    DscpPortRanges portRanges;
+};
+
+// Owns the classifier maps of dscp_policy.c. Policy sets are written to the inactive slot and
+// made active at once, so packets are never classified against a partially written set.
+//
+// A slot can only be rewritten once no program still classifies with it, i.e. after an RCU grace
+// period. A cleanup thread waits for it after each update, and then clears the socket cache.
+class DscpPolicyManager {
+  public:
+    ~DscpPolicyManager();
+
+    netdutils::Status start() EXCLUDES(mMutex, mCleanupMutex);
+
+    // Validates the given policies, writes their classifier to the inactive slot and makes it
+    // active. Returns EINVAL if a policy is malformed and E2BIG if the set does not fit in the
+    // maps; the active policies are left unchanged in both cases. Only blocks for the grace
+    // period of the previous update if that one is still running.
+    netdutils::Status setPolicies(const DscpPolicySet& ipv4Policies,
+                                  const DscpPolicySet& ipv6Policies)
+            EXCLUDES(mMutex, mCleanupMutex);
+
+    // Returns the packets and bytes matched by the policy of the given priority, and how many of
+    // those packets had to be rewritten, summed over all cpus. The counters are reset when a
+    // different policy takes that priority.
+    netdutils::StatusOr<DscpPolicyStats> getPolicyStats(uint32_t priority) EXCLUDES(mMutex);
+
+    // Builds the classifier of the given policies for the given slot.
+    static netdutils::StatusOr<DscpClassifier> buildClassifier(const DscpPolicySet& ipv4Policies,
+                                                               const DscpPolicySet& ipv6Policies,
+                                                               uint8_t slot);
+
+    // Returns the elementary range of a port, i.e. the number of bounds lower or equal to it.
+    static uint16_t findPortRange(const DscpPortRanges& ranges, uint16_t port);
+
+  private:
+    netdutils::Status writeSlot(const DscpClassifier& classifier, uint8_t slot) REQUIRES(mMutex);
+    netdutils::Status clearSlot(uint8_t slot) REQUIRES(mMutex);
+    void runCleanup() EXCLUDES(mCleanupMutex);
+    netdutils::Status clearSocketCache(uint32_t generation);
+    netdutils::Status resetChangedStats(const DscpPolicySet& ipv4Policies,
+                                        const DscpPolicySet& ipv6Policies) REQUIRES(mMutex);
+
+    bpf::BpfMap<DscpTupleKey, DscpTupleValue> mIpv4TuplesMap GUARDED_BY(mMutex);
+    bpf::BpfMap<DscpTupleKey, DscpTupleValue> mIpv6TuplesMap GUARDED_BY(mMutex);
+    bpf::BpfMap<uint32_t, DscpTupleMasks> mTupleMasksMap GUARDED_BY(mMutex);
+    bpf::BpfMap<uint32_t, DscpPortRanges> mPortRangesMap GUARDED_BY(mMutex);
+    bpf::BpfMap<uint32_t, uint32_t> mGenerationMap GUARDED_BY(mMutex);
+    // Only used by the cleanup thread once started.
+    bpf::BpfMap<uint64_t, RuleEntry> mIpv4SocketMap;
+    bpf::BpfMap<uint64_t, RuleEntry> mIpv6SocketMap;
+    // Per cpu, so only accessed through its fd.
+    base::unique_fd mStatsMapFd GUARDED_BY(mMutex);
+
+    // The policies of the active slot, to tell which stats to reset.
+    DscpPolicySet mIpv4Policies GUARDED_BY(mMutex);
+    DscpPolicySet mIpv6Policies GUARDED_BY(mMutex);
+
+    std::mutex mMutex;
+    std::thread mCleanupThread GUARDED_BY(mMutex);
+
+    // The last generation made active, and the last one whose grace period has passed.
+    uint32_t mActiveGeneration GUARDED_BY(mCleanupMutex) = 0;
+    uint32_t mSyncedGeneration GUARDED_BY(mCleanupMutex) = 0;
+    bool mStopCleanup GUARDED_BY(mCleanupMutex) = false;
+    // Always acquired after mMutex.
+    std::mutex mCleanupMutex;
+    std::condition_variable_any mCleanupCv;
+};
+
+}  // namespace net
+}  // namespace android
@@ -64,6 +64,23 @@ class TrafficController {
 
     void dump(int fd, bool verbose) EXCLUDES(mMutex);
 
+    /*
+     * Run counters of a BPF program, from bpf_prog_info. The kernel only updates them while
+     * BPF_ENABLE_STATS is in effect.
+     */
+    struct BpfProgramStats {
+        uint64_t runCnt;
+        uint64_t runTimeNs;
+    };
+
+    static netdutils::StatusOr<BpfProgramStats> getBpfProgramStats(const char* path);
+
+    /*
+     * Keep the kernel collecting BPF program run counters until disabled again. The dump reports
+     * them, but never enables them itself.
+     */
+    netdutils::Status setBpfProgramStatsEnabled(bool enable) EXCLUDES(mMutex);
+
     netdutils::Status replaceRulesInMap(UidOwnerMatchType match, const std::vector<int32_t>& uids)
             EXCLUDES(mMutex);
 
@@ -172,6 +189,9 @@ class TrafficController {
 
     std::unique_ptr<netdutils::NetlinkListenerInterface> mSkDestroyListener;
 
+    // Returned by BPF_ENABLE_STATS, run counters are collected for as long as it is open.
+    base::unique_fd mBpfStatsFd GUARDED_BY(mMutex);
+
     netdutils::Status removeRule(uint32_t uid, UidOwnerMatchType match) REQUIRES(mMutex);
 
     netdutils::Status addRule(uint32_t uid, UidOwnerMatchType match, uint32_t iif = 0)
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unistd.h>
+
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "bpf/BpfUtils.h"
+
+namespace android {
+namespace bpf {
+
+// The values of per cpu maps (BPF_MAP_TYPE_PERCPU_*) are read and written as arrays of one value
+// per possible cpu. Note that bionic's sysconf(_SC_NPROCESSORS_CONF) reads
+// /sys/devices/system/cpu/possible.
+template <class Value>
+std::vector<Value> makePerCpuValues() {
+    const long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return std::vector<Value>(cpus > 0 ? cpus : 1);  // zero initialized
+}
+
+// Reads the per cpu values of key into values, one per possible cpu. Returns 0 on success, or -1
+// with errno set, like findMapEntry.
+template <class Key, class Value>
+int findPerCpuMapEntry(const base::unique_fd& mapFd, const Key& key, std::vector<Value>* values) {
+    *values = makePerCpuValues<Value>();
+    return findMapEntry(mapFd, &key, values->data());
+}
+
+}  // namespace bpf
+}  // namespace android
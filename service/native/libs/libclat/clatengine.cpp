@@ -0,0 +1,1044 @@
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define LOG_TAG "clatengine"
+
+#include "libclat/clatengine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <log/log.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+extern "C" {
+#include "checksum.h"
+}
+
+// Sync from external/android-clat/clatd.h
+#define MAXMTU 65536
+#define PACKETLEN (MAXMTU + sizeof(struct tun_pi) + sizeof(struct tun_vnet_hdr))
+// The growth of a translated IPv4 packet, including a fragment header (see also
+// ClatCoordinator#MTU_DELTA).
+#define MTU_DELTA (sizeof(struct ip6_hdr) - sizeof(struct iphdr) + sizeof(struct ip6_frag))
+
+namespace android {
+namespace net {
+namespace clat {
+
+// Upper bound of the packets read from one fd per wakeup, so that a busy tun queue or packet socket
+// does not starve the other direction.
+static constexpr int READ_BATCH = 64;
+
+static constexpr size_t TCP_FLAGS_OFFSET = 13;
+static constexpr uint8_t TCP_FLAG_FIN = 0x01;
+static constexpr uint8_t TCP_FLAG_PSH = 0x08;
+static constexpr uint8_t TCP_FLAG_CWR = 0x80;
+
+static uint32_t ipv6_pseudo_header_sum(const ip6_hdr& ip6, uint32_t len, uint8_t protocol) {
+    const uint32_t be_len = htonl(len);
+    const uint32_t be_protocol = htonl(protocol);
+    uint32_t sum = ip_checksum_add(0, &ip6.ip6_src, sizeof(ip6.ip6_src));
+    sum = ip_checksum_add(sum, &ip6.ip6_dst, sizeof(ip6.ip6_dst));
+    sum = ip_checksum_add(sum, &be_len, sizeof(be_len));
+    return ip_checksum_add(sum, &be_protocol, sizeof(be_protocol));
+}
+
+static uint32_t ipv4_pseudo_header_sum(const iphdr& ip, uint16_t len) {
+    const uint16_t words[2] = {htons(ip.protocol), htons(len)};
+    uint32_t sum = ip_checksum_add(0, &ip.saddr, sizeof(ip.saddr));
+    sum = ip_checksum_add(sum, &ip.daddr, sizeof(ip.daddr));
+    return ip_checksum_add(sum, words, sizeof(words));
+}
+
+// Stores a 16-bit checksum at an offset that need not be aligned.
+static void store_checksum(uint8_t* p, uint16_t checksum) {
+    memcpy(p, &checksum, sizeof(checksum));
+}
+
+static constexpr uint32_t IPV4_MINIMUM_MTU = 68;
+static constexpr uint32_t IPV6_MINIMUM_MTU = 1280;
+
+// ICMP errors quote as much of the offending packet as fits in these sizes (RFC 1812 section
+// 4.3.2.3 and RFC 4443 section 2.4).
+static constexpr size_t ICMP_ERROR_MAXLEN = 576;
+static constexpr size_t ICMP6_ERROR_MAXLEN = IPV6_MINIMUM_MTU;
+
+// The type, code and parameter (pointer or mtu) of a translated ICMP error, per RFC 7915 sections
+// 4.2 and 5.2.
+struct IcmpError {
+    uint8_t type;
+    uint8_t code;
+    uint32_t param;
+};
+
+static bool is_icmp_error(uint8_t type) {
+    switch (type) {
+        case ICMP_DEST_UNREACH:
+        case ICMP_TIME_EXCEEDED:
+        case ICMP_PARAMETERPROB:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_icmp6_error(uint8_t type) {
+    return type < ICMP6_ECHO_REQUEST;
+}
+
+// Maps an ICMPv4 error to ICMPv6, returns false if it has no equivalent.
+static bool icmp_error_to_icmp6(const uint8_t* icmp, IcmpError* error) {
+    const uint8_t type = icmp[0];
+    const uint8_t code = icmp[1];
+    *error = {};
+    if (type == ICMP_TIME_EXCEEDED) {
+        *error = {ICMP6_TIME_EXCEEDED, code, 0};
+        return true;
+    }
+    if (type == ICMP_PARAMETERPROB) {
+        if (code != 0 && code != 2) return false;
+        // Offsets in the IPv4 header to offsets in the IPv6 header.
+        const uint8_t ptr = icmp[4];
+        uint32_t ptr6;
+        if (ptr <= 1) {
+            ptr6 = ptr;
+        } else if (ptr <= 3) {
+            ptr6 = offsetof(ip6_hdr, ip6_plen);
+        } else if (ptr == offsetof(iphdr, ttl)) {
+            ptr6 = offsetof(ip6_hdr, ip6_hlim);
+        } else if (ptr == offsetof(iphdr, protocol)) {
+            ptr6 = offsetof(ip6_hdr, ip6_nxt);
+        } else if (ptr >= offsetof(iphdr, saddr) && ptr < offsetof(iphdr, daddr)) {
+            ptr6 = offsetof(ip6_hdr, ip6_src);
+        } else if (ptr >= offsetof(iphdr, daddr) && ptr < sizeof(iphdr)) {
+            ptr6 = offsetof(ip6_hdr, ip6_dst);
+        } else {
+            return false;
+        }
+        *error = {ICMP6_PARAM_PROB, ICMP6_PARAMPROB_HEADER, ptr6};
+        return true;
+    }
+    if (type != ICMP_DEST_UNREACH) return false;
+    switch (code) {
+        case ICMP_NET_UNREACH:
+        case ICMP_HOST_UNREACH:
+        case ICMP_SR_FAILED:
+        case ICMP_NET_UNKNOWN:
+        case ICMP_HOST_UNKNOWN:
+        case ICMP_HOST_ISOLATED:
+        case ICMP_NET_UNR_TOS:
+        case ICMP_HOST_UNR_TOS:
+            *error = {ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE, 0};
+            return true;
+        case ICMP_PROT_UNREACH:
+            *error = {ICMP6_PARAM_PROB, ICMP6_PARAMPROB_NEXTHEADER, offsetof(ip6_hdr, ip6_nxt)};
+            return true;
+        case ICMP_PORT_UNREACH:
+            *error = {ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT, 0};
+            return true;
+        case ICMP_FRAG_NEEDED: {
+            uint16_t mtu;
+            memcpy(&mtu, icmp + offsetof(icmphdr, un.frag.mtu), sizeof(mtu));
+            const uint32_t mtu6 = ntohs(mtu) + sizeof(ip6_hdr) - sizeof(iphdr);
+            *error = {ICMP6_PACKET_TOO_BIG, 0, std::max<uint32_t>(mtu6, IPV6_MINIMUM_MTU)};
+            return true;
+        }
+        case ICMP_NET_ANO:
+        case ICMP_HOST_ANO:
+        case ICMP_PKT_FILTERED:
+        case ICMP_PREC_CUTOFF:
+            *error = {ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN, 0};
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Maps an ICMPv6 error to ICMPv4, returns false if it has no equivalent.
+static bool icmp6_error_to_icmp(const uint8_t* icmp6, IcmpError* error) {
+    const uint8_t type = icmp6[0];
+    const uint8_t code = icmp6[1];
+    uint32_t param;
+    memcpy(&param, icmp6 + offsetof(icmp6_hdr, icmp6_data32), sizeof(param));
+    param = ntohl(param);
+    *error = {};
+    switch (type) {
+        case ICMP6_DST_UNREACH:
+            switch (code) {
+                case ICMP6_DST_UNREACH_NOROUTE:
+                case ICMP6_DST_UNREACH_BEYONDSCOPE:
+                case ICMP6_DST_UNREACH_ADDR:
+                    *error = {ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0};
+                    return true;
+                case ICMP6_DST_UNREACH_ADMIN:
+                    *error = {ICMP_DEST_UNREACH, ICMP_HOST_ANO, 0};
+                    return true;
+                case ICMP6_DST_UNREACH_NOPORT:
+                    *error = {ICMP_DEST_UNREACH, ICMP_PORT_UNREACH, 0};
+                    return true;
+                default:
+                    return false;
+            }
+        case ICMP6_PACKET_TOO_BIG: {
+            // Leave room for the fragment header that DF-less packets get, as the v4- mtu does.
+            const uint32_t mtu = param > MTU_DELTA ? param - MTU_DELTA : 0;
+            *error = {ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+                      std::clamp<uint32_t>(mtu, IPV4_MINIMUM_MTU, 0xffff)};
+            return true;
+        }
+        case ICMP6_TIME_EXCEEDED:
+            *error = {ICMP_TIME_EXCEEDED, code, 0};
+            return true;
+        case ICMP6_PARAM_PROB:
+            if (code == ICMP6_PARAMPROB_NEXTHEADER) {
+                *error = {ICMP_DEST_UNREACH, ICMP_PROT_UNREACH, 0};
+                return true;
+            }
+            if (code != ICMP6_PARAMPROB_HEADER) return false;
+            // Offsets in the IPv6 header to offsets in the IPv4 header.
+            if (param <= 1) {
+                error->param = param;
+            } else if (param == offsetof(ip6_hdr, ip6_plen) ||
+                       param == offsetof(ip6_hdr, ip6_plen) + 1) {
+                error->param = offsetof(iphdr, tot_len);
+            } else if (param == offsetof(ip6_hdr, ip6_nxt)) {
+                error->param = offsetof(iphdr, protocol);
+            } else if (param == offsetof(ip6_hdr, ip6_hlim)) {
+                error->param = offsetof(iphdr, ttl);
+            } else if (param >= offsetof(ip6_hdr, ip6_src) && param < offsetof(ip6_hdr, ip6_dst)) {
+                error->param = offsetof(iphdr, saddr);
+            } else if (param >= offsetof(ip6_hdr, ip6_dst) && param < sizeof(ip6_hdr)) {
+                error->param = offsetof(iphdr, daddr);
+            } else {
+                return false;
+            }
+            error->type = ICMP_PARAMETERPROB;
+            error->code = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Translates the IPv4 packet quoted by an ICMP error. It is a packet that the remote host sent
+// and the local IPv4 stack refused, so goes from the NAT64 prefix to local6 once translated. The
+// quote may be truncated, so only its headers are checked.
+//   in     - the quoted packet
+//   len    - the length of the quote
+//   out    - the output buffer, which must hold at least len + MTU_DELTA bytes
+// returns: the length of the translated quote, or -errno
+static int translate_quoted_4to6(const ClatAddresses& addrs, const uint8_t* in, size_t len,
+                                 uint8_t* out) {
+    iphdr ip;
+    if (len < sizeof(ip)) return -EINVAL;
+    memcpy(&ip, in, sizeof(ip));
+    const size_t hdrlen = ip.ihl * 4;
+    const size_t totlen = ntohs(ip.tot_len);
+    if (ip.version != 4 || hdrlen < sizeof(ip) || hdrlen > len || totlen < hdrlen) return -EINVAL;
+    if (ip.daddr != addrs.local4.s_addr) return -EADDRNOTAVAIL;
+
+    const uint16_t frag_off = ntohs(ip.frag_off);
+    const bool fragmented = frag_off & (IP_MF | IP_OFFMASK);
+    const uint8_t protocol = (ip.protocol == IPPROTO_ICMP) ? (uint8_t)IPPROTO_ICMPV6 : ip.protocol;
+    const size_t hdr6len = sizeof(ip6_hdr) + (fragmented ? sizeof(ip6_frag) : 0);
+
+    ip6_hdr ip6 = {};
+    ip6.ip6_flow = htonl(6 << 28 | ip.tos << 20);
+    ip6.ip6_plen = htons(hdr6len - sizeof(ip6_hdr) + totlen - hdrlen);
+    ip6.ip6_nxt = fragmented ? (uint8_t)IPPROTO_FRAGMENT : protocol;
+    ip6.ip6_hlim = ip.ttl;
+    ip6.ip6_src = addrs.pfx96;
+    ip6.ip6_src.s6_addr32[3] = ip.saddr;
+    ip6.ip6_dst = addrs.local6;
+    memcpy(out, &ip6, sizeof(ip6));
+    if (fragmented) {
+        ip6_frag frag = {
+                .ip6f_nxt = protocol,
+                .ip6f_reserved = 0,
+                .ip6f_offlg = htons((frag_off & IP_OFFMASK) << 3 | ((frag_off & IP_MF) ? 1 : 0)),
+                .ip6f_ident = htonl(ntohs(ip.id)),
+        };
+        memcpy(out + sizeof(ip6), &frag, sizeof(frag));
+    }
+
+    uint8_t* out_payload = out + hdr6len;
+    const size_t payload_len = len - hdrlen;
+    memcpy(out_payload, in + hdrlen, payload_len);
+    // The quoted transport checksum is left as is, only the echo types need translating.
+    if (ip.protocol == IPPROTO_ICMP && !(frag_off & IP_OFFMASK) && payload_len > 0) {
+        if (out_payload[0] == ICMP_ECHO) out_payload[0] = ICMP6_ECHO_REQUEST;
+        if (out_payload[0] == ICMP_ECHOREPLY) out_payload[0] = ICMP6_ECHO_REPLY;
+    }
+    return hdr6len + payload_len;
+}
+
+// Translates the IPv6 packet quoted by an ICMPv6 error, which the local host sent towards the NAT64
+// prefix. See translate_quoted_4to6.
+//   out    - the output buffer, which must hold at least len bytes
+static int translate_quoted_6to4(const ClatAddresses& addrs, const uint8_t* in, size_t len,
+                                 uint8_t* out) {
+    ip6_hdr ip6;
+    if (len < sizeof(ip6)) return -EINVAL;
+    memcpy(&ip6, in, sizeof(ip6));
+    if ((ip6.ip6_vfc >> 4) != 6) return -EINVAL;
+    if (!IN6_ARE_ADDR_EQUAL(&ip6.ip6_src, &addrs.local6)) return -EADDRNOTAVAIL;
+    if (memcmp(&ip6.ip6_dst, &addrs.pfx96, 12)) return -EADDRNOTAVAIL;
+
+    const uint8_t* payload = in + sizeof(ip6);
+    size_t payload_len = len - sizeof(ip6);
+    size_t plen = ntohs(ip6.ip6_plen);
+    uint8_t protocol = ip6.ip6_nxt;
+    uint16_t frag_off = IP_DF;
+    uint16_t id = 0;
+    if (protocol == IPPROTO_FRAGMENT) {
+        ip6_frag frag;
+        if (payload_len < sizeof(frag) || plen < sizeof(frag)) return -EINVAL;
+        memcpy(&frag, payload, sizeof(frag));
+        const uint16_t offlg = ntohs(frag.ip6f_offlg);
+        protocol = frag.ip6f_nxt;
+        frag_off = (offlg >> 3) | ((offlg & 1) ? IP_MF : 0);
+        id = htons(ntohl(frag.ip6f_ident) & 0xffff);
+        payload += sizeof(frag);
+        payload_len -= sizeof(frag);
+        plen -= sizeof(frag);
+    }
+
+    uint8_t* out_payload = out + sizeof(iphdr);
+    memcpy(out_payload, payload, payload_len);
+    if (protocol == IPPROTO_ICMPV6 && !(frag_off & IP_OFFMASK) && payload_len > 0) {
+        if (out_payload[0] == ICMP6_ECHO_REQUEST) out_payload[0] = ICMP_ECHO;
+        if (out_payload[0] == ICMP6_ECHO_REPLY) out_payload[0] = ICMP_ECHOREPLY;
+    }
+
+    iphdr ip = {};
+    ip.version = 4;
+    ip.ihl = sizeof(ip) / 4;
+    ip.tos = (ntohl(ip6.ip6_flow) >> 20) & 0xff;
+    ip.tot_len = htons(sizeof(ip) + plen);
+    ip.id = id;
+    ip.frag_off = htons(frag_off);
+    ip.ttl = ip6.ip6_hlim;
+    ip.protocol = (protocol == IPPROTO_ICMPV6) ? (uint8_t)IPPROTO_ICMP : protocol;
+    ip.saddr = addrs.local4.s_addr;
+    ip.daddr = ip6.ip6_dst.s6_addr32[3];
+    ip.check = ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip)));
+    memcpy(out, &ip, sizeof(ip));
+
+    return sizeof(ip) + payload_len;
+}
+
+// Translates an ICMPv4 error, including the packet it quotes, into out_payload, the ICMPv6 message
+// following the IPv6 header ip6. Updates the payload length of ip6.
+static int translate_icmp_error_4to6(const ClatAddresses& addrs, const uint8_t* icmp, size_t len,
+                                     ip6_hdr* ip6, uint8_t* out_payload, size_t outlen) {
+    IcmpError error;
+    if (len < sizeof(icmphdr) || !icmp_error_to_icmp6(icmp, &error)) return -EOPNOTSUPP;
+
+    // Quote no more than fits in a minimum mtu IPv6 packet once translated.
+    const size_t maxlen = ICMP6_ERROR_MAXLEN - sizeof(ip6_hdr) - sizeof(icmp6_hdr) - MTU_DELTA;
+    const size_t quotelen = std::min(len - sizeof(icmphdr), maxlen);
+    if (outlen < sizeof(icmp6_hdr) + quotelen + MTU_DELTA) return -EMSGSIZE;
+    int ret = translate_quoted_4to6(addrs, icmp + sizeof(icmphdr), quotelen,
+                                    out_payload + sizeof(icmp6_hdr));
+    if (ret < 0) return ret;
+
+    const size_t payload_len = sizeof(icmp6_hdr) + ret;
+    icmp6_hdr icmp6 = {};
+    icmp6.icmp6_type = error.type;
+    icmp6.icmp6_code = error.code;
+    icmp6.icmp6_data32[0] = htonl(error.param);
+    memcpy(out_payload, &icmp6, sizeof(icmp6));
+
+    ip6->ip6_plen = htons(payload_len);
+    uint32_t sum = ipv6_pseudo_header_sum(*ip6, payload_len, IPPROTO_ICMPV6);
+    store_checksum(out_payload + offsetof(icmp6_hdr, icmp6_cksum),
+                   ip_checksum_finish(ip_checksum_add(sum, out_payload, payload_len)));
+    return payload_len;
+}
+
+// Translates an ICMPv6 error, including the packet it quotes, into out_payload, the ICMP message
+// following the IPv4 header.
+static int translate_icmp6_error_6to4(const ClatAddresses& addrs, const uint8_t* icmp6, size_t len,
+                                      uint8_t* out_payload, size_t outlen) {
+    IcmpError error;
+    if (len < sizeof(icmp6_hdr) || !icmp6_error_to_icmp(icmp6, &error)) return -EOPNOTSUPP;
+
+    // Quote no more than fits in an ICMP error once the quoted IPv6 header shrinks.
+    const size_t maxlen = ICMP_ERROR_MAXLEN - sizeof(iphdr) - sizeof(icmphdr) + sizeof(ip6_hdr) -
+                          sizeof(iphdr);
+    const size_t quotelen = std::min(len - sizeof(icmp6_hdr), maxlen);
+    if (outlen < sizeof(icmphdr) + quotelen) return -EMSGSIZE;
+    int ret = translate_quoted_6to4(addrs, icmp6 + sizeof(icmp6_hdr), quotelen,
+                                    out_payload + sizeof(icmphdr));
+    if (ret < 0) return ret;
+
+    const size_t payload_len = sizeof(icmphdr) + ret;
+    icmphdr icmp = {};
+    icmp.type = error.type;
+    icmp.code = error.code;
+    if (error.type == ICMP_PARAMETERPROB) {
+        icmp.un.gateway = htonl(error.param << 24);
+    } else if (error.type == ICMP_DEST_UNREACH && error.code == ICMP_FRAG_NEEDED) {
+        icmp.un.frag.mtu = htons(error.param);
+    }
+    memcpy(out_payload, &icmp, sizeof(icmp));
+    store_checksum(out_payload + offsetof(icmphdr, checksum),
+                   ip_checksum_finish(ip_checksum_add(0, out_payload, payload_len)));
+    return payload_len;
+}
+
+int translate_4to6(const ClatAddresses& addrs, const uint8_t* in, size_t len, uint8_t* out,
+                   size_t outlen) {
+    iphdr ip;
+    if (len < sizeof(ip)) return -EINVAL;
+    memcpy(&ip, in, sizeof(ip));
+
+    const size_t hdrlen = ip.ihl * 4;
+    const size_t totlen = ntohs(ip.tot_len);
+    if (ip.version != 4 || hdrlen < sizeof(ip) || totlen < hdrlen || totlen > len) return -EINVAL;
+    if (ip_checksum_finish(ip_checksum_add(0, in, hdrlen)) != 0) return -EINVAL;
+    if (ip.saddr != addrs.local4.s_addr) return -EADDRNOTAVAIL;
+
+    const uint16_t frag_off = ntohs(ip.frag_off);
+    const bool fragmented = frag_off & (IP_MF | IP_OFFMASK);
+    const uint8_t protocol = (ip.protocol == IPPROTO_ICMP) ? (uint8_t)IPPROTO_ICMPV6 : ip.protocol;
+    const uint8_t* payload = in + hdrlen;
+    const size_t payload_len = totlen - hdrlen;
+    const size_t hdr6len = sizeof(ip6_hdr) + (fragmented ? sizeof(ip6_frag) : 0);
+    if (outlen < hdr6len + payload_len) return -EMSGSIZE;
+
+    ip6_hdr ip6 = {};
+    ip6.ip6_flow = htonl(6 << 28 | ip.tos << 20);
+    ip6.ip6_plen = htons(hdr6len - sizeof(ip6_hdr) + payload_len);
+    ip6.ip6_nxt = fragmented ? (uint8_t)IPPROTO_FRAGMENT : protocol;
+    ip6.ip6_hlim = ip.ttl;
+    ip6.ip6_src = addrs.local6;
+    ip6.ip6_dst = addrs.pfx96;
+    ip6.ip6_dst.s6_addr32[3] = ip.daddr;
+    memcpy(out, &ip6, sizeof(ip6));
+
+    if (fragmented) {
+        ip6_frag frag = {
+                .ip6f_nxt = protocol,
+                .ip6f_reserved = 0,
+                .ip6f_offlg = htons((frag_off & IP_OFFMASK) << 3 | ((frag_off & IP_MF) ? 1 : 0)),
+                .ip6f_ident = htonl(ntohs(ip.id)),
+        };
+        memcpy(out + sizeof(ip6), &frag, sizeof(frag));
+    }
+
+    uint8_t* out_payload = out + hdr6len;
+
+    if (ip.protocol == IPPROTO_ICMP && payload_len >= sizeof(icmphdr) &&
+        is_icmp_error(payload[0])) {
+        // The quoted packet changes size when translated, so the error is rebuilt rather than
+        // copied. Errors are never fragmented by their sender.
+        if (fragmented) return -EOPNOTSUPP;
+        if (ip_checksum_finish(ip_checksum_add(0, payload, payload_len)) != 0) return -EINVAL;
+        int ret = translate_icmp_error_4to6(addrs, payload, payload_len, &ip6, out_payload,
+                                            outlen - hdr6len);
+        if (ret < 0) return ret;
+        memcpy(out, &ip6, sizeof(ip6));
+        return hdr6len + ret;
+    }
+
+    memcpy(out_payload, payload, payload_len);
+
+    switch (ip.protocol) {
+        case IPPROTO_ICMP: {
+            // Beyond errors, only echo requests and replies have an ICMPv6 equivalent. Their
+            // checksum covers the reassembled message and the pseudo-header, so it cannot be
+            // recomputed for a fragment.
+            if (fragmented) return -EOPNOTSUPP;
+            if (payload_len < sizeof(icmphdr)) return -EINVAL;
+            if (ip_checksum_finish(ip_checksum_add(0, payload, payload_len)) != 0) return -EINVAL;
+            if (payload[0] == ICMP_ECHO) {
+                out_payload[0] = ICMP6_ECHO_REQUEST;
+            } else if (payload[0] == ICMP_ECHOREPLY) {
+                out_payload[0] = ICMP6_ECHO_REPLY;
+            } else {
+                return -EOPNOTSUPP;
+            }
+            uint8_t* checksum = out_payload + offsetof(icmp6_hdr, icmp6_cksum);
+            store_checksum(checksum, 0);
+            uint32_t sum = ipv6_pseudo_header_sum(ip6, payload_len, IPPROTO_ICMPV6);
+            store_checksum(checksum,
+                           ip_checksum_finish(ip_checksum_add(sum, out_payload, payload_len)));
+            break;
+        }
+        case IPPROTO_UDP: {
+            // A zero UDP checksum is valid for IPv4 but not for IPv6, so it must be computed.
+            // Every other TCP and UDP checksum is unchanged thanks to the checksum neutral local6.
+            // That is impossible for fragments without reassembling them, which RFC 7915 section
+            // 4.5 lets stateless translators drop.
+            if (frag_off & IP_OFFMASK) break;
+            if (payload_len < sizeof(udphdr)) return -EINVAL;
+            uint8_t* checksum = out_payload + offsetof(udphdr, check);
+            if (checksum[0] || checksum[1]) break;
+            if (fragmented) return -EOPNOTSUPP;
+            uint32_t sum = ipv6_pseudo_header_sum(ip6, payload_len, IPPROTO_UDP);
+            uint16_t value = ip_checksum_finish(ip_checksum_add(sum, out_payload, payload_len));
+            store_checksum(checksum, value ? value : 0xffff);
+            break;
+        }
+        default:
+            break;
+    }
+
+    return hdr6len + payload_len;
+}
+
+int translate_6to4(const ClatAddresses& addrs, const uint8_t* in, size_t len, uint8_t* out,
+                   size_t outlen) {
+    ip6_hdr ip6;
+    if (len < sizeof(ip6)) return -EINVAL;
+    memcpy(&ip6, in, sizeof(ip6));
+
+    size_t payload_len = ntohs(ip6.ip6_plen);
+    if ((ip6.ip6_vfc >> 4) != 6 || sizeof(ip6) + payload_len > len) return -EINVAL;
+    if (!IN6_ARE_ADDR_EQUAL(&ip6.ip6_dst, &addrs.local6)) return -EADDRNOTAVAIL;
+    // Only ICMPv6 errors may come from outside the NAT64 prefix, i.e. from a router on the path.
+    const bool from_pfx96 = !memcmp(&ip6.ip6_src, &addrs.pfx96, 12);
+    if (!from_pfx96 && ip6.ip6_nxt != IPPROTO_ICMPV6) return -EADDRNOTAVAIL;
+
+    const uint8_t* payload = in + sizeof(ip6);
+    uint8_t protocol = ip6.ip6_nxt;
+    uint16_t frag_off = IP_DF;
+    uint16_t id = 0;
+    if (protocol == IPPROTO_FRAGMENT) {
+        ip6_frag frag;
+        if (payload_len < sizeof(frag)) return -EINVAL;
+        memcpy(&frag, payload, sizeof(frag));
+        const uint16_t offlg = ntohs(frag.ip6f_offlg);
+        protocol = frag.ip6f_nxt;
+        frag_off = (offlg >> 3) | ((offlg & 1) ? IP_MF : 0);
+        id = htons(ntohl(frag.ip6f_ident) & 0xffff);
+        payload += sizeof(frag);
+        payload_len -= sizeof(frag);
+    }
+    const bool fragmented = frag_off & (IP_MF | IP_OFFMASK);
+
+    switch (protocol) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_FRAGMENT:
+            return -EOPNOTSUPP;
+        default:
+            break;
+    }
+
+    if (outlen < sizeof(iphdr)) return -EMSGSIZE;
+    uint8_t* out_payload = out + sizeof(iphdr);
+    size_t totlen = sizeof(iphdr) + payload_len;
+
+    if (protocol == IPPROTO_ICMPV6) {
+        if (fragmented) return -EOPNOTSUPP;
+        if (payload_len < sizeof(icmp6_hdr)) return -EINVAL;
+        uint32_t sum = ipv6_pseudo_header_sum(ip6, payload_len, IPPROTO_ICMPV6);
+        if (ip_checksum_finish(ip_checksum_add(sum, payload, payload_len)) != 0) return -EINVAL;
+    }
+
+    if (protocol == IPPROTO_ICMPV6 && is_icmp6_error(payload[0])) {
+        int ret = translate_icmp6_error_6to4(addrs, payload, payload_len, out_payload,
+                                             outlen - sizeof(iphdr));
+        if (ret < 0) return ret;
+        totlen = sizeof(iphdr) + ret;
+    } else if (!from_pfx96) {
+        return -EADDRNOTAVAIL;
+    } else if (protocol == IPPROTO_ICMPV6) {
+        if (outlen < totlen) return -EMSGSIZE;
+        memcpy(out_payload, payload, payload_len);
+        if (payload[0] == ICMP6_ECHO_REQUEST) {
+            out_payload[0] = ICMP_ECHO;
+        } else if (payload[0] == ICMP6_ECHO_REPLY) {
+            out_payload[0] = ICMP_ECHOREPLY;
+        } else {
+            return -EOPNOTSUPP;
+        }
+        uint8_t* checksum = out_payload + offsetof(icmphdr, checksum);
+        store_checksum(checksum, 0);
+        store_checksum(checksum, ip_checksum_finish(ip_checksum_add(0, out_payload, payload_len)));
+    } else {
+        if (outlen < totlen) return -EMSGSIZE;
+        memcpy(out_payload, payload, payload_len);
+    }
+
+    iphdr ip = {};
+    ip.version = 4;
+    ip.ihl = sizeof(ip) / 4;
+    ip.tos = (ntohl(ip6.ip6_flow) >> 20) & 0xff;
+    ip.tot_len = htons(totlen);
+    ip.id = id;
+    ip.frag_off = htons(frag_off);
+    ip.ttl = ip6.ip6_hlim;
+    ip.protocol = (protocol == IPPROTO_ICMPV6) ? (uint8_t)IPPROTO_ICMP : protocol;
+    // Like clatd, make up 255.0.0.<ttl> for routers with a native IPv6 address, which at least
+    // identifies the hop in a traceroute.
+    ip.saddr = from_pfx96 ? ip6.ip6_src.s6_addr32[3] : htonl(0xff000000 | ip.ttl);
+    ip.daddr = addrs.local4.s_addr;
+    ip.check = ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip)));
+    memcpy(out, &ip, sizeof(ip));
+
+    return totlen;
+}
+
+int make_frag_needed(const uint8_t* in, size_t len, uint16_t mtu, uint8_t* out, size_t outlen) {
+    iphdr ip;
+    if (len < sizeof(ip)) return -EINVAL;
+    memcpy(&ip, in, sizeof(ip));
+    const size_t hdrlen = ip.ihl * 4;
+    if (hdrlen < sizeof(ip) || hdrlen > len) return -EINVAL;
+
+    // No errors about errors or about non-first fragments (RFC 1122 section 3.2.2).
+    if (ntohs(ip.frag_off) & IP_OFFMASK) return -EOPNOTSUPP;
+    if (ip.protocol == IPPROTO_ICMP && (len < hdrlen + 1 || is_icmp_error(in[hdrlen]))) {
+        return -EOPNOTSUPP;
+    }
+
+    const size_t quotelen = std::min(len, ICMP_ERROR_MAXLEN - sizeof(iphdr) - sizeof(icmphdr));
+    const size_t totlen = sizeof(iphdr) + sizeof(icmphdr) + quotelen;
+    if (outlen < totlen) return -EMSGSIZE;
+
+    // Sent as if by the destination, the only remote IPv4 address this packet names.
+    iphdr err = {};
+    err.version = 4;
+    err.ihl = sizeof(err) / 4;
+    err.tot_len = htons(totlen);
+    err.ttl = 64;
+    err.protocol = IPPROTO_ICMP;
+    err.saddr = ip.daddr;
+    err.daddr = ip.saddr;
+    err.check = ip_checksum_finish(ip_checksum_add(0, &err, sizeof(err)));
+    memcpy(out, &err, sizeof(err));
+
+    uint8_t* payload = out + sizeof(err);
+    icmphdr icmp = {};
+    icmp.type = ICMP_DEST_UNREACH;
+    icmp.code = ICMP_FRAG_NEEDED;
+    icmp.un.frag.mtu = htons(mtu);
+    memcpy(payload, &icmp, sizeof(icmp));
+    memcpy(payload + sizeof(icmp), in, quotelen);
+    const size_t payload_len = sizeof(icmp) + quotelen;
+    store_checksum(payload + offsetof(icmphdr, checksum),
+                   ip_checksum_finish(ip_checksum_add(0, payload, payload_len)));
+    return totlen;
+}
+
+int fragment_4to6(const uint8_t* in, size_t len, uint32_t mtu6, uint8_t* buf, size_t buflen,
+                  const std::function<void(const uint8_t*, size_t)>& fn) {
+    iphdr ip;
+    if (len < sizeof(ip)) return -EINVAL;
+    memcpy(&ip, in, sizeof(ip));
+    const size_t hdrlen = ip.ihl * 4;
+    const size_t totlen = ntohs(ip.tot_len);
+    if (hdrlen < sizeof(ip) || totlen < hdrlen || totlen > len) return -EINVAL;
+
+    const uint16_t frag_off = ntohs(ip.frag_off);
+    if (frag_off & IP_DF) return -EMSGSIZE;
+
+    // Every fragment but the last carries a multiple of 8 bytes.
+    const size_t overhead = sizeof(ip6_hdr) + sizeof(ip6_frag);
+    if (mtu6 < overhead + 8) return -EINVAL;
+    const size_t chunk = (mtu6 - overhead) & ~7;
+    if (buflen < sizeof(iphdr) + chunk) return -EMSGSIZE;
+
+    // A zero UDP checksum cannot be computed once the datagram is fragmented, so do it now. The
+    // IPv4 checksum stays valid for IPv6 thanks to the checksum neutral local6.
+    const uint8_t* payload = in + hdrlen;
+    const size_t payload_len = totlen - hdrlen;
+    bool fix_udp_checksum = false;
+    uint16_t udp_checksum = 0;
+    if (ip.protocol == IPPROTO_UDP && !(frag_off & (IP_MF | IP_OFFMASK)) &&
+        payload_len >= sizeof(udphdr) && !payload[offsetof(udphdr, check)] &&
+        !payload[offsetof(udphdr, check) + 1]) {
+        uint32_t sum = ipv4_pseudo_header_sum(ip, payload_len);
+        udp_checksum = ip_checksum_finish(ip_checksum_add(sum, payload, payload_len));
+        if (udp_checksum == 0) udp_checksum = 0xffff;
+        fix_udp_checksum = true;
+    }
+
+    // The fragments do not repeat the IPv4 options, which the translation drops anyway.
+    for (size_t offset = 0; offset < payload_len; offset += chunk) {
+        const size_t fraglen = std::min(chunk, payload_len - offset);
+        const bool more = (offset + fraglen < payload_len) || (frag_off & IP_MF);
+        iphdr frag = ip;
+        frag.ihl = sizeof(frag) / 4;
+        frag.tot_len = htons(sizeof(frag) + fraglen);
+        frag.frag_off = htons(((frag_off & IP_OFFMASK) + offset / 8) | (more ? IP_MF : 0));
+        frag.check = 0;
+        frag.check = ip_checksum_finish(ip_checksum_add(0, &frag, sizeof(frag)));
+        memcpy(buf, &frag, sizeof(frag));
+        memcpy(buf + sizeof(frag), payload + offset, fraglen);
+        if (offset == 0 && fix_udp_checksum) {
+            store_checksum(buf + sizeof(frag) + offsetof(udphdr, check), udp_checksum);
+        }
+        fn(buf, sizeof(frag) + fraglen);
+    }
+    return 0;
+}
+
+std::unique_ptr<ClatEngine> ClatEngine::start(const ClatEngineConfig& config, int* error) {
+    std::unique_ptr<ClatEngine> engine(new ClatEngine());
+    int ret = engine->init(config);
+    if (ret) {
+        *error = ret;
+        return nullptr;
+    }
+    engine->mThread = std::thread(&ClatEngine::run, engine.get());
+    return engine;
+}
+
+int ClatEngine::init(const ClatEngineConfig& config) {
+    mAddrs = config.addrs;
+    mVnetHdr = config.vnetHdr;
+    mPacketRing = config.packetRing;
+    mReadBuf.resize(PACKETLEN);
+    mSegmentBuf.resize(PACKETLEN);
+    mFragmentBuf.resize(PACKETLEN);
+    mWriteBuf.resize(PACKETLEN);
+
+    if (config.tunFds.empty()) return -EINVAL;
+    for (int fd : config.tunFds) {
+        int dupFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dupFd < 0) return -errno;
+        mTunFds.push_back(dupFd);
+        // The engine is the only reader of the tun interface, so the shared file description can
+        // be made nonblocking to drain each queue in batches.
+        int flags = fcntl(dupFd, F_GETFL);
+        if (flags < 0 || fcntl(dupFd, F_SETFL, flags | O_NONBLOCK)) return -errno;
+    }
+    if ((mReadSock6 = fcntl(config.readSock6, F_DUPFD_CLOEXEC, 0)) < 0) return -errno;
+    if ((mWriteSock6 = fcntl(config.writeSock6, F_DUPFD_CLOEXEC, 0)) < 0) return -errno;
+
+    if (mPacketRing) {
+        int ret = map_packet_ring(mReadSock6, &mRing);
+        if (ret) return ret;
+    }
+
+    if ((mStopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) return -errno;
+    if ((mEpollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -errno;
+
+    std::vector<int> fds = mTunFds;
+    fds.push_back(mReadSock6);
+    fds.push_back(mStopFd);
+    for (int fd : fds) {
+        struct epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event)) {
+            int res = errno;
+            ALOGE("epoll_ctl failed: %s", strerror(errno));
+            return -res;
+        }
+    }
+
+    return 0;
+}
+
+ClatEngine::~ClatEngine() {
+    if (mThread.joinable()) {
+        const uint64_t one = 1;
+        if (write(mStopFd, &one, sizeof(one)) != sizeof(one)) {
+            ALOGE("failed to signal the clat engine: %s", strerror(errno));
+        }
+        mThread.join();
+    }
+
+    unmap_packet_ring(&mRing);
+    for (int fd : mTunFds) close(fd);
+    for (int fd : {mReadSock6, mWriteSock6, mEpollFd, mStopFd}) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+void ClatEngine::setPathMtu(uint32_t mtu) {
+    mPathMtu = mtu;
+}
+
+ClatEngineStats ClatEngine::getStats() const {
+    return {
+            .packets4to6 = mPackets4to6.load(),
+            .packets6to4 = mPackets6to4.load(),
+            .dropped = mDropped.load(),
+    };
+}
+
+void ClatEngine::run() {
+    pthread_setname_np(pthread_self(), "clatengine");
+
+    struct epoll_event events[8];
+    while (true) {
+        int n = epoll_wait(mEpollFd, events, std::size(events), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("epoll_wait failed, stopping the clat engine: %s", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == mStopFd) return;
+            if (fd == mReadSock6) {
+                readPacketSocket();
+            } else {
+                readTun(fd);
+            }
+        }
+    }
+}
+
+void ClatEngine::readTun(int fd) {
+    for (int i = 0; i < READ_BATCH; i++) {
+        ssize_t len = read(fd, mReadBuf.data(), mReadBuf.size());
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                ALOGE("read from tun failed: %s", strerror(errno));
+            }
+            return;
+        }
+        handleTunPacket(mReadBuf.data(), len);
+    }
+}
+
+void ClatEngine::readPacketSocket() {
+    if (mPacketRing) {
+        auto fn = [this](const uint8_t* packet, size_t len) { handleIpv6Packet(packet, len); };
+        for (uint32_t i = 0; i < PACKET_RING_BLOCK_COUNT; i++) {
+            int ret = read_packet_ring(mReadSock6, &mRing, 0, fn);
+            if (ret < 0) {
+                ALOGE("read from packet ring failed: %s", strerror(-ret));
+            }
+            if (ret <= 0) return;
+        }
+        return;
+    }
+
+    for (int i = 0; i < READ_BATCH; i++) {
+        ssize_t len = recvfrom(mReadSock6, mReadBuf.data(), mReadBuf.size(), MSG_DONTWAIT, nullptr,
+                               nullptr);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                ALOGE("read from packet socket failed: %s", strerror(errno));
+            }
+            return;
+        }
+        handleIpv6Packet(mReadBuf.data(), len);
+    }
+}
+
+void ClatEngine::handleTunPacket(uint8_t* packet, size_t len) {
+    struct tun_pi pi;
+    if (len < sizeof(pi)) {
+        mDropped++;
+        return;
+    }
+    memcpy(&pi, packet, sizeof(pi));
+    packet += sizeof(pi);
+    len -= sizeof(pi);
+    if (pi.proto != htons(ETH_P_IP)) {
+        mDropped++;
+        return;
+    }
+
+    if (mVnetHdr) {
+        struct tun_vnet_hdr vnet;
+        if (len < sizeof(vnet)) {
+            mDropped++;
+            return;
+        }
+        memcpy(&vnet, packet, sizeof(vnet));
+        packet += sizeof(vnet);
+        len -= sizeof(vnet);
+
+        const uint8_t gsoType = vnet.gso_type & ~TUN_VNET_HDR_GSO_ECN;
+        if (gsoType != TUN_VNET_HDR_GSO_NONE) {
+            segmentGsoPacket(packet, len, gsoType, vnet.gso_size);
+            return;
+        }
+        if (vnet.flags & TUN_VNET_HDR_F_NEEDS_CSUM) {
+            // The checksum field holds the pseudo-header sum, complete it over the payload.
+            const size_t start = vnet.csum_start;
+            if (start + vnet.csum_offset + sizeof(uint16_t) > len) {
+                mDropped++;
+                return;
+            }
+            store_checksum(packet + start + vnet.csum_offset,
+                           ip_checksum_finish(ip_checksum_add(0, packet + start, len - start)));
+        }
+    }
+
+    handleIpv4Packet(packet, len);
+}
+
+// Splits a TSO or USO super-packet from the tun interface into gsoSize segments, recomputing the
+// IPv4 and transport checksums of each one, as the kernel does in software for devices without
+// segmentation offload.
+void ClatEngine::segmentGsoPacket(const uint8_t* packet, size_t len, uint8_t gsoType,
+                                  uint16_t gsoSize) {
+    iphdr ip;
+    if (len < sizeof(ip) || gsoSize == 0) {
+        mDropped++;
+        return;
+    }
+    memcpy(&ip, packet, sizeof(ip));
+    const size_t hdrlen = ip.ihl * 4;
+
+    size_t l4len;
+    if (gsoType == TUN_VNET_HDR_GSO_TCPV4 && ip.protocol == IPPROTO_TCP &&
+        len >= hdrlen + sizeof(tcphdr)) {
+        tcphdr tcp;
+        memcpy(&tcp, packet + hdrlen, sizeof(tcp));
+        l4len = tcp.doff * 4;
+    } else if (gsoType == TUN_VNET_HDR_GSO_UDP_L4 && ip.protocol == IPPROTO_UDP) {
+        l4len = sizeof(udphdr);
+    } else {
+        mDropped++;
+        return;
+    }
+
+    const size_t headers = hdrlen + l4len;
+    if (hdrlen < sizeof(ip) || headers > len) {
+        mDropped++;
+        return;
+    }
+
+    uint8_t* seg = mSegmentBuf.data();
+    uint16_t id = ntohs(ip.id);
+    for (size_t offset = headers; offset < len; offset += gsoSize, id++) {
+        const size_t seglen = std::min<size_t>(gsoSize, len - offset);
+        const bool first = (offset == headers);
+        const bool last = (offset + seglen == len);
+        memcpy(seg, packet, headers);
+        memcpy(seg + headers, packet + offset, seglen);
+
+        iphdr segip = ip;
+        segip.tot_len = htons(headers + seglen);
+        segip.id = htons(id);
+        segip.check = 0;
+        memcpy(seg, &segip, sizeof(segip));
+        store_checksum(seg + offsetof(iphdr, check),
+                       ip_checksum_finish(ip_checksum_add(0, seg, hdrlen)));
+
+        uint8_t* l4 = seg + hdrlen;
+        size_t checkOffset;
+        if (ip.protocol == IPPROTO_TCP) {
+            uint32_t seq;
+            memcpy(&seq, l4 + offsetof(tcphdr, seq), sizeof(seq));
+            seq = htonl(ntohl(seq) + (offset - headers));
+            memcpy(l4 + offsetof(tcphdr, seq), &seq, sizeof(seq));
+            if (!last) l4[TCP_FLAGS_OFFSET] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+            if (!first) l4[TCP_FLAGS_OFFSET] &= ~TCP_FLAG_CWR;
+            checkOffset = offsetof(tcphdr, check);
+        } else {
+            const uint16_t udplen = htons(l4len + seglen);
+            memcpy(l4 + offsetof(udphdr, len), &udplen, sizeof(udplen));
+            checkOffset = offsetof(udphdr, check);
+        }
+        store_checksum(l4 + checkOffset, 0);
+        uint32_t sum = ipv4_pseudo_header_sum(segip, l4len + seglen);
+        uint16_t checksum = ip_checksum_finish(ip_checksum_add(sum, l4, l4len + seglen));
+        if (checksum == 0 && ip.protocol == IPPROTO_UDP) checksum = 0xffff;
+        store_checksum(l4 + checkOffset, checksum);
+
+        handleIpv4Packet(seg, headers + seglen);
+    }
+}
+
+void ClatEngine::handleIpv4Packet(const uint8_t* packet, size_t len) {
+    int ret = translate_4to6(mAddrs, packet, len, mWriteBuf.data(), mWriteBuf.size());
+    if (ret < 0) {
+        mDropped++;
+        return;
+    }
+
+    const uint32_t mtu = mPathMtu.load();
+    if (mtu && (size_t)ret > mtu) {
+        handleTooBigPacket(packet, len, mtu);
+        return;
+    }
+
+    // The raw socket is IPPROTO_RAW, so the kernel sends the IPv6 header as built.
+    struct sockaddr_in6 sin6 = {.sin6_family = AF_INET6};
+    memcpy(&sin6.sin6_addr, mWriteBuf.data() + offsetof(ip6_hdr, ip6_dst), sizeof(in6_addr));
+    if (sendto(mWriteSock6, mWriteBuf.data(), ret, 0, (struct sockaddr*)&sin6, sizeof(sin6)) < 0) {
+        mDropped++;
+        return;
+    }
+    mPackets4to6++;
+}
+
+// The BPF program punts packets which exceed the path mtu, which the v4- mtu has not caught up
+// with yet. Refuse them with the error the v4- interface would send with an up to date mtu, or
+// fragment them if they allow it, so that path mtu discovery keeps working.
+void ClatEngine::handleTooBigPacket(const uint8_t* packet, size_t len, uint32_t mtu) {
+    iphdr ip;
+    memcpy(&ip, packet, sizeof(ip));
+    if (ip.frag_off & htons(IP_DF)) {
+        mDropped++;
+        int ret = make_frag_needed(packet, len, mtu - MTU_DELTA, mFragmentBuf.data(),
+                                   mFragmentBuf.size());
+        if (ret > 0) writeTun(mFragmentBuf.data(), ret);
+        return;
+    }
+
+    auto fn = [this](const uint8_t* frag, size_t fraglen) { handleIpv4Packet(frag, fraglen); };
+    if (fragment_4to6(packet, len, mtu, mFragmentBuf.data(), mFragmentBuf.size(), fn) < 0) {
+        mDropped++;
+    }
+}
+
+void ClatEngine::handleIpv6Packet(const uint8_t* packet, size_t len) {
+    int ret = translate_6to4(mAddrs, packet, len, mWriteBuf.data(), mWriteBuf.size());
+    if (ret < 0) {
+        mDropped++;
+        return;
+    }
+    if (!writeTun(mWriteBuf.data(), ret)) {
+        mDropped++;
+        return;
+    }
+    mPackets6to4++;
+}
+
+bool ClatEngine::writeTun(const uint8_t* packet, size_t len) {
+    struct tun_pi pi = {.flags = 0, .proto = htons(ETH_P_IP)};
+    struct tun_vnet_hdr vnet = {.flags = 0, .gso_type = TUN_VNET_HDR_GSO_NONE};
+    struct iovec iov[3];
+    int iovcnt = 0;
+    iov[iovcnt++] = {&pi, sizeof(pi)};
+    if (mVnetHdr) iov[iovcnt++] = {&vnet, sizeof(vnet)};
+    iov[iovcnt++] = {const_cast<uint8_t*>(packet), len};
+
+    // Any queue of a multi-queue tun interface delivers the packet to the kernel.
+    return writev(mTunFds[0], iov, iovcnt) >= 0;
+}
+
+}  // namespace clat
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,552 @@
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "libclat/clatengine.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "checksum.h"
+}
+
+namespace android {
+namespace net {
+namespace clat {
+
+static const char kIPv4LocalAddr[] = "192.0.0.4";
+static const char kIPv4RemoteAddr[] = "8.8.8.8";
+static const char kIPv6LocalAddr[] = "2001:db8:1:2:1:2:3:4";
+static const char kNat64Prefix[] = "64:ff9b::";
+
+class ClatEngineTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        ASSERT_EQ(1, inet_pton(AF_INET, kIPv4LocalAddr, &mAddrs.local4));
+        ASSERT_EQ(1, inet_pton(AF_INET, kIPv4RemoteAddr, &mRemote4));
+        ASSERT_EQ(1, inet_pton(AF_INET6, kIPv6LocalAddr, &mAddrs.local6));
+        ASSERT_EQ(1, inet_pton(AF_INET6, kNat64Prefix, &mAddrs.pfx96));
+        makeChecksumNeutral(&mAddrs.local6, mAddrs.local4, mAddrs.pfx96);
+        mRemote6 = mAddrs.pfx96;
+        mRemote6.s6_addr32[3] = mRemote4.s_addr;
+    }
+
+    std::vector<uint8_t> makeIpv4Packet(uint8_t protocol, const std::vector<uint8_t>& payload,
+                                        uint16_t fragOff = IP_DF) {
+        std::vector<uint8_t> packet(sizeof(iphdr) + payload.size());
+        iphdr ip = {};
+        ip.version = 4;
+        ip.ihl = 5;
+        ip.tos = 0x10;
+        ip.tot_len = htons(packet.size());
+        ip.id = htons(0x1234);
+        ip.frag_off = htons(fragOff);
+        ip.ttl = 64;
+        ip.protocol = protocol;
+        ip.saddr = mAddrs.local4.s_addr;
+        ip.daddr = mRemote4.s_addr;
+        ip.check = ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip)));
+        memcpy(packet.data(), &ip, sizeof(ip));
+        memcpy(packet.data() + sizeof(ip), payload.data(), payload.size());
+        return packet;
+    }
+
+    std::vector<uint8_t> makeIpv6Packet(uint8_t nxt, const std::vector<uint8_t>& payload) {
+        std::vector<uint8_t> packet(sizeof(ip6_hdr) + payload.size());
+        ip6_hdr ip6 = {};
+        ip6.ip6_flow = htonl(6 << 28 | 0x10 << 20);
+        ip6.ip6_plen = htons(payload.size());
+        ip6.ip6_nxt = nxt;
+        ip6.ip6_hlim = 64;
+        ip6.ip6_src = mRemote6;
+        ip6.ip6_dst = mAddrs.local6;
+        memcpy(packet.data(), &ip6, sizeof(ip6));
+        memcpy(packet.data() + sizeof(ip6), payload.data(), payload.size());
+        return packet;
+    }
+
+    // Returns the sum of the IPv6 pseudo-header and the upper-layer payload of a translated packet,
+    // which folds to zero iff the transport checksum is correct.
+    static uint16_t ipv6Checksum(const uint8_t* packet, size_t payloadOffset, uint8_t protocol) {
+        ip6_hdr ip6;
+        memcpy(&ip6, packet, sizeof(ip6));
+        const uint32_t len = sizeof(ip6) + ntohs(ip6.ip6_plen) - payloadOffset;
+        const uint32_t beLen = htonl(len);
+        const uint32_t beProtocol = htonl(protocol);
+        uint32_t sum = ip_checksum_add(0, &ip6.ip6_src, 32);
+        sum = ip_checksum_add(sum, &beLen, sizeof(beLen));
+        sum = ip_checksum_add(sum, &beProtocol, sizeof(beProtocol));
+        return ip_checksum_finish(ip_checksum_add(sum, packet + payloadOffset, len));
+    }
+
+    static std::vector<uint8_t> makeUdp(uint16_t len, bool zeroChecksum, const iphdr* ip) {
+        std::vector<uint8_t> udp(len, 0xa5);
+        udphdr hdr = {};
+        hdr.source = htons(12345);
+        hdr.dest = htons(53);
+        hdr.len = htons(len);
+        memcpy(udp.data(), &hdr, sizeof(hdr));
+        if (!zeroChecksum) {
+            const uint16_t words[2] = {htons(IPPROTO_UDP), htons(len)};
+            uint32_t sum = ip_checksum_add(0, &ip->saddr, 8);
+            sum = ip_checksum_add(sum, words, sizeof(words));
+            hdr.check = ip_checksum_finish(ip_checksum_add(sum, udp.data(), udp.size()));
+            memcpy(udp.data(), &hdr, sizeof(hdr));
+        }
+        return udp;
+    }
+
+    static std::vector<uint8_t> makeEcho(uint8_t type) {
+        std::vector<uint8_t> echo(64, 0x5a);
+        echo[0] = type;
+        echo[1] = 0;
+        echo[2] = echo[3] = 0;
+        uint16_t checksum = ip_checksum_finish(ip_checksum_add(0, echo.data(), echo.size()));
+        memcpy(&echo[2], &checksum, sizeof(checksum));
+        return echo;
+    }
+
+    // Turns a packet around, which keeps the header checksum valid.
+    static void swapIpv4Addresses(std::vector<uint8_t>& packet) {
+        std::swap_ranges(packet.begin() + offsetof(iphdr, saddr),
+                         packet.begin() + offsetof(iphdr, daddr),
+                         packet.begin() + offsetof(iphdr, daddr));
+    }
+
+    static void swapIpv6Addresses(std::vector<uint8_t>& packet) {
+        std::swap_ranges(packet.begin() + offsetof(ip6_hdr, ip6_src),
+                         packet.begin() + offsetof(ip6_hdr, ip6_dst),
+                         packet.begin() + offsetof(ip6_hdr, ip6_dst));
+    }
+
+    static std::vector<uint8_t> makeIcmpError(uint8_t type, uint8_t code, uint32_t param,
+                                              const std::vector<uint8_t>& quote) {
+        std::vector<uint8_t> icmp(sizeof(icmphdr) + quote.size());
+        icmp[0] = type;
+        icmp[1] = code;
+        param = htonl(param);
+        memcpy(&icmp[4], &param, sizeof(param));
+        memcpy(&icmp[sizeof(icmphdr)], quote.data(), quote.size());
+        uint16_t checksum = ip_checksum_finish(ip_checksum_add(0, icmp.data(), icmp.size()));
+        memcpy(&icmp[2], &checksum, sizeof(checksum));
+        return icmp;
+    }
+
+    // Wraps an ICMPv6 message into a packet from src, filling in its checksum.
+    std::vector<uint8_t> makeIcmp6Packet(std::vector<uint8_t> icmp6, const in6_addr& src) {
+        icmp6[2] = icmp6[3] = 0;
+        std::vector<uint8_t> packet = makeIpv6Packet(IPPROTO_ICMPV6, icmp6);
+        memcpy(packet.data() + offsetof(ip6_hdr, ip6_src), &src, sizeof(src));
+        uint16_t checksum = ipv6Checksum(packet.data(), sizeof(ip6_hdr), IPPROTO_ICMPV6);
+        memcpy(packet.data() + sizeof(ip6_hdr) + offsetof(icmp6_hdr, icmp6_cksum), &checksum,
+               sizeof(checksum));
+        return packet;
+    }
+
+    ClatAddresses mAddrs;
+    in_addr mRemote4;
+    in6_addr mRemote6;
+    uint8_t mOut[2048];
+};
+
+TEST_F(ClatEngineTest, TranslateUdp4to6) {
+    iphdr ip = {.saddr = mAddrs.local4.s_addr, .daddr = mRemote4.s_addr};
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(100, false, &ip));
+
+    int len = translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(ip6_hdr) + 100), len);
+
+    ip6_hdr ip6;
+    memcpy(&ip6, mOut, sizeof(ip6));
+    EXPECT_EQ(6, ip6.ip6_vfc >> 4);
+    EXPECT_EQ(0x10U, (ntohl(ip6.ip6_flow) >> 20) & 0xff);
+    EXPECT_EQ(100, ntohs(ip6.ip6_plen));
+    EXPECT_EQ(IPPROTO_UDP, ip6.ip6_nxt);
+    EXPECT_EQ(64, ip6.ip6_hlim);
+    EXPECT_TRUE(IN6_ARE_ADDR_EQUAL(&mAddrs.local6, &ip6.ip6_src));
+    EXPECT_TRUE(IN6_ARE_ADDR_EQUAL(&mRemote6, &ip6.ip6_dst));
+
+    // The checksum was not touched, yet is still correct thanks to the checksum neutral local6.
+    EXPECT_EQ(0, memcmp(packet.data() + sizeof(iphdr), mOut + sizeof(ip6_hdr), 100));
+    EXPECT_EQ(0, ipv6Checksum(mOut, sizeof(ip6_hdr), IPPROTO_UDP));
+}
+
+TEST_F(ClatEngineTest, TranslateUdpZeroChecksum4to6) {
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(40, true, nullptr));
+
+    int len = translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(ip6_hdr) + 40), len);
+    uint16_t checksum;
+    memcpy(&checksum, mOut + sizeof(ip6_hdr) + offsetof(udphdr, check), sizeof(checksum));
+    EXPECT_NE(0, checksum);
+    EXPECT_EQ(0, ipv6Checksum(mOut, sizeof(ip6_hdr), IPPROTO_UDP));
+
+    // Fragments of a datagram without checksum cannot be translated.
+    packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(40, true, nullptr), IP_MF);
+    EXPECT_EQ(-EOPNOTSUPP,
+              translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+}
+
+TEST_F(ClatEngineTest, TranslateIcmpEcho) {
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_ICMP, makeEcho(ICMP_ECHO));
+    int len = translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(ip6_hdr) + 64), len);
+    EXPECT_EQ(IPPROTO_ICMPV6, mOut[offsetof(ip6_hdr, ip6_nxt)]);
+    EXPECT_EQ(ICMP6_ECHO_REQUEST, mOut[sizeof(ip6_hdr)]);
+    EXPECT_EQ(0, ipv6Checksum(mOut, sizeof(ip6_hdr), IPPROTO_ICMPV6));
+
+    // Answer with an ICMPv6 echo reply, whose checksum covers the IPv6 pseudo-header.
+    std::vector<uint8_t> reply = makeIpv6Packet(IPPROTO_ICMPV6, makeEcho(ICMP6_ECHO_REPLY));
+    icmp6_hdr icmp6;
+    memcpy(&icmp6, reply.data() + sizeof(ip6_hdr), sizeof(icmp6));
+    icmp6.icmp6_cksum = 0;
+    memcpy(reply.data() + sizeof(ip6_hdr), &icmp6, sizeof(icmp6));
+    uint16_t checksum = ipv6Checksum(reply.data(), sizeof(ip6_hdr), IPPROTO_ICMPV6);
+    memcpy(reply.data() + sizeof(ip6_hdr) + offsetof(icmp6_hdr, icmp6_cksum), &checksum,
+           sizeof(checksum));
+
+    len = translate_6to4(mAddrs, reply.data(), reply.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(iphdr) + 64), len);
+    iphdr ip;
+    memcpy(&ip, mOut, sizeof(ip));
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip))));
+    EXPECT_EQ(IPPROTO_ICMP, ip.protocol);
+    EXPECT_EQ(IP_DF, ntohs(ip.frag_off));
+    EXPECT_EQ(mRemote4.s_addr, ip.saddr);
+    EXPECT_EQ(mAddrs.local4.s_addr, ip.daddr);
+    EXPECT_EQ(ICMP_ECHOREPLY, mOut[sizeof(iphdr)]);
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, mOut + sizeof(iphdr), 64)));
+
+    // Other ICMP messages are left to the kernel.
+    packet = makeIpv4Packet(IPPROTO_ICMP, makeEcho(ICMP_TIMESTAMP));
+    EXPECT_EQ(-EOPNOTSUPP,
+              translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+}
+
+TEST_F(ClatEngineTest, TranslateFragments) {
+    // A non-first fragment at offset 1480 with more fragments to come.
+    std::vector<uint8_t> payload(200, 0x42);
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, payload, IP_MF | (1480 / 8));
+
+    int len = translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(ip6_hdr) + sizeof(ip6_frag) + payload.size()), len);
+    EXPECT_EQ(IPPROTO_FRAGMENT, mOut[offsetof(ip6_hdr, ip6_nxt)]);
+    ip6_frag frag;
+    memcpy(&frag, mOut + sizeof(ip6_hdr), sizeof(frag));
+    EXPECT_EQ(IPPROTO_UDP, frag.ip6f_nxt);
+    EXPECT_EQ(1480 | 1, ntohs(frag.ip6f_offlg));
+    EXPECT_EQ(0x1234U, ntohl(frag.ip6f_ident));
+
+    // The same fragment coming back is translated into an IPv4 fragment.
+    std::vector<uint8_t> frag6(mOut + sizeof(ip6_hdr), mOut + len);
+    std::vector<uint8_t> reply = makeIpv6Packet(IPPROTO_FRAGMENT, frag6);
+    len = translate_6to4(mAddrs, reply.data(), reply.size(), mOut, sizeof(mOut));
+    ASSERT_EQ((int)(sizeof(iphdr) + payload.size()), len);
+    iphdr ip;
+    memcpy(&ip, mOut, sizeof(ip));
+    EXPECT_EQ(IP_MF | (1480 / 8), ntohs(ip.frag_off));
+    EXPECT_EQ(0x1234, ntohs(ip.id));
+    EXPECT_EQ(IPPROTO_UDP, ip.protocol);
+    EXPECT_EQ(0, memcmp(payload.data(), mOut + sizeof(iphdr), payload.size()));
+}
+
+TEST_F(ClatEngineTest, TranslateRejectsInvalidPackets) {
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(40, true, nullptr));
+
+    // Not from the local IPv4 address.
+    in_addr local4 = mAddrs.local4;
+    mAddrs.local4.s_addr ^= htonl(1);
+    std::vector<uint8_t> other = makeIpv4Packet(IPPROTO_UDP, makeUdp(40, true, nullptr));
+    mAddrs.local4 = local4;
+    EXPECT_EQ(-EADDRNOTAVAIL, translate_4to6(mAddrs, other.data(), other.size(), mOut, 2048));
+
+    // Bad header checksum.
+    other = packet;
+    other[offsetof(iphdr, check)] ^= 1;
+    EXPECT_EQ(-EINVAL, translate_4to6(mAddrs, other.data(), other.size(), mOut, 2048));
+
+    // Truncated.
+    EXPECT_EQ(-EINVAL, translate_4to6(mAddrs, packet.data(), packet.size() - 1, mOut, 2048));
+
+    // Output buffer too small.
+    EXPECT_EQ(-EMSGSIZE, translate_4to6(mAddrs, packet.data(), packet.size(), mOut, 50));
+
+    // Not from the NAT64 prefix, or not to the local IPv6 address.
+    std::vector<uint8_t> reply = makeIpv6Packet(IPPROTO_UDP, makeUdp(40, true, nullptr));
+    other = reply;
+    other[offsetof(ip6_hdr, ip6_src)] ^= 1;
+    EXPECT_EQ(-EADDRNOTAVAIL, translate_6to4(mAddrs, other.data(), other.size(), mOut, 2048));
+    other = reply;
+    other[offsetof(ip6_hdr, ip6_dst) + 15] ^= 1;
+    EXPECT_EQ(-EADDRNOTAVAIL, translate_6to4(mAddrs, other.data(), other.size(), mOut, 2048));
+
+    // Extension headers other than the fragment header.
+    reply = makeIpv6Packet(IPPROTO_DSTOPTS, std::vector<uint8_t>(16));
+    EXPECT_EQ(-EOPNOTSUPP, translate_6to4(mAddrs, reply.data(), reply.size(), mOut, 2048));
+}
+
+TEST_F(ClatEngineTest, TranslateIcmpErrors4to6) {
+    // The local stack refuses a datagram which the remote host sent.
+    iphdr ip = {.saddr = mAddrs.local4.s_addr, .daddr = mRemote4.s_addr};
+    std::vector<uint8_t> quote = makeIpv4Packet(IPPROTO_UDP, makeUdp(100, false, &ip));
+    swapIpv4Addresses(quote);
+    std::vector<uint8_t> packet = makeIpv4Packet(
+            IPPROTO_ICMP, makeIcmpError(ICMP_DEST_UNREACH, ICMP_PORT_UNREACH, 0, quote));
+
+    // The quoted IPv4 header grows into an IPv6 header.
+    int len = translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    const size_t quote6len = sizeof(ip6_hdr) + 100;
+    ASSERT_EQ((int)(sizeof(ip6_hdr) + sizeof(icmp6_hdr) + quote6len), len);
+    EXPECT_EQ(sizeof(icmp6_hdr) + quote6len, ntohs(*(uint16_t*)(mOut + 4)));
+    EXPECT_EQ(IPPROTO_ICMPV6, mOut[offsetof(ip6_hdr, ip6_nxt)]);
+    const uint8_t* icmp6 = mOut + sizeof(ip6_hdr);
+    EXPECT_EQ(ICMP6_DST_UNREACH, icmp6[0]);
+    EXPECT_EQ(ICMP6_DST_UNREACH_NOPORT, icmp6[1]);
+    EXPECT_EQ(0, ipv6Checksum(mOut, sizeof(ip6_hdr), IPPROTO_ICMPV6));
+
+    ip6_hdr inner;
+    memcpy(&inner, icmp6 + sizeof(icmp6_hdr), sizeof(inner));
+    EXPECT_EQ(100, ntohs(inner.ip6_plen));
+    EXPECT_EQ(IPPROTO_UDP, inner.ip6_nxt);
+    EXPECT_TRUE(IN6_ARE_ADDR_EQUAL(&mRemote6, &inner.ip6_src));
+    EXPECT_TRUE(IN6_ARE_ADDR_EQUAL(&mAddrs.local6, &inner.ip6_dst));
+    EXPECT_EQ(0, memcmp(quote.data() + sizeof(iphdr), icmp6 + sizeof(icmp6_hdr) + sizeof(inner),
+                        100));
+
+    // Fragmentation needed becomes packet too big, with room for the larger header.
+    packet = makeIpv4Packet(IPPROTO_ICMP,
+                            makeIcmpError(ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, 1400, quote));
+    ASSERT_LT(0, translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+    EXPECT_EQ(ICMP6_PACKET_TOO_BIG, icmp6[0]);
+    uint32_t mtu;
+    memcpy(&mtu, icmp6 + offsetof(icmp6_hdr, icmp6_data32), sizeof(mtu));
+    EXPECT_EQ(1420U, ntohl(mtu));
+    EXPECT_EQ(0, ipv6Checksum(mOut, sizeof(ip6_hdr), IPPROTO_ICMPV6));
+
+    // Errors without an ICMPv6 equivalent, or about packets which were not for local4.
+    packet = makeIpv4Packet(IPPROTO_ICMP, makeIcmpError(ICMP_SOURCE_QUENCH, 0, 0, quote));
+    EXPECT_EQ(-EOPNOTSUPP,
+              translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+    swapIpv4Addresses(quote);
+    packet = makeIpv4Packet(IPPROTO_ICMP,
+                            makeIcmpError(ICMP_DEST_UNREACH, ICMP_PORT_UNREACH, 0, quote));
+    EXPECT_EQ(-EADDRNOTAVAIL,
+              translate_4to6(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+}
+
+TEST_F(ClatEngineTest, TranslateIcmpErrors6to4) {
+    // A router with a native IPv6 address cannot forward a packet that the local host sent.
+    std::vector<uint8_t> quote = makeIpv6Packet(IPPROTO_UDP, makeUdp(1200, true, nullptr));
+    swapIpv6Addresses(quote);
+    in6_addr router;
+    ASSERT_EQ(1, inet_pton(AF_INET6, "2001:db8:ffff::1", &router));
+    std::vector<uint8_t> packet =
+            makeIcmp6Packet(makeIcmpError(ICMP6_PACKET_TOO_BIG, 0, 1400, quote), router);
+
+    // The quote is cut to fit the 576 bytes of an ICMP error.
+    int len = translate_6to4(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut));
+    ASSERT_EQ(576, len);
+    iphdr ip;
+    memcpy(&ip, mOut, sizeof(ip));
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip))));
+    EXPECT_EQ(576, ntohs(ip.tot_len));
+    EXPECT_EQ(IPPROTO_ICMP, ip.protocol);
+    EXPECT_EQ(htonl(0xff000040), ip.saddr);  // 255.0.0.<ttl>
+    EXPECT_EQ(mAddrs.local4.s_addr, ip.daddr);
+
+    const uint8_t* icmp = mOut + sizeof(iphdr);
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, icmp, len - sizeof(iphdr))));
+    EXPECT_EQ(ICMP_DEST_UNREACH, icmp[0]);
+    EXPECT_EQ(ICMP_FRAG_NEEDED, icmp[1]);
+    uint16_t mtu;
+    memcpy(&mtu, icmp + offsetof(icmphdr, un.frag.mtu), sizeof(mtu));
+    EXPECT_EQ(1400 - 28, ntohs(mtu));
+
+    iphdr inner;
+    memcpy(&inner, icmp + sizeof(icmphdr), sizeof(inner));
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, &inner, sizeof(inner))));
+    EXPECT_EQ(sizeof(iphdr) + 1200, ntohs(inner.tot_len));
+    EXPECT_EQ(IPPROTO_UDP, inner.protocol);
+    EXPECT_EQ(mAddrs.local4.s_addr, inner.saddr);
+    EXPECT_EQ(mRemote4.s_addr, inner.daddr);
+
+    // From within the NAT64 prefix, the source address is translated as usual.
+    packet = makeIcmp6Packet(makeIcmpError(ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT, 0, quote),
+                             mRemote6);
+    ASSERT_LT(0, translate_6to4(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+    memcpy(&ip, mOut, sizeof(ip));
+    EXPECT_EQ(mRemote4.s_addr, ip.saddr);
+    EXPECT_EQ(ICMP_DEST_UNREACH, icmp[0]);
+    EXPECT_EQ(ICMP_PORT_UNREACH, icmp[1]);
+
+    // Anything but errors must come from the NAT64 prefix.
+    packet = makeIcmp6Packet(makeEcho(ICMP6_ECHO_REPLY), router);
+    EXPECT_EQ(-EADDRNOTAVAIL,
+              translate_6to4(mAddrs, packet.data(), packet.size(), mOut, sizeof(mOut)));
+}
+
+TEST_F(ClatEngineTest, MakeFragNeeded) {
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, std::vector<uint8_t>(1400));
+    int len = make_frag_needed(packet.data(), packet.size(), 1252, mOut, sizeof(mOut));
+    ASSERT_EQ(576, len);
+    iphdr ip;
+    memcpy(&ip, mOut, sizeof(ip));
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, &ip, sizeof(ip))));
+    EXPECT_EQ(mRemote4.s_addr, ip.saddr);
+    EXPECT_EQ(mAddrs.local4.s_addr, ip.daddr);
+    const uint8_t* icmp = mOut + sizeof(iphdr);
+    EXPECT_EQ(0, ip_checksum_finish(ip_checksum_add(0, icmp, len - sizeof(iphdr))));
+    EXPECT_EQ(ICMP_DEST_UNREACH, icmp[0]);
+    EXPECT_EQ(ICMP_FRAG_NEEDED, icmp[1]);
+    uint16_t mtu;
+    memcpy(&mtu, icmp + offsetof(icmphdr, un.frag.mtu), sizeof(mtu));
+    EXPECT_EQ(1252, ntohs(mtu));
+    EXPECT_EQ(0, memcmp(packet.data(), icmp + sizeof(icmphdr), len - sizeof(iphdr) - 8));
+
+    // Never about an ICMP error or a non-first fragment.
+    packet = makeIpv4Packet(IPPROTO_ICMP, makeIcmpError(ICMP_DEST_UNREACH, 0, 0, packet));
+    EXPECT_EQ(-EOPNOTSUPP, make_frag_needed(packet.data(), packet.size(), 1252, mOut, 2048));
+    packet = makeIpv4Packet(IPPROTO_UDP, std::vector<uint8_t>(1400), 185);
+    EXPECT_EQ(-EOPNOTSUPP, make_frag_needed(packet.data(), packet.size(), 1252, mOut, 2048));
+}
+
+TEST_F(ClatEngineTest, Fragment4to6) {
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(3000, true, nullptr), 0);
+
+    // Translate and reassemble the fragments.
+    std::vector<uint8_t> reassembled;
+    int count = 0;
+    auto fn = [&](const uint8_t* frag, size_t fraglen) {
+        count++;
+        uint8_t out[2048];
+        int len = translate_4to6(mAddrs, frag, fraglen, out, sizeof(out));
+        ASSERT_LE(0, len);
+        EXPECT_GE(1280, len);
+        ASSERT_EQ(IPPROTO_FRAGMENT, out[offsetof(ip6_hdr, ip6_nxt)]);
+        ip6_frag frag6;
+        memcpy(&frag6, out + sizeof(ip6_hdr), sizeof(frag6));
+        const size_t offset = ntohs(frag6.ip6f_offlg) & ~7;
+        EXPECT_EQ(reassembled.size(), offset);
+        EXPECT_EQ(reassembled.size() + len - sizeof(ip6_hdr) - sizeof(frag6) < 3000,
+                  (bool)(ntohs(frag6.ip6f_offlg) & 1));
+        reassembled.insert(reassembled.end(), out + sizeof(ip6_hdr) + sizeof(frag6), out + len);
+    };
+    uint8_t buf[2048];
+    ASSERT_EQ(0, fragment_4to6(packet.data(), packet.size(), 1280, buf, sizeof(buf), fn));
+    EXPECT_EQ(3, count);
+    ASSERT_EQ(3000U, reassembled.size());
+
+    // The zero checksum was filled in before fragmenting, and holds for IPv6.
+    std::vector<uint8_t> whole = makeIpv6Packet(IPPROTO_UDP, reassembled);
+    swapIpv6Addresses(whole);
+    EXPECT_NE(0, whole[sizeof(ip6_hdr) + offsetof(udphdr, check)] |
+                         whole[sizeof(ip6_hdr) + offsetof(udphdr, check) + 1]);
+    EXPECT_EQ(0, ipv6Checksum(whole.data(), sizeof(ip6_hdr), IPPROTO_UDP));
+
+    // Packets with DF must be refused instead.
+    packet = makeIpv4Packet(IPPROTO_UDP, makeUdp(3000, true, nullptr));
+    EXPECT_EQ(-EMSGSIZE, fragment_4to6(packet.data(), packet.size(), 1280, buf, sizeof(buf), fn));
+}
+
+static bool waitForStats(ClatEngine& engine, uint64_t packets6to4, uint64_t dropped) {
+    for (int i = 0; i < 100; i++) {
+        ClatEngineStats stats = engine.getStats();
+        if (stats.packets6to4 == packets6to4 && stats.dropped == dropped) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST_F(ClatEngineTest, EngineWritesTranslatedPacketsToTun) {
+    // Stand in for the tun interface and the packet socket with datagram socket pairs, which keep
+    // the packet boundaries. Writing to the raw socket is not exercised here.
+    int tun[2], sock6[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, tun));
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sock6));
+
+    ClatEngineConfig config = {
+            .addrs = mAddrs,
+            .tunFds = {tun[0]},
+            .vnetHdr = false,
+            .readSock6 = sock6[0],
+            .packetRing = false,
+            .writeSock6 = sock6[0],
+    };
+    int error = 0;
+    std::unique_ptr<ClatEngine> engine = ClatEngine::start(config, &error);
+    ASSERT_NE(nullptr, engine) << strerror(-error);
+    // The engine owns duplicates of the file descriptors.
+    close(tun[0]);
+    close(sock6[0]);
+
+    std::vector<uint8_t> reply = makeIpv6Packet(IPPROTO_UDP, makeUdp(40, true, nullptr));
+    ASSERT_EQ((ssize_t)reply.size(), write(sock6[1], reply.data(), reply.size()));
+
+    pollfd pfd = {.fd = tun[1], .events = POLLIN};
+    ASSERT_EQ(1, poll(&pfd, 1, 1000));
+    uint8_t buf[2048];
+    ssize_t len = read(tun[1], buf, sizeof(buf));
+    ASSERT_EQ((ssize_t)(sizeof(tun_pi) + sizeof(iphdr) + 40), len);
+    tun_pi pi;
+    memcpy(&pi, buf, sizeof(pi));
+    EXPECT_EQ(htons(ETH_P_IP), pi.proto);
+    iphdr ip;
+    memcpy(&ip, buf + sizeof(pi), sizeof(ip));
+    EXPECT_EQ(mAddrs.local4.s_addr, ip.daddr);
+    EXPECT_EQ(IPPROTO_UDP, ip.protocol);
+    EXPECT_TRUE(waitForStats(*engine, 1, 0));
+
+    // Packets that cannot be translated are counted and dropped.
+    reply[offsetof(ip6_hdr, ip6_src)] ^= 1;
+    ASSERT_EQ((ssize_t)reply.size(), write(sock6[1], reply.data(), reply.size()));
+    EXPECT_TRUE(waitForStats(*engine, 1, 1));
+
+    // Packets with DF which do not fit in the path mtu are refused through the tun interface.
+    engine->setPathMtu(1280);
+    std::vector<uint8_t> packet = makeIpv4Packet(IPPROTO_UDP, std::vector<uint8_t>(1300));
+    tun_pi outPi = {.flags = 0, .proto = htons(ETH_P_IP)};
+    packet.insert(packet.begin(), (uint8_t*)&outPi, (uint8_t*)(&outPi + 1));
+    ASSERT_EQ((ssize_t)packet.size(), write(tun[1], packet.data(), packet.size()));
+    ASSERT_EQ(1, poll(&pfd, 1, 1000));
+    len = read(tun[1], buf, sizeof(buf));
+    ASSERT_EQ((ssize_t)(sizeof(tun_pi) + 576), len);
+    const uint8_t* icmp = buf + sizeof(tun_pi) + sizeof(iphdr);
+    EXPECT_EQ(ICMP_DEST_UNREACH, icmp[0]);
+    EXPECT_EQ(ICMP_FRAG_NEEDED, icmp[1]);
+    EXPECT_EQ(1280 - 28, ntohs(*(uint16_t*)(icmp + offsetof(icmphdr, un.frag.mtu))));
+    EXPECT_TRUE(waitForStats(*engine, 1, 2));
+
+    engine.reset();
+    close(tun[1]);
+    close(sock6[1]);
+}
+
+}  // namespace clat
+}  // namespace net
+}  // namespace android
@@ -18,13 +18,23 @@
 
 #include <errno.h>
 #include <linux/filter.h>
+#include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/if_addr.h>
 #include <linux/if_tun.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <log/log.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <functional>
+#include <vector>
+
 extern "C" {
 #include "checksum.h"
 }
@@ -67,6 +77,12 @@ bool isIpv4AddressFree(in_addr_t addr) {
 //   prefixlen - the length of the prefix from which addresses may be selected.
 //   returns: the IPv4 address, or INADDR_NONE if no addresses were available
 in_addr_t selectIpv4Address(const in_addr ip, int16_t prefixlen) {
+    // A single address dump is much cheaper than probing candidates one socket at a time. Only
+    // fall back to probing if the dump fails.
+    std::vector<in_addr_t> addrs;
+    if (getIpv4Addresses(&addrs) == 0) {
+        return selectIpv4AddressInternal(ip, prefixlen, addrs);
+    }
     return selectIpv4AddressInternal(ip, prefixlen, isIpv4AddressFree);
 }
 
@@ -102,6 +118,47 @@ in_addr_t selectIpv4AddressInternal(const in_addr ip, int16_t prefixlen,
     return INADDR_NONE;
 }
 
+// Same as above, but takes the addresses in use (in network byte order) instead of probing them.
+// The addresses within the prefix are marked in a bitmap, which is then scanned 64 addresses at a
+// time in the same order, starting from ip and wrapping around.
+in_addr_t selectIpv4AddressInternal(const in_addr ip, int16_t prefixlen,
+                                    const std::vector<in_addr_t>& usedAddrs) {
+    if (prefixlen < 16 || prefixlen > 32) {
+        return INADDR_NONE;
+    }
+
+    // All these are in host byte order.
+    const in_addr_t mask = 0xffffffff >> (32 - prefixlen) << (32 - prefixlen);
+    const in_addr_t prefix = ntohl(ip.s_addr) & mask;
+    const uint32_t size = ~mask + 1;
+    const uint32_t words = (size + 63) / 64;
+
+    std::vector<uint64_t> used(words, 0);
+    // Addresses past the end of a prefix smaller than 64 addresses are never free.
+    if (size % 64) used[words - 1] = ~0ULL << (size % 64);
+    for (in_addr_t addr : usedAddrs) {
+        addr = ntohl(addr);
+        if ((addr & mask) != prefix) continue;
+        const uint32_t offset = addr & ~mask;
+        used[offset / 64] |= 1ULL << (offset % 64);
+    }
+
+    const uint32_t start = ntohl(ip.s_addr) & ~mask;
+    // Scan from the start word to the end, then wrap around. The start word is visited twice:
+    // first for the addresses from start upwards, and last for those below start.
+    for (uint32_t i = 0; i <= words; i++) {
+        const uint32_t w = (start / 64 + i) % words;
+        uint64_t free = ~used[w];
+        if (i == 0) free &= ~0ULL << (start % 64);
+        if (i == words) free &= ~(~0ULL << (start % 64));
+        if (free) {
+            return htonl(prefix | (w * 64 + __builtin_ctzll(free)));
+        }
+    }
+
+    return INADDR_NONE;
+}
+
 // Alters the bits in the IPv6 address to make them checksum neutral with v4 and nat64Prefix.
 void makeChecksumNeutral(in6_addr* v6, const in_addr v4, const in6_addr& nat64Prefix) {
     // Fill last 8 bytes of IPv6 address with random bits.
@@ -219,6 +276,363 @@ int detect_mtu(const struct in6_addr* plat_subnet, uint32_t plat_suffix, uint32_
     return mtu;
 }
 
+// Appends a netlink attribute to the request, returns false if it does not fit in maxlen bytes.
+static bool addNetlinkAttr(nlmsghdr* n, size_t maxlen, uint16_t type, const void* data,
+                           size_t len) {
+    const size_t rtalen = RTA_LENGTH(len);
+    if (NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rtalen) > maxlen) return false;
+
+    rtattr* rta = reinterpret_cast<rtattr*>(reinterpret_cast<char*>(n) + NLMSG_ALIGN(n->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = rtalen;
+    memcpy(RTA_DATA(rta), data, len);
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rtalen);
+    return true;
+}
+
+// Sends a request on a NETLINK_ROUTE socket and passes every message of the reply (which may be
+// a multipart dump) to the given callback.
+//   returns: 0 on success, -errno on failure
+static int sendNetlinkRequest(nlmsghdr* req, const std::function<void(const nlmsghdr*)>& fn) {
+    int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (s == -1) return -errno;
+
+    req->nlmsg_seq = 1;
+    if (send(s, req, req->nlmsg_len, 0) != static_cast<ssize_t>(req->nlmsg_len)) {
+        int ret = errno;
+        ALOGE("send netlink request failed: %s", strerror(errno));
+        close(s);
+        return -ret;
+    }
+
+    alignas(nlmsghdr) char buf[8192];
+    int ret = 0;
+    bool done = false;
+    while (!done) {
+        ssize_t len = recv(s, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            ret = -errno;
+            break;
+        }
+        if (len == 0) break;
+
+        for (nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nh, len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                done = true;
+                break;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                // An error code of 0 is an ack.
+                ret = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nh))->error;
+                done = true;
+                break;
+            }
+            fn(nh);
+            if (!(nh->nlmsg_flags & NLM_F_MULTI)) done = true;
+        }
+    }
+
+    close(s);
+    return ret;
+}
+
+// Dumps the IPv4 addresses assigned to all interfaces with a single RTM_GETADDR request.
+//   addrs - filled with the local addresses, in network byte order
+//   returns: 0 on success, -errno on failure
+int getIpv4Addresses(std::vector<in_addr_t>* addrs) {
+    struct {
+        nlmsghdr n;
+        ifaddrmsg ifa;
+    } req = {
+            .n =
+                    {
+                            .nlmsg_len = NLMSG_LENGTH(sizeof(ifaddrmsg)),
+                            .nlmsg_type = RTM_GETADDR,
+                            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+                    },
+            .ifa = {.ifa_family = AF_INET},
+    };
+
+    addrs->clear();
+    int ret = sendNetlinkRequest(&req.n, [addrs](const nlmsghdr* nh) {
+        if (nh->nlmsg_type != RTM_NEWADDR) return;
+        const ifaddrmsg* ifa = reinterpret_cast<const ifaddrmsg*>(NLMSG_DATA(nh));
+        if (ifa->ifa_family != AF_INET) return;
+
+        // IFA_LOCAL is the local address; IFA_ADDRESS is the peer on point-to-point links, and
+        // only present alone on broadcast links where the two are the same.
+        const in_addr_t* local = nullptr;
+        const in_addr_t* address = nullptr;
+        int len = IFA_PAYLOAD(nh);
+        for (const rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (RTA_PAYLOAD(rta) < sizeof(in_addr_t)) continue;
+            if (rta->rta_type == IFA_LOCAL) {
+                local = reinterpret_cast<const in_addr_t*>(RTA_DATA(rta));
+            } else if (rta->rta_type == IFA_ADDRESS) {
+                address = reinterpret_cast<const in_addr_t*>(RTA_DATA(rta));
+            }
+        }
+        if (local != nullptr) {
+            addrs->push_back(*local);
+        } else if (address != nullptr) {
+            addrs->push_back(*address);
+        }
+    });
+    if (ret < 0) {
+        ALOGE("address dump failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+// Finds the next hop towards plat_subnet(96 bits):plat_suffix(32 bits) through the routing table,
+// as seen by a socket with the given mark, and returns its link layer address from the neighbour
+// table.  This is the destination mac address of translated packets on an ethernet upstream.
+//   plat_subnet - the NAT64 prefix
+//   plat_suffix - the bottom 32 bits of the destination, see detect_mtu
+//   ifindex     - the upstream interface the next hop must be reached through
+//   mark        - the socket mark used by clat for routing decisions (network selection)
+//   mac         - output buffer of ETH_ALEN bytes for the neighbour's mac address
+// returns: 0 on success, -errno on failure (-ENOENT if the neighbour is not resolved)
+int get_next_hop_mac(const struct in6_addr* plat_subnet, uint32_t plat_suffix, int ifindex,
+                     uint32_t mark, uint8_t* mac) {
+    struct in6_addr dst = *plat_subnet;
+    dst.s6_addr32[3] = plat_suffix;
+
+    struct {
+        nlmsghdr n;
+        rtmsg r;
+        char attrs[64];
+    } routeReq = {
+            .n = {.nlmsg_len = NLMSG_LENGTH(sizeof(rtmsg)),
+                  .nlmsg_type = RTM_GETROUTE,
+                  .nlmsg_flags = NLM_F_REQUEST},
+            .r = {.rtm_family = AF_INET6, .rtm_dst_len = 128},
+    };
+    if (!addNetlinkAttr(&routeReq.n, sizeof(routeReq), RTA_DST, &dst, sizeof(dst)) ||
+        !addNetlinkAttr(&routeReq.n, sizeof(routeReq), RTA_OIF, &ifindex, sizeof(ifindex)) ||
+        ((mark != MARK_UNSET) &&
+         !addNetlinkAttr(&routeReq.n, sizeof(routeReq), RTA_MARK, &mark, sizeof(mark)))) {
+        return -ENOBUFS;
+    }
+
+    // Without a gateway the destination itself is on-link and is the next hop.
+    struct in6_addr nextHop = dst;
+    int oif = 0;
+    int ret = sendNetlinkRequest(&routeReq.n, [&](const nlmsghdr* nh) {
+        if (nh->nlmsg_type != RTM_NEWROUTE) return;
+        const rtmsg* rtm = reinterpret_cast<const rtmsg*>(NLMSG_DATA(nh));
+        int len = RTM_PAYLOAD(nh);
+        for (const rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == RTA_GATEWAY && RTA_PAYLOAD(rta) == sizeof(nextHop)) {
+                memcpy(&nextHop, RTA_DATA(rta), sizeof(nextHop));
+            } else if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) == sizeof(oif)) {
+                memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+            }
+        }
+    });
+    if (ret < 0) {
+        ALOGE("route lookup failed: %s", strerror(-ret));
+        return ret;
+    }
+    if (oif != ifindex) return -ENETUNREACH;
+
+    // Dump the IPv6 neighbours of the interface. A dump works on all kernels, whereas a single
+    // RTM_GETNEIGH lookup is only supported from 4.18.
+    struct {
+        nlmsghdr n;
+        ndmsg nd;
+    } neighReq = {
+            .n = {.nlmsg_len = NLMSG_LENGTH(sizeof(ndmsg)),
+                  .nlmsg_type = RTM_GETNEIGH,
+                  .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP},
+            .nd = {.ndm_family = AF_INET6, .ndm_ifindex = ifindex},
+    };
+
+    bool found = false;
+    ret = sendNetlinkRequest(&neighReq.n, [&](const nlmsghdr* nh) {
+        if (found || nh->nlmsg_type != RTM_NEWNEIGH) return;
+        const ndmsg* ndm = reinterpret_cast<const ndmsg*>(NLMSG_DATA(nh));
+        // Older kernels ignore the ifindex filter of the dump request.
+        if (ndm->ndm_ifindex != ifindex) return;
+        if (!(ndm->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE |
+                                NUD_PERMANENT))) {
+            return;
+        }
+
+        const void* neighDst = nullptr;
+        const void* lladdr = nullptr;
+        int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+        for (const rtattr* rta = reinterpret_cast<const rtattr*>(
+                     reinterpret_cast<const char*>(ndm) + NLMSG_ALIGN(sizeof(*ndm)));
+             RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(nextHop)) {
+                neighDst = RTA_DATA(rta);
+            } else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN) {
+                lladdr = RTA_DATA(rta);
+            }
+        }
+        if (neighDst && lladdr && !memcmp(neighDst, &nextHop, sizeof(nextHop))) {
+            memcpy(mac, lladdr, ETH_ALEN);
+            found = true;
+        }
+    });
+    if (ret < 0) {
+        ALOGE("neighbour dump failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    return found ? 0 : -ENOENT;
+}
+
+// Looks up the MTU of the path towards plat_subnet(96 bits):plat_suffix(32 bits) with a single
+// RTM_GETROUTE request instead of connecting a socket as detect_mtu does. The route returned by
+// the kernel carries the path MTU learnt from Packet Too Big messages, if any, in its metrics;
+// otherwise the MTU of the output interface applies.
+//   plat_subnet - the NAT64 prefix
+//   plat_suffix - the bottom 32 bits of the destination, see detect_mtu
+//   mark        - the socket mark used by clat for routing decisions (network selection)
+// returns: the MTU on success, -errno on failure
+int get_route_mtu(const struct in6_addr* plat_subnet, uint32_t plat_suffix, uint32_t mark) {
+    struct in6_addr dst = *plat_subnet;
+    dst.s6_addr32[3] = plat_suffix;
+
+    struct {
+        nlmsghdr n;
+        rtmsg r;
+        char attrs[64];
+    } routeReq = {
+            .n = {.nlmsg_len = NLMSG_LENGTH(sizeof(rtmsg)),
+                  .nlmsg_type = RTM_GETROUTE,
+                  .nlmsg_flags = NLM_F_REQUEST},
+            .r = {.rtm_family = AF_INET6, .rtm_dst_len = 128},
+    };
+    if (!addNetlinkAttr(&routeReq.n, sizeof(routeReq), RTA_DST, &dst, sizeof(dst)) ||
+        ((mark != MARK_UNSET) &&
+         !addNetlinkAttr(&routeReq.n, sizeof(routeReq), RTA_MARK, &mark, sizeof(mark)))) {
+        return -ENOBUFS;
+    }
+
+    uint32_t mtu = 0;
+    int oif = 0;
+    int ret = sendNetlinkRequest(&routeReq.n, [&](const nlmsghdr* nh) {
+        if (nh->nlmsg_type != RTM_NEWROUTE) return;
+        const rtmsg* rtm = reinterpret_cast<const rtmsg*>(NLMSG_DATA(nh));
+        int len = RTM_PAYLOAD(nh);
+        for (const rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) == sizeof(oif)) {
+                memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+            } else if (rta->rta_type == RTA_METRICS) {
+                int mlen = RTA_PAYLOAD(rta);
+                for (const rtattr* m = reinterpret_cast<const rtattr*>(RTA_DATA(rta));
+                     RTA_OK(m, mlen); m = RTA_NEXT(m, mlen)) {
+                    if (m->rta_type == RTAX_MTU && RTA_PAYLOAD(m) == sizeof(mtu)) {
+                        memcpy(&mtu, RTA_DATA(m), sizeof(mtu));
+                    }
+                }
+            }
+        }
+    });
+    if (ret < 0) {
+        ALOGE("route lookup failed: %s", strerror(-ret));
+        return ret;
+    }
+    if (mtu) return mtu;
+    if (!oif) return -ENETUNREACH;
+
+    struct {
+        nlmsghdr n;
+        ifinfomsg ifi;
+    } linkReq = {
+            .n = {.nlmsg_len = NLMSG_LENGTH(sizeof(ifinfomsg)),
+                  .nlmsg_type = RTM_GETLINK,
+                  .nlmsg_flags = NLM_F_REQUEST},
+            .ifi = {.ifi_family = AF_UNSPEC, .ifi_index = oif},
+    };
+    ret = sendNetlinkRequest(&linkReq.n, [&](const nlmsghdr* nh) {
+        if (nh->nlmsg_type != RTM_NEWLINK) return;
+        const ifinfomsg* ifi = reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nh));
+        int len = IFLA_PAYLOAD(nh);
+        for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) == sizeof(mtu)) {
+                memcpy(&mtu, RTA_DATA(rta), sizeof(mtu));
+            }
+        }
+    });
+    if (ret < 0) {
+        ALOGE("link lookup failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    return mtu ? (int)mtu : -ENODATA;
+}
+
+// Opens a netlink socket which is notified of IPv6 route and link changes, both of which may
+// change the MTU returned by get_route_mtu, and of IPv6 neighbour changes, which may change the mac
+// address returned by get_next_hop_mac. Packet Too Big messages only create cached route
+// exceptions, which the kernel does not announce, so callers should also re-check periodically.
+// returns: the non-blocking socket on success, -errno on failure
+int open_route_monitor() {
+    int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (s == -1) return -errno;
+
+    struct sockaddr_nl snl = {
+            .nl_family = AF_NETLINK,
+            .nl_groups = RTMGRP_IPV6_ROUTE | RTMGRP_LINK | RTMGRP_NEIGH,
+    };
+    if (bind(s, reinterpret_cast<struct sockaddr*>(&snl), sizeof(snl))) {
+        int ret = errno;
+        ALOGE("bind route monitor failed: %s", strerror(errno));
+        close(s);
+        return -ret;
+    }
+
+    return s;
+}
+
+// Reads all pending notifications from a socket returned by open_route_monitor.
+// returns: the number of route, link or IPv6 neighbour notifications read, -errno on failure
+int read_route_monitor(int sock) {
+    alignas(nlmsghdr) char buf[8192];
+    int count = 0;
+    while (true) {
+        ssize_t len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            // Notifications were lost, so assume that something changed.
+            if (errno == ENOBUFS) {
+                count++;
+                continue;
+            }
+            return -errno;
+        }
+        for (nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nh, len);
+             nh = NLMSG_NEXT(nh, len)) {
+            switch (nh->nlmsg_type) {
+                case RTM_NEWROUTE:
+                case RTM_DELROUTE:
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                    count++;
+                    break;
+                case RTM_NEWNEIGH:
+                case RTM_DELNEIGH:
+                    // RTMGRP_NEIGH has no per family variant, skip the ARP entries.
+                    if (nh->nlmsg_len >= NLMSG_LENGTH(sizeof(ndmsg)) &&
+                        reinterpret_cast<const ndmsg*>(NLMSG_DATA(nh))->ndm_family == AF_INET6) {
+                        count++;
+                    }
+                    break;
+            }
+        }
+    }
+    return count;
+}
+
 /* function: configure_packet_socket
  * Binds the packet socket and attaches the receive filter to it.
  *   sock    - the socket to configure
@@ -272,6 +686,111 @@ int configure_packet_socket(int sock, in6_addr* addr, int ifindex) {
     return 0;
 }
 
+/* function: configure_packet_ring
+ * Switches the packet socket to TPACKET_V3 and sets up its PACKET_RX_RING. Once this is done the
+ * kernel no longer queues packets for recvfrom(), they must be read through map_packet_ring().
+ *   sock - the socket to configure, before it is bound with configure_packet_socket
+ * returns: 0 on success, -errno on failure
+ */
+int configure_packet_ring(int sock) {
+    int version = TPACKET_V3;
+    if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+        int res = errno;
+        ALOGE("setsockopt PACKET_VERSION failed: %s", strerror(errno));
+        return -res;
+    }
+
+    struct tpacket_req3 req = {
+            .tp_block_size = PACKET_RING_BLOCK_SIZE,
+            .tp_block_nr = PACKET_RING_BLOCK_COUNT,
+            .tp_frame_size = PACKET_RING_FRAME_SIZE,
+            .tp_frame_nr = PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE * PACKET_RING_BLOCK_COUNT,
+            .tp_retire_blk_tov = PACKET_RING_BLOCK_TIMEOUT_MS,
+    };
+    if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        int res = errno;
+        ALOGE("setsockopt PACKET_RX_RING failed: %s", strerror(errno));
+        return -res;
+    }
+
+    return 0;
+}
+
+/* function: map_packet_ring
+ * Maps the receive ring set up by configure_packet_ring into this process.
+ *   sock - the packet socket
+ *   ring - the ring to initialize, must be released with unmap_packet_ring
+ * returns: 0 on success, -errno on failure
+ */
+int map_packet_ring(int sock, struct packet_ring* ring) {
+    size_t len = (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCK_COUNT;
+    void* map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sock, 0);
+    if (map == MAP_FAILED) {
+        int res = errno;
+        ALOGE("mmap packet ring failed: %s", strerror(errno));
+        return -res;
+    }
+
+    ring->map = static_cast<uint8_t*>(map);
+    ring->len = len;
+    ring->next_block = 0;
+    return 0;
+}
+
+/* function: unmap_packet_ring
+ * Releases a ring mapped by map_packet_ring.
+ *   ring - the ring to release
+ */
+void unmap_packet_ring(struct packet_ring* ring) {
+    if (ring->map != nullptr) {
+        munmap(ring->map, ring->len);
+        ring->map = nullptr;
+        ring->len = 0;
+    }
+}
+
+/* function: read_packet_ring
+ * Waits for the kernel to retire the next block of the ring, passes every packet in it to fn and
+ * hands the block back to the kernel. A single poll() thus covers a whole block of packets.
+ *   sock       - the packet socket
+ *   ring       - the ring mapped by map_packet_ring
+ *   timeout_ms - how long to wait for a block, -1 to wait forever
+ *   fn         - called with the network header and length of each packet
+ * returns: number of packets read, 0 on timeout, -errno on failure
+ */
+int read_packet_ring(int sock, struct packet_ring* ring, int timeout_ms,
+                     const std::function<void(const uint8_t*, size_t)>& fn) {
+    uint8_t* block = ring->map + (size_t)ring->next_block * PACKET_RING_BLOCK_SIZE;
+    auto* desc = reinterpret_cast<tpacket_block_desc*>(block);
+
+    if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        struct pollfd pfd = {.fd = sock, .events = POLLIN | POLLERR};
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret < 0) return -errno;
+        if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            return 0;
+        }
+    }
+
+    const uint32_t num_pkts = desc->hdr.bh1.num_pkts;
+    const uint8_t* end = block + PACKET_RING_BLOCK_SIZE;
+    const uint8_t* p = block + desc->hdr.bh1.offset_to_first_pkt;
+    int count = 0;
+    while (count < (int)num_pkts && p + sizeof(tpacket3_hdr) <= end) {
+        auto* hdr = reinterpret_cast<const tpacket3_hdr*>(p);
+        // For SOCK_DGRAM sockets the mac header offset points at the network header.
+        if (p + hdr->tp_mac + hdr->tp_snaplen > end) break;
+        fn(p + hdr->tp_mac, hdr->tp_snaplen);
+        count++;
+        if (hdr->tp_next_offset == 0) break;
+        p += hdr->tp_next_offset;
+    }
+
+    __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->next_block = (ring->next_block + 1) % PACKET_RING_BLOCK_COUNT;
+    return count;
+}
+
 }  // namespace clat
 }  // namespace net
 }  // namespace android
@@ -17,8 +17,22 @@
 #include <android-base/stringprintf.h>
 #include <arpa/inet.h>
 #include <gtest/gtest.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
 #include <linux/if_packet.h>
+#include <linux/ipv6.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
 #include "tun_interface.h"
 
 extern "C" {
@@ -37,6 +51,106 @@ using base::StringPrintf;
 
 class ClatUtils : public ::testing::Test {};
 
+static rtattr* addAttr(nlmsghdr* n, uint16_t type, const void* data, size_t len) {
+    rtattr* rta = reinterpret_cast<rtattr*>(reinterpret_cast<uint8_t*>(n) +
+                                            NLMSG_ALIGN(n->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len) memcpy(RTA_DATA(rta), data, len);
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+static void endNest(nlmsghdr* n, rtattr* nest) {
+    nest->rta_len = reinterpret_cast<uint8_t*>(n) + n->nlmsg_len - reinterpret_cast<uint8_t*>(nest);
+}
+
+// Creates a veth pair with the given names, or deletes it (and thus its peer) if peer is null.
+static int vethRequest(const char* name, const char* peer) {
+    struct {
+        nlmsghdr n;
+        ifinfomsg ifi;
+        uint8_t buf[256];
+    } req = {};
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(ifinfomsg));
+    req.n.nlmsg_type = peer ? RTM_NEWLINK : RTM_DELLINK;
+    req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | (peer ? NLM_F_CREATE | NLM_F_EXCL : 0);
+    req.ifi.ifi_family = AF_UNSPEC;
+    addAttr(&req.n, IFLA_IFNAME, name, strlen(name) + 1);
+    if (peer) {
+        rtattr* linkinfo = addAttr(&req.n, IFLA_LINKINFO, nullptr, 0);
+        addAttr(&req.n, IFLA_INFO_KIND, "veth", strlen("veth"));
+        rtattr* data = addAttr(&req.n, IFLA_INFO_DATA, nullptr, 0);
+        rtattr* peerInfo = addAttr(&req.n, VETH_INFO_PEER, nullptr, 0);
+        req.n.nlmsg_len += sizeof(ifinfomsg);  // The peer's (zeroed) ifinfomsg.
+        addAttr(&req.n, IFLA_IFNAME, peer, strlen(peer) + 1);
+        endNest(&req.n, peerInfo);
+        endNest(&req.n, data);
+        endNest(&req.n, linkinfo);
+    }
+
+    int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (s < 0) return -errno;
+    int ret = 0;
+    struct {
+        nlmsghdr n;
+        nlmsgerr err;
+    } ack;
+    if (send(s, &req, req.n.nlmsg_len, 0) != (ssize_t)req.n.nlmsg_len ||
+        recv(s, &ack, sizeof(ack), 0) < (ssize_t)sizeof(ack)) {
+        ret = -errno;
+    } else if (ack.n.nlmsg_type == NLMSG_ERROR) {
+        ret = ack.err.error;
+    }
+    close(s);
+    return ret;
+}
+
+static int setLinkUp(const char* name) {
+    int s = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -errno;
+    ifreq ifr = {};
+    strlcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+    int ret = ioctl(s, SIOCGIFFLAGS, &ifr);
+    if (ret == 0) {
+        ifr.ifr_flags |= IFF_UP;
+        ret = ioctl(s, SIOCSIFFLAGS, &ifr);
+    }
+    if (ret) ret = -errno;
+    close(s);
+    return ret;
+}
+
+// Sends a UDP over IPv6 packet with the given destination out of the interface, towards a MAC
+// address that is not the peer's, so that the peer receives it as PACKET_OTHERHOST.
+static void sendIpv6Packet(int ifindex, const char* dst, uint8_t tag) {
+    struct {
+        ipv6hdr ip6;
+        uint8_t udp[8];
+        uint8_t payload[4];
+    } __attribute__((packed)) pkt = {};
+    pkt.ip6.version = 6;
+    pkt.ip6.payload_len = htons(sizeof(pkt.udp) + sizeof(pkt.payload));
+    pkt.ip6.nexthdr = IPPROTO_UDP;
+    pkt.ip6.hop_limit = 64;
+    ASSERT_EQ(1, inet_pton(AF_INET6, "2001:db8::1", &pkt.ip6.saddr));
+    ASSERT_EQ(1, inet_pton(AF_INET6, dst, &pkt.ip6.daddr));
+    pkt.payload[0] = tag;
+
+    int s = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_IPV6));
+    ASSERT_LE(0, s);
+    sockaddr_ll sll = {
+            .sll_family = AF_PACKET,
+            .sll_protocol = htons(ETH_P_IPV6),
+            .sll_ifindex = ifindex,
+            .sll_halen = ETH_ALEN,
+            .sll_addr = {0x02, 0x00, 0x00, 0x00, 0x64, 0x64},
+    };
+    EXPECT_EQ((ssize_t)sizeof(pkt),
+              sendto(s, &pkt, sizeof(pkt), 0, reinterpret_cast<sockaddr*>(&sll), sizeof(sll)));
+    close(s);
+}
+
 // Mock functions for isIpv4AddressFree.
 bool neverFree(in_addr_t /* addr */) {
     return 0;
@@ -99,6 +213,86 @@ TEST_F(ClatUtils, SelectIpv4Address) {
     EXPECT_EQ(inet_addr("127.0.0.2"), selectIpv4Address(addr, 29));
 }
 
+TEST_F(ClatUtils, SelectIpv4AddressFromUsedAddresses) {
+    struct in_addr addr;
+    inet_pton(AF_INET, kIPv4LocalAddr, &addr);
+
+    const std::vector<in_addr_t> none;
+    std::vector<in_addr_t> used;
+    for (int i = 0; i < 8; i++) used.push_back(htonl(0xc0000000 | i));  // 192.0.0.0/29
+
+    // Same expectations as the probing implementation.
+    EXPECT_EQ(inet_addr(kIPv4LocalAddr), selectIpv4AddressInternal(addr, 29, none));
+    EXPECT_EQ(inet_addr(kIPv4LocalAddr), selectIpv4AddressInternal(addr, 32, none));
+    EXPECT_EQ(INADDR_NONE, selectIpv4AddressInternal(addr, 15, none));
+    EXPECT_EQ(INADDR_NONE, selectIpv4AddressInternal(addr, 33, none));
+    EXPECT_EQ(INADDR_NONE, selectIpv4AddressInternal(addr, 29, used));
+    EXPECT_EQ(INADDR_NONE, selectIpv4AddressInternal(addr, 32, used));
+    EXPECT_EQ(inet_addr("192.0.0.8"), selectIpv4AddressInternal(addr, 28, used));
+
+    // Wrap around to addresses that are lower than the first address.
+    used = {inet_addr("192.0.0.4"), inet_addr("192.0.0.5"), inet_addr("192.0.0.6"),
+            inet_addr("192.0.0.7"), inet_addr("10.0.0.1")};
+    EXPECT_EQ(inet_addr("192.0.0.0"), selectIpv4AddressInternal(addr, 29, used));
+    EXPECT_EQ(INADDR_NONE, selectIpv4AddressInternal(addr, 30, used));
+
+    // The loopback address is in the address dump.
+    ASSERT_EQ(0, getIpv4Addresses(&used));
+    EXPECT_NE(used.end(), std::find(used.begin(), used.end(), inet_addr("127.0.0.1")));
+}
+
+static std::vector<bool> sUsedInPrefix;
+static bool usedInPrefixFree(in_addr_t addr) {
+    return !sUsedInPrefix[ntohl(addr) & 0xffff];
+}
+
+TEST_F(ClatUtils, SelectIpv4AddressBenchmark) {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    using std::chrono::steady_clock;
+    struct in_addr addr;
+    inet_pton(AF_INET, kIPv4LocalAddr, &addr);
+
+    // Worst case for a /16: every address but the one just below the starting address is in use.
+    std::vector<in_addr_t> used;
+    sUsedInPrefix.assign(1 << 16, true);
+    for (uint32_t i = 0; i < (1 << 16); i++) {
+        if (i != 3) used.push_back(htonl(0xc0000000 | i));
+    }
+    sUsedInPrefix[3] = false;
+
+    const int kIterations = 20;
+    auto start = steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        EXPECT_EQ(inet_addr("192.0.0.3"), selectIpv4AddressInternal(addr, 16, usedInPrefixFree));
+    }
+    auto probeUs = duration_cast<microseconds>(steady_clock::now() - start).count();
+    start = steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        EXPECT_EQ(inet_addr("192.0.0.3"), selectIpv4AddressInternal(addr, 16, used));
+    }
+    auto bitmapUs = duration_cast<microseconds>(steady_clock::now() - start).count();
+    // Reported in the test XML output rather than asserted on, the timings depend on the device.
+    RecordProperty("iterations", kIterations);
+    RecordProperty("slash16_per_address_us", std::to_string(probeUs));
+    RecordProperty("slash16_bitmap_us", std::to_string(bitmapUs));
+
+    // End to end: a connected socket per candidate vs. a single address dump.
+    addr.s_addr = inet_addr("127.0.0.1");
+    start = steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        EXPECT_EQ(inet_addr("127.0.0.2"), selectIpv4AddressInternal(addr, 24, isIpv4AddressFree));
+    }
+    probeUs = duration_cast<microseconds>(steady_clock::now() - start).count();
+    start = steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        EXPECT_EQ(inet_addr("127.0.0.2"), selectIpv4Address(addr, 24));
+    }
+    auto dumpUs = duration_cast<microseconds>(steady_clock::now() - start).count();
+    RecordProperty("loopback24_probing_us", std::to_string(probeUs));
+    RecordProperty("loopback24_address_dump_us", std::to_string(dumpUs));
+}
+
 TEST_F(ClatUtils, MakeChecksumNeutral) {
     // We can't test generateIPv6Address here since it requires manipulating routing, which we can't
     // do without talking to the real netd on the system.
@@ -159,6 +353,42 @@ TEST_F(ClatUtils, DetectMtu) {
     ASSERT_EQ(detect_mtu(&in6addr_loopback, htonl(1), 0 /*MARK_UNSET*/), 65536);
 }
 
+TEST_F(ClatUtils, GetRouteMtu) {
+    // Same as detect_mtu, without a socket.
+    EXPECT_EQ(65536, get_route_mtu(&in6addr_loopback, htonl(1), 0 /*MARK_UNSET*/));
+}
+
+TEST_F(ClatUtils, RouteMonitor) {
+    int s = open_route_monitor();
+    ASSERT_LE(0, s);
+    EXPECT_EQ(0, read_route_monitor(s));
+
+    // Creating and deleting an interface is announced.
+    TunInterface v6Iface;
+    ASSERT_EQ(0, v6Iface.init());
+    v6Iface.destroy();
+    EXPECT_LT(0, read_route_monitor(s));
+    EXPECT_EQ(0, read_route_monitor(s));
+
+    close(s);
+}
+
+TEST_F(ClatUtils, GetNextHopMac) {
+    // ::1 routes via lo, which never has any neighbour entries.
+    uint8_t mac[ETH_ALEN];
+    const int loIfindex = if_nametoindex("lo");
+    ASSERT_LT(0, loIfindex);
+    EXPECT_EQ(-ENOENT, get_next_hop_mac(&in6addr_loopback, htonl(1), loIfindex, 0 /*MARK_UNSET*/,
+                                        mac));
+
+    // The route towards ::1 does not go through a tun interface.
+    TunInterface v6Iface;
+    ASSERT_EQ(0, v6Iface.init());
+    EXPECT_GT(0, get_next_hop_mac(&in6addr_loopback, htonl(1), v6Iface.ifindex(),
+                                  0 /*MARK_UNSET*/, mac));
+    v6Iface.destroy();
+}
+
 TEST_F(ClatUtils, ConfigurePacketSocket) {
     // Create an interface for configure_packet_socket to attach socket filter to.
     TunInterface v6Iface;
@@ -182,6 +412,62 @@ TEST_F(ClatUtils, ConfigurePacketSocket) {
     v6Iface.destroy();
 }
 
+TEST_F(ClatUtils, ConfigurePacketRing) {
+    static const char kVeth[] = "clatring0";
+    static const char kPeer[] = "clatring1";
+    ASSERT_EQ(0, vethRequest(kVeth, kPeer));
+    ASSERT_EQ(0, setLinkUp(kVeth));
+    ASSERT_EQ(0, setLinkUp(kPeer));
+    int ifindex = if_nametoindex(kVeth);
+    int peerIfindex = if_nametoindex(kPeer);
+    ASSERT_NE(0, ifindex);
+    ASSERT_NE(0, peerIfindex);
+
+    // As in ClatCoordinator, open the socket without a protocol, so that it receives nothing until
+    // configure_packet_socket has attached the filter and bound it to the veth. Otherwise the ring
+    // would also collect the IPv6 traffic of every other interface in the meantime.
+    int s = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    ASSERT_LE(0, s);
+    EXPECT_EQ(0, configure_packet_ring(s));
+    struct in6_addr addr6;
+    ASSERT_EQ(1, inet_pton(AF_INET6, "2001:db8::f00", &addr6));
+    EXPECT_EQ(0, configure_packet_socket(s, &addr6, ifindex));
+
+    struct packet_ring ring = {};
+    ASSERT_EQ(0, map_packet_ring(s, &ring));
+
+    // Only packets towards the filtered address must make it into the ring.
+    const int kNumPackets = 8;
+    for (int i = 0; i < kNumPackets; i++) {
+        sendIpv6Packet(peerIfindex, "2001:db8::f00", i);
+        sendIpv6Packet(peerIfindex, "2001:db8::f01", 0xff);
+    }
+
+    std::vector<uint8_t> tags;
+    for (int i = 0; i < 10 && tags.size() < kNumPackets; i++) {
+        int ret = read_packet_ring(s, &ring, 100, [&](const uint8_t* pkt, size_t len) {
+            ASSERT_EQ(sizeof(ipv6hdr) + 12, len);
+            auto* ip6 = reinterpret_cast<const ipv6hdr*>(pkt);
+            EXPECT_EQ(0, memcmp(&ip6->daddr, &addr6, sizeof(addr6)));
+            tags.push_back(pkt[sizeof(ipv6hdr) + 8]);
+        });
+        ASSERT_LE(0, ret);
+    }
+    ASSERT_EQ((size_t)kNumPackets, tags.size());
+    for (int i = 0; i < kNumPackets; i++) {
+        EXPECT_EQ(i, tags[i]);
+    }
+
+    // The ring replaces the socket receive queue.
+    uint8_t buf[128];
+    EXPECT_EQ(-1, recv(s, buf, sizeof(buf), MSG_DONTWAIT));
+
+    unmap_packet_ring(&ring);
+    EXPECT_EQ(nullptr, ring.map);
+    close(s);
+    EXPECT_EQ(0, vethRequest(kVeth, nullptr));
+}
+
 }  // namespace clat
 }  // namespace net
 }  // namespace android
@@ -0,0 +1,141 @@
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <netinet/in.h>
+#include <netinet/in6.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "libclat/clatutils.h"
+
+namespace android {
+namespace net {
+namespace clat {
+
+// The addresses of one 464xlat instance. local6 must have been made checksum neutral with local4
+// and pfx96 by makeChecksumNeutral, which lets TCP and UDP checksums through unchanged.
+struct ClatAddresses {
+    in_addr local4;
+    in6_addr local6;
+    in6_addr pfx96;
+};
+
+// Translate a single packet, as clatd does for the packets the BPF programs punt to it.
+//   addrs  - the translation addresses
+//   in     - the IPv4 (resp. IPv6) packet, starting at the network header
+//   len    - the length of the packet
+//   out    - the output buffer for the translated packet
+//   outlen - the size of the output buffer
+// returns: the length of the translated packet on success, -errno if it cannot be translated
+int translate_4to6(const ClatAddresses& addrs, const uint8_t* in, size_t len, uint8_t* out,
+                   size_t outlen);
+int translate_6to4(const ClatAddresses& addrs, const uint8_t* in, size_t len, uint8_t* out,
+                   size_t outlen);
+
+// Build the ICMP fragmentation needed error that a router on a link of the given mtu would send
+// back about an IPv4 packet.
+//   in     - the IPv4 packet which does not fit
+//   len    - the length of the packet
+//   mtu    - the IPv4 mtu to report
+//   out    - the output buffer for the error
+//   outlen - the size of the output buffer
+// returns: the length of the error on success, -errno if no error may be sent about the packet
+int make_frag_needed(const uint8_t* in, size_t len, uint16_t mtu, uint8_t* out, size_t outlen);
+
+// Split an IPv4 packet without DF into fragments which fit in an IPv6 mtu once translated.
+//   in     - the IPv4 packet
+//   len    - the length of the packet
+//   mtu6   - the IPv6 path mtu
+//   buf    - scratch buffer for the fragments
+//   buflen - the size of the scratch buffer
+//   fn     - called with each fragment in turn
+// returns: 0 on success, -errno if the packet cannot be fragmented
+int fragment_4to6(const uint8_t* in, size_t len, uint32_t mtu6, uint8_t* buf, size_t buflen,
+                  const std::function<void(const uint8_t*, size_t)>& fn);
+
+struct ClatEngineConfig {
+    ClatAddresses addrs;
+    std::vector<int> tunFds;  // One fd per queue of the v4- tun interface.
+    bool vnetHdr;             // Whether the tun interface was created with IFF_VNET_HDR.
+    int readSock6;            // Packet socket set up with configure_packet_socket.
+    bool packetRing;          // Whether readSock6 has a ring from configure_packet_ring.
+    int writeSock6;           // Raw IPv6 socket, marked and joined to the local6 anycast group.
+};
+
+struct ClatEngineStats {
+    uint64_t packets4to6;
+    uint64_t packets6to4;
+    uint64_t dropped;
+};
+
+// Translates the traffic of a v4- interface in a thread of the calling process instead of a
+// clatd process. The engine keeps duplicates of the file descriptors in its configuration.
+class ClatEngine {
+  public:
+    // Starts the translation thread.
+    //   error - set to -errno if the engine cannot be started
+    // returns: the running engine, or nullptr on failure
+    static std::unique_ptr<ClatEngine> start(const ClatEngineConfig& config, int* error);
+
+    // Stops the translation thread, if still running, and closes the file descriptors.
+    ~ClatEngine();
+
+    ClatEngineStats getStats() const;
+
+    // Sets the IPv6 path mtu, 0 if unknown. Translated packets which would exceed it are
+    // fragmented, or refused with an ICMP error if they have DF.
+    void setPathMtu(uint32_t mtu);
+
+  private:
+    ClatEngine() = default;
+    int init(const ClatEngineConfig& config);
+    void run();
+    void readTun(int fd);
+    void readPacketSocket();
+    void handleTunPacket(uint8_t* packet, size_t len);
+    void segmentGsoPacket(const uint8_t* packet, size_t len, uint8_t gsoType, uint16_t gsoSize);
+    void handleIpv4Packet(const uint8_t* packet, size_t len);
+    void handleTooBigPacket(const uint8_t* packet, size_t len, uint32_t mtu);
+    void handleIpv6Packet(const uint8_t* packet, size_t len);
+    bool writeTun(const uint8_t* packet, size_t len);
+
+    ClatAddresses mAddrs;
+    bool mVnetHdr = false;
+    bool mPacketRing = false;
+    std::vector<int> mTunFds;
+    int mReadSock6 = -1;
+    int mWriteSock6 = -1;
+    int mEpollFd = -1;
+    int mStopFd = -1;
+    struct packet_ring mRing = {};
+    std::vector<uint8_t> mReadBuf;
+    std::vector<uint8_t> mSegmentBuf;
+    std::vector<uint8_t> mFragmentBuf;
+    std::vector<uint8_t> mWriteBuf;
+    std::thread mThread;
+
+    std::atomic<uint32_t> mPathMtu = 0;
+    std::atomic<uint64_t> mPackets4to6 = 0;
+    std::atomic<uint64_t> mPackets6to4 = 0;
+    std::atomic<uint64_t> mDropped = 0;
+};
+
+}  // namespace clat
+}  // namespace net
+}  // namespace android
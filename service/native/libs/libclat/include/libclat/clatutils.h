@@ -16,21 +16,68 @@
 #include <netinet/in.h>
 #include <netinet/in6.h>
 
+#include <functional>
+#include <vector>
+
 namespace android {
 namespace net {
 namespace clat {
 
+// Geometry of the TPACKET_V3 receive ring of the packet socket. The kernel retires a block to
+// userspace when it is full or, at low packet rates, after PACKET_RING_BLOCK_TIMEOUT_MS.
+static constexpr uint32_t PACKET_RING_BLOCK_SIZE = 1 << 16;
+static constexpr uint32_t PACKET_RING_BLOCK_COUNT = 32;
+static constexpr uint32_t PACKET_RING_FRAME_SIZE = 1 << 11;
+static constexpr uint32_t PACKET_RING_BLOCK_TIMEOUT_MS = 2;
+
+// Mirror of struct virtio_net_hdr, which tun interfaces created with IFF_VNET_HDR put in front of
+// every packet. linux/virtio_net.h cannot be included from C++ since its control structures use
+// "class" as a field name. Fields are in host byte order, as tun does not set TUNSETVNETLE.
+struct tun_vnet_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+};
+
+static constexpr uint8_t TUN_VNET_HDR_F_NEEDS_CSUM = 1;
+static constexpr uint8_t TUN_VNET_HDR_GSO_NONE = 0;
+static constexpr uint8_t TUN_VNET_HDR_GSO_TCPV4 = 1;
+static constexpr uint8_t TUN_VNET_HDR_GSO_UDP_L4 = 5;
+static constexpr uint8_t TUN_VNET_HDR_GSO_ECN = 0x80;
+
+struct packet_ring {
+    uint8_t* map;
+    size_t len;
+    uint32_t next_block;
+};
+
 bool isIpv4AddressFree(in_addr_t addr);
+int getIpv4Addresses(std::vector<in_addr_t>* addrs);
 in_addr_t selectIpv4Address(const in_addr ip, int16_t prefixlen);
 void makeChecksumNeutral(in6_addr* v6, const in_addr v4, const in6_addr& nat64Prefix);
 int generateIpv6Address(const char* iface, const in_addr v4, const in6_addr& nat64Prefix,
                         in6_addr* v6, uint32_t mark);
 int detect_mtu(const struct in6_addr* plat_subnet, uint32_t plat_suffix, uint32_t mark);
+int get_route_mtu(const struct in6_addr* plat_subnet, uint32_t plat_suffix, uint32_t mark);
+int open_route_monitor();
+int read_route_monitor(int sock);
+int get_next_hop_mac(const struct in6_addr* plat_subnet, uint32_t plat_suffix, int ifindex,
+                     uint32_t mark, uint8_t* mac);
 int configure_packet_socket(int sock, in6_addr* addr, int ifindex);
+int configure_packet_ring(int sock);
+int map_packet_ring(int sock, struct packet_ring* ring);
+void unmap_packet_ring(struct packet_ring* ring);
+int read_packet_ring(int sock, struct packet_ring* ring, int timeout_ms,
+                     const std::function<void(const uint8_t*, size_t)>& fn);
 
 // For testing
 typedef bool (*isIpv4AddrFreeFn)(in_addr_t);
 in_addr_t selectIpv4AddressInternal(const in_addr ip, int16_t prefixlen, isIpv4AddrFreeFn fn);
+in_addr_t selectIpv4AddressInternal(const in_addr ip, int16_t prefixlen,
+                                    const std::vector<in_addr_t>& usedAddrs);
 
 }  // namespace clat
 }  // namespace net
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Scoped atrace sections for the native connectivity code, shown in Perfetto and systrace under
+// the "network" category.
+//
+//   CONNECTIVITY_TRACE("swapActiveStatsMap");
+//       Opens a section named after the operation until the end of the enclosing scope.
+//   CONNECTIVITY_TRACE_COUNT("parseBpfNetworkStatsDetail:lines", lines->size());
+//       Sets a counter track, e.g. to the number of map entries the enclosing section walked.
+//
+// Both are no-ops costing a single load when the category is not being traced, and compile to
+// nothing when CONNECTIVITY_TRACE_DISABLED is defined.
+
+#ifdef CONNECTIVITY_TRACE_DISABLED
+
+#define CONNECTIVITY_TRACE(name) \
+    do {                         \
+    } while (0)
+#define CONNECTIVITY_TRACE_COUNT(name, value) \
+    do {                                      \
+    } while (0)
+
+#else  // CONNECTIVITY_TRACE_DISABLED
+
+#include <stdint.h>
+
+#include <cutils/trace.h>
+
+namespace android {
+namespace net {
+
+class ScopedConnectivityTrace {
+  public:
+    explicit ScopedConnectivityTrace(const char* name) { atrace_begin(ATRACE_TAG_NETWORK, name); }
+    ~ScopedConnectivityTrace() { atrace_end(ATRACE_TAG_NETWORK); }
+
+    ScopedConnectivityTrace(const ScopedConnectivityTrace&) = delete;
+    ScopedConnectivityTrace& operator=(const ScopedConnectivityTrace&) = delete;
+};
+
+}  // namespace net
+}  // namespace android
+
+#define CONNECTIVITY_TRACE_CONCAT_(a, b) a##b
+#define CONNECTIVITY_TRACE_NAME_(line) CONNECTIVITY_TRACE_CONCAT_(connectivityTrace, line)
+#define CONNECTIVITY_TRACE(name) \
+    ::android::net::ScopedConnectivityTrace CONNECTIVITY_TRACE_NAME_(__LINE__)(name)
+#define CONNECTIVITY_TRACE_COUNT(name, value) \
+    atrace_int64(ATRACE_TAG_NETWORK, name, static_cast<int64_t>(value))
+
+#endif  // CONNECTIVITY_TRACE_DISABLED
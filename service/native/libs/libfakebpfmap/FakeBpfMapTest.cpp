@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * FakeBpfMapTest.cpp - unit tests for FakeBpfMap.h
+ */
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include "FakeBpfMap.h"
+
+namespace android {
+namespace bpf {
+
+using base::Result;
+
+constexpr uint32_t TEST_MAP_SIZE = 4;
+
+struct TestKey {
+    uint32_t uid;
+    uint16_t port;
+    uint16_t protocol;
+};
+
+TEST(FakeBpfMapTest, HashReadWriteDelete) {
+    FakeBpfMap<TestKey, uint64_t> map(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+    ASSERT_TRUE(map.isValid());
+    const TestKey key = {.uid = 10000, .port = 80, .protocol = 6};
+
+    EXPECT_EQ(ENOENT, map.readValue(key).error().code());
+    EXPECT_EQ(ENOENT, map.writeValue(key, 1, BPF_EXIST).error().code());
+    ASSERT_TRUE(map.writeValue(key, 1, BPF_NOEXIST).ok());
+    EXPECT_EQ(EEXIST, map.writeValue(key, 2, BPF_NOEXIST).error().code());
+    ASSERT_TRUE(map.writeValue(key, 3, BPF_EXIST).ok());
+    EXPECT_EQ(3U, map.readValue(key).value());
+    EXPECT_FALSE(map.isEmpty().value());
+
+    ASSERT_TRUE(map.deleteValue(key).ok());
+    EXPECT_EQ(ENOENT, map.deleteValue(key).error().code());
+    EXPECT_TRUE(map.isEmpty().value());
+}
+
+TEST(FakeBpfMapTest, HashFull) {
+    FakeBpfMap<uint32_t, uint32_t> map(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+    for (uint32_t i = 0; i < TEST_MAP_SIZE; i++) {
+        ASSERT_TRUE(map.writeValue(i, i, BPF_ANY).ok());
+    }
+    EXPECT_EQ(E2BIG, map.writeValue(TEST_MAP_SIZE, 0, BPF_ANY).error().code());
+    // Existing entries can still be updated.
+    EXPECT_TRUE(map.writeValue(0, 42, BPF_ANY).ok());
+    ASSERT_TRUE(map.deleteValue(1).ok());
+    EXPECT_TRUE(map.writeValue(TEST_MAP_SIZE, 0, BPF_ANY).ok());
+}
+
+TEST(FakeBpfMapTest, Array) {
+    FakeBpfMap<uint32_t, uint64_t> map(BPF_MAP_TYPE_ARRAY, TEST_MAP_SIZE);
+    ASSERT_TRUE(map.isValid());
+    EXPECT_EQ(0U, map.readValue(TEST_MAP_SIZE - 1).value());
+    EXPECT_EQ(ENOENT, map.readValue(TEST_MAP_SIZE).error().code());
+    EXPECT_EQ(E2BIG, map.writeValue(TEST_MAP_SIZE, 1, BPF_ANY).error().code());
+    EXPECT_EQ(EEXIST, map.writeValue(0, 1, BPF_NOEXIST).error().code());
+    EXPECT_EQ(EINVAL, map.deleteValue(0).error().code());
+    EXPECT_EQ(EINVAL, map.clear().error().code());
+
+    // Keys are iterated in index order, including the ones whose bytes do not sort that way.
+    FakeBpfMap<uint32_t, uint64_t> bigMap(BPF_MAP_TYPE_ARRAY, 300);
+    uint32_t expected = 0;
+    ASSERT_TRUE(bigMap.iterate([&expected](const uint32_t& key, const auto&) -> Result<void> {
+                          EXPECT_EQ(expected++, key);
+                          return {};
+                      }).ok());
+    EXPECT_EQ(300U, expected);
+}
+
+TEST(FakeBpfMapTest, InvalidMap) {
+    FakeBpfMap<uint32_t, uint32_t> map;
+    EXPECT_FALSE(map.isValid());
+    EXPECT_EQ(ENOENT, map.getFirstKey().error().code());
+    EXPECT_EQ(EINVAL, map.writeValue(0, 0, BPF_ANY).error().code());
+    EXPECT_EQ(EINVAL, map.resetMap(BPF_MAP_TYPE_LRU_HASH, TEST_MAP_SIZE).error().code());
+    EXPECT_EQ(EINVAL, (FakeBpfMap<uint64_t, uint32_t>().resetMap(BPF_MAP_TYPE_ARRAY, 1))
+                              .error()
+                              .code());
+}
+
+TEST(FakeBpfMapTest, GetNextKey) {
+    FakeBpfMap<uint32_t, uint32_t> map(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+    ASSERT_TRUE(map.writeValue(1, 1, BPF_ANY).ok());
+    ASSERT_TRUE(map.writeValue(2, 2, BPF_ANY).ok());
+
+    Result<uint32_t> first = map.getFirstKey();
+    ASSERT_TRUE(first.ok());
+    // A key that is not in the map restarts the iteration, as in the kernel.
+    EXPECT_EQ(first.value(), map.getNextKey(3).value());
+    Result<uint32_t> second = map.getNextKey(first.value());
+    ASSERT_TRUE(second.ok());
+    EXPECT_NE(first.value(), second.value());
+    EXPECT_EQ(ENOENT, map.getNextKey(second.value()).error().code());
+}
+
+TEST(FakeBpfMapTest, IterateAndDelete) {
+    FakeBpfMap<uint32_t, uint32_t> map(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+    for (uint32_t i = 0; i < TEST_MAP_SIZE; i++) {
+        ASSERT_TRUE(map.writeValue(i, i * 10, BPF_ANY).ok());
+    }
+
+    const auto deleteOdd = [](const uint32_t& key, const uint32_t& value,
+                              FakeBpfMap<uint32_t, uint32_t>& map) -> Result<void> {
+        EXPECT_EQ(key * 10, value);
+        if (key % 2) return map.deleteValue(key);
+        return {};
+    };
+    ASSERT_TRUE(map.iterateWithValue(deleteOdd).ok());
+
+    std::set<uint32_t> keys;
+    ASSERT_TRUE(map.iterate([&keys](const uint32_t& key, const auto&) -> Result<void> {
+                       keys.insert(key);
+                       return {};
+                   }).ok());
+    EXPECT_EQ(std::set<uint32_t>({0, 2}), keys);
+
+    ASSERT_TRUE(map.clear().ok());
+    EXPECT_TRUE(map.isEmpty().value());
+}
+
+TEST(FakeBpfMapTest, Batch) {
+    FakeBpfMap<uint32_t, uint32_t> map(BPF_MAP_TYPE_HASH, TEST_MAP_SIZE);
+    uint32_t done;
+    // Stops at the first entry that does not fit, leaving the previous ones written.
+    EXPECT_EQ(E2BIG, map.writeBatch({1, 2, 3, 4, 5, 6}, {1, 2, 3, 4, 5, 6}, BPF_ANY, &done)
+                             .error()
+                             .code());
+    EXPECT_EQ(TEST_MAP_SIZE, done);
+
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> values;
+    uint32_t cursor;
+    ASSERT_TRUE(map.readBatch(nullptr, &cursor, 3, &keys, &values).ok());
+    EXPECT_EQ(3U, keys.size());
+    EXPECT_EQ(ENOENT, map.readBatch(&cursor, &cursor, 3, &keys, &values).error().code());
+    ASSERT_EQ(TEST_MAP_SIZE, keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_EQ(keys[i], values[i]);
+    }
+
+    EXPECT_EQ(ENOENT, map.deleteBatch({1, 2, 7, 3}, &done).error().code());
+    EXPECT_EQ(2U, done);
+    EXPECT_EQ(3U, map.readValue(3).value());
+}
+
+}  // namespace bpf
+}  // namespace android
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <endian.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <array>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+namespace bpf {
+
+// A userspace implementation of the BpfMap API, for unit tests and benchmarks that must run
+// without root, setrlimitForTest() or a bpf capable kernel, e.g. on host or under sanitizers.
+//
+// It follows the kernel semantics of the map type it is created with, including the errors:
+//  - BPF_MAP_TYPE_HASH: ENOENT for missing keys, EEXIST for BPF_NOEXIST writes of existing keys,
+//    E2BIG when inserting into a full map.
+//  - BPF_MAP_TYPE_ARRAY: every key below max_entries exists and starts zeroed, writes of other
+//    keys fail with E2BIG, BPF_NOEXIST writes with EEXIST and deletes with EINVAL.
+// Keys are iterated in the order of their bytes, which is stable but differs from the kernel's,
+// so tests must not depend on the iteration order of hash maps. Unlike kernel maps, a copy of a
+// FakeBpfMap does not share its content, and the map is not thread safe.
+template <class Key, class Value>
+class FakeBpfMap {
+  public:
+    FakeBpfMap() {}
+
+    FakeBpfMap(bpf_map_type mapType, uint32_t maxEntries) { (void)resetMap(mapType, maxEntries); }
+
+    base::Result<void> resetMap(bpf_map_type mapType, uint32_t maxEntries) {
+        mValid = false;
+        mEntries.clear();
+        if ((mapType != BPF_MAP_TYPE_HASH && mapType != BPF_MAP_TYPE_ARRAY) || maxEntries == 0) {
+            return base::Error(EINVAL) << "unsupported map type " << mapType << " or size "
+                                       << maxEntries;
+        }
+        if (mapType == BPF_MAP_TYPE_ARRAY && sizeof(Key) != sizeof(uint32_t)) {
+            return base::Error(EINVAL) << "array map keys must be 4 bytes";
+        }
+        mMapType = mapType;
+        mMaxEntries = maxEntries;
+        if constexpr (sizeof(Key) == sizeof(uint32_t)) {
+            if (mapType == BPF_MAP_TYPE_ARRAY) {
+                for (uint32_t i = 0; i < maxEntries; i++) {
+                    Key key;
+                    memcpy(&key, &i, sizeof(key));
+                    mEntries.emplace(toBytes(key), Value{});
+                }
+            }
+        }
+        mValid = true;
+        return {};
+    }
+
+    bool isValid() const { return mValid; }
+
+    base::Result<Value> readValue(const Key key) const {
+        const auto it = mEntries.find(toBytes(key));
+        if (!mValid || it == mEntries.end()) {
+            return base::Error(ENOENT) << "readValue";
+        }
+        return it->second;
+    }
+
+    base::Result<void> writeValue(const Key& key, const Value& value, uint64_t flags) {
+        if (!mValid || flags > BPF_EXIST) return base::Error(EINVAL) << "writeValue";
+        const KeyBytes bytes = toBytes(key);
+        const auto it = mEntries.find(bytes);
+        if (mMapType == BPF_MAP_TYPE_ARRAY && it == mEntries.end()) {
+            return base::Error(E2BIG) << "writeValue: index out of range";
+        }
+        if (it != mEntries.end() && flags == BPF_NOEXIST) {
+            return base::Error(EEXIST) << "writeValue";
+        }
+        if (it == mEntries.end() && flags == BPF_EXIST) {
+            return base::Error(ENOENT) << "writeValue";
+        }
+        if (it == mEntries.end() && mEntries.size() >= mMaxEntries) {
+            return base::Error(E2BIG) << "writeValue: map full";
+        }
+        mEntries[bytes] = value;
+        return {};
+    }
+
+    base::Result<void> deleteValue(const Key& key) {
+        if (!mValid || mMapType == BPF_MAP_TYPE_ARRAY) return base::Error(EINVAL) << "deleteValue";
+        if (mEntries.erase(toBytes(key)) == 0) return base::Error(ENOENT) << "deleteValue";
+        return {};
+    }
+
+    base::Result<Key> getFirstKey() const {
+        if (!mValid || mEntries.empty()) return base::Error(ENOENT) << "getFirstKey";
+        return fromBytes(mEntries.begin()->first);
+    }
+
+    // As BPF_MAP_GET_NEXT_KEY, returns the first key if the given one is not in the map.
+    base::Result<Key> getNextKey(const Key& key) const {
+        if (!mValid) return base::Error(ENOENT) << "getNextKey";
+        const KeyBytes bytes = toBytes(key);
+        if (mEntries.find(bytes) == mEntries.end()) return getFirstKey();
+        const auto next = mEntries.upper_bound(bytes);
+        if (next == mEntries.end()) return base::Error(ENOENT) << "getNextKey";
+        return fromBytes(next->first);
+    }
+
+    // The filter may delete the key it is called with, as with BpfMap::iterate.
+    base::Result<void> iterate(
+            const std::function<base::Result<void>(const Key& key,
+                                                   const FakeBpfMap<Key, Value>& map)>& filter)
+            const {
+        base::Result<Key> curKey = getFirstKey();
+        while (curKey.ok()) {
+            const base::Result<Key> nextKey = getNextKey(curKey.value());
+            base::Result<void> status = filter(curKey.value(), *this);
+            if (!status.ok()) return status;
+            curKey = nextKey;
+        }
+        if (curKey.error().code() == ENOENT) return {};
+        return curKey.error();
+    }
+
+    base::Result<void> iterate(
+            const std::function<base::Result<void>(const Key& key, FakeBpfMap<Key, Value>& map)>&
+                    filter) {
+        base::Result<Key> curKey = getFirstKey();
+        while (curKey.ok()) {
+            const base::Result<Key> nextKey = getNextKey(curKey.value());
+            base::Result<void> status = filter(curKey.value(), *this);
+            if (!status.ok()) return status;
+            curKey = nextKey;
+        }
+        if (curKey.error().code() == ENOENT) return {};
+        return curKey.error();
+    }
+
+    base::Result<void> iterateWithValue(
+            const std::function<base::Result<void>(const Key& key, const Value& value,
+                                                   const FakeBpfMap<Key, Value>& map)>& filter)
+            const {
+        return iterate([&filter](const Key& key, const FakeBpfMap<Key, Value>& map) {
+            base::Result<Value> value = map.readValue(key);
+            if (!value.ok()) return base::Result<void>(value.error());
+            return filter(key, value.value(), map);
+        });
+    }
+
+    base::Result<void> iterateWithValue(
+            const std::function<base::Result<void>(const Key& key, const Value& value,
+                                                   FakeBpfMap<Key, Value>& map)>& filter) {
+        return iterate([&filter](const Key& key, FakeBpfMap<Key, Value>& map) {
+            base::Result<Value> value = map.readValue(key);
+            if (!value.ok()) return base::Result<void>(value.error());
+            return filter(key, value.value(), map);
+        });
+    }
+
+    // As BPF_MAP_LOOKUP_BATCH: appends up to count entries following the cursor to keys and
+    // values, and advances the cursor. A null cursor starts from the first key. Fails with
+    // ENOENT once no entry is left, after appending the last ones.
+    base::Result<void> readBatch(const Key* inCursor, Key* outCursor, uint32_t count,
+                                 std::vector<Key>* keys, std::vector<Value>* values) const {
+        if (!mValid || count == 0) return base::Error(EINVAL) << "readBatch";
+        auto it = inCursor ? mEntries.upper_bound(toBytes(*inCursor)) : mEntries.begin();
+        for (; it != mEntries.end() && count > 0; ++it, count--) {
+            keys->push_back(fromBytes(it->first));
+            values->push_back(it->second);
+            *outCursor = keys->back();
+        }
+        if (it == mEntries.end()) return base::Error(ENOENT) << "readBatch";
+        return {};
+    }
+
+    // As BPF_MAP_UPDATE_BATCH: writes the entries in order and stops at the first failure,
+    // leaving the previous ones written. done is set to the number of entries written.
+    base::Result<void> writeBatch(const std::vector<Key>& keys, const std::vector<Value>& values,
+                                  uint64_t flags, uint32_t* done) {
+        *done = 0;
+        if (keys.size() != values.size()) return base::Error(EINVAL) << "writeBatch";
+        for (; *done < keys.size(); (*done)++) {
+            base::Result<void> res = writeValue(keys[*done], values[*done], flags);
+            if (!res.ok()) return res;
+        }
+        return {};
+    }
+
+    // As BPF_MAP_DELETE_BATCH: deletes the keys in order and stops at the first failure.
+    base::Result<void> deleteBatch(const std::vector<Key>& keys, uint32_t* done) {
+        *done = 0;
+        for (; *done < keys.size(); (*done)++) {
+            base::Result<void> res = deleteValue(keys[*done]);
+            if (!res.ok()) return res;
+        }
+        return {};
+    }
+
+    base::Result<void> clear() {
+        while (true) {
+            base::Result<Key> key = getFirstKey();
+            if (!key.ok()) {
+                if (key.error().code() == ENOENT) return {};  // empty: success
+                return key.error();                           // Anything else is an error
+            }
+            base::Result<void> res = deleteValue(key.value());
+            if (!res.ok()) return res;
+        }
+    }
+
+    base::Result<bool> isEmpty() const {
+        if (!mValid) return base::Error(EINVAL) << "isEmpty";
+        return mEntries.empty();
+    }
+
+  private:
+    using KeyBytes = std::array<uint8_t, sizeof(Key)>;
+
+    // Array keys are stored big endian, so that they iterate in index order like the kernel's.
+    KeyBytes toBytes(const Key& key) const {
+        KeyBytes bytes;
+        memcpy(bytes.data(), &key, sizeof(Key));
+        if (mMapType == BPF_MAP_TYPE_ARRAY) swapArrayKey(&bytes);
+        return bytes;
+    }
+
+    Key fromBytes(KeyBytes bytes) const {
+        if (mMapType == BPF_MAP_TYPE_ARRAY) swapArrayKey(&bytes);
+        Key key;
+        memcpy(&key, bytes.data(), sizeof(Key));
+        return key;
+    }
+
+    static void swapArrayKey(KeyBytes* bytes) {
+        if constexpr (sizeof(Key) == sizeof(uint32_t)) {
+            uint32_t index;
+            memcpy(&index, bytes->data(), sizeof(index));
+            index = htobe32(index);
+            memcpy(bytes->data(), &index, sizeof(index));
+        }
+    }
+
+    bool mValid = false;
+    bpf_map_type mMapType = BPF_MAP_TYPE_UNSPEC;
+    uint32_t mMaxEntries = 0;
+    std::map<KeyBytes, Value> mEntries;
+};
+
+}  // namespace bpf
+}  // namespace android
@@ -40,6 +40,8 @@ public class BpfNetMaps {
     // Use legacy netd for releases before T.
     private static final boolean USE_NETD = !SdkLevel.isAtLeastT();
     private static boolean sInitialized = false;
+    // Number of values of each operation returned by getNativeMetrics().
+    public static final int NATIVE_METRIC_FIELDS = 6;
 
     /**
      * Initializes the class if it is not already initialized. This method will open maps but not
@@ -261,6 +263,38 @@ public class BpfNetMaps {
         native_dump(fd, verbose);
     }
 
+    /**
+     * Get the latency metrics of the native control plane operations, such as swapping the
+     * active stats map or starting clatd.
+     *
+     * @return for each operation, {@link #NATIVE_METRIC_FIELDS} values: the number of calls, the
+     *         number of failed calls, the total, maximum, median and 99th percentile latencies in
+     *         microseconds. Operations are in the order of the Metric enum of
+     *         ConnectivityMetrics.h. Empty before T, where these operations are done by netd.
+     */
+    public long[] getNativeMetrics() {
+        if (USE_NETD) return new long[0];
+        return native_getNativeMetrics();
+    }
+
+    /**
+     * Make the kernel collect the run count and run time of the BPF programs, reported by
+     * {@link #dump}. This adds some overhead to every program run, so only enable it while
+     * measuring.
+     *
+     * @param enable whether to start or stop collecting.
+     * @throws ServiceSpecificException in case of failure, with an error code indicating the
+     *                                  cause of the failure, e.g. EINVAL on kernels before 5.8.
+     */
+    public void setBpfProgramStatsEnabled(boolean enable) {
+        if (USE_NETD) {
+            throw new ServiceSpecificException(EOPNOTSUPP, "BPF program stats not available on"
+                    + " pre-T devices");
+        }
+        final int err = native_setBpfProgramStatsEnabled(enable);
+        maybeThrow(err, "Unable to " + (enable ? "enable" : "disable") + " BPF program stats");
+    }
+
     private static native void native_init();
     private native int native_addNaughtyApp(int uid);
     private native int native_removeNaughtyApp(int uid);
@@ -274,4 +308,6 @@ public class BpfNetMaps {
     private native int native_swapActiveStatsMap();
     private native void native_setPermissionForUids(int permissions, int[] uids);
     private native void native_dump(FileDescriptor fd, boolean verbose);
+    private native long[] native_getNativeMetrics();
+    private native int native_setBpfProgramStatsEnabled(boolean enable);
 }
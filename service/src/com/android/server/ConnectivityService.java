@@ -3359,6 +3359,11 @@ public class ConnectivityService extends IConnectivityManager.Stub
         pw.println();
         mKeepaliveTracker.dump(pw);
 
+        if (mDscpPolicyTracker != null) {
+            pw.println();
+            mDscpPolicyTracker.dump(pw);
+        }
+
         pw.println();
         dumpAvoidBadWifiSettings(pw);
 
@@ -3520,6 +3525,13 @@ public class ConnectivityService extends IConnectivityManager.Stub
         }
     }
 
+    // Collecting the stats slows down every BPF program run, so only shell and privileged callers
+    // may turn it on. Throws ServiceSpecificException if the kernel does not support it.
+    private void setBpfProgramStatsEnabled(boolean enable) {
+        enforceNetworkStackOrSettingsPermission();
+        mBpfNetMaps.setBpfProgramStatsEnabled(enable);
+    }
+
     private void dumpTrafficController(IndentingPrintWriter pw, final FileDescriptor fd,
             boolean verbose) {
         try {
@@ -9700,6 +9712,18 @@ public class ConnectivityService extends IConnectivityManager.Stub
                             onHelp();
                             return -1;
                         }
+                    case "bpf-program-stats":
+                        final String statsAction = getNextArg();
+                        if ("enable".equals(statsAction)) {
+                            setBpfProgramStatsEnabled(true);
+                            return 0;
+                        } else if ("disable".equals(statsAction)) {
+                            setBpfProgramStatsEnabled(false);
+                            return 0;
+                        } else {
+                            onHelp();
+                            return -1;
+                        }
                     default:
                         return handleDefaultCommands(cmd);
                 }
@@ -9719,6 +9743,9 @@ public class ConnectivityService extends IConnectivityManager.Stub
             pw.println("    Turn airplane mode on or off.");
             pw.println("  airplane-mode");
             pw.println("    Get airplane mode.");
+            pw.println("  bpf-program-stats [enable|disable]");
+            pw.println("    Start or stop collecting the BPF program run stats shown by");
+            pw.println("    dumpsys connectivity trafficcontroller.");
         }
     }
 
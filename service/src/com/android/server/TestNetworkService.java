@@ -19,6 +19,10 @@ package com.android.server;
 import static android.net.TestNetworkManager.CLAT_INTERFACE_PREFIX;
 import static android.net.TestNetworkManager.TEST_TAP_PREFIX;
 import static android.net.TestNetworkManager.TEST_TUN_PREFIX;
+import static android.net.TestNetworkManager.TUNTAP_MAX_QUEUES;
+import static android.net.TestNetworkManager.TUNTAP_NAPI;
+import static android.net.TestNetworkManager.TUNTAP_NAPI_FRAGS;
+import static android.net.TestNetworkManager.TUNTAP_VNET_HDR;
 
 import android.annotation.NonNull;
 import android.annotation.Nullable;
@@ -76,7 +80,8 @@ class TestNetworkService extends ITestNetworkManager.Stub {
     @NonNull private final NetworkProvider mNetworkProvider;
 
     // Native method stubs
-    private static native int jniCreateTunTap(boolean isTun, @NonNull String iface);
+    private static native int[] jniCreateTunTap(boolean isTun, @NonNull String iface,
+            int numQueues, int flags);
 
     @VisibleForTesting
     protected TestNetworkService(@NonNull Context context) {
@@ -128,10 +133,48 @@ class TestNetworkService extends ITestNetworkManager.Stub {
             throw new IllegalArgumentException("invalid interface name requested: " + iface);
         }
 
+        return createInterfaceInternal(isTun, bringUp, linkAddrs, interfaceName,
+                1 /* numQueues */, 0 /* flags */);
+    }
+
+    /**
+     * Create a TUN or TAP interface with the specified number of queues and TUNTAP_* flags.
+     *
+     * <p>This method will return the FileDescriptors of all queues of the interface. Close them to
+     * tear down the interface.
+     */
+    @Override
+    public TestNetworkInterface createTunTapInterface(boolean isTun, boolean bringUp,
+            LinkAddress[] linkAddrs, int numQueues, int flags) {
+        enforceTestNetworkPermissions(mContext);
+
+        Objects.requireNonNull(linkAddrs, "missing linkAddrs");
+        if (numQueues < 1 || numQueues > TUNTAP_MAX_QUEUES) {
+            throw new IllegalArgumentException("invalid number of queues: " + numQueues);
+        }
+        if ((flags & ~(TUNTAP_VNET_HDR | TUNTAP_NAPI | TUNTAP_NAPI_FRAGS)) != 0) {
+            throw new IllegalArgumentException("invalid flags: " + flags);
+        }
+        if ((flags & TUNTAP_NAPI_FRAGS) != 0 && (isTun || (flags & TUNTAP_NAPI) == 0)) {
+            throw new IllegalArgumentException("TUNTAP_NAPI_FRAGS requires TAP and TUNTAP_NAPI");
+        }
+
+        final String ifacePrefix = isTun ? TEST_TUN_PREFIX : TEST_TAP_PREFIX;
+        return createInterfaceInternal(isTun, bringUp, linkAddrs,
+                ifacePrefix + sTestTunIndex.getAndIncrement(), numQueues, flags);
+    }
+
+    private TestNetworkInterface createInterfaceInternal(boolean isTun, boolean bringUp,
+            @NonNull LinkAddress[] linkAddrs, @NonNull String interfaceName, int numQueues,
+            int flags) {
         final long token = Binder.clearCallingIdentity();
         try {
-            ParcelFileDescriptor tunIntf =
-                    ParcelFileDescriptor.adoptFd(jniCreateTunTap(isTun, interfaceName));
+            final int[] fds = jniCreateTunTap(isTun, interfaceName, numQueues, flags);
+            ParcelFileDescriptor tunIntf = ParcelFileDescriptor.adoptFd(fds[0]);
+            final ParcelFileDescriptor[] queues = new ParcelFileDescriptor[fds.length - 1];
+            for (int i = 1; i < fds.length; i++) {
+                queues[i - 1] = ParcelFileDescriptor.adoptFd(fds[i]);
+            }
             for (LinkAddress addr : linkAddrs) {
                 mNetd.interfaceAddAddress(
                         interfaceName,
@@ -143,7 +186,7 @@ class TestNetworkService extends ITestNetworkManager.Stub {
                 NetdUtils.setInterfaceUp(mNetd, interfaceName);
             }
 
-            return new TestNetworkInterface(tunIntf, interfaceName);
+            return new TestNetworkInterface(tunIntf, interfaceName, queues);
         } catch (RemoteException e) {
             throw e.rethrowFromSystemServer();
         } finally {
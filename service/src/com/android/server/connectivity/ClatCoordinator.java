@@ -30,9 +30,13 @@ import android.net.INetd;
 import android.net.InetAddresses;
 import android.net.InterfaceConfigurationParcel;
 import android.net.IpPrefix;
+import android.net.MacAddress;
+import android.os.Handler;
+import android.os.MessageQueue;
 import android.os.ParcelFileDescriptor;
 import android.os.RemoteException;
 import android.os.ServiceSpecificException;
+import android.os.SystemClock;
 import android.system.ErrnoException;
 import android.util.Log;
 
@@ -44,7 +48,6 @@ import com.android.net.module.util.IBpfMap;
 import com.android.net.module.util.InterfaceParams;
 import com.android.net.module.util.TcUtils;
 import com.android.net.module.util.bpf.ClatEgress4Key;
-import com.android.net.module.util.bpf.ClatEgress4Value;
 import com.android.net.module.util.bpf.ClatIngress6Key;
 import com.android.net.module.util.bpf.ClatIngress6Value;
 
@@ -54,6 +57,7 @@ import java.net.Inet4Address;
 import java.net.Inet6Address;
 import java.net.InetAddress;
 import java.nio.ByteBuffer;
+import java.util.Arrays;
 import java.util.Objects;
 
 /**
@@ -84,6 +88,8 @@ public class ClatCoordinator {
 
     private static final int INVALID_IFINDEX = 0;
 
+    private static final MacAddress NULL_MAC_ADDRESS = MacAddress.fromString("00:00:00:00:00:00");
+
     // For better code clarity when used for 'bool ingress' parameter.
     @VisibleForTesting
     static final boolean EGRESS = false;
@@ -94,6 +100,15 @@ public class ClatCoordinator {
     static final boolean RAWIP = false;
     static final boolean ETHER = true;
 
+    // How often the path MTU is re-checked while clatd runs. Route and link changes are notified
+    // immediately, but path MTU changes learnt from Packet Too Big messages are not.
+    @VisibleForTesting
+    static final int PATH_MTU_REFRESH_INTERVAL_MS = 60_000;
+
+    // How long clatd is given to exit after SIGTERM before it is killed.
+    @VisibleForTesting
+    static final int CLATD_STOP_TIMEOUT_MS = 5000;
+
     // The priority of clat hook - must be after tethering.
     @VisibleForTesting
     static final int PRIO_CLAT = 4;
@@ -123,6 +138,15 @@ public class ClatCoordinator {
     private final IBpfMap<ClatEgress4Key, ClatEgress4Value> mEgressMap;
     @Nullable
     private ClatdTracker mClatdTracker = null;
+    @Nullable
+    private PendingClatdStop mPendingClatdStop = null;
+    @Nullable
+    private PathMtuMonitor mPathMtuMonitor = null;
+    // The native handle of the in-process translation engine, 0 if clat runs in a clatd process.
+    private long mClatEngine = 0;
+    // The fwmark and IPv6 path MTU towards the NAT64 prefix of the running clatd.
+    private int mFwmark;
+    private int mPathMtu;
 
     /**
      * Dependencies of ClatCoordinator which makes ConnectivityService injection
@@ -153,10 +177,40 @@ public class ClatCoordinator {
         }
 
         /**
-         * Create tun interface for a given interface name.
+         * Create tun interface for a given interface name, or attach a new queue to it if it
+         * already exists and multiQueue is set.
+         *
+         * @param multiQueue whether to create the interface with IFF_MULTI_QUEUE.
+         * @param vnetHdr whether packets carry a virtio_net_hdr, which enables checksum and
+         *                segmentation offloads on the interface.
+         */
+        public int createTunInterface(@NonNull String tuniface, boolean multiQueue,
+                boolean vnetHdr) throws IOException {
+            return native_createTunInterface(tuniface, multiQueue, vnetHdr);
+        }
+
+        /**
+         * Get the number of tun queues to hand to the in-process engine, which runs one thread
+         * per queue. clatd only reads a single queue and always gets a plain tun interface.
+         */
+        public int getTunQueueCount() {
+            return 1;
+        }
+
+        /**
+         * Whether the tun interface of the in-process engine should use IFF_VNET_HDR and offloads.
+         * clatd does not understand the virtio_net_hdr, so this is ignored when it translates.
          */
-        public int createTunInterface(@NonNull String tuniface) throws IOException {
-            return native_createTunInterface(tuniface);
+        public boolean isTunVnetHdrEnabled() {
+            return false;
+        }
+
+        /**
+         * Whether to translate in a thread of the system server instead of a clatd process. The
+         * BPF programs still translate most packets, the engine only sees what they punt.
+         */
+        public boolean isInProcessClatEnabled() {
+            return false;
         }
 
         /**
@@ -185,6 +239,49 @@ public class ClatCoordinator {
             return native_detectMtu(platSubnet, platSuffix, mark);
         }
 
+        /**
+         * Get the MTU of the route towards the PLAT, as a netlink route lookup.
+         */
+        public int getRouteMtu(@NonNull String platSubnet, int platSuffix, int mark)
+                throws IOException {
+            return native_getRouteMtu(platSubnet, platSuffix, mark);
+        }
+
+        /**
+         * Open a netlink socket notified of IPv6 route, link and IPv6 neighbour changes.
+         */
+        public int openRouteMonitor() throws IOException {
+            return native_openRouteMonitor();
+        }
+
+        /**
+         * Read the pending notifications of a route monitor socket.
+         *
+         * @return the number of route, link or IPv6 neighbour changes read.
+         */
+        public int readRouteMonitor(@NonNull FileDescriptor fd) throws IOException {
+            return native_readRouteMonitor(fd);
+        }
+
+        /**
+         * Get the mac address of the next hop towards the NAT64 prefix on an upstream interface.
+         */
+        @NonNull
+        public MacAddress getNextHopMac(@NonNull String platSubnet, int platSuffix, int ifIndex,
+                int mark) throws IOException {
+            return MacAddress.fromString(native_getNextHopMac(platSubnet, platSuffix, ifIndex,
+                    mark));
+        }
+
+        /**
+         * Get the mac address of a given interface.
+         */
+        @Nullable
+        public MacAddress getInterfaceMac(String ifName) {
+            final InterfaceParams params = InterfaceParams.getByName(ifName);
+            return params != null ? params.macAddr : null;
+        }
+
         /**
          * Open packet socket.
          */
@@ -209,21 +306,53 @@ public class ClatCoordinator {
 
         /**
          * Configure packet socket.
+         *
+         * @param rxRing whether to set up a TPACKET_V3 receive ring on the socket. Packets are then
+         *               only readable through the ring, not with recvfrom().
          */
-        public void configurePacketSocket(@NonNull FileDescriptor sock, String v6, int ifindex)
-                throws IOException {
-            native_configurePacketSocket(sock, v6, ifindex);
+        public void configurePacketSocket(@NonNull FileDescriptor sock, String v6, int ifindex,
+                boolean rxRing) throws IOException {
+            native_configurePacketSocket(sock, v6, ifindex, rxRing);
         }
 
         /**
          * Start clatd.
          */
-        public int startClatd(@NonNull FileDescriptor tunfd, @NonNull FileDescriptor readsock6,
-                @NonNull FileDescriptor writesock6, @NonNull String iface, @NonNull String pfx96,
-                @NonNull String v4, @NonNull String v6) throws IOException {
+        public int startClatd(@NonNull FileDescriptor tunfd,
+                @NonNull FileDescriptor readsock6, @NonNull FileDescriptor writesock6,
+                @NonNull String iface, @NonNull String pfx96, @NonNull String v4,
+                @NonNull String v6) throws IOException {
             return native_startClatd(tunfd, readsock6, writesock6, iface, pfx96, v4, v6);
         }
 
+        /**
+         * Start the in-process translation engine, which keeps its own duplicates of the fds.
+         *
+         * @return a handle to pass to {@link #stopClatEngine}.
+         */
+        public long startClatEngine(@NonNull FileDescriptor[] tunfds, boolean vnetHdr,
+                @NonNull FileDescriptor readsock6, boolean packetRing,
+                @NonNull FileDescriptor writesock6, @NonNull String pfx96, @NonNull String v4,
+                @NonNull String v6) throws IOException {
+            return native_startClatEngine(tunfds, vnetHdr, readsock6, packetRing, writesock6,
+                    pfx96, v4, v6);
+        }
+
+        /**
+         * Stop the in-process translation engine and release its fds.
+         */
+        public void stopClatEngine(long engine) throws IOException {
+            native_stopClatEngine(engine);
+        }
+
+        /**
+         * Set the IPv6 path mtu that the in-process engine fragments to or reports to senders,
+         * 0 if unknown.
+         */
+        public void setClatEngineMtu(long engine, int mtu) throws IOException {
+            native_setClatEngineMtu(engine, mtu);
+        }
+
         /**
          * Stop clatd.
          */
@@ -232,6 +361,24 @@ public class ClatCoordinator {
             native_stopClatd(iface, pfx96, v4, v6, pid);
         }
 
+        /**
+         * Send SIGTERM to clatd without waiting for it to exit.
+         *
+         * @return a pidfd for clatd, which becomes readable once the process has exited.
+         */
+        public int signalClatdStop(int pid) throws IOException {
+            return native_signalClatdStop(pid);
+        }
+
+        /**
+         * Wait for clatd to exit after {@link #signalClatdStop}, send it SIGKILL if it has not
+         * exited within the timeout, and reap it.
+         */
+        public void waitClatdStop(@NonNull FileDescriptor pidfd, int pid, int timeoutMs)
+                throws IOException {
+            native_waitClatdStop(pidfd, pid, timeoutMs);
+        }
+
         /**
          * Tag socket as clat.
          */
@@ -246,6 +393,36 @@ public class ClatCoordinator {
             native_untagSocket(cookie);
         }
 
+        /**
+         * Create the zeroed BPF translation counters of a v4-* interface.
+         */
+        public void createClatStats(int v4ifIndex) throws IOException {
+            native_createClatStats(v4ifIndex);
+        }
+
+        /**
+         * Delete the BPF translation counters of a v4-* interface.
+         */
+        public void deleteClatStats(int v4ifIndex) throws IOException {
+            native_deleteClatStats(v4ifIndex);
+        }
+
+        /**
+         * Get the BPF translation counters of a v4-* interface, summed over all cpus.
+         */
+        @NonNull
+        public long[] getClatStats(int v4ifIndex) throws IOException {
+            return native_getClatStats(v4ifIndex);
+        }
+
+        /**
+         * Get the names of the reasons for the BPF programs to punt packets to clatd.
+         */
+        @NonNull
+        public String[] getClatErrorNames() {
+            return native_getClatErrorNames();
+        }
+
         /** Get ingress6 BPF map. */
         @Nullable
         public IBpfMap<ClatIngress6Key, ClatIngress6Value> getBpfIngress6Map() {
@@ -303,6 +480,47 @@ public class ClatCoordinator {
         }
     }
 
+    /**
+     * Translation counters of the clat BPF programs for a v4-* interface, see ClatStatsValue in
+     * bpf_shared.h.
+     *
+     * The byte counts are those of the IPv4 packets on the v4-* interface, while the overhead
+     * counts the additional bytes of the IPv6 packets on the upstream interface. Packets that
+     * are not translated in BPF, but passed to clatd, are only counted by punt reason.
+     *
+     * These are for monitoring the fast path coverage: they are only exported, in the dump and
+     * through {@link #getClatStats}. NetworkStatsService does not use them, and keeps adding a
+     * fixed 20 bytes per packet of 464xlat overhead to the stacked interface stats.
+     */
+    public static class ClatStats {
+        public final long rxPackets;
+        public final long rxBytes;
+        public final long rxOverheadBytes;
+        public final long txPackets;
+        public final long txBytes;
+        public final long txOverheadBytes;
+        // Indexed like the names returned by Dependencies#getClatErrorNames.
+        @NonNull
+        public final long[] punts;
+
+        @VisibleForTesting
+        ClatStats(@NonNull long[] counters) {
+            rxPackets = counters[0];
+            rxBytes = counters[1];
+            rxOverheadBytes = counters[2];
+            txPackets = counters[3];
+            txBytes = counters[4];
+            txOverheadBytes = counters[5];
+            punts = Arrays.copyOfRange(counters, 6, counters.length);
+        }
+
+        @Override
+        public String toString() {
+            return String.format("rx: %d packets %d bytes (+%d), tx: %d packets %d bytes (+%d)",
+                    rxPackets, rxBytes, rxOverheadBytes, txPackets, txBytes, txOverheadBytes);
+        }
+    }
+
     @VisibleForTesting
     static class ClatdTracker {
         @NonNull
@@ -371,6 +589,58 @@ public class ClatCoordinator {
         return mtu;
     }
 
+    /**
+     * Watches route, link and neighbour changes while clatd runs, see
+     * {@link #startPathMtuMonitor}.
+     */
+    private class PathMtuMonitor {
+        @NonNull
+        public final Handler handler;
+        @NonNull
+        public final ParcelFileDescriptor fd;
+        @NonNull
+        public final Runnable refresh = new Runnable() {
+            @Override
+            public void run() {
+                updateUpstream();
+                handler.postDelayed(this, PATH_MTU_REFRESH_INTERVAL_MS);
+            }
+        };
+
+        PathMtuMonitor(@NonNull Handler handler, @NonNull ParcelFileDescriptor fd) {
+            this.handler = handler;
+            this.fd = fd;
+        }
+    }
+
+    /**
+     * A clatd process which was sent SIGTERM by {@link #clatStopAsync} and has not been reaped yet.
+     */
+    private class PendingClatdStop {
+        @NonNull
+        public final String iface;
+        public final int pid;
+        @NonNull
+        public final ParcelFileDescriptor pidfd;
+        @NonNull
+        public final Handler handler;
+        @Nullable
+        public final Runnable onStopped;
+        public final long deadlineMs;
+        @NonNull
+        public final Runnable timeout = () -> finishPendingClatdStop(0 /* timeoutMs */);
+
+        PendingClatdStop(@NonNull String iface, int pid, @NonNull ParcelFileDescriptor pidfd,
+                @NonNull Handler handler, @Nullable Runnable onStopped) {
+            this.iface = iface;
+            this.pid = pid;
+            this.pidfd = pidfd;
+            this.handler = handler;
+            this.onStopped = onStopped;
+            this.deadlineMs = SystemClock.elapsedRealtime() + CLATD_STOP_TIMEOUT_MS;
+        }
+    }
+
     public ClatCoordinator(@NonNull Dependencies deps) {
         mDeps = deps;
         mNetd = mDeps.getNetd();
@@ -378,7 +648,40 @@ public class ClatCoordinator {
         mEgressMap = mDeps.getBpfEgress4Map();
     }
 
-    private void maybeStartBpf(final ClatdTracker tracker) {
+    // Build the egress value which carries the ethernet header towards the next hop on ethernet
+    // upstreams. If the next hop cannot be resolved, the ethertype is left zero and the egress
+    // program passes packets to clatd instead of translating them.
+    @NonNull
+    private ClatEgress4Value makeEgress4Value(final ClatdTracker tracker, boolean isEthernet,
+            int fwmark) {
+        MacAddress dstMac = NULL_MAC_ADDRESS;
+        MacAddress srcMac = NULL_MAC_ADDRESS;
+        int ethProto = 0;
+        if (isEthernet) {
+            try {
+                final MacAddress ifaceMac = mDeps.getInterfaceMac(tracker.iface);
+                if (ifaceMac == null) throw new IOException("no mac address on " + tracker.iface);
+                dstMac = mDeps.getNextHopMac(tracker.pfx96.getHostAddress(),
+                        ByteBuffer.wrap(GOOGLE_DNS_4.getAddress()).getInt(), tracker.ifIndex,
+                        fwmark);
+                srcMac = ifaceMac;
+                ethProto = ETH_P_IPV6;
+            } catch (IOException | IllegalArgumentException e) {
+                Log.w(TAG, "Cannot resolve next hop on " + tracker.iface
+                        + ", egress translation stays in clatd: " + e);
+            }
+        }
+        return new ClatEgress4Value(tracker.ifIndex, tracker.v6, tracker.pfx96,
+                (short) (isEthernet ? 1 /* ETHER */ : 0 /* RAWIP */), dstMac, srcMac, ethProto,
+                toEgressPmtu(mPathMtu));
+    }
+
+    // The egress value only has 16 bits for the path MTU, 0 means unknown and disables the check.
+    private static int toEgressPmtu(int pathMtu) {
+        return (pathMtu >= IPV6_MIN_MTU && pathMtu <= 0xffff) ? pathMtu : 0;
+    }
+
+    private void maybeStartBpf(final ClatdTracker tracker, int fwmark) {
         if (mIngressMap == null || mEgressMap == null) return;
 
         final boolean isEthernet;
@@ -390,8 +693,15 @@ public class ClatCoordinator {
         }
 
         final ClatEgress4Key txKey = new ClatEgress4Key(tracker.v4ifIndex, tracker.v4);
-        final ClatEgress4Value txValue = new ClatEgress4Value(tracker.ifIndex, tracker.v6,
-                tracker.pfx96, (short) (isEthernet ? 1 /* ETHER */ : 0 /* RAWIP */));
+        final ClatEgress4Value txValue = makeEgress4Value(tracker, isEthernet, fwmark);
+
+        // The counters are best effort, the BPF programs translate regardless.
+        try {
+            mDeps.createClatStats(tracker.v4ifIndex);
+        } catch (IOException e) {
+            Log.e(TAG, "Could not create clat stats for " + tracker.v4iface + ": " + e);
+        }
+
         try {
             mEgressMap.insertEntry(txKey, txValue);
         } catch (ErrnoException | IllegalStateException e) {
@@ -509,6 +819,12 @@ public class ClatCoordinator {
             throw new IOException("Clatd is already running on " + mClatdTracker.iface
                     + " (pid " + mClatdTracker.pid + ")");
         }
+        // A clatd which is still exiting holds the tun interface, so it has to be gone first.
+        if (mPendingClatdStop != null) {
+            final long remainingMs =
+                    mPendingClatdStop.deadlineMs - SystemClock.elapsedRealtime();
+            finishPendingClatdStop((int) Math.max(0, remainingMs));
+        }
         if (nat64Prefix.getPrefixLength() != 96) {
             throw new IOException("Prefix must be 96 bits long: " + nat64Prefix);
         }
@@ -549,9 +865,14 @@ public class ClatCoordinator {
         // [3] Open, configure and bring up the tun interface.
         // Create the v4-... tun interface.
         final String tunIface = CLAT_PREFIX + iface;
+        // Only the in-process engine can serve several queues and the virtio_net_hdr.
+        final boolean inProcess = mDeps.isInProcessClatEnabled();
+        final int tunQueueCount = inProcess ? Math.max(1, mDeps.getTunQueueCount()) : 1;
+        final boolean multiQueue = tunQueueCount > 1;
+        final boolean vnetHdr = inProcess && mDeps.isTunVnetHdrEnabled();
         final ParcelFileDescriptor tunFd;
         try {
-            tunFd = mDeps.adoptFd(mDeps.createTunInterface(tunIface));
+            tunFd = mDeps.adoptFd(mDeps.createTunInterface(tunIface, multiQueue, vnetHdr));
         } catch (IOException e) {
             throw new IOException("Create tun interface " + tunIface + " failed: " + e);
         }
@@ -655,8 +976,11 @@ public class ClatCoordinator {
         }
 
         // Update our packet socket filter to reflect the new 464xlat IP address.
+        // clatd reads the packet socket with recvfrom(), so only the in-process engine can use a
+        // receive ring.
         try {
-            mDeps.configurePacketSocket(readSock6.getFileDescriptor(), v6Str, ifIndex);
+            mDeps.configurePacketSocket(readSock6.getFileDescriptor(), v6Str, ifIndex,
+                    inProcess /* rxRing */);
         } catch (IOException e) {
             tunFd.close();
             readSock6.close();
@@ -664,17 +988,43 @@ public class ClatCoordinator {
             throw new IOException("configure packet socket failed: " + e);
         }
 
-        // [5] Start clatd.
+        // Attach the remaining queues of a multi-queue tun interface.
+        final ParcelFileDescriptor[] tunFds = new ParcelFileDescriptor[tunQueueCount];
+        tunFds[0] = tunFd;
+        try {
+            for (int i = 1; i < tunQueueCount; i++) {
+                tunFds[i] = mDeps.adoptFd(mDeps.createTunInterface(tunIface, multiQueue, vnetHdr));
+            }
+        } catch (IOException e) {
+            closeFds(tunFds);
+            readSock6.close();
+            writeSock6.close();
+            throw new IOException("Create tun queue on " + tunIface + " failed: " + e);
+        }
+
+        // [5] Start clatd, or the in-process engine which then runs without a pid.
+        final FileDescriptor[] tunFileDescriptors = new FileDescriptor[tunQueueCount];
+        for (int i = 0; i < tunQueueCount; i++) {
+            tunFileDescriptors[i] = tunFds[i].getFileDescriptor();
+        }
         final int pid;
+        long engine = 0;
         try {
-            pid = mDeps.startClatd(tunFd.getFileDescriptor(), readSock6.getFileDescriptor(),
-                    writeSock6.getFileDescriptor(), iface, pfx96Str, v4Str, v6Str);
+            if (inProcess) {
+                engine = mDeps.startClatEngine(tunFileDescriptors, vnetHdr,
+                        readSock6.getFileDescriptor(), true /* packetRing */,
+                        writeSock6.getFileDescriptor(), pfx96Str, v4Str, v6Str);
+                pid = 0;
+            } else {
+                pid = mDeps.startClatd(tunFd.getFileDescriptor(), readSock6.getFileDescriptor(),
+                        writeSock6.getFileDescriptor(), iface, pfx96Str, v4Str, v6Str);
+            }
         } catch (IOException e) {
             // TODO: probably refactor to handle the exception of #untagSocket if any.
             mDeps.untagSocket(cookie);
             throw new IOException("Error start clatd on " + iface + ": " + e);
         } finally {
-            tunFd.close();
+            closeFds(tunFds);
             readSock6.close();
             writeSock6.close();
         }
@@ -682,13 +1032,23 @@ public class ClatCoordinator {
         // [6] Initialize and store clatd tracker object.
         mClatdTracker = new ClatdTracker(iface, ifIndex, tunIface, tunIfIndex, v4, v6, pfx96,
                 pid, cookie);
+        mClatEngine = engine;
+        mFwmark = fwmark;
+        mPathMtu = detectedMtu;
+        updateClatEngineMtu();
 
         // [7] Start BPF
-        maybeStartBpf(mClatdTracker);
+        maybeStartBpf(mClatdTracker, fwmark);
 
         return v6Str;
     }
 
+    private static void closeFds(@NonNull final ParcelFileDescriptor[] fds) throws IOException {
+        for (ParcelFileDescriptor fd : fds) {
+            if (fd != null) fd.close();
+        }
+    }
+
     private void maybeStopBpf(final ClatdTracker tracker) {
         if (mIngressMap == null || mEgressMap == null) return;
 
@@ -723,6 +1083,29 @@ public class ClatCoordinator {
         } catch (ErrnoException | IllegalStateException e) {
             Log.e(TAG, "Could not delete entry (" + rxKey + "): " + e);
         }
+
+        try {
+            mDeps.deleteClatStats(tracker.v4ifIndex);
+        } catch (IOException e) {
+            Log.e(TAG, "Could not delete clat stats for " + tracker.v4iface + ": " + e);
+        }
+    }
+
+    /**
+     * Get the BPF translation counters of the running clat, or null if clat is not running or
+     * the counters are not available.
+     *
+     * See {@link ClatStats} for what they count and who uses them.
+     */
+    @Nullable
+    public ClatStats getClatStats() {
+        if (mClatdTracker == null) return null;
+        try {
+            return new ClatStats(mDeps.getClatStats(mClatdTracker.v4ifIndex));
+        } catch (IOException e) {
+            Log.e(TAG, "Could not get clat stats for " + mClatdTracker.v4iface + ": " + e);
+            return null;
+        }
     }
 
     /**
@@ -734,16 +1117,229 @@ public class ClatCoordinator {
         }
         Log.i(TAG, "Stopping clatd pid=" + mClatdTracker.pid + " on " + mClatdTracker.iface);
 
+        stopPathMtuMonitor();
         maybeStopBpf(mClatdTracker);
-        mDeps.stopClatd(mClatdTracker.iface, mClatdTracker.pfx96.getHostAddress(),
-                mClatdTracker.v4.getHostAddress(), mClatdTracker.v6.getHostAddress(),
-                mClatdTracker.pid);
+        if (mClatEngine != 0) {
+            stopClatEngine();
+        } else {
+            mDeps.stopClatd(mClatdTracker.iface, mClatdTracker.pfx96.getHostAddress(),
+                    mClatdTracker.v4.getHostAddress(), mClatdTracker.v6.getHostAddress(),
+                    mClatdTracker.pid);
+        }
         mDeps.untagSocket(mClatdTracker.cookie);
 
         Log.i(TAG, "clatd on " + mClatdTracker.iface + " stopped");
         mClatdTracker = null;
     }
 
+    /**
+     * Keep the clat MTU and the egress next hop in sync with the upstream while clatd runs.
+     *
+     * The IPv6 path MTU towards the NAT64 prefix is looked up again whenever an IPv6 route, a
+     * link or an IPv6 neighbour changes, and every {@link #PATH_MTU_REFRESH_INTERVAL_MS}. A new
+     * value is applied to the v4- interface MTU and to the egress BPF program, which punts packets
+     * that would not fit the path to clatd. On ethernet upstreams the mac address of the next hop
+     * is resolved again at the same times, so that the egress program neither keeps using a stale
+     * one nor punts to clatd forever when it was not resolved at start. Must be called on the
+     * thread of the given handler. The monitor stops with clatd.
+     */
+    public void startPathMtuMonitor(@NonNull Handler handler) throws IOException {
+        if (mClatdTracker == null) {
+            throw new IOException("Clatd has not started");
+        }
+        if (mPathMtuMonitor != null) return;
+
+        final ParcelFileDescriptor fd = mDeps.adoptFd(mDeps.openRouteMonitor());
+        final PathMtuMonitor monitor = new PathMtuMonitor(handler, fd);
+        mPathMtuMonitor = monitor;
+        handler.getLooper().getQueue().addOnFileDescriptorEventListener(fd.getFileDescriptor(),
+                MessageQueue.OnFileDescriptorEventListener.EVENT_INPUT,
+                (unused, events) -> {
+                    if (mPathMtuMonitor != monitor) return 0;
+                    try {
+                        if (mDeps.readRouteMonitor(fd.getFileDescriptor()) > 0) updateUpstream();
+                    } catch (IOException e) {
+                        Log.e(TAG, "Error reading route monitor: " + e);
+                    }
+                    return MessageQueue.OnFileDescriptorEventListener.EVENT_INPUT;
+                });
+        handler.postDelayed(monitor.refresh, PATH_MTU_REFRESH_INTERVAL_MS);
+    }
+
+    private void stopPathMtuMonitor() {
+        final PathMtuMonitor monitor = mPathMtuMonitor;
+        if (monitor == null) return;
+        mPathMtuMonitor = null;
+
+        monitor.handler.removeCallbacks(monitor.refresh);
+        monitor.handler.getLooper().getQueue().removeOnFileDescriptorEventListener(
+                monitor.fd.getFileDescriptor());
+        try {
+            monitor.fd.close();
+        } catch (IOException e) {
+            Log.e(TAG, "Error closing route monitor: " + e);
+        }
+    }
+
+    private void updateUpstream() {
+        final ClatdTracker tracker = mClatdTracker;
+        if (tracker == null) return;
+
+        updatePathMtu(tracker);
+        updateEgress4Value(tracker);
+    }
+
+    private void updatePathMtu(@NonNull ClatdTracker tracker) {
+        final int pathMtu;
+        try {
+            pathMtu = mDeps.getRouteMtu(tracker.pfx96.getHostAddress(),
+                    ByteBuffer.wrap(GOOGLE_DNS_4.getAddress()).getInt(), mFwmark);
+        } catch (IOException e) {
+            Log.w(TAG, "Could not get the path mtu towards " + tracker.pfx96 + ": " + e);
+            return;
+        }
+        if (pathMtu == mPathMtu) return;
+        Log.i(TAG, "Path mtu towards " + tracker.pfx96 + " changed from " + mPathMtu + " to "
+                + pathMtu);
+        mPathMtu = pathMtu;
+        updateClatEngineMtu();
+
+        final int mtu = adjustMtu(pathMtu);
+        try {
+            mNetd.interfaceSetMtu(tracker.v4iface, mtu);
+        } catch (RemoteException | ServiceSpecificException e) {
+            Log.e(TAG, "Set MTU " + mtu + " on " + tracker.v4iface + " failed: " + e);
+        }
+    }
+
+    // The engine handles the packets which the egress program punts for exceeding the path MTU,
+    // which it needs to know in turn.
+    private void updateClatEngineMtu() {
+        if (mClatEngine == 0) return;
+        try {
+            mDeps.setClatEngineMtu(mClatEngine, toEgressPmtu(mPathMtu));
+        } catch (IOException e) {
+            Log.e(TAG, "Set path mtu " + mPathMtu + " on the clat engine failed: " + e);
+        }
+    }
+
+    // Rewrite the egress value if the path MTU or, on ethernet upstreams, the next hop changed.
+    private void updateEgress4Value(@NonNull ClatdTracker tracker) {
+        if (mEgressMap == null) return;
+        final ClatEgress4Key txKey = new ClatEgress4Key(tracker.v4ifIndex, tracker.v4);
+        try {
+            final ClatEgress4Value old = mEgressMap.getValue(txKey);
+            if (old == null) return;
+
+            final ClatEgress4Value value;
+            if (old.oifIsEthernet != 0) {
+                value = makeEgress4Value(tracker, true /* isEthernet */, mFwmark);
+            } else {
+                value = new ClatEgress4Value(old.oif, old.local6, old.pfx96, old.oifIsEthernet,
+                        old.ethDstMac, old.ethSrcMac, old.ethProto, toEgressPmtu(mPathMtu));
+            }
+            if (value.equals(old)) return;
+            if (!value.ethDstMac.equals(old.ethDstMac)) {
+                Log.i(TAG, "Next hop towards " + tracker.pfx96 + " changed from " + old.ethDstMac
+                        + " to " + value.ethDstMac);
+            }
+            mEgressMap.updateEntry(txKey, value);
+        } catch (ErrnoException | IllegalStateException e) {
+            Log.e(TAG, "Could not update the egress value of " + txKey + ": " + e);
+        }
+    }
+
+    /**
+     * Stop clatd without waiting for the process to exit.
+     *
+     * The BPF programs and maps are torn down and clatd is sent SIGTERM before this returns. The
+     * process is reaped when it exits, or killed if it has not exited within
+     * {@link #CLATD_STOP_TIMEOUT_MS}, after which onStopped is run. Must be called on the thread
+     * of the given handler, which is also the thread onStopped runs on.
+     */
+    public void clatStopAsync(@NonNull Handler handler, @Nullable Runnable onStopped)
+            throws IOException {
+        if (mClatdTracker == null) {
+            throw new IOException("Clatd has not started");
+        }
+        final ClatdTracker tracker = mClatdTracker;
+        Log.i(TAG, "Stopping clatd pid=" + tracker.pid + " on " + tracker.iface);
+
+        stopPathMtuMonitor();
+        maybeStopBpf(tracker);
+        // The in-process engine stops within one wakeup of its thread, no need to wait for it.
+        if (mClatEngine != 0) {
+            stopClatEngine();
+            mDeps.untagSocket(tracker.cookie);
+            mClatdTracker = null;
+            Log.i(TAG, "clatd on " + tracker.iface + " stopped");
+            if (onStopped != null) handler.post(onStopped);
+            return;
+        }
+        ParcelFileDescriptor pidfd = null;
+        try {
+            pidfd = mDeps.adoptFd(mDeps.signalClatdStop(tracker.pid));
+        } catch (IOException e) {
+            // Most likely a kernel without pidfd support, stop clatd synchronously instead.
+            Log.w(TAG, "Could not signal clatd pid=" + tracker.pid + " to stop: " + e);
+        }
+        if (pidfd == null) {
+            mDeps.stopClatd(tracker.iface, tracker.pfx96.getHostAddress(),
+                    tracker.v4.getHostAddress(), tracker.v6.getHostAddress(), tracker.pid);
+        }
+        mDeps.untagSocket(tracker.cookie);
+        mClatdTracker = null;
+
+        if (pidfd == null) {
+            Log.i(TAG, "clatd on " + tracker.iface + " stopped");
+            if (onStopped != null) handler.post(onStopped);
+            return;
+        }
+
+        final PendingClatdStop stop =
+                new PendingClatdStop(tracker.iface, tracker.pid, pidfd, handler, onStopped);
+        mPendingClatdStop = stop;
+        handler.getLooper().getQueue().addOnFileDescriptorEventListener(
+                pidfd.getFileDescriptor(),
+                MessageQueue.OnFileDescriptorEventListener.EVENT_INPUT,
+                (fd, events) -> {
+                    if (mPendingClatdStop == stop) finishPendingClatdStop(0 /* timeoutMs */);
+                    return 0;
+                });
+        handler.postDelayed(stop.timeout, CLATD_STOP_TIMEOUT_MS);
+    }
+
+    private void stopClatEngine() throws IOException {
+        final long engine = mClatEngine;
+        mClatEngine = 0;
+        mDeps.stopClatEngine(engine);
+    }
+
+    // Waits up to timeoutMs for the clatd being stopped asynchronously to exit, then kills it if
+    // needed and reaps it.
+    private void finishPendingClatdStop(int timeoutMs) {
+        final PendingClatdStop stop = mPendingClatdStop;
+        if (stop == null) return;
+        mPendingClatdStop = null;
+
+        stop.handler.removeCallbacks(stop.timeout);
+        stop.handler.getLooper().getQueue().removeOnFileDescriptorEventListener(
+                stop.pidfd.getFileDescriptor());
+        try {
+            mDeps.waitClatdStop(stop.pidfd.getFileDescriptor(), stop.pid, timeoutMs);
+        } catch (IOException e) {
+            Log.e(TAG, "Error waiting for clatd pid=" + stop.pid + " to stop: " + e);
+        }
+        try {
+            stop.pidfd.close();
+        } catch (IOException e) {
+            Log.e(TAG, "Error closing pidfd of clatd pid=" + stop.pid + ": " + e);
+        }
+
+        Log.i(TAG, "clatd on " + stop.iface + " stopped");
+        if (stop.onStopped != null) stop.onStopped.run();
+    }
+
     private void dumpBpfIngress(@NonNull IndentingPrintWriter pw) {
         if (mIngressMap == null) {
             pw.println("No BPF ingress6 map");
@@ -777,12 +1373,14 @@ public class ClatCoordinator {
             if (mEgressMap.isEmpty()) {
                 pw.println("<empty>");
             }
-            pw.println("BPF egress map: iif v4Addr -> v6Addr nat64Prefix oif");
+            pw.println("BPF egress map: iif v4Addr -> v6Addr nat64Prefix oif [srcMac -> dstMac]");
             pw.increaseIndent();
             mEgressMap.forEach((k, v) -> {
                 // TODO: print interface name
                 pw.println(String.format("%d %s -> %s %s/96 %d %s", k.iif, k.local4, v.local6,
-                        v.pfx96, v.oif, v.oifIsEthernet != 0 ? "ether" : "rawip"));
+                        v.pfx96, v.oif, v.oifIsEthernet == 0 ? "rawip"
+                        : v.ethProto == 0 ? "ether [unresolved]"
+                        : "ether [" + v.ethSrcMac + " -> " + v.ethDstMac + "]"));
             });
             pw.decreaseIndent();
         } catch (ErrnoException e) {
@@ -790,6 +1388,23 @@ public class ClatCoordinator {
         }
     }
 
+    private void dumpBpfStats(@NonNull IndentingPrintWriter pw) {
+        final ClatStats stats = getClatStats();
+        if (stats == null) {
+            pw.println("No BPF stats");
+            return;
+        }
+
+        pw.println("BPF stats: " + stats);
+        pw.increaseIndent();
+        final String[] names = mDeps.getClatErrorNames();
+        for (int i = 0; i < stats.punts.length && i < names.length; i++) {
+            if (stats.punts[i] == 0) continue;
+            pw.println(String.format("%s: %d", names[i], stats.punts[i]));
+        }
+        pw.decreaseIndent();
+    }
+
     /**
      * Dump the cordinator information.
      *
@@ -804,6 +1419,10 @@ public class ClatCoordinator {
         dumpBpfIngress(pw);
         dumpBpfEgress(pw);
         pw.decreaseIndent();
+        pw.println("Translation stats:");
+        pw.increaseIndent();
+        dumpBpfStats(pw);
+        pw.decreaseIndent();
         pw.println();
     }
 
@@ -820,20 +1439,39 @@ public class ClatCoordinator {
             throws IOException;
     private static native String native_generateIpv6Address(String iface, String v4,
             String prefix64, int mark) throws IOException;
-    private static native int native_createTunInterface(String tuniface) throws IOException;
+    private static native int native_createTunInterface(String tuniface, boolean multiQueue,
+            boolean vnetHdr) throws IOException;
     private static native int native_detectMtu(String platSubnet, int platSuffix, int mark)
             throws IOException;
+    private static native int native_getRouteMtu(String platSubnet, int platSuffix, int mark)
+            throws IOException;
+    private static native int native_openRouteMonitor() throws IOException;
+    private static native int native_readRouteMonitor(FileDescriptor fd) throws IOException;
+    private static native String native_getNextHopMac(String platSubnet, int platSuffix,
+            int ifIndex, int mark) throws IOException;
     private static native int native_openPacketSocket() throws IOException;
     private static native int native_openRawSocket6(int mark) throws IOException;
     private static native void native_addAnycastSetsockopt(FileDescriptor sock, String v6,
             int ifindex) throws IOException;
     private static native void native_configurePacketSocket(FileDescriptor sock, String v6,
-            int ifindex) throws IOException;
+            int ifindex, boolean rxRing) throws IOException;
     private static native int native_startClatd(FileDescriptor tunfd, FileDescriptor readsock6,
             FileDescriptor writesock6, String iface, String pfx96, String v4, String v6)
             throws IOException;
     private static native void native_stopClatd(String iface, String pfx96, String v4, String v6,
             int pid) throws IOException;
+    private static native int native_signalClatdStop(int pid) throws IOException;
+    private static native long native_startClatEngine(FileDescriptor[] tunfds, boolean vnetHdr,
+            FileDescriptor readsock6, boolean packetRing, FileDescriptor writesock6, String pfx96,
+            String v4, String v6) throws IOException;
+    private static native void native_stopClatEngine(long engine) throws IOException;
+    private static native void native_setClatEngineMtu(long engine, int mtu) throws IOException;
+    private static native void native_waitClatdStop(FileDescriptor pidfd, int pid, int timeoutMs)
+            throws IOException;
     private static native long native_tagSocketAsClat(FileDescriptor sock) throws IOException;
     private static native void native_untagSocket(long cookie) throws IOException;
+    private static native void native_createClatStats(int v4ifIndex) throws IOException;
+    private static native void native_deleteClatStats(int v4ifIndex) throws IOException;
+    private static native long[] native_getClatStats(int v4ifIndex) throws IOException;
+    private static native String[] native_getClatErrorNames();
 }
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.server.connectivity;
+
+import android.annotation.NonNull;
+import android.net.MacAddress;
+
+import com.android.net.module.util.Struct;
+import com.android.net.module.util.Struct.Field;
+import com.android.net.module.util.Struct.Type;
+
+import java.net.Inet6Address;
+import java.util.Objects;
+
+/**
+ * Value type for clat egress IPv4 maps.
+ *
+ * This mirrors ClatEgress4Value in packages/modules/Connectivity/bpf_progs/bpf_shared.h, which
+ * carries the ethernet header of the next hop neighbour in addition to the translation addresses.
+ */
+public class ClatEgress4Value extends Struct {
+    @Field(order = 0, type = Type.U32)
+    public final long oif; // The output interface to redirect to
+
+    @Field(order = 1, type = Type.Ipv6Address)
+    public final Inet6Address local6; // The full 128-bits of the source IPv6 address
+
+    @Field(order = 2, type = Type.Ipv6Address)
+    public final Inet6Address pfx96; // The destination /96 nat64 prefix, bottom 32 bits must be 0
+
+    @Field(order = 3, type = Type.U8, padding = 3)
+    public final short oifIsEthernet; // Whether the output interface requires ethernet header
+
+    // The ethhdr struct which is defined in uapi/linux/if_ether.h
+    @Field(order = 4, type = Type.EUI48)
+    public final MacAddress ethDstMac; // The destination mac address.
+    @Field(order = 5, type = Type.EUI48)
+    public final MacAddress ethSrcMac; // The source mac address.
+    @Field(order = 6, type = Type.UBE16)
+    public final int ethProto; // Packet type ID field, zero iff the header must not be used.
+
+    @Field(order = 7, type = Type.U16)
+    public final int pmtu; // The path MTU towards the nat64 prefix, 0 if unknown.
+
+    public ClatEgress4Value(final long oif, @NonNull final Inet6Address local6,
+            @NonNull final Inet6Address pfx96, final short oifIsEthernet,
+            @NonNull final MacAddress ethDstMac, @NonNull final MacAddress ethSrcMac,
+            final int ethProto, final int pmtu) {
+        Objects.requireNonNull(ethDstMac);
+        Objects.requireNonNull(ethSrcMac);
+
+        this.oif = oif;
+        this.local6 = local6;
+        this.pfx96 = pfx96;
+        this.oifIsEthernet = oifIsEthernet;
+        this.ethDstMac = ethDstMac;
+        this.ethSrcMac = ethSrcMac;
+        this.ethProto = ethProto;
+        this.pmtu = pmtu;
+    }
+
+    @Override
+    public String toString() {
+        return String.format("oif: %d, local6: %s, pfx96: %s, oifIsEthernet: %d, dstMac: %s, "
+                + "srcMac: %s, proto: %d, pmtu: %d", oif, local6, pfx96, oifIsEthernet, ethDstMac,
+                ethSrcMac, ethProto, pmtu);
+    }
+}
@@ -16,26 +16,30 @@
 
 package com.android.server.connectivity;
 
+import static android.system.OsConstants.IPPROTO_TCP;
+import static android.system.OsConstants.IPPROTO_UDP;
+
 import static com.android.net.module.util.BpfUtils.BPF_CGROUP_INET4_BIND;
 import static com.android.net.module.util.BpfUtils.BPF_CGROUP_INET6_BIND;
 
-import android.annotation.NonNull;
-import android.annotation.Nullable;
 import android.content.Context;
+import android.content.pm.PackageManager;
+import android.net.connectivity.aidl.BlockedBindCount;
 import android.net.connectivity.aidl.ConnectivityNative;
 import android.os.Binder;
 import android.os.Process;
 import android.os.ServiceSpecificException;
 import android.system.ErrnoException;
+import android.system.Os;
 import android.util.Log;
 
-import com.android.internal.annotations.VisibleForTesting;
-import com.android.net.module.util.BpfBitmap;
 import com.android.net.module.util.BpfUtils;
 import com.android.net.module.util.CollectionUtils;
 import com.android.net.module.util.PermissionUtils;
 
+import java.io.FileDescriptor;
 import java.io.IOException;
+import java.io.PrintWriter;
 import java.util.ArrayList;
 
 /**
@@ -50,30 +54,13 @@ public class ConnectivityNativeService extends ConnectivityNative.Stub {
             "/sys/fs/bpf/net_shared/prog_block_bind4_block_port";
     private static final String V6_PROG_PATH =
             "/sys/fs/bpf/net_shared/prog_block_bind6_block_port";
-    private static final String BLOCKED_PORTS_MAP_PATH =
-            "/sys/fs/bpf/net_shared/map_block_blocked_ports_map";
-
-    private final Context mContext;
 
-    // BPF map for port blocking. Exactly 65536 entries long, with one entry per port number
-    @Nullable
-    private final BpfBitmap mBpfBlockedPortsMap;
+    // Bitmaps of block.c an operation applies to, see BindPortBlocker.h.
+    private static final int BLOCK_TCP = 1 << 0;
+    private static final int BLOCK_UDP = 1 << 1;
+    private static final int BLOCK_ALL = BLOCK_TCP | BLOCK_UDP;
 
-    /**
-     * Dependencies of ConnectivityNativeService, for injection in tests.
-     */
-    @VisibleForTesting
-    public static class Dependencies {
-        /** Get BPF maps. */
-        @Nullable public BpfBitmap getBlockPortsMap() {
-            try {
-                return new BpfBitmap(BLOCKED_PORTS_MAP_PATH);
-            } catch (ErrnoException e) {
-                throw new UnsupportedOperationException("Failed to create blocked ports map: "
-                        + e);
-            }
-        }
-    }
+    private final Context mContext;
 
     private void enforceBlockPortPermission() {
         final int uid = Binder.getCallingUid();
@@ -87,63 +74,142 @@ public class ConnectivityNativeService extends ConnectivityNative.Stub {
         }
     }
 
-    public ConnectivityNativeService(final Context context) {
-        this(context, new Dependencies());
+    private static int toBitmaps(int protocol) {
+        if (protocol == 0) return BLOCK_ALL;
+        if (protocol == IPPROTO_TCP) return BLOCK_TCP;
+        if (protocol == IPPROTO_UDP) return BLOCK_UDP;
+        throw new IllegalArgumentException("Invalid protocol " + protocol);
+    }
+
+    private static void maybeThrow(int err, String msg) {
+        if (err != 0) throw new ServiceSpecificException(err, msg + ": " + Os.strerror(err));
     }
 
-    @VisibleForTesting
-    protected ConnectivityNativeService(final Context context, @NonNull Dependencies deps) {
+    public ConnectivityNativeService(final Context context) {
         mContext = context;
-        mBpfBlockedPortsMap = deps.getBlockPortsMap();
+        try {
+            native_init();
+        } catch (ErrnoException e) {
+            throw new UnsupportedOperationException("Failed to open blocked ports map: " + e);
+        }
         attachProgram();
     }
 
     @Override
     public void blockPortForBind(int port) {
+        blockPortRangeForBind(0, port, port);
+    }
+
+    @Override
+    public void unblockPortForBind(int port) {
+        unblockPortRangeForBind(0, port, port);
+    }
+
+    @Override
+    public void unblockAllPortsForBind() {
         enforceBlockPortPermission();
-        ensureValidPortNumber(port);
-        try {
-            mBpfBlockedPortsMap.set(port);
-        } catch (ErrnoException e) {
-            throw new ServiceSpecificException(e.errno, e.getMessage());
+        maybeThrow(native_clear(), "Could not clear map");
+    }
+
+    @Override
+    public int[] getPortsBlockedForBind() {
+        final long[] bitmap = getBlockedPortsBitmap(0);
+        final ArrayList<Integer> ports = new ArrayList<>();
+        for (int word = 0; word < bitmap.length; word++) {
+            for (long bits = bitmap[word]; bits != 0; bits &= bits - 1) {
+                ports.add(word * 64 + Long.numberOfTrailingZeros(bits));
+            }
         }
+        return CollectionUtils.toIntArray(ports);
     }
 
     @Override
-    public void unblockPortForBind(int port) {
+    public void blockPortRangeForBind(int protocol, int firstPort, int lastPort) {
+        setPortRange(protocol, firstPort, lastPort, true /* blocked */);
+    }
+
+    @Override
+    public void unblockPortRangeForBind(int protocol, int firstPort, int lastPort) {
+        setPortRange(protocol, firstPort, lastPort, false /* blocked */);
+    }
+
+    private void setPortRange(int protocol, int firstPort, int lastPort, boolean blocked) {
+        enforceBlockPortPermission();
+        ensureValidPortNumber(firstPort);
+        ensureValidPortNumber(lastPort);
+        if (firstPort > lastPort) {
+            throw new IllegalArgumentException("Invalid port range " + firstPort + "-" + lastPort);
+        }
+        maybeThrow(native_setPortRange(toBitmaps(protocol), firstPort, lastPort, blocked),
+                "Could not update ports " + firstPort + "-" + lastPort);
+    }
+
+    @Override
+    public void blockPortsForBind(int protocol, int[] ports) {
+        setPorts(protocol, ports, true /* blocked */);
+    }
+
+    @Override
+    public void unblockPortsForBind(int protocol, int[] ports) {
+        setPorts(protocol, ports, false /* blocked */);
+    }
+
+    private void setPorts(int protocol, int[] ports, boolean blocked) {
+        enforceBlockPortPermission();
+        for (int port : ports) ensureValidPortNumber(port);
+        maybeThrow(native_setPorts(toBitmaps(protocol), ports, blocked),
+                "Could not update " + ports.length + " ports");
+    }
+
+    @Override
+    public long[] getBlockedPortsBitmap(int protocol) {
         enforceBlockPortPermission();
-        ensureValidPortNumber(port);
         try {
-            mBpfBlockedPortsMap.unset(port);
+            return native_getBitmap(toBitmaps(protocol));
         } catch (ErrnoException e) {
-            throw new ServiceSpecificException(e.errno,
-                    "Could not unset bitmap value for (port: " + port + "): " + e);
+            throw new ServiceSpecificException(e.errno, "Could not read blocked ports: " + e);
         }
     }
 
     @Override
-    public void unblockAllPortsForBind() {
+    public BlockedBindCount[] getBlockedBindCounts() {
         enforceBlockPortPermission();
+        final long[] values;
         try {
-            mBpfBlockedPortsMap.clear();
+            values = native_getBlockedBindCounts();
         } catch (ErrnoException e) {
-            throw new ServiceSpecificException(e.errno, "Could not clear map: " + e);
+            throw new ServiceSpecificException(e.errno, "Could not read blocked binds: " + e);
         }
+        final BlockedBindCount[] counts = new BlockedBindCount[values.length / 4];
+        for (int i = 0; i < counts.length; i++) {
+            counts[i] = new BlockedBindCount();
+            counts[i].uid = (int) values[4 * i];
+            counts[i].port = (int) values[4 * i + 1];
+            counts[i].protocol = (int) values[4 * i + 2];
+            counts[i].count = values[4 * i + 3];
+        }
+        return counts;
     }
 
     @Override
-    public int[] getPortsBlockedForBind() {
-        enforceBlockPortPermission();
+    protected void dump(FileDescriptor fd, PrintWriter pw, String[] args) {
+        if (mContext.checkCallingOrSelfPermission(android.Manifest.permission.DUMP)
+                != PackageManager.PERMISSION_GRANTED) {
+            pw.println("Permission Denial: can't dump " + TAG + " from pid="
+                    + Binder.getCallingPid() + ", uid=" + Binder.getCallingUid());
+            return;
+        }
 
-        ArrayList<Integer> portMap = new ArrayList<Integer>();
-        for (int i = 0; i <= 65535; i++) {
-            try {
-                if (mBpfBlockedPortsMap.get(i)) portMap.add(i);
-            } catch (ErrnoException e) {
-                Log.e(TAG, "Failed to get index " + i, e);
+        pw.println("Blocked binds:");
+        try {
+            final long[] values = native_getBlockedBindCounts();
+            for (int i = 0; i < values.length; i += 4) {
+                pw.println("  uid: " + values[i] + ", port: " + values[i + 1] + ", protocol: "
+                        + values[i + 2] + ", denied: " + values[i + 3]);
             }
+        } catch (ErrnoException e) {
+            pw.println("  unavailable: " + e);
         }
-        return CollectionUtils.toIntArray(portMap);
     }
 
     @Override
@@ -174,4 +240,12 @@ public class ConnectivityNativeService extends ConnectivityNative.Stub {
         }
         Log.d(TAG, "Attached BPF_CGROUP_INET4_BIND and BPF_CGROUP_INET6_BIND programs");
     }
+
+    private static native void native_init() throws ErrnoException;
+    private static native int native_setPortRange(int bitmaps, int firstPort, int lastPort,
+            boolean blocked);
+    private static native int native_setPorts(int bitmaps, int[] ports, boolean blocked);
+    private static native int native_clear();
+    private static native long[] native_getBitmap(int bitmaps) throws ErrnoException;
+    private static native long[] native_getBlockedBindCounts() throws ErrnoException;
 }
@@ -21,16 +21,19 @@ import static android.net.NetworkAgent.DSCP_POLICY_STATUS_INSUFFICIENT_PROCESSIN
 import static android.net.NetworkAgent.DSCP_POLICY_STATUS_POLICY_NOT_FOUND;
 import static android.net.NetworkAgent.DSCP_POLICY_STATUS_REQUEST_DECLINED;
 import static android.net.NetworkAgent.DSCP_POLICY_STATUS_SUCCESS;
+import static android.system.OsConstants.EINVAL;
 import static android.system.OsConstants.ETH_P_ALL;
 
 import android.annotation.NonNull;
 import android.net.DscpPolicy;
 import android.os.RemoteException;
 import android.system.ErrnoException;
+import android.system.Os;
 import android.util.Log;
+import android.util.SparseArray;
 import android.util.SparseIntArray;
 
-import com.android.net.module.util.BpfMap;
+import com.android.internal.util.IndentingPrintWriter;
 import com.android.net.module.util.Struct;
 import com.android.net.module.util.TcUtils;
 
@@ -38,8 +41,10 @@ import java.io.IOException;
 import java.net.Inet4Address;
 import java.net.Inet6Address;
 import java.net.NetworkInterface;
+import java.nio.ByteBuffer;
 import java.util.HashMap;
 import java.util.HashSet;
+import java.util.Map;
 import java.util.Set;
 
 /**
@@ -53,28 +58,17 @@ public class DscpPolicyTracker {
     private static final String TAG = DscpPolicyTracker.class.getSimpleName();
     private static final String PROG_PATH =
             "/sys/fs/bpf/net_shared/prog_dscp_policy_schedcls_set_dscp";
-    // Name is "map + *.o + map_name + map". Can probably shorten this
-    private static final String IPV4_POLICY_MAP_PATH = makeMapPath(
-            "dscp_policy_ipv4_dscp_policies");
-    private static final String IPV6_POLICY_MAP_PATH = makeMapPath(
-            "dscp_policy_ipv6_dscp_policies");
-    private static final int MAX_POLICIES = 16;
-
-    private static String makeMapPath(String which) {
-        return "/sys/fs/bpf/net_shared/map_" + which + "_map";
-    }
+    private static final int MAX_POLICIES = 1024;
 
     private Set<String> mAttachedIfaces;
 
-    private final BpfMap<Struct.U32, DscpPolicyValue> mBpfDscpIpv4Policies;
-    private final BpfMap<Struct.U32, DscpPolicyValue> mBpfDscpIpv6Policies;
+    // The policies, keyed by their index, which is also their priority: among the matching
+    // policies with the most fields, the one with the lowest index wins. A given policy always
+    // consumes one index even if it's an IPv4-only or IPv6-only policy. The BPF code does not see
+    // these directly but the classifier that DscpPolicyManager builds from them.
+    private final SparseArray<DscpPolicyValue> mIpv4Policies = new SparseArray<>();
+    private final SparseArray<DscpPolicyValue> mIpv6Policies = new SparseArray<>();
 
-    // The actual policy rules used by the BPF code to process packets
-    // are in mBpfDscpIpv4Policies and mBpfDscpIpv4Policies. Both of
-    // these can contain up to MAX_POLICIES rules.
-    //
-    // A given policy always consumes one entry in both the IPv4 and
-    // IPv6 maps even if if's an IPv4-only or IPv6-only policy.
     //
     // Each interface index has a SparseIntArray of rules which maps a
     // policy ID to the index of the corresponding rule in the maps.
@@ -85,10 +79,40 @@ public class DscpPolicyTracker {
     public DscpPolicyTracker() throws ErrnoException {
         mAttachedIfaces = new HashSet<String>();
         mIfaceIndexToPolicyIdBpfMapIndex = new HashMap<Integer, SparseIntArray>();
-        mBpfDscpIpv4Policies = new BpfMap<Struct.U32, DscpPolicyValue>(IPV4_POLICY_MAP_PATH,
-                BpfMap.BPF_F_RDWR, Struct.U32.class, DscpPolicyValue.class);
-        mBpfDscpIpv6Policies = new BpfMap<Struct.U32, DscpPolicyValue>(IPV6_POLICY_MAP_PATH,
-                BpfMap.BPF_F_RDWR, Struct.U32.class, DscpPolicyValue.class);
+        native_init();
+    }
+
+    private static byte[] toBytes(SparseArray<DscpPolicyValue> policies) {
+        final int size = Struct.getSize(DscpPolicyValue.class);
+        final ByteBuffer buffer = ByteBuffer.allocate(policies.size() * size);
+        for (int i = 0; i < policies.size(); i++) {
+            buffer.put(policies.valueAt(i).writeToBytes());
+        }
+        return buffer.array();
+    }
+
+    private static int[] toPriorities(SparseArray<DscpPolicyValue> policies) {
+        final int[] priorities = new int[policies.size()];
+        for (int i = 0; i < policies.size(); i++) {
+            priorities[i] = policies.keyAt(i);
+        }
+        return priorities;
+    }
+
+    /**
+     * Apply mIpv4Policies and mIpv6Policies. The native code validates them, writes their
+     * classifier to the inactive slot of the BPF maps and then makes it active at once.
+     *
+     * @return 0 on success, EINVAL if a policy is invalid, or another errno if the policies do
+     *         not fit in the BPF maps or could not be written.
+     */
+    private int updateClassifier() {
+        final int err = native_setPolicies(toPriorities(mIpv4Policies), toBytes(mIpv4Policies),
+                toPriorities(mIpv6Policies), toBytes(mIpv6Policies));
+        if (err != 0) {
+            Log.e(TAG, "Failed to update the DSCP policy classifier: " + Os.strerror(err));
+        }
+        return err;
     }
 
     private boolean isUnusedIndex(int index) {
@@ -176,42 +200,55 @@ public class DscpPolicyTracker {
             return DSCP_POLICY_STATUS_INSUFFICIENT_PROCESSING_RESOURCES;
         }
 
-        try {
-            // Add v4 policy to mBpfDscpIpv4Policies if source and destination address
-            // are both null or if they are both instances of Inet4Address.
-            if (matchesIpv4(policy)) {
-                mBpfDscpIpv4Policies.insertOrReplaceEntry(
-                        new Struct.U32(addIndex),
-                        new DscpPolicyValue(policy.getSourceAddress(),
-                            policy.getDestinationAddress(), ifIndex,
-                            policy.getSourcePort(), policy.getDestinationPortRange(),
-                            (short) policy.getProtocol(), (short) policy.getDscpValue()));
-            }
+        final DscpPolicyValue value = new DscpPolicyValue(policy.getSourceAddress(),
+                policy.getDestinationAddress(), ifIndex,
+                policy.getSourcePort(), policy.getDestinationPortRange(),
+                (short) policy.getProtocol(), (short) policy.getDscpValue());
+        final DscpPolicyValue oldIpv4 = mIpv4Policies.get(addIndex);
+        final DscpPolicyValue oldIpv6 = mIpv6Policies.get(addIndex);
+
+        // Add v4 policy to mIpv4Policies if source and destination address
+        // are both null or if they are both instances of Inet4Address.
+        if (matchesIpv4(policy)) {
+            mIpv4Policies.put(addIndex, value);
+        } else {
+            mIpv4Policies.remove(addIndex);
+        }
 
-            // Add v6 policy to mBpfDscpIpv6Policies if source and destination address
-            // are both null or if they are both instances of Inet6Address.
-            if (matchesIpv6(policy)) {
-                mBpfDscpIpv6Policies.insertOrReplaceEntry(
-                        new Struct.U32(addIndex),
-                        new DscpPolicyValue(policy.getSourceAddress(),
-                                policy.getDestinationAddress(), ifIndex,
-                                policy.getSourcePort(), policy.getDestinationPortRange(),
-                                (short) policy.getProtocol(), (short) policy.getDscpValue()));
-            }
+        // Add v6 policy to mIpv6Policies if source and destination address
+        // are both null or if they are both instances of Inet6Address.
+        if (matchesIpv6(policy)) {
+            mIpv6Policies.put(addIndex, value);
+        } else {
+            mIpv6Policies.remove(addIndex);
+        }
 
-            ifacePolicies.put(policy.getPolicyId(), addIndex);
-            // Only add the policy to the per interface map if the policy was successfully
-            // added to both bpf maps above. It is safe to assume that if insert fails for
-            // one map then it fails for both.
-            mIfaceIndexToPolicyIdBpfMapIndex.put(ifIndex, ifacePolicies);
-        } catch (ErrnoException e) {
-            Log.e(TAG, "Failed to insert policy into map: ", e);
-            return DSCP_POLICY_STATUS_INSUFFICIENT_PROCESSING_RESOURCES;
+        final int err = updateClassifier();
+        if (err != 0) {
+            // Put back the policies that were there before, so that the next update does not
+            // carry this one.
+            restorePolicy(mIpv4Policies, addIndex, oldIpv4);
+            restorePolicy(mIpv6Policies, addIndex, oldIpv6);
+            return err == EINVAL ? DSCP_POLICY_STATUS_REQUEST_DECLINED
+                    : DSCP_POLICY_STATUS_INSUFFICIENT_PROCESSING_RESOURCES;
         }
 
+        // Only add the policy to the per interface map if the classifier was successfully
+        // updated with it.
+        ifacePolicies.put(policy.getPolicyId(), addIndex);
+        mIfaceIndexToPolicyIdBpfMapIndex.put(ifIndex, ifacePolicies);
         return DSCP_POLICY_STATUS_SUCCESS;
     }
 
+    private static void restorePolicy(SparseArray<DscpPolicyValue> policies, int index,
+            DscpPolicyValue value) {
+        if (value != null) {
+            policies.put(index, value);
+        } else {
+            policies.remove(index);
+        }
+    }
+
     /**
      * Add the provided DSCP policy to the bpf map. Attach bpf program dscp_policy to iface
      * if not already attached. Response will be sent back to nai with status.
@@ -243,14 +280,10 @@ public class DscpPolicyTracker {
 
     private void removePolicyFromMap(NetworkAgentInfo nai, int policyId, int index,
             boolean sendCallback) {
-        int status = DSCP_POLICY_STATUS_POLICY_NOT_FOUND;
-        try {
-            mBpfDscpIpv4Policies.replaceEntry(new Struct.U32(index), DscpPolicyValue.NONE);
-            mBpfDscpIpv6Policies.replaceEntry(new Struct.U32(index), DscpPolicyValue.NONE);
-            status = DSCP_POLICY_STATUS_DELETED;
-        } catch (ErrnoException e) {
-            Log.e(TAG, "Failed to delete policy from map: ", e);
-        }
+        mIpv4Policies.remove(index);
+        mIpv6Policies.remove(index);
+        final int status = updateClassifier() == 0
+                ? DSCP_POLICY_STATUS_DELETED : DSCP_POLICY_STATUS_POLICY_NOT_FOUND;
 
         if (sendCallback) {
             sendStatus(nai, policyId, status);
@@ -300,9 +333,17 @@ public class DscpPolicyTracker {
 
         SparseIntArray ifacePolicies = mIfaceIndexToPolicyIdBpfMapIndex.get(getIfaceIndex(nai));
         if (ifacePolicies == null) return;
+        // Rebuild the classifier once for all the policies of the network.
         for (int i = 0; i < ifacePolicies.size(); i++) {
-            removePolicyFromMap(nai, ifacePolicies.keyAt(i), ifacePolicies.valueAt(i),
-                    sendCallback);
+            mIpv4Policies.remove(ifacePolicies.valueAt(i));
+            mIpv6Policies.remove(ifacePolicies.valueAt(i));
+        }
+        final int status = updateClassifier() == 0
+                ? DSCP_POLICY_STATUS_DELETED : DSCP_POLICY_STATUS_POLICY_NOT_FOUND;
+        if (sendCallback) {
+            for (int i = 0; i < ifacePolicies.size(); i++) {
+                sendStatus(nai, ifacePolicies.keyAt(i), status);
+            }
         }
         ifacePolicies.clear();
         detachProgram(nai.linkProperties.getInterfaceName());
@@ -340,4 +381,37 @@ public class DscpPolicyTracker {
             Log.e(TAG, "Unable to detach to TC on " + iface + ": " + e);
         }
     }
+
+    /**
+     * Dump the policies of every interface along with the packets and bytes they matched.
+     */
+    public void dump(IndentingPrintWriter pw) {
+        pw.println("DSCP policies:");
+        pw.increaseIndent();
+        for (Map.Entry<Integer, SparseIntArray> entry
+                : mIfaceIndexToPolicyIdBpfMapIndex.entrySet()) {
+            final SparseIntArray ifacePolicies = entry.getValue();
+            for (int i = 0; i < ifacePolicies.size(); i++) {
+                final int index = ifacePolicies.valueAt(i);
+                String stats;
+                try {
+                    final long[] counters = native_getPolicyStats(index);
+                    stats = "packets: " + counters[0] + ", bytes: " + counters[1]
+                            + ", rewritten: " + counters[2]
+                            + ", already marked: " + (counters[0] - counters[2]);
+                } catch (ErrnoException e) {
+                    stats = "stats unavailable: " + e;
+                }
+                pw.println("ifindex: " + entry.getKey() + ", id: " + ifacePolicies.keyAt(i)
+                        + ", priority: " + index + ", ipv4: " + (mIpv4Policies.get(index) != null)
+                        + ", ipv6: " + (mIpv6Policies.get(index) != null) + ", " + stats);
+            }
+        }
+        pw.decreaseIndent();
+    }
+
+    private static native void native_init() throws ErrnoException;
+    private static native int native_setPolicies(int[] ipv4Priorities, byte[] ipv4Policies,
+            int[] ipv6Priorities, byte[] ipv6Policies);
+    private static native long[] native_getPolicyStats(int priority) throws ErrnoException;
 }
@@ -27,7 +27,10 @@ import java.net.Inet4Address;
 import java.net.InetAddress;
 import java.net.UnknownHostException;
 
-/** Value type for DSCP setting and rewriting to DSCP policy BPF maps. */
+/**
+ * A DSCP policy, which mirrors DscpPolicy in packages/modules/Connectivity/bpf_progs/dscp_policy.h.
+ * These are passed to the native DscpPolicyManager, which builds the classifier maps from them.
+ */
 public class DscpPolicyValue extends Struct {
     private static final String TAG = DscpPolicyValue.class.getSimpleName();
 
@@ -58,11 +61,11 @@ public class DscpPolicyValue extends Struct {
     @Field(order = 8, type = Type.U8, padding = 3)
     public final short mask;
 
-    private static final int SRC_IP_MASK = 0x1;
-    private static final int DST_IP_MASK = 0x02;
-    private static final int SRC_PORT_MASK = 0x4;
-    private static final int DST_PORT_MASK = 0x8;
-    private static final int PROTO_MASK = 0x10;
+    static final int SRC_IP_MASK = 0x1;
+    static final int DST_IP_MASK = 0x02;
+    static final int SRC_PORT_MASK = 0x4;
+    static final int DST_PORT_MASK = 0x8;
+    static final int PROTO_MASK = 0x10;
 
     private boolean ipEmpty(final byte[] ip) {
         for (int i = 0; i < ip.length; i++) {
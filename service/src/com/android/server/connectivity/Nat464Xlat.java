@@ -190,6 +190,13 @@ public class Nat464Xlat {
             } catch (IOException e) {
                 Log.e(TAG, "Error starting clatd on " + baseIface + ": " + e);
             }
+            if (addrStr != null) {
+                try {
+                    mClatCoordinator.startPathMtuMonitor(mNetwork.handler());
+                } catch (IOException e) {
+                    Log.e(TAG, "Error monitoring the path mtu on " + baseIface + ": " + e);
+                }
+            }
         } else {
             try {
                 addrStr = mNetd.clatdStart(baseIface, mNat64PrefixInUse.toString());
@@ -271,7 +278,8 @@ public class Nat464Xlat {
         Log.i(TAG, "Stopping clatd on " + mBaseIface);
         if (SdkLevel.isAtLeastT()) {
             try {
-                mClatCoordinator.clatStop();
+                // Don't block the handler until clatd has exited.
+                mClatCoordinator.clatStopAsync(mNetwork.handler(), null /* onStopped */);
             } catch (IOException e) {
                 Log.e(TAG, "Error stopping clatd on " + mBaseIface + ": " + e);
             }
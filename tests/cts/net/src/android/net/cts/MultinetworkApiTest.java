@@ -16,11 +16,14 @@
 
 package android.net.cts;
 
+import static android.net.DnsResolver.CLASS_IN;
+import static android.net.DnsResolver.TYPE_A;
 import static android.net.NetworkCapabilities.TRANSPORT_CELLULAR;
 
 import android.content.Context;
 import android.content.ContentResolver;
 import android.net.ConnectivityManager;
+import android.net.DnsResolver;
 import android.net.Network;
 import android.net.NetworkCapabilities;
 import android.net.NetworkUtils;
@@ -32,6 +35,7 @@ import android.system.OsConstants;
 import android.test.AndroidTestCase;
 
 import java.util.ArrayList;
+import java.util.Arrays;
 
 public class MultinetworkApiTest extends AndroidTestCase {
 
@@ -55,6 +59,11 @@ public class MultinetworkApiTest extends AndroidTestCase {
     private static native void runResNsendCheck(long networkHandle);
     private static native void runResNnxDomainCheck(long networkHandle);
 
+    private static final int BATCH_QUERY_TIMEOUT_MS = 10_000;
+    // Exceeds the 63 bytes limit of labels, so cannot even be sent.
+    private static final String MALFORMED_QUERY_NAME =
+            "www." + new String(new char[70]).replace('\0', 'g') + ".com";
+
 
     private ContentResolver mCR;
     private ConnectivityManager mCM;
@@ -239,4 +248,63 @@ public class MultinetworkApiTest extends AndroidTestCase {
             mCtsNetUtils.restorePrivateDnsSetting();
         }
     }
+
+    public void testResNetworkQueryBatch() throws ErrnoException {
+        for (Network network : getTestableNetworks()) {
+            final String[] dnames = {
+                    "www.google.com", MALFORMED_QUERY_NAME, null, "www.youtube.com" };
+            final int[] errors = new int[dnames.length];
+            final DnsResolver.DnsResponse[] responses = NetworkUtils.resNetworkQueryBatch(
+                    network.getNetId(), dnames, CLASS_IN, TYPE_A, 0 /* flags */,
+                    BATCH_QUERY_TIMEOUT_MS, errors);
+
+            // Failed queries do not prevent the others from being answered.
+            assertEquals(dnames.length, responses.length);
+            assertEquals(0, errors[0]);
+            assertNotNull(responses[0]);
+            assertEquals(OsConstants.EMSGSIZE, errors[1]);
+            assertNull(responses[1]);
+            assertEquals(OsConstants.EINVAL, errors[2]);
+            assertNull(responses[2]);
+            assertEquals(0, errors[3]);
+            assertNotNull(responses[3]);
+        }
+    }
+
+    public void testResNetworkQueryBatchLimits() throws ErrnoException {
+        final Network network = getTestableNetworks()[0];
+        final String[] dnames = new String[NetworkUtils.MAX_BATCH_QUERIES];
+        Arrays.fill(dnames, "www.google.com");
+        final int[] errors = new int[dnames.length];
+        final DnsResolver.DnsResponse[] responses = NetworkUtils.resNetworkQueryBatch(
+                network.getNetId(), dnames, CLASS_IN, TYPE_A, 0 /* flags */,
+                BATCH_QUERY_TIMEOUT_MS, errors);
+        for (int i = 0; i < dnames.length; i++) {
+            assertEquals("Query " + i, 0, errors[i]);
+            assertNotNull("Query " + i, responses[i]);
+        }
+
+        try {
+            NetworkUtils.resNetworkQueryBatch(network.getNetId(),
+                    new String[NetworkUtils.MAX_BATCH_QUERIES + 1], CLASS_IN, TYPE_A,
+                    0 /* flags */, BATCH_QUERY_TIMEOUT_MS,
+                    new int[NetworkUtils.MAX_BATCH_QUERIES + 1]);
+            fail("Batches are limited to " + NetworkUtils.MAX_BATCH_QUERIES + " queries");
+        } catch (IllegalArgumentException expected) { }
+        try {
+            NetworkUtils.resNetworkQueryBatch(network.getNetId(), dnames, CLASS_IN, TYPE_A,
+                    0 /* flags */, BATCH_QUERY_TIMEOUT_MS, new int[1]);
+            fail("errors must be as long as dnames");
+        } catch (IllegalArgumentException expected) { }
+        try {
+            NetworkUtils.resNetworkQueryBatch(network.getNetId(), null, CLASS_IN, TYPE_A,
+                    0 /* flags */, BATCH_QUERY_TIMEOUT_MS, errors);
+            fail("null dnames");
+        } catch (NullPointerException expected) { }
+        try {
+            NetworkUtils.resNetworkQueryBatch(network.getNetId(), dnames, CLASS_IN, TYPE_A,
+                    0 /* flags */, BATCH_QUERY_TIMEOUT_MS, null);
+            fail("null errors");
+        } catch (NullPointerException expected) { }
+    }
 }
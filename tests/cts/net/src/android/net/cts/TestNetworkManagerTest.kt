@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package android.net.cts
+
+import android.Manifest.permission.MANAGE_TEST_NETWORKS
+import android.net.TestNetworkInterface
+import android.net.TestNetworkManager
+import android.net.TestNetworkManager.TUNTAP_MAX_QUEUES
+import android.os.Build
+import android.os.Parcel
+import android.platform.test.annotations.AppModeFull
+import android.system.Os
+import androidx.test.platform.app.InstrumentationRegistry
+import androidx.test.runner.AndroidJUnit4
+import com.android.testutils.DevSdkIgnoreRule
+import com.android.testutils.runAsShell
+import org.junit.After
+import org.junit.Rule
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.net.NetworkInterface
+import kotlin.test.assertEquals
+import kotlin.test.assertFailsWith
+import kotlin.test.assertNotNull
+import kotlin.test.assertTrue
+
+private const val TEST_NUM_QUEUES = 4
+
+// An IPv6 packet without payload from fe80::1 to ff02::1. TAP interfaces take it as a garbage
+// ethernet frame, which they accept all the same.
+private val TEST_PACKET = byteArrayOf(
+        0x60, 0, 0, 0,  // Version 6, no traffic class nor flow label
+        0, 0, 59, 255.toByte(),  // No payload, no next header, hop limit 255
+        0xfe.toByte(), 0x80.toByte(), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+        0xff.toByte(), 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1)
+
+@AppModeFull(reason = "Instant apps cannot create test networks")
+@RunWith(AndroidJUnit4::class)
+class TestNetworkManagerTest {
+    @JvmField
+    @Rule
+    val ignoreRule = DevSdkIgnoreRule(ignoreClassUpTo = Build.VERSION_CODES.S_V2)
+
+    private val context by lazy { InstrumentationRegistry.getInstrumentation().context }
+    private val tnm by lazy { context.assertHasService(TestNetworkManager::class.java) }
+
+    private val interfaces = ArrayList<TestNetworkInterface>()
+
+    @After
+    fun tearDown() {
+        // Closing every queue tears down the interface.
+        interfaces.forEach { iface -> allQueues(iface).forEach { it.close() } }
+    }
+
+    private fun createTunTapInterface(isTun: Boolean, numQueues: Int): TestNetworkInterface {
+        val iface = runAsShell(MANAGE_TEST_NETWORKS) {
+            tnm.createTunTapInterface(isTun, true /* bringUp */, emptyList(), numQueues,
+                    0 /* flags */)
+        }
+        interfaces.add(iface)
+        return iface
+    }
+
+    private fun allQueues(iface: TestNetworkInterface) =
+            listOf(iface.fileDescriptor) + iface.queueFileDescriptors
+
+    private fun assertQueuesAttached(iface: TestNetworkInterface, numQueues: Int) {
+        val queues = allQueues(iface)
+        assertEquals(numQueues, queues.size)
+        assertEquals(numQueues, queues.map { it.fd }.toSet().size, "Queues share an fd")
+        // Writing to a queue that is not attached to the interface fails with EBADFD.
+        queues.forEach {
+            assertEquals(TEST_PACKET.size,
+                    Os.write(it.fileDescriptor, TEST_PACKET, 0, TEST_PACKET.size))
+        }
+    }
+
+    private fun parcelAndUnparcel(iface: TestNetworkInterface): TestNetworkInterface {
+        val parcel = Parcel.obtain()
+        try {
+            iface.writeToParcel(parcel, 0 /* flags */)
+            parcel.setDataPosition(0)
+            return TestNetworkInterface.CREATOR.createFromParcel(parcel)
+        } finally {
+            parcel.recycle()
+        }
+    }
+
+    private fun doTestMultiQueueInterface(isTun: Boolean) {
+        val iface = createTunTapInterface(isTun, TEST_NUM_QUEUES)
+        assertNotNull(NetworkInterface.getByName(iface.interfaceName))
+        assertQueuesAttached(iface, TEST_NUM_QUEUES)
+
+        // The unparcelled queues are duplicates of the same queues.
+        val unparcelled = parcelAndUnparcel(iface)
+        interfaces.add(unparcelled)
+        assertEquals(iface.interfaceName, unparcelled.interfaceName)
+        assertQueuesAttached(unparcelled, TEST_NUM_QUEUES)
+    }
+
+    @Test
+    fun testCreateMultiQueueTunInterface() = doTestMultiQueueInterface(true /* isTun */)
+
+    @Test
+    fun testCreateMultiQueueTapInterface() = doTestMultiQueueInterface(false /* isTun */)
+
+    @Test
+    fun testCreateSingleQueueInterface() {
+        val iface = createTunTapInterface(true /* isTun */, 1 /* numQueues */)
+        assertTrue(iface.queueFileDescriptors.isEmpty())
+        assertQueuesAttached(iface, 1)
+
+        val unparcelled = parcelAndUnparcel(iface)
+        interfaces.add(unparcelled)
+        assertTrue(unparcelled.queueFileDescriptors.isEmpty())
+    }
+
+    @Test
+    fun testCreateTunTapInterfaceInvalidArguments() {
+        listOf(0, TUNTAP_MAX_QUEUES + 1).forEach { numQueues ->
+            assertFailsWith<IllegalArgumentException> {
+                createTunTapInterface(true /* isTun */, numQueues)
+            }
+        }
+        assertFailsWith<IllegalArgumentException> {
+            runAsShell(MANAGE_TEST_NETWORKS) {
+                tnm.createTunTapInterface(true /* isTun */, true /* bringUp */, emptyList(),
+                        1 /* numQueues */, TestNetworkManager.TUNTAP_NAPI_FRAGS)
+            }
+        }
+    }
+}
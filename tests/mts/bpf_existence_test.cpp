@@ -87,16 +87,19 @@ static const set<string> REMOVED_S = {
 };
 
 static const set<string> INTRODUCED_T = {
+    SHARED "map_block_blocked_bind_stats_map",
     SHARED "map_block_blocked_ports_map",
     SHARED "map_clatd_clat_egress4_map",
+    SHARED "map_clatd_clat_stats_map",
     SHARED "map_clatd_clat_ingress6_map",
-    SHARED "map_dscp_policy_ipv4_dscp_policies_map",
-    SHARED "map_dscp_policy_ipv4_socket_to_policies_map_A",
-    SHARED "map_dscp_policy_ipv4_socket_to_policies_map_B",
-    SHARED "map_dscp_policy_ipv6_dscp_policies_map",
-    SHARED "map_dscp_policy_ipv6_socket_to_policies_map_A",
-    SHARED "map_dscp_policy_ipv6_socket_to_policies_map_B",
-    SHARED "map_dscp_policy_switch_comp_map",
+    SHARED "map_dscp_policy_dscp_policy_stats_map",
+    SHARED "map_dscp_policy_dscp_port_ranges_map",
+    SHARED "map_dscp_policy_dscp_tuple_masks_map",
+    SHARED "map_dscp_policy_ipv4_dscp_tuples_map",
+    SHARED "map_dscp_policy_ipv4_socket_to_policies_map",
+    SHARED "map_dscp_policy_ipv6_dscp_tuples_map",
+    SHARED "map_dscp_policy_ipv6_socket_to_policies_map",
+    SHARED "map_dscp_policy_policy_generation_map",
     NETD "map_netd_app_uid_stats_map",
     NETD "map_netd_configuration_map",
     NETD "map_netd_cookie_tag_map",
@@ -107,6 +110,7 @@ static const set<string> INTRODUCED_T = {
     NETD "map_netd_uid_counterset_map",
     NETD "map_netd_uid_owner_map",
     NETD "map_netd_uid_permission_map",
+    TETHERING "map_offload_tether_ra_map",
     SHARED "prog_clatd_schedcls_egress4_clat_ether",
     SHARED "prog_clatd_schedcls_egress4_clat_rawip",
     SHARED "prog_clatd_schedcls_ingress6_clat_ether",
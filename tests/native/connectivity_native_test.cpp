@@ -206,6 +206,85 @@ TEST_F(ConnectivityNativeBinderTest, GetBlockedPorts) {
     EXPECT_TRUE(actualBlockedPorts.empty());
 }
 
+TEST_F(ConnectivityNativeBinderTest, BlockPortRangePerProtocol) {
+    ndk::ScopedAStatus status = mService->unblockAllPortsForBind();
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+
+    status = mService->blockPortRangeForBind(IPPROTO_UDP, 5550, 5700);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    std::vector<int64_t> udpBitmap;
+    status = mService->getBlockedPortsBitmap(IPPROTO_UDP, &udpBitmap);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    ASSERT_EQ(1024U, udpBitmap.size());
+    for (int port : {5549, 5550, 5700, 5701}) {
+        const bool blocked = (udpBitmap[port >> 6] >> (port & 63)) & 1;
+        EXPECT_EQ(port >= 5550 && port <= 5700, blocked) << port;
+    }
+    std::vector<int64_t> tcpBitmap;
+    status = mService->getBlockedPortsBitmap(IPPROTO_TCP, &tcpBitmap);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    EXPECT_EQ(std::vector<int64_t>(1024), tcpBitmap);
+
+    // TCP can still bind to a port blocked for UDP only.
+    in_port_t port = 5555;
+    int sock = openSocket(&port, AF_INET6, SOCK_STREAM, false /* expectBindFail */);
+    close(sock);
+    port = 5555;
+    openSocket(&port, AF_INET6, SOCK_DGRAM, true /* expectBindFail */);
+
+    status = mService->unblockPortsForBind(IPPROTO_UDP, {5555});
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    std::vector<int32_t> actualBlockedPorts;
+    status = mService->getPortsBlockedForBind(&actualBlockedPorts);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    EXPECT_EQ(150U, actualBlockedPorts.size());
+
+    status = mService->unblockPortRangeForBind(0, 0, 65535);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    status = mService->getPortsBlockedForBind(&actualBlockedPorts);
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    EXPECT_TRUE(actualBlockedPorts.empty());
+}
+
+TEST_F(ConnectivityNativeBinderTest, CountBlockedBinds) {
+    using aidl::android::net::connectivity::aidl::BlockedBindCount;
+    const auto deniedBinds = [this]() -> int64_t {
+        std::vector<BlockedBindCount> counts;
+        ndk::ScopedAStatus status = mService->getBlockedBindCounts(&counts);
+        EXPECT_TRUE(status.isOk()) << status.getDescription ();
+        for (const BlockedBindCount& c : counts) {
+            if (c.uid == (int)getuid() && c.port == 5555 && c.protocol == IPPROTO_UDP) {
+                return c.count;
+            }
+        }
+        return 0;
+    };
+    const int64_t before = deniedBinds();
+
+    ndk::ScopedAStatus status = mService->blockPortsForBind(IPPROTO_UDP, {5555});
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+    for (int i = 0; i < 3; i++) {
+        in_port_t port = 5555;
+        openSocket(&port, AF_INET, SOCK_DGRAM, true /* expectBindFail */);
+    }
+    status = mService->unblockPortsForBind(IPPROTO_UDP, {5555});
+    EXPECT_TRUE(status.isOk()) << status.getDescription ();
+
+    EXPECT_EQ(before + 3, deniedBinds());
+}
+
+TEST_F(ConnectivityNativeBinderTest, BlockInvalidPortRange) {
+    int retry = 0;
+    ndk::ScopedAStatus status;
+    do {
+        status = mService->blockPortRangeForBind(IPPROTO_TCP, 2000, 1000);
+        // TODO: find out why transaction failed is being thrown on the first attempt.
+    } while (status.getExceptionCode() == EX_TRANSACTION_FAILED && retry++ < 5);
+    EXPECT_EQ(EX_ILLEGAL_ARGUMENT, status.getExceptionCode());
+    status = mService->blockPortsForBind(IPPROTO_ICMP, {1000});
+    EXPECT_EQ(EX_ILLEGAL_ARGUMENT, status.getExceptionCode());
+}
+
 TEST_F(ConnectivityNativeBinderTest, UnblockAllPorts) {
     ndk::ScopedAStatus status;
     std::vector<int> blockedPorts{1, 100, 1220, 1333, 2700, 5555, 5600, 65000};
@@ -9813,7 +9813,7 @@ public class ConnectivityServiceTest {
     private void verifyClatdStop(@Nullable InOrder inOrder, @NonNull String iface)
             throws Exception {
         if (SdkLevel.isAtLeastT()) {
-            verifyWithOrder(inOrder, mClatCoordinator).clatStop();
+            verifyWithOrder(inOrder, mClatCoordinator).clatStopAsync(any(), any());
         } else {
             verifyWithOrder(inOrder, mMockNetd).clatdStop(eq(iface));
         }
@@ -9822,7 +9822,7 @@ public class ConnectivityServiceTest {
     private void verifyNeverClatdStop(@Nullable InOrder inOrder, @NonNull String iface)
             throws Exception {
         if (SdkLevel.isAtLeastT()) {
-            verifyNeverWithOrder(inOrder, mClatCoordinator).clatStop();
+            verifyNeverWithOrder(inOrder, mClatCoordinator).clatStopAsync(any(), any());
         } else {
             verifyNeverWithOrder(inOrder, mMockNetd).clatdStop(eq(iface));
         }
@@ -29,26 +29,42 @@ import static com.android.server.connectivity.ClatCoordinator.INIT_V4ADDR_STRING
 import static com.android.server.connectivity.ClatCoordinator.PRIO_CLAT;
 import static com.android.testutils.MiscAsserts.assertThrows;
 
+import static org.junit.Assert.assertArrayEquals;
 import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
 import static org.junit.Assert.assertNull;
 import static org.junit.Assert.fail;
+import static org.mockito.Mockito.any;
+import static org.mockito.Mockito.anyInt;
+import static org.mockito.Mockito.anyLong;
 import static org.mockito.Mockito.argThat;
 import static org.mockito.Mockito.clearInvocations;
+import static org.mockito.Mockito.doAnswer;
+import static org.mockito.Mockito.doNothing;
+import static org.mockito.Mockito.doReturn;
+import static org.mockito.Mockito.doThrow;
 import static org.mockito.Mockito.eq;
 import static org.mockito.Mockito.inOrder;
+import static org.mockito.Mockito.never;
+import static org.mockito.Mockito.timeout;
+import static org.mockito.Mockito.times;
+import static org.mockito.Mockito.verify;
 
 import android.annotation.NonNull;
 import android.net.INetd;
 import android.net.InetAddresses;
 import android.net.IpPrefix;
+import android.net.MacAddress;
 import android.os.Build;
+import android.os.Handler;
+import android.os.HandlerThread;
 import android.os.ParcelFileDescriptor;
+import android.system.Os;
 
 import androidx.test.filters.SmallTest;
 
 import com.android.net.module.util.IBpfMap;
 import com.android.net.module.util.bpf.ClatEgress4Key;
-import com.android.net.module.util.bpf.ClatEgress4Value;
 import com.android.net.module.util.bpf.ClatIngress6Key;
 import com.android.net.module.util.bpf.ClatIngress6Value;
 import com.android.testutils.DevSdkIgnoreRule;
@@ -63,10 +79,13 @@ import org.mockito.MockitoAnnotations;
 import org.mockito.Spy;
 
 import java.io.FileDescriptor;
+import java.io.FileOutputStream;
 import java.io.IOException;
 import java.net.Inet4Address;
 import java.net.Inet6Address;
 import java.util.Objects;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.TimeUnit;
 
 @RunWith(DevSdkIgnoreRunner.class)
 @SmallTest
@@ -96,6 +115,12 @@ public class ClatCoordinatorTest {
     private static final Inet6Address INET6_LOCAL6 = (Inet6Address)
             InetAddresses.parseNumericAddress(XLAT_LOCAL_IPV6ADDR_STRING);
     private static final int CLATD_PID = 10483;
+    private static final int CLATD_PIDFD = 537;
+    private static final int ROUTE_MONITOR_FD = 538;
+    private static final long CLAT_ENGINE = 0x7f001234L;
+    private static final int TIMEOUT_MS = 5_000;
+    private static final MacAddress BASE_IFACE_MAC = MacAddress.fromString("12:34:56:78:90:ab");
+    private static final MacAddress NEXT_HOP_MAC = MacAddress.fromString("ab:90:78:56:34:12");
 
     private static final int TUN_FD = 534;
     private static final int RAW_SOCK_FD = 535;
@@ -115,12 +140,17 @@ public class ClatCoordinatorTest {
     private static final ClatEgress4Key EGRESS_KEY = new ClatEgress4Key(STACKED_IFINDEX,
             INET4_LOCAL4);
     private static final ClatEgress4Value EGRESS_VALUE = new ClatEgress4Value(BASE_IFINDEX,
-            INET6_LOCAL6, INET6_PFX96, (short) 1 /* oifIsEthernet, 1 = true */);
+            INET6_LOCAL6, INET6_PFX96, (short) 1 /* oifIsEthernet, 1 = true */, NEXT_HOP_MAC,
+            BASE_IFACE_MAC, ETH_P_IPV6, ETHER_MTU /* pmtu */);
     private static final ClatIngress6Key INGRESS_KEY = new ClatIngress6Key(BASE_IFINDEX,
             INET6_PFX96, INET6_LOCAL6);
     private static final ClatIngress6Value INGRESS_VALUE = new ClatIngress6Value(STACKED_IFINDEX,
             INET4_LOCAL4);
 
+    // rx packets/bytes/overhead, tx packets/bytes/overhead, followed by the punt counters.
+    private static final long[] CLAT_STATS = {10, 5000, 200, 20, 8000, 400, 3, 0};
+    private static final String[] CLAT_ERROR_NAMES = {"INVALID_IP_VERSION", "INVALID_IP_HEADER"};
+
     @Mock private INetd mNetd;
     @Spy private TestDependencies mDeps = new TestDependencies();
     @Mock private IBpfMap<ClatIngress6Key, ClatIngress6Value> mIngressMap;
@@ -176,7 +206,8 @@ public class ClatCoordinatorTest {
          * Create tun interface for a given interface name.
          */
         @Override
-        public int createTunInterface(@NonNull String tuniface) throws IOException {
+        public int createTunInterface(@NonNull String tuniface, boolean multiQueue,
+                boolean vnetHdr) throws IOException {
             if (STACKED_IFACE.equals(tuniface)) {
                 return TUN_FD;
             }
@@ -225,6 +256,33 @@ public class ClatCoordinatorTest {
             return -1;
         }
 
+        /**
+         * Get the mac address of the next hop towards the NAT64 prefix on an upstream interface.
+         */
+        @Override
+        public MacAddress getNextHopMac(@NonNull String platSubnet, int platSuffix, int ifIndex,
+                int mark) throws IOException {
+            if (NAT64_PREFIX_STRING.equals(platSubnet) && GOOGLE_DNS_4 == platSuffix
+                    && BASE_IFINDEX == ifIndex && MARK == mark) {
+                return NEXT_HOP_MAC;
+            }
+            fail("unsupported args: " + platSubnet + ", " + platSuffix + ", " + ifIndex + ", "
+                    + mark);
+            return null;
+        }
+
+        /**
+         * Get the mac address of a given interface.
+         */
+        @Override
+        public MacAddress getInterfaceMac(String ifName) {
+            if (BASE_IFACE.equals(ifName)) {
+                return BASE_IFACE_MAC;
+            }
+            fail("unsupported arg: " + ifName);
+            return null;
+        }
+
         /**
          * Open IPv6 raw socket and set SO_MARK.
          */
@@ -262,12 +320,12 @@ public class ClatCoordinatorTest {
          * Configure packet socket.
          */
         @Override
-        public void configurePacketSocket(@NonNull FileDescriptor sock, String v6, int ifindex)
-                throws IOException {
+        public void configurePacketSocket(@NonNull FileDescriptor sock, String v6, int ifindex,
+                boolean rxRing) throws IOException {
             if (Objects.equals(PACKET_SOCK_PFD.getFileDescriptor(), sock)
                     && XLAT_LOCAL_IPV6ADDR_STRING.equals(v6)
-                    && BASE_IFINDEX == ifindex) return;
-            fail("unsupported args: " + sock + ", " + v6 + ", " + ifindex);
+                    && BASE_IFINDEX == ifindex && rxRing == isInProcessClatEnabled()) return;
+            fail("unsupported args: " + sock + ", " + v6 + ", " + ifindex + ", " + rxRing);
         }
 
         /**
@@ -286,7 +344,8 @@ public class ClatCoordinatorTest {
                     && XLAT_LOCAL_IPV6ADDR_STRING.equals(v6)) {
                 return CLATD_PID;
             }
-            fail("unsupported args: " + tunfd + ", " + readsock6 + ", " + writesock6 + ", "
+            fail("unsupported args: " + tunfd + ", " + readsock6 + ", "
+                    + writesock6 + ", "
                     + ", " + iface + ", " + v4 + ", " + v6);
             return -1;
         }
@@ -324,6 +383,37 @@ public class ClatCoordinatorTest {
             }
         }
 
+        /** Create the BPF translation counters of a v4-* interface. */
+        @Override
+        public void createClatStats(int v4ifIndex) throws IOException {
+            if (STACKED_IFINDEX == v4ifIndex) return;
+
+            fail("unsupported arg: " + v4ifIndex);
+        }
+
+        /** Delete the BPF translation counters of a v4-* interface. */
+        @Override
+        public void deleteClatStats(int v4ifIndex) throws IOException {
+            if (STACKED_IFINDEX == v4ifIndex) return;
+
+            fail("unsupported arg: " + v4ifIndex);
+        }
+
+        /** Get the BPF translation counters of a v4-* interface. */
+        @Override
+        public long[] getClatStats(int v4ifIndex) throws IOException {
+            if (STACKED_IFINDEX == v4ifIndex) return CLAT_STATS.clone();
+
+            fail("unsupported arg: " + v4ifIndex);
+            return null;
+        }
+
+        /** Get the names of the BPF punt reasons. */
+        @Override
+        public String[] getClatErrorNames() {
+            return CLAT_ERROR_NAMES.clone();
+        }
+
         /** Get ingress6 BPF map. */
         @Override
         public IBpfMap<ClatIngress6Key, ClatIngress6Value> getBpfIngress6Map() {
@@ -369,6 +459,14 @@ public class ClatCoordinatorTest {
     };
 
     @NonNull
+    private static boolean isTunFds(FileDescriptor[] fds) {
+        if (fds.length == 0) return false;
+        for (FileDescriptor fd : fds) {
+            if (!Objects.equals(TUN_PFD.getFileDescriptor(), fd)) return false;
+        }
+        return true;
+    }
+
     private ClatCoordinator makeClatCoordinator() throws Exception {
         final ClatCoordinator coordinator = new ClatCoordinator(mDeps);
         return coordinator;
@@ -411,7 +509,8 @@ public class ClatCoordinatorTest {
                 eq(XLAT_LOCAL_IPV4ADDR_STRING), eq(NAT64_PREFIX_STRING), eq(MARK));
 
         // Open, configure and bring up the tun interface.
-        inOrder.verify(mDeps).createTunInterface(eq(STACKED_IFACE));
+        inOrder.verify(mDeps).createTunInterface(eq(STACKED_IFACE), eq(false /* multiQueue */),
+                eq(false /* vnetHdr */));
         inOrder.verify(mDeps).adoptFd(eq(TUN_FD));
         inOrder.verify(mDeps).getInterfaceIndex(eq(STACKED_IFACE));
         inOrder.verify(mNetd).interfaceSetEnableIPv6(eq(STACKED_IFACE), eq(false /* enable */));
@@ -438,7 +537,7 @@ public class ClatCoordinatorTest {
                 argThat(fd -> Objects.equals(RAW_SOCK_PFD.getFileDescriptor(), fd)));
         inOrder.verify(mDeps).configurePacketSocket(
                 argThat(fd -> Objects.equals(PACKET_SOCK_PFD.getFileDescriptor(), fd)),
-                eq(XLAT_LOCAL_IPV6ADDR_STRING), eq(BASE_IFINDEX));
+                eq(XLAT_LOCAL_IPV6ADDR_STRING), eq(BASE_IFINDEX), eq(false));
 
         // Start clatd.
         inOrder.verify(mDeps).startClatd(
@@ -447,6 +546,10 @@ public class ClatCoordinatorTest {
                 argThat(fd -> Objects.equals(RAW_SOCK_PFD.getFileDescriptor(), fd)),
                 eq(BASE_IFACE), eq(NAT64_PREFIX_STRING),
                 eq(XLAT_LOCAL_IPV4ADDR_STRING), eq(XLAT_LOCAL_IPV6ADDR_STRING));
+        inOrder.verify(mDeps).getInterfaceMac(eq(BASE_IFACE));
+        inOrder.verify(mDeps).getNextHopMac(eq(NAT64_PREFIX_STRING), eq(GOOGLE_DNS_4),
+                eq(BASE_IFINDEX), eq(MARK));
+        inOrder.verify(mDeps).createClatStats(eq(STACKED_IFINDEX));
         inOrder.verify(mEgressMap).insertEntry(eq(EGRESS_KEY), eq(EGRESS_VALUE));
         inOrder.verify(mIngressMap).insertEntry(eq(INGRESS_KEY), eq(INGRESS_VALUE));
         inOrder.verify(mDeps).tcQdiscAddDevClsact(eq(STACKED_IFINDEX));
@@ -469,6 +572,7 @@ public class ClatCoordinatorTest {
                 eq((short) PRIO_CLAT), eq((short) ETH_P_IP));
         inOrder.verify(mEgressMap).deleteEntry(eq(EGRESS_KEY));
         inOrder.verify(mIngressMap).deleteEntry(eq(INGRESS_KEY));
+        inOrder.verify(mDeps).deleteClatStats(eq(STACKED_IFINDEX));
         inOrder.verify(mDeps).stopClatd(eq(BASE_IFACE), eq(NAT64_PREFIX_STRING),
                 eq(XLAT_LOCAL_IPV4ADDR_STRING), eq(XLAT_LOCAL_IPV6ADDR_STRING), eq(CLATD_PID));
         inOrder.verify(mDeps).untagSocket(eq(RAW_SOCK_COOKIE));
@@ -481,6 +585,280 @@ public class ClatCoordinatorTest {
         inOrder.verifyNoMoreInteractions();
     }
 
+    @Test
+    public void testStopClatdAsync() throws Exception {
+        final ClatCoordinator coordinator = makeClatCoordinator();
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+
+        // A pipe stands in for the pidfd: it becomes readable when clatd "exits".
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+        doReturn(CLATD_PIDFD).when(mDeps).signalClatdStop(CLATD_PID);
+        doReturn(pipe[0]).when(mDeps).adoptFd(CLATD_PIDFD);
+        doNothing().when(mDeps).waitClatdStop(any(), anyInt(), anyInt());
+
+        final HandlerThread thread = new HandlerThread("ClatCoordinatorTest");
+        thread.start();
+        final Handler handler = new Handler(thread.getLooper());
+        final CompletableFuture<Void> called = new CompletableFuture<>();
+        final CompletableFuture<Void> stopped = new CompletableFuture<>();
+        try {
+            handler.post(() -> {
+                try {
+                    coordinator.clatStopAsync(handler, () -> stopped.complete(null));
+                    called.complete(null);
+                } catch (IOException e) {
+                    called.completeExceptionally(e);
+                }
+            });
+            called.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+
+            // BPF and the socket tag are cleaned up immediately, but clatd is not waited for.
+            verify(mDeps).deleteClatStats(eq(STACKED_IFINDEX));
+            verify(mDeps).untagSocket(eq(RAW_SOCK_COOKIE));
+            verify(mDeps, never()).stopClatd(any(), any(), any(), any(), anyInt());
+            verify(mDeps, never()).waitClatdStop(any(), anyInt(), anyInt());
+            assertNull(coordinator.getClatdTrackerForTesting());
+            assertFalse(stopped.isDone());
+
+            try (FileOutputStream out = new FileOutputStream(pipe[1].getFileDescriptor())) {
+                out.write(0);
+            }
+            stopped.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+            verify(mDeps).waitClatdStop(any(), eq(CLATD_PID), eq(0 /* timeoutMs */));
+        } finally {
+            thread.quitSafely();
+            pipe[1].close();
+        }
+    }
+
+    @Test
+    public void testPathMtuMonitor() throws Exception {
+        final ClatCoordinator coordinator = makeClatCoordinator();
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+
+        // A pipe stands in for the netlink socket: each byte written is a route change.
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+        doReturn(ROUTE_MONITOR_FD).when(mDeps).openRouteMonitor();
+        doReturn(pipe[0]).when(mDeps).adoptFd(ROUTE_MONITOR_FD);
+        doAnswer(inv -> {
+            Os.read(inv.getArgument(0), new byte[1], 0, 1);
+            return 1;
+        }).when(mDeps).readRouteMonitor(any());
+        doReturn(1400).when(mDeps).getRouteMtu(NAT64_PREFIX_STRING, GOOGLE_DNS_4, MARK);
+        doReturn(EGRESS_VALUE).when(mEgressMap).getValue(EGRESS_KEY);
+
+        final HandlerThread thread = new HandlerThread("ClatCoordinatorTest");
+        thread.start();
+        final Handler handler = new Handler(thread.getLooper());
+        try {
+            final CompletableFuture<Void> started = new CompletableFuture<>();
+            handler.post(() -> {
+                try {
+                    coordinator.startPathMtuMonitor(handler);
+                    started.complete(null);
+                } catch (IOException e) {
+                    started.completeExceptionally(e);
+                }
+            });
+            started.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+
+            try (FileOutputStream out = new FileOutputStream(pipe[1].getFileDescriptor())) {
+                out.write(0);
+            }
+            verify(mNetd, timeout(TIMEOUT_MS)).interfaceSetMtu(eq(STACKED_IFACE),
+                    eq(1372 /* 1400 - MTU_DELTA(28) */));
+            // Only the in-process engine needs to know the path mtu.
+            verify(mDeps, never()).setClatEngineMtu(anyLong(), anyInt());
+            verify(mEgressMap, timeout(TIMEOUT_MS)).updateEntry(eq(EGRESS_KEY),
+                    eq(new ClatEgress4Value(BASE_IFINDEX, INET6_LOCAL6, INET6_PFX96,
+                            (short) 1 /* oifIsEthernet */, NEXT_HOP_MAC, BASE_IFACE_MAC,
+                            ETH_P_IPV6, 1400 /* pmtu */)));
+
+            // The monitor goes away with clatd.
+            final CompletableFuture<Void> stopped = new CompletableFuture<>();
+            handler.post(() -> {
+                try {
+                    coordinator.clatStop();
+                    stopped.complete(null);
+                } catch (IOException e) {
+                    stopped.completeExceptionally(e);
+                }
+            });
+            stopped.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+            assertFalse(pipe[0].getFileDescriptor().valid());
+        } finally {
+            thread.quitSafely();
+            pipe[1].close();
+        }
+    }
+
+    @Test
+    public void testNextHopMonitor() throws Exception {
+        final ClatCoordinator coordinator = makeClatCoordinator();
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+        doReturn(ROUTE_MONITOR_FD).when(mDeps).openRouteMonitor();
+        doReturn(pipe[0]).when(mDeps).adoptFd(ROUTE_MONITOR_FD);
+        doAnswer(inv -> {
+            Os.read(inv.getArgument(0), new byte[1], 0, 1);
+            return 1;
+        }).when(mDeps).readRouteMonitor(any());
+        doReturn(ETHER_MTU).when(mDeps).getRouteMtu(NAT64_PREFIX_STRING, GOOGLE_DNS_4, MARK);
+        doReturn(EGRESS_VALUE).when(mEgressMap).getValue(EGRESS_KEY);
+
+        final HandlerThread thread = new HandlerThread("ClatCoordinatorTest");
+        thread.start();
+        final Handler handler = new Handler(thread.getLooper());
+        try {
+            final CompletableFuture<Void> started = new CompletableFuture<>();
+            handler.post(() -> {
+                try {
+                    coordinator.startPathMtuMonitor(handler);
+                    started.complete(null);
+                } catch (IOException e) {
+                    started.completeExceptionally(e);
+                }
+            });
+            started.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+
+            // The gateway moved to another mac address, e.g. after a router failover.
+            final MacAddress newNextHopMac = MacAddress.fromString("ab:90:78:56:34:13");
+            doReturn(newNextHopMac).when(mDeps).getNextHopMac(NAT64_PREFIX_STRING, GOOGLE_DNS_4,
+                    BASE_IFINDEX, MARK);
+            try (FileOutputStream out = new FileOutputStream(pipe[1].getFileDescriptor())) {
+                out.write(0);
+            }
+            verify(mEgressMap, timeout(TIMEOUT_MS)).updateEntry(eq(EGRESS_KEY),
+                    eq(new ClatEgress4Value(BASE_IFINDEX, INET6_LOCAL6, INET6_PFX96,
+                            (short) 1 /* oifIsEthernet */, newNextHopMac, BASE_IFACE_MAC,
+                            ETH_P_IPV6, ETHER_MTU /* pmtu */)));
+
+            // Without a resolved next hop, the egress program passes packets to clatd.
+            final MacAddress nullMac = MacAddress.fromString("00:00:00:00:00:00");
+            doThrow(new IOException("not resolved")).when(mDeps).getNextHopMac(
+                    NAT64_PREFIX_STRING, GOOGLE_DNS_4, BASE_IFINDEX, MARK);
+            try (FileOutputStream out = new FileOutputStream(pipe[1].getFileDescriptor())) {
+                out.write(0);
+            }
+            verify(mEgressMap, timeout(TIMEOUT_MS)).updateEntry(eq(EGRESS_KEY),
+                    eq(new ClatEgress4Value(BASE_IFINDEX, INET6_LOCAL6, INET6_PFX96,
+                            (short) 1 /* oifIsEthernet */, nullMac, nullMac,
+                            0 /* ethProto */, ETHER_MTU /* pmtu */)));
+        } finally {
+            thread.quitSafely();
+            pipe[1].close();
+        }
+    }
+
+    @Test
+    public void testStartClatEngineWithMultiQueueTun() throws Exception {
+        doReturn(3).when(mDeps).getTunQueueCount();
+        doReturn(true).when(mDeps).isTunVnetHdrEnabled();
+        doReturn(true).when(mDeps).isInProcessClatEnabled();
+        doReturn(CLAT_ENGINE).when(mDeps).startClatEngine(any(), eq(true /* vnetHdr */), any(),
+                eq(true /* packetRing */), any(), any(), any(), any());
+        doNothing().when(mDeps).setClatEngineMtu(anyLong(), anyInt());
+        final ClatCoordinator coordinator = makeClatCoordinator();
+
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+        verify(mDeps, times(3)).createTunInterface(eq(STACKED_IFACE), eq(true /* multiQueue */),
+                eq(true /* vnetHdr */));
+        verify(mDeps).startClatEngine(argThat(fds -> fds.length == 3 && isTunFds(fds)),
+                eq(true /* vnetHdr */), any(), eq(true /* packetRing */), any(),
+                eq(NAT64_PREFIX_STRING), eq(XLAT_LOCAL_IPV4ADDR_STRING),
+                eq(XLAT_LOCAL_IPV6ADDR_STRING));
+    }
+
+    @Test
+    public void testStartClatdIgnoresMultiQueueTun() throws Exception {
+        // clatd reads a single plain tun queue whatever the engine settings are.
+        doReturn(3).when(mDeps).getTunQueueCount();
+        doReturn(true).when(mDeps).isTunVnetHdrEnabled();
+        final ClatCoordinator coordinator = makeClatCoordinator();
+
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+        verify(mDeps).createTunInterface(eq(STACKED_IFACE), eq(false /* multiQueue */),
+                eq(false /* vnetHdr */));
+        verify(mDeps).startClatd(argThat(fd -> Objects.equals(TUN_PFD.getFileDescriptor(), fd)),
+                any(), any(), eq(BASE_IFACE), eq(NAT64_PREFIX_STRING),
+                eq(XLAT_LOCAL_IPV4ADDR_STRING), eq(XLAT_LOCAL_IPV6ADDR_STRING));
+    }
+
+    @Test
+    public void testStartStopInProcessClat() throws Exception {
+        doReturn(true).when(mDeps).isInProcessClatEnabled();
+        doReturn(CLAT_ENGINE).when(mDeps).startClatEngine(any(), eq(false /* vnetHdr */), any(),
+                eq(true /* packetRing */), any(), any(), any(), any());
+        doNothing().when(mDeps).stopClatEngine(anyLong());
+        doNothing().when(mDeps).setClatEngineMtu(anyLong(), anyInt());
+        final ClatCoordinator coordinator = makeClatCoordinator();
+        final InOrder inOrder = inOrder(mDeps);
+
+        // The engine replaces clatd and reads the packet socket through a receive ring.
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+        inOrder.verify(mDeps).configurePacketSocket(
+                argThat(fd -> Objects.equals(PACKET_SOCK_PFD.getFileDescriptor(), fd)),
+                eq(XLAT_LOCAL_IPV6ADDR_STRING), eq(BASE_IFINDEX), eq(true /* rxRing */));
+        inOrder.verify(mDeps).startClatEngine(argThat(fds -> fds.length == 1 && isTunFds(fds)),
+                eq(false /* vnetHdr */),
+                argThat(fd -> Objects.equals(PACKET_SOCK_PFD.getFileDescriptor(), fd)),
+                eq(true /* packetRing */),
+                argThat(fd -> Objects.equals(RAW_SOCK_PFD.getFileDescriptor(), fd)),
+                eq(NAT64_PREFIX_STRING), eq(XLAT_LOCAL_IPV4ADDR_STRING),
+                eq(XLAT_LOCAL_IPV6ADDR_STRING));
+        // The engine handles the packets exceeding the path mtu.
+        inOrder.verify(mDeps).setClatEngineMtu(eq(CLAT_ENGINE), eq(ETHER_MTU));
+        verify(mDeps, never()).startClatd(any(), any(), any(), any(), any(), any(), any());
+        assertEquals(0, coordinator.getClatdTrackerForTesting().pid);
+
+        coordinator.clatStop();
+        inOrder.verify(mDeps).deleteClatStats(eq(STACKED_IFINDEX));
+        inOrder.verify(mDeps).stopClatEngine(eq(CLAT_ENGINE));
+        inOrder.verify(mDeps).untagSocket(eq(RAW_SOCK_COOKIE));
+        verify(mDeps, never()).stopClatd(any(), any(), any(), any(), anyInt());
+        assertNull(coordinator.getClatdTrackerForTesting());
+
+        // Stopping asynchronously stops the engine right away and has nothing to wait for.
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+        final HandlerThread thread = new HandlerThread("ClatCoordinatorTest");
+        thread.start();
+        final Handler handler = new Handler(thread.getLooper());
+        final CompletableFuture<Void> stopped = new CompletableFuture<>();
+        try {
+            coordinator.clatStopAsync(handler, () -> stopped.complete(null));
+            verify(mDeps, times(2)).stopClatEngine(eq(CLAT_ENGINE));
+            assertNull(coordinator.getClatdTrackerForTesting());
+            stopped.get(TIMEOUT_MS, TimeUnit.MILLISECONDS);
+            verify(mDeps, never()).signalClatdStop(anyInt());
+        } finally {
+            thread.quitSafely();
+        }
+    }
+
+    @Test
+    public void testGetClatStats() throws Exception {
+        final ClatCoordinator coordinator = makeClatCoordinator();
+        assertNull(coordinator.getClatStats());
+
+        coordinator.clatStart(BASE_IFACE, NETID, NAT64_IP_PREFIX);
+        final ClatCoordinator.ClatStats stats = coordinator.getClatStats();
+        verify(mDeps).getClatStats(eq(STACKED_IFINDEX));
+        assertEquals(10, stats.rxPackets);
+        assertEquals(5000, stats.rxBytes);
+        assertEquals(200, stats.rxOverheadBytes);
+        assertEquals(20, stats.txPackets);
+        assertEquals(8000, stats.txBytes);
+        assertEquals(400, stats.txOverheadBytes);
+        assertArrayEquals(new long[] {3, 0}, stats.punts);
+
+        doThrow(new IOException()).when(mDeps).getClatStats(anyInt());
+        assertNull(coordinator.getClatStats());
+
+        coordinator.clatStop();
+        assertNull(coordinator.getClatStats());
+    }
+
     @Test
     public void testGetFwmark() throws Exception {
         assertEquals(0xf0064, ClatCoordinator.getFwmark(100));
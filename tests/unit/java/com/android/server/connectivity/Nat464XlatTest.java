@@ -247,7 +247,7 @@ public class Nat464XlatTest {
 
     private void verifyClatdStop(@Nullable InOrder inOrder) throws Exception {
         if (SdkLevel.isAtLeastT()) {
-            verifyWithOrder(inOrder, mClatCoordinator).clatStop();
+            verifyWithOrder(inOrder, mClatCoordinator).clatStopAsync(any(), any());
         } else {
             verifyWithOrder(inOrder, mNetd).clatdStop(eq(BASE_IFACE));
         }